@@ -0,0 +1,196 @@
+#include <fstream>
+#include <iterator>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include "batch_cipher.hpp"
+#include "logging.hpp"
+
+namespace sp
+{
+
+namespace {
+static const std::size_t key_size = 32;
+static const std::size_t iv_size = 12;
+static const std::size_t nonce_size = 16;
+static const std::size_t min_psk_size = 16;
+static const std::size_t length_size = 2;
+static const char aes_256_gcm[] = "aes-256-gcm";
+static const char chacha20_poly1305[] = "chacha20-poly1305";
+
+std::string to_hex(const unsigned char* data, std::size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string ret;
+  for(std::size_t i = 0; i < size; ++i) {
+    ret.push_back(digits[data[i] >> 4]);
+    ret.push_back(digits[data[i] & 0x0f]);
+  }
+  return ret;
+}
+
+const EVP_CIPHER* find_cipher(const std::string& cipher) {
+  if(aes_256_gcm == cipher) return EVP_aes_256_gcm();
+  if(chacha20_poly1305 == cipher) return EVP_chacha20_poly1305();
+  return nullptr;
+}
+
+// hkdf-sha256 of the pre-shared key salted with both nonces, distinct for cipher and direction
+bool derive_key(const std::string& cipher, const std::string& psk, const std::string& salt, bool client_to_server, unsigned char* key) {
+  std::string info = std::string("secret passage batch ") + cipher + (client_to_server ? " client to server" : " server to client");
+  EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  std::size_t size = key_size;
+  bool ok = ctx
+    && 0 < EVP_PKEY_derive_init(ctx)
+    && 0 < EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256())
+    && 0 < EVP_PKEY_CTX_set1_hkdf_salt(ctx, reinterpret_cast<const unsigned char*>(salt.data()), salt.size())
+    && 0 < EVP_PKEY_CTX_set1_hkdf_key(ctx, reinterpret_cast<const unsigned char*>(psk.data()), psk.size())
+    && 0 < EVP_PKEY_CTX_add1_hkdf_info(ctx, reinterpret_cast<const unsigned char*>(info.data()), info.size())
+    && 0 < EVP_PKEY_derive(ctx, key, &size)
+    && key_size == size;
+  EVP_PKEY_CTX_free(ctx);
+  return ok;
+}
+}
+
+bool batch_cipher::supported(const std::string& cipher) {
+  return nullptr != find_cipher(cipher);
+}
+
+std::string batch_cipher::load_key(const std::string& path) {
+  std::ifstream f(path.c_str(), std::ios::binary);
+  if(!f) {
+    throw exception(bf("can't read key file '%s'") % path);
+  }
+  std::string ret((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  // so that a passphrase can be written with echo
+  while(!ret.empty() && ('\n' == ret.back() || '\r' == ret.back())) {
+    ret.pop_back();
+  }
+  if(ret.size() < min_psk_size) {
+    throw exception(bf("key in '%s' is shorter than %d bytes") % path % min_psk_size);
+  }
+  return ret;
+}
+
+std::string batch_cipher::make_nonce() {
+  unsigned char nonce[nonce_size];
+  RAND_bytes(nonce, sizeof(nonce));
+  return to_hex(nonce, sizeof(nonce));
+}
+
+std::string batch_cipher::prove(const std::string& psk, const std::string& client_nonce, const std::string& session) {
+  std::string data = "secret passage seal proof " + client_nonce + ':' + session;
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  unsigned int size = 0;
+  if(!HMAC(EVP_sha256(), psk.data(), psk.size(), reinterpret_cast<const unsigned char*>(data.data()), data.size(), mac, &size)) {
+    return std::string();
+  }
+  return to_hex(mac, size);
+}
+
+bool batch_cipher::check_proof(const std::string& psk, const std::string& client_nonce, const std::string& session,
+  const std::string& proof) {
+  auto expected = prove(psk, client_nonce, session);
+  return !expected.empty() && expected.size() == proof.size()
+    && 0 == CRYPTO_memcmp(expected.data(), proof.data(), proof.size());
+}
+
+batch_cipher::batch_cipher(const std::string& cipher, const std::string& psk,
+  const std::string& client_nonce, const std::string& server_nonce, bool client_to_server)
+  : ctx_(EVP_CIPHER_CTX_new()), sequence_(0)
+{
+  auto evp = find_cipher(cipher);
+  if(!evp) {
+    EVP_CIPHER_CTX_free(ctx_);
+    throw exception(bf("unsupported cipher '%s'") % cipher);
+  }
+  unsigned char key[key_size];
+  bool ok = ctx_ && derive_key(cipher, psk, client_nonce + ':' + server_nonce, client_to_server, key)
+    && 1 == EVP_CipherInit_ex(ctx_, evp, nullptr, key, nullptr, -1);
+  OPENSSL_cleanse(key, sizeof(key));
+  if(!ok) {
+    EVP_CIPHER_CTX_free(ctx_);
+    throw exception(bf("failed to key cipher '%s'") % cipher);
+  }
+}
+
+batch_cipher::~batch_cipher() {
+  EVP_CIPHER_CTX_free(ctx_);
+}
+
+bool batch_cipher::append(std::vector<char>& batch, const char* frame, std::size_t size) {
+  if(size > 0xffff) {
+    return false;
+  }
+  batch.push_back(size >> 8);
+  batch.push_back(size);
+  batch.insert(batch.end(), frame, frame + size);
+  return true;
+}
+
+// the number of the batch, big endian behind 4 zero bytes
+void batch_cipher::make_iv(unsigned char* iv) {
+  auto sequence = sequence_++;
+  for(std::size_t i = iv_size; i > 0; --i) {
+    iv[i - 1] = sequence;
+    sequence >>= 8;
+  }
+}
+
+bool batch_cipher::seal(std::vector<char>& batch) {
+  unsigned char iv[iv_size];
+  make_iv(iv);
+  int len = 0;
+  auto size = batch.size();
+  batch.resize(size + tag_size);
+  auto data = reinterpret_cast<unsigned char*>(batch.data());
+  return 1 == EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, iv, 1)
+    && 1 == EVP_CipherUpdate(ctx_, data, &len, data, size)
+    && 1 == EVP_CipherFinal_ex(ctx_, data + len, &len)
+    && 1 == EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_GET_TAG, tag_size, data + size);
+}
+
+bool batch_cipher::open(std::vector<char>& batch) {
+  if(batch.size() < tag_size) {
+    return false;
+  }
+  unsigned char iv[iv_size];
+  make_iv(iv);
+  auto size = batch.size() - tag_size;
+  int len = 0;
+  auto data = reinterpret_cast<unsigned char*>(batch.data());
+  if(1 != EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, iv, 0)
+  || 1 != EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_SET_TAG, tag_size, data + size)
+  || 1 != EVP_CipherUpdate(ctx_, data, &len, data, size)
+  || 1 != EVP_CipherFinal_ex(ctx_, data + len, &len)) {
+    return false;
+  }
+  batch.resize(size);
+  return true;
+}
+
+bool batch_cipher::split(const std::vector<char>& batch, std::vector<std::vector<char> >& frames) {
+  return split(batch.data(), batch.size(), frames);
+}
+
+bool batch_cipher::split(const char* batch, std::size_t size, std::vector<std::vector<char> >& frames) {
+  auto data = reinterpret_cast<const unsigned char*>(batch);
+  std::size_t offset = 0;
+  while(offset < size) {
+    if(size - offset < length_size) {
+      return false;
+    }
+    std::size_t frame_size = (std::size_t(data[offset]) << 8) | data[offset + 1];
+    offset += length_size;
+    if(size - offset < frame_size) {
+      return false;
+    }
+    frames.emplace_back(batch + offset, batch + offset + frame_size);
+    offset += frame_size;
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef BATCH_CIPHER_HPP
+#define BATCH_CIPHER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "exception.hpp"
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace sp
+{
+
+// seals the frames of a plain http tunnel connection in batches, one aead seal for all the
+// frames written at once instead of tls records. keys are derived from a pre-shared key and
+// nonces both ends pick for the connection, one key per direction. batches are numbered
+// implicitly, the number is the aead nonce: one replayed, dropped or reordered fails to open.
+// plaintext of a batch is its frames, each behind its 2 byte big endian length
+class batch_cipher
+{
+public:
+  typedef sp::exception<batch_cipher> exception;
+
+  static const std::size_t tag_size = 16;
+
+  // aes-256-gcm or chacha20-poly1305
+  static bool supported(const std::string& cipher);
+  // contents of the file, throws exception if it can't be read or is shorter than 16 bytes
+  static std::string load_key(const std::string& path);
+  // random handshake nonce, hex
+  static std::string make_nonce();
+  // proof of the pre-shared key the client sends with its nonce, hmac-sha256 over the nonce
+  // and the session, hex. a server takes each nonce once, so a request seen on the wire
+  // can't be sent again
+  static std::string prove(const std::string& psk, const std::string& client_nonce, const std::string& session);
+  // in constant time
+  static bool check_proof(const std::string& psk, const std::string& client_nonce, const std::string& session,
+    const std::string& proof);
+
+  // one direction of the connection the nonces were exchanged on
+  batch_cipher(const std::string& cipher, const std::string& psk,
+    const std::string& client_nonce, const std::string& server_nonce, bool client_to_server); // throws exception
+  ~batch_cipher();
+  batch_cipher(const batch_cipher&) = delete;
+  batch_cipher& operator=(const batch_cipher&) = delete;
+
+  // appends a frame to a batch being built, false if it's too large for the 2 byte length
+  static bool append(std::vector<char>& batch, const char* frame, std::size_t size);
+  // encrypts batch in place and appends the tag, false if the cipher fails
+  bool seal(std::vector<char>& batch);
+  // decrypts batch in place and strips the tag, false if it is not the next sealed batch
+  bool open(std::vector<char>& batch);
+  // splits an opened batch into its frames, false if the lengths don't add up
+  static bool split(const std::vector<char>& batch, std::vector<std::vector<char> >& frames);
+  static bool split(const char* batch, std::size_t size, std::vector<std::vector<char> >& frames);
+
+private:
+  void make_iv(unsigned char* iv);
+
+  EVP_CIPHER_CTX* ctx_;
+  uint64_t sequence_;
+};
+
+}
+
+#endif // BATCH_CIPHER_HPP
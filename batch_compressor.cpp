@@ -0,0 +1,295 @@
+#include <ctime>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <zlib.h>
+#include "batch_compressor.hpp"
+#include "batch_cipher.hpp"
+#include "logging.hpp"
+
+namespace sp
+{
+
+namespace {
+static const std::size_t max_batch_size = 0xffff;
+static const std::size_t max_dictionary_size = 32768; // deflate window
+static const std::size_t length_size = 2;
+static const std::size_t flow_buckets = 256;
+static const std::size_t probe_min_size = 256;    // smaller frames are always tried
+static const std::size_t probe_sample = 128;      // last bytes of the frame, past its headers
+static const std::size_t probe_max_distinct = 88; // random bytes take ~101 distinct values of 128
+static const unsigned max_misses = 8;             // a flow failing again skips 16 << misses frames
+
+uint64_t thread_cpu_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// encrypted or compressed payload spreads over most byte values, text and protocol fields don't
+bool looks_random(const char* frame, std::size_t size) {
+  if(size < probe_min_size) {
+    return false;
+  }
+  bool seen[256] = {};
+  std::size_t distinct = 0;
+  auto sample = reinterpret_cast<const unsigned char*>(frame) + size - probe_sample;
+  for(std::size_t i = 0; i < probe_sample; ++i) {
+    if(!seen[sample[i]]) {
+      seen[sample[i]] = true;
+      ++distinct;
+    }
+  }
+  return distinct > probe_max_distinct;
+}
+
+// of the frame at offset of a batch, with its length
+std::size_t entry_size(const std::vector<char>& batch, std::size_t offset) {
+  auto data = reinterpret_cast<const unsigned char*>(batch.data()) + offset;
+  return length_size + ((std::size_t(data[0]) << 8) | data[1]);
+}
+
+double ms_per_mb(uint64_t ns, uint64_t bytes) {
+  return bytes ? ns / 1e6 / (bytes / 1e6) : 0;
+}
+}
+
+std::string batch_compressor::load_dictionary(const std::string& path) {
+  std::ifstream f(path.c_str(), std::ios::binary);
+  if(!f) {
+    throw exception(bf("can't read dictionary file '%s'") % path);
+  }
+  std::string ret((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  // deflate sees only the window, the most common strings go last
+  if(ret.size() > max_dictionary_size) {
+    ret.erase(0, ret.size() - max_dictionary_size);
+  }
+  return ret;
+}
+
+batch_compressor::batch_compressor(int level, const std::string& dictionary)
+  : deflate_(new z_stream()), inflate_(new z_stream()), dictionary_(dictionary), flows_(flow_buckets)
+{
+  // raw deflate, batches are framed and authenticated by the tunnel
+  if(Z_OK != deflateInit2(deflate_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)) {
+    delete deflate_;
+    delete inflate_;
+    throw exception(bf("failed to set up deflate at level %d") % level);
+  }
+  if(Z_OK != inflateInit2(inflate_, -15)) {
+    deflateEnd(deflate_);
+    delete deflate_;
+    delete inflate_;
+    throw exception("failed to set up inflate");
+  }
+}
+
+batch_compressor::~batch_compressor() {
+  deflateEnd(deflate_);
+  inflateEnd(inflate_);
+  delete deflate_;
+  delete inflate_;
+}
+
+std::string batch_compressor::method() const {
+  if(dictionary_.empty()) {
+    return "deflate";
+  }
+  auto id = adler32(adler32(0, nullptr, 0), reinterpret_cast<const Bytef*>(dictionary_.data()), dictionary_.size());
+  return boost::str(bf("deflate-%08x") % id);
+}
+
+void batch_compressor::begin() {
+  plain_.clear();
+  plain_end_ = 0;
+  runs_.clear();
+  stored_.clear();
+  touched_.clear();
+}
+
+// frames of a flow stay in order, the first one of the batch decides for the others
+void batch_compressor::add(const char* frame, std::size_t size, uint32_t flow) {
+  in_ += size;
+  auto bucket = flow % flow_buckets;
+  auto& f = flows_[bucket];
+  if(flow_t::none == f.part) {
+    touched_.push_back(bucket);
+    if(f.skip) {
+      --f.skip;
+      f.part = flow_t::stored;
+    }
+    else if(looks_random(frame, size)) {
+      miss(f);
+      f.part = flow_t::stored;
+    }
+    else {
+      f.part = flow_t::deflated;
+    }
+  }
+  else if(flow_t::stored == f.part && f.skip) {
+    --f.skip;
+  }
+  if(flow_t::stored == f.part) {
+    bypassed_ += size;
+    batch_cipher::append(stored_, frame, size);
+    batch_cipher::append(plain_, frame, 0);
+  }
+  else {
+    if(runs_.empty() || flow != run_flow_) {
+      runs_.push_back(plain_.size());
+      run_flow_ = flow;
+    }
+    batch_cipher::append(plain_, frame, size);
+    plain_end_ = plain_.size();
+  }
+}
+
+void batch_compressor::store(const char* frame, std::size_t size) {
+  in_ += size;
+  batch_cipher::append(stored_, frame, size);
+  batch_cipher::append(plain_, frame, 0);
+}
+
+std::size_t batch_compressor::size() const {
+  return length_size + plain_.size() + stored_.size();
+}
+
+void batch_compressor::finish(std::vector<char>& body) {
+  body.clear();
+  // stored frames past the last deflated one follow it anyway
+  plain_.resize(plain_end_);
+  std::size_t deflated = 0;
+  if(!plain_.empty()) {
+    auto start = thread_cpu_ns();
+    // deflated part has to save at least 1/16 of the frames to be worth it
+    auto room = plain_.size() - plain_.size() / 16;
+    body.resize(length_size + room);
+    deflateReset(deflate_);
+    if(!dictionary_.empty()) {
+      deflateSetDictionary(deflate_, reinterpret_cast<const Bytef*>(dictionary_.data()), dictionary_.size());
+    }
+    deflate_->next_out = reinterpret_cast<Bytef*>(body.data() + length_size);
+    deflate_->avail_out = room;
+    // a full flush ends each run, nothing after it matches what came before
+    bool shrunk = true;
+    for(std::size_t r = 0; r < runs_.size() && shrunk; ++r) {
+      auto begin = r ? runs_[r] : 0;
+      auto end = r + 1 < runs_.size() ? runs_[r + 1] : plain_.size();
+      deflate_->next_in = reinterpret_cast<Bytef*>(plain_.data() + begin);
+      deflate_->avail_in = end - begin;
+      if(r + 1 == runs_.size()) {
+        shrunk = Z_STREAM_END == deflate(deflate_, Z_FINISH);
+      }
+      else {
+        // out of room if the flush couldn't complete
+        shrunk = Z_OK == deflate(deflate_, Z_FULL_FLUSH) && deflate_->avail_out && !deflate_->avail_in;
+      }
+    }
+    if(shrunk) {
+      deflated = room - deflate_->avail_out;
+    }
+    for(auto i = touched_.begin(); i != touched_.end(); ++i) {
+      auto& f = flows_[*i];
+      if(flow_t::deflated == f.part && shrunk) {
+        f.misses = 0;
+      }
+      else if(flow_t::deflated == f.part) {
+        miss(f);
+      }
+    }
+    deflate_ns_ += thread_cpu_ns() - start;
+  }
+  for(auto i = touched_.begin(); i != touched_.end(); ++i) {
+    flows_[*i].part = flow_t::none;
+  }
+  body.resize(length_size + deflated);
+  body[0] = deflated >> 8;
+  body[1] = deflated;
+  std::size_t stored = 0;
+  if(!deflated) {
+    // all stored, the empty frames are replaced by those they stand for
+    for(std::size_t i = 0; i < plain_.size();) {
+      auto size = entry_size(plain_, i);
+      if(length_size == size) {
+        size = entry_size(stored_, stored);
+        body.insert(body.end(), stored_.begin() + stored, stored_.begin() + stored + size);
+        stored += size;
+        i += length_size;
+      }
+      else {
+        body.insert(body.end(), plain_.begin() + i, plain_.begin() + i + size);
+        i += size;
+      }
+    }
+  }
+  body.insert(body.end(), stored_.begin() + stored, stored_.end());
+  out_ += body.size();
+}
+
+bool batch_compressor::decompress(const char* body, std::size_t size, std::vector<std::vector<char> >& frames) {
+  if(size < length_size) {
+    return false;
+  }
+  auto data = reinterpret_cast<const unsigned char*>(body);
+  std::size_t deflated = (std::size_t(data[0]) << 8) | data[1];
+  if(size - length_size < deflated) {
+    return false;
+  }
+  if(!deflated) {
+    return batch_cipher::split(body + length_size, size - length_size, frames);
+  }
+  auto start = thread_cpu_ns();
+  // frames of a batch fit a length prefix, a body inflating beyond is not the peer's
+  inflated_.resize(max_batch_size);
+  inflateReset(inflate_);
+  if(!dictionary_.empty()) {
+    inflateSetDictionary(inflate_, reinterpret_cast<const Bytef*>(dictionary_.data()), dictionary_.size());
+  }
+  inflate_->next_in = const_cast<Bytef*>(data + length_size);
+  inflate_->avail_in = deflated;
+  inflate_->next_out = reinterpret_cast<Bytef*>(inflated_.data());
+  inflate_->avail_out = inflated_.size();
+  auto rc = inflate(inflate_, Z_FINISH);
+  inflated_.resize(inflated_.size() - inflate_->avail_out);
+  inflate_ns_ += thread_cpu_ns() - start;
+  if(Z_STREAM_END != rc || inflate_->avail_in) {
+    return false;
+  }
+  inflated_in_ += deflated;
+  inflated_out_ += inflated_.size();
+  std::vector<std::vector<char> > plain, stored;
+  if(!batch_cipher::split(inflated_.data(), inflated_.size(), plain)
+    || !batch_cipher::split(body + length_size + deflated, size - length_size - deflated, stored)) {
+    return false;
+  }
+  auto next = stored.begin();
+  for(auto i = plain.begin(); i != plain.end(); ++i) {
+    if(!i->empty()) {
+      frames.push_back(std::move(*i));
+    }
+    else if(stored.end() != next) {
+      frames.push_back(std::move(*next++));
+    }
+    else {
+      return false;
+    }
+  }
+  std::move(next, stored.end(), std::back_inserter(frames));
+  return true;
+}
+
+std::string batch_compressor::stats() const {
+  return boost::str(bf("compression %s: %d B of frames sent in %d B (ratio %.2f), %d B left alone by the probe, %.2f ms cpu per MB;"
+    " %d B received inflated to %d B, %.2f ms cpu per MB")
+    % method() % in_ % out_ % (out_ ? double(in_) / out_ : 1.0) % bypassed_ % ms_per_mb(deflate_ns_, in_)
+    % inflated_in_ % inflated_out_ % ms_per_mb(inflate_ns_, inflated_out_));
+}
+
+void batch_compressor::miss(flow_t& f) {
+  if(f.misses < max_misses) {
+    ++f.misses;
+  }
+  f.skip = std::size_t(16) << f.misses;
+}
+
+}
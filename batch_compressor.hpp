@@ -0,0 +1,90 @@
+#ifndef BATCH_COMPRESSOR_HPP
+#define BATCH_COMPRESSOR_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "exception.hpp"
+
+struct z_stream_s;
+
+namespace sp
+{
+
+// deflates batches of frames written at once, with a preset dictionary of typical traffic
+// both peers load if given. frames that look random are left as they are, and so is a flow
+// whose frames did not shrink, for longer each time it fails again. body of a batch is the
+// 2 byte big endian length of the deflated part, the deflated frames, then the stored ones.
+// frames in either part are laid out like those of batch_cipher, each behind its length.
+// an empty frame among the deflated ones stands for the next stored one, so that frames come
+// out in the order they were added. with nothing deflated all frames are stored in that order.
+// deflate is fully flushed wherever the flow changes, so no frame refers back to another flow's
+// and the size of a sealed batch can't tell one flow what another carries (crime). the preset
+// dictionary serves the first run of frames only. a flow mixing secrets with data an attacker
+// chooses can still be probed through its own frames, as with any compression under encryption
+class batch_compressor
+{
+public:
+  typedef sp::exception<batch_compressor> exception;
+
+  // up to the last 32 KiB of the file, throws exception if it can't be read
+  static std::string load_dictionary(const std::string& path);
+
+  // level 1 for speed to 9 for ratio
+  batch_compressor(int level, const std::string& dictionary); // throws exception
+  ~batch_compressor();
+  batch_compressor(const batch_compressor&) = delete;
+  batch_compressor& operator=(const batch_compressor&) = delete;
+
+  // capability value, peers compress only if they agree on it, dictionary included
+  std::string method() const;
+
+  // frames of the next batch, flow is the hash of the one the frame belongs to
+  void begin();
+  void add(const char* frame, std::size_t size, uint32_t flow);
+  // one to be left as it is whatever its flow, a control message
+  void store(const char* frame, std::size_t size);
+  // most the body of the frames added so far takes
+  std::size_t size() const;
+  void finish(std::vector<char>& body);
+
+  // frames of a body finished by the peer, false if it is corrupt
+  bool decompress(const char* body, std::size_t size, std::vector<std::vector<char> >& frames);
+
+  // ratio and cpu time per MB of either direction
+  std::string stats() const;
+
+private:
+  // backoff of the flows hashed to a bucket
+  struct flow_t {
+    enum part_t { none, deflated, stored };
+    unsigned misses = 0;
+    std::size_t skip = 0;  // frames left as they are until the next try
+    part_t part = none;    // of the batch being built its frames go to
+  };
+  void miss(flow_t& f);
+
+  z_stream_s* deflate_;
+  z_stream_s* inflate_;
+  std::string dictionary_;
+  std::vector<flow_t> flows_;
+  std::vector<std::size_t> touched_; // buckets with frames in the batch
+  std::vector<char> plain_;        // frames to be deflated, empty ones in place of stored ones
+  std::size_t plain_end_ = 0;      // of the last frame to be deflated
+  std::vector<std::size_t> runs_;  // offsets in plain_ where frames of another flow start
+  uint32_t run_flow_ = 0;          // of the last run
+  std::vector<char> stored_;       // frames to be left as they are
+  std::vector<char> inflated_;
+
+  uint64_t in_ = 0;        // bytes of frames added
+  uint64_t out_ = 0;       // bytes of bodies finished
+  uint64_t bypassed_ = 0;  // bytes of frames left alone without trying
+  uint64_t deflate_ns_ = 0;
+  uint64_t inflated_in_ = 0;
+  uint64_t inflated_out_ = 0;
+  uint64_t inflate_ns_ = 0;
+};
+
+}
+
+#endif // BATCH_COMPRESSOR_HPP
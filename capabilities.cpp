@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <cctype>
+#include <vector>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include "capabilities.hpp"
+
+namespace sp
+{
+
+namespace {
+static const char version_name[] = "v";
+
+bool is_number(const std::string& value) {
+  return !value.empty() && value.size() < 20 && std::all_of(value.begin(), value.end(), ::isdigit);
+}
+}
+
+capabilities::capabilities()
+{}
+
+capabilities capabilities::parse(const std::string& header) {
+  std::vector<std::string> tokens;
+  boost::algorithm::split(tokens, header, boost::is_any_of(","), boost::token_compress_on);
+  capabilities ret;
+  for(auto i = tokens.begin(); i != tokens.end(); ++i) {
+    auto eq = i->find('=');
+    auto name = boost::algorithm::to_lower_copy(boost::algorithm::trim_copy(i->substr(0, eq)));
+    if(name.empty()) continue;
+    ret.caps_[name] = std::string::npos == eq ? std::string() : boost::algorithm::trim_copy(i->substr(eq + 1));
+  }
+  return ret;
+}
+
+std::string capabilities::to_string() const {
+  std::string ret;
+  for(auto i = caps_.begin(); i != caps_.end(); ++i) {
+    if(!ret.empty()) ret += ", ";
+    ret += i->first;
+    if(!i->second.empty()) ret += "=" + i->second;
+  }
+  return ret;
+}
+
+unsigned capabilities::version() const {
+  auto i = caps_.find(version_name);
+  if(caps_.end() == i || !is_number(i->second)) return 0;
+  return std::stoul(i->second);
+}
+
+void capabilities::set_version(unsigned version) {
+  caps_[version_name] = std::to_string(version);
+}
+
+bool capabilities::has(const std::string& name) const {
+  return caps_.count(name);
+}
+
+uint64_t capabilities::number(const std::string& name) const {
+  auto i = caps_.find(name);
+  if(caps_.end() == i || !is_number(i->second)) return 0;
+  return std::stoull(i->second);
+}
+
+void capabilities::set(const std::string& name, const std::string& value) {
+  caps_[name] = value;
+}
+
+void capabilities::unset(const std::string& name) {
+  caps_.erase(name);
+}
+
+capabilities capabilities::negotiate(const capabilities& peer) const {
+  capabilities ret;
+  for(auto i = caps_.begin(); i != caps_.end(); ++i) {
+    auto j = peer.caps_.find(i->first);
+    if(peer.caps_.end() == j) continue;
+    if(i->second == j->second) {
+      ret.caps_.insert(*i);
+    }
+    else if(is_number(i->second) && is_number(j->second)) {
+      ret.caps_[i->first] = std::to_string(std::min(std::stoull(i->second), std::stoull(j->second)));
+    }
+  }
+  return ret;
+}
+
+}
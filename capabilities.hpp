@@ -0,0 +1,47 @@
+#ifndef CAPABILITIES_HPP
+#define CAPABILITIES_HPP
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace sp
+{
+
+// features of a tunnel peer, exchanged in the tunnel handshake so old and new peers run the
+// best set both of them support. the client offers its own in the request, the server
+// answers with the negotiated ones in the response, e.g.
+//   X-Tunnel-Capabilities: v=1, resume, datagram
+// a token without value is a flag, v is the protocol version. a peer sending no header
+// is version 0 with no capabilities
+class capabilities
+{
+public:
+  // version of the tunnel protocol spoken by this build
+  static const unsigned current_version = 1;
+
+  capabilities();
+  // unknown tokens are kept, they just never make it into a negotiated set
+  static capabilities parse(const std::string& header);
+  // header value
+  std::string to_string() const;
+
+  unsigned version() const;
+  void set_version(unsigned version);
+  bool has(const std::string& name) const;
+  // value of a numeric capability, 0 if it's missing or not a number
+  uint64_t number(const std::string& name) const;
+  void set(const std::string& name, const std::string& value = std::string());
+  void unset(const std::string& name);
+
+  // features both support: the lower version and capabilities with the same value in both,
+  // numeric values that differ take the lower one
+  capabilities negotiate(const capabilities& peer) const;
+
+private:
+  std::map<std::string, std::string> caps_;
+};
+
+}
+
+#endif // CAPABILITIES_HPP
@@ -1,5 +1,11 @@
 #include <vector>
+#include <algorithm>
+#include <random>
+#include <sstream>
 #include <boost/make_shared.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio/placeholders.hpp>
 #include <boost/asio/steady_timer.hpp>
@@ -9,9 +15,20 @@
 #include "connect_mode.hpp"
 #include "normal_socket.hpp"
 #include "secure_socket.hpp"
+#include "h2_connection.hpp"
 #include "http_parser.hpp"
 #include "http_to_tap_loop.hpp"
 #include "tap_to_http_loop.hpp"
+#include "datagram_transport.hpp"
+#include "capabilities.hpp"
+#include "tap_set.hpp"
+#include "batch_cipher.hpp"
+#include "timing_wheel.hpp"
+#include "tunnel_protocol.hpp"
+#include "websocket.hpp"
+#include "upstream_selector.hpp"
+#include "happy_eyeballs.hpp"
+#include "resolver_cache.hpp"
 #include "logging.hpp"
 
 namespace asio = boost::asio;
@@ -22,6 +39,21 @@ namespace sp
 namespace
 {
   static const char CRLF[] = "\r\n";
+
+  upstream_selector::upstream_t parse_upstream(const std::string& address) {
+    // split host and port
+    upstream_selector::upstream_t ret;
+    auto colon = address.find(':');
+    if(std::string::npos == colon) {
+      ret.host = address;
+      ret.port = "443";
+    }
+    else {
+      ret.host = address.substr(0, colon);
+      ret.port = address.substr(colon+1);
+    }
+    return ret;
+  }
 }
 
 /*\
@@ -29,215 +61,534 @@ namespace
 \*/
 class connect_mode::private_t {
 public:
-  private_t(boost::asio::io_service& ios, const settings& st, shared_descriptor tap);
+  private_t(boost::asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps);
   ~private_t();
   void setup();
 
 private:
-  typedef asio::ip::tcp::resolver resolver_t;
+  // one of the connections the tunnel is striped over, reconnects on its own.
+  // with standby enabled there is one connection more than stripes, it takes over
+  // the stripe of a failed connection which then becomes the standby
+  struct stripe_t {
+    stripe_t(asio::io_service& ios, const settings& st, std::size_t s)
+      : race(ios, st), attempt(0)
+      , reconnect_timer(ios), handshake_timer(timing_wheel::no_timer)
+      , awaiting_carrier(false)
+      , serves(s), direction(protocol::both), standby(false), established(false)
+      , ping_timer(timing_wheel::no_timer), pong_pending(false) {}
 
-  void close_and_reconnect();
-  void set_reconnect_timer();
-  void async_reconnect();
-  void handle_resolve(const boost::system::error_code& ec, resolver_t::iterator i);
-  void async_connect(resolver_t::iterator i);
-  void handle_connect(const boost::system::error_code& ec, resolver_t::iterator i);
+    happy_eyeballs race;
+    uint64_t attempt; // bumped when a pending resolve is abandoned
+    asio::steady_timer reconnect_timer;
+    timing_wheel::timer_id handshake_timer;
+    boost::shared_ptr<socket> sock;
+    boost::shared_ptr<h2_stream> stream; // sock itself with http/2 transport
+    bool awaiting_carrier;               // http/2 stream waits for the connection to come up
+    boost::shared_ptr<http_to_tap_loop> htt_loop;
+    asio::ip::tcp::endpoint peer;        // server address datagrams go to
+
+    std::size_t serves;  // tunnel stripe index, meaningless in standby
+    protocol::direction_t direction; // half of a split stripe if not both
+    bool standby;
+    bool established;
+    std::chrono::steady_clock::time_point established_at;
+    timing_wheel::timer_id ping_timer;  // standby keepalive
+    bool pong_pending;
+    std::string ping;                   // framed ping being written
+
+    std::string websocket_key;          // of the pending upgrade
+    capabilities caps;                  // negotiated by the last response
+    std::string seal_nonce;             // ours, of the pending request
+    boost::shared_ptr<batch_cipher> seal; // of the frames we send, only sealed
+
+    asio::streambuf http_heades_buf;
+
+    // frames of the stripe are sent on this connection
+    bool sends() const { return !standby && protocol::download != direction; }
+    // datagrams are keyed by this connection, a single one so both sides agree on the key
+    bool keys_datagrams() const { return !standby && 0 == serves && protocol::upload != direction; }
+    // for logging
+    std::string name() const {
+      if(standby) return "standby";
+      auto ret = "stripe " + std::to_string(serves);
+      if(protocol::upload == direction) ret += " upload";
+      if(protocol::download == direction) ret += " download";
+      return ret;
+    }
+  };
 
-  void async_write_http_headers();
-  void handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr);
+  // with http/2 transport all stripes are streams of this connection
+  struct carrier_t {
+    enum state_t { down, connecting, up };
+    carrier_t(asio::io_service& ios, const settings& st)
+      : race(ios, st), attempt(0), state(down) {}
 
-  bool handle_headers_complete(const http_parser* parser);
-  void handle_htt_loop_stop(loop_stop_reason::code_t code);
+    happy_eyeballs race;
+    uint64_t attempt; // bumped when the connection is reset
+    boost::shared_ptr<socket> sock;
+    boost::shared_ptr<h2_connection> h2;
+    state_t state;
+  };
+
+  void close_and_reconnect(std::size_t stripe);
+  void set_reconnect_timer(std::size_t stripe, bool immediate = false);
+  void handle_reconnect_timer(const boost::system::error_code& ec, std::size_t stripe);
+  void handle_handshake_timeout(std::size_t stripe);
+  void async_reconnect(std::size_t stripe);
+  void handle_resolve(const boost::system::error_code& ec, const resolver_cache::endpoints_t& endpoints, std::size_t stripe, uint64_t attempt);
+  void handle_connect(const boost::system::error_code& ec, asio::ip::tcp::socket& winner, std::size_t stripe);
+  void handle_attach(const boost::system::error_code& ec, std::size_t stripe);
+
+  void async_write_http_headers(std::size_t stripe);
+  void handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr, std::size_t stripe);
+
+  bool handle_headers_complete(const http_parser* parser, std::size_t stripe);
+  bool handle_response(int code, const std::string& status, const std::string* caps, const std::string* resume,
+    const std::string* seal, std::size_t stripe);
+  void handle_control(const std::vector<char>& message, std::size_t stripe);
+  void send_ack(uint64_t received, std::size_t stripe);
+  bool answer_websocket(websocket::opcode_t opcode, const std::vector<char>& payload, std::size_t stripe);
+  void handle_htt_loop_stop(loop_stop_reason::code_t code, std::size_t stripe);
+
+  void add_stripe(std::size_t stripe, bool confirmed);
+  protocol::framing_t framing() const; // of the frames we send
+  capabilities offer(std::size_t stripe) const;
+  bool activate_standby(std::size_t serves);
+  void schedule_ping(std::size_t stripe);
+  void handle_ping_timer(std::size_t stripe);
+  void handle_write_ping(const boost::system::error_code& ec, std::size_t stripe);
+
+  void handle_upstream_switch(const upstream_selector::upstream_t& upstream);
+
+  // http/2 transport
+  void connect_stream(std::size_t stripe);
+  void open_stream(std::size_t stripe);
+  void handle_response_headers(const header_list& headers, std::size_t stripe);
+  void connect_carrier();
+  void handle_carrier_resolve(const boost::system::error_code& ec, const resolver_cache::endpoints_t& endpoints, uint64_t attempt);
+  void handle_carrier_connect(const boost::system::error_code& ec, asio::ip::tcp::socket& winner, uint64_t attempt);
+  void handle_carrier_attach(const boost::system::error_code& ec, uint64_t attempt);
+  void handle_carrier_close(const boost::system::error_code& ec, uint64_t attempt);
+  void fail_carrier(const char* what, const boost::system::error_code& ec);
+  void reset_carrier();
+
+  void schedule_stats();
+  void handle_stats_timer();
 
   asio::io_service& ios_;
   const settings& st_;
-  asio::posix::stream_descriptor tap_;
-
-  resolver_t resolver_;
-  asio::steady_timer reconnect_timer_;
+  tap_set taps_;
+  timing_wheel wheel_;
+  timing_wheel::timer_id stats_timer_;
+  resolver_cache resolver_;
+  boost::shared_ptr<tls_context> tls_; // only with tls
+  boost::shared_ptr<crypto_pool> crypto_; // only with tls and crypto threads
 
   std::string host_, port_;
-  boost::shared_ptr<socket> socket_;
-  boost::shared_ptr<http_to_tap_loop> htt_loop_;
+  boost::shared_ptr<upstream_selector> selector_; // only with several upstreams
+  bool connecting_;
+  std::string session_;
+  std::string seal_key_;  // pre-shared, only sealed
+  boost::shared_ptr<batch_compressor> compressor_; // of all stripes, only compressed
+  std::vector<boost::shared_ptr<stripe_t> > stripes_;
+  boost::shared_ptr<carrier_t> carrier_; // only with http/2 transport
   boost::shared_ptr<tap_to_http_loop> tth_loop_;
-
-  asio::streambuf http_heades_buf_;
+  boost::shared_ptr<datagram_transport> datagrams_; // only with datagrams enabled
 };
 
-connect_mode::private_t::private_t(asio::io_service& ios, const settings& st, shared_descriptor tap)
-  : ios_(ios), st_(st), tap_(ios_, tap->get())
-  , resolver_(ios_)
-  , reconnect_timer_(ios_)
+connect_mode::private_t::private_t(asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps)
+  : ios_(ios), st_(st), taps_(ios_, taps)
+  , wheel_(ios_)
+  , stats_timer_(timing_wheel::no_timer)
+  , resolver_(ios_, wheel_, st_.resolve_ttl)
+  , connecting_(false)
 {
-  socket_ = boost::make_shared<normal_socket>(ios_); //@TODO: read tls option from settings
-  htt_loop_ = boost::make_shared<http_to_tap_loop>(
-    socket_,
-    tap_,
-    boost::bind(
-      &private_t::handle_headers_complete,
-        this,
-        _1
-    ),
-    boost::bind(
-      &private_t::handle_htt_loop_stop,
-        this,
-        _1
-    )
-  );
+  std::random_device rd;
+  std::ostringstream sstr;
+  sstr << std::hex << rd() << rd();
+  session_ = sstr.str();
+  if(st_.tls) {
+    tls_ = boost::make_shared<tls_context>(st_);
+    if(st_.crypto_threads) {
+      crypto_ = boost::make_shared<crypto_pool>(ios_, st_.crypto_threads);
+    }
+  }
+  if(!st_.seal_key.empty()) {
+    seal_key_ = batch_cipher::load_key(st_.seal_key);
+  }
+  if(st_.compress_level) {
+    compressor_ = boost::make_shared<batch_compressor>(st_.compress_level,
+      st_.compress_dictionary.empty() ? std::string() : batch_compressor::load_dictionary(st_.compress_dictionary));
+  }
+
+  // as offered until a response tells what the server takes, for frames sent optimistically
+  taps_.multiplex(taps_.size() > 1 ? taps_.size() : 0);
   tth_loop_ = boost::make_shared<tap_to_http_loop>(
-    socket_,
-    tap_,
-    boost::bind(
-      &private_t::handle_htt_loop_stop,
-        this,
-        _1
-    )
+    taps_,
+    wheel_,
+    st_.write_stall_timeout
   );
+  if(st_.datagram) {
+    datagrams_ = boost::make_shared<datagram_transport>(ios_, taps_, wheel_, false);
+    tth_loop_->divert(boost::bind(&datagram_transport::send, datagrams_, _1, _2));
+  }
+  if(settings::transport::http2 == st_.transport) {
+    carrier_ = boost::make_shared<carrier_t>(ios_, st_);
+    if(tls_) {
+      carrier_->sock = boost::make_shared<secure_socket>(ios_, *tls_, st_.tls_flush_delay, crypto_.get());
+    }
+    else {
+      carrier_->sock = boost::make_shared<normal_socket>(ios_, st_.mptcp);
+    }
+    carrier_->h2 = boost::make_shared<h2_connection>(ios_, carrier_->sock, false, st_.http2_window);
+  }
+  // a split stripe is an upload and a download connection next to each other
+  std::size_t halves = st_.split ? 2 : 1;
+  auto slots = st_.stripes * halves + (st_.standby ? 1 : 0);
+  for(std::size_t i = 0; i < slots; ++i) {
+    auto s = boost::make_shared<stripe_t>(ios_, st_, i / halves);
+    s->standby = i == st_.stripes * halves;
+    if(st_.split) {
+      s->direction = i % 2 ? protocol::download : protocol::upload;
+    }
+    if(carrier_) {
+      s->stream = carrier_->h2->create_stream();
+      s->sock = s->stream;
+    }
+    else if(tls_) {
+      s->sock = boost::make_shared<secure_socket>(ios_, *tls_, st_.tls_flush_delay, crypto_.get());
+    }
+    else {
+      s->sock = boost::make_shared<normal_socket>(ios_, st_.mptcp);
+    }
+    s->htt_loop = boost::make_shared<http_to_tap_loop>(
+      s->sock,
+      taps_,
+      wheel_,
+      // nothing but the response head is received on an upload
+      protocol::upload == s->direction ? std::chrono::milliseconds(0) : st_.idle_timeout,
+      boost::bind(
+        &private_t::handle_headers_complete,
+          this,
+          _1,
+          i
+      ),
+      boost::bind(
+        &private_t::handle_control,
+          this,
+          _1,
+          i
+      ),
+      boost::bind(
+        &private_t::handle_htt_loop_stop,
+          this,
+          _1,
+          i
+      ),
+      carrier_ ? protocol::length_prefixed : protocol::chunked
+    );
+    if(st_.resume) {
+      s->htt_loop->acknowledge(boost::bind(
+        &private_t::send_ack,
+          this,
+          _1,
+          i
+      ));
+    }
+    if(settings::transport::websocket == st_.transport) {
+      s->htt_loop->answer_websocket(boost::bind(
+        &private_t::answer_websocket,
+          this,
+          _1,
+          _2,
+          i
+      ));
+    }
+    stripes_.push_back(s);
+  }
 }
 
 connect_mode::private_t::~private_t() {
-  boost::system::error_code close_ec;
-  socket_->shutdown(close_ec);
-  if(close_ec) {
-    LOG_WARNING << bf("connect_mode dtor: error while shutting socket down after accept failure: %s")
-      % close_ec.message();
+  wheel_.cancel(stats_timer_);
+  for(auto i = stripes_.begin(); i != stripes_.end(); ++i) {
+    (*i)->race.cancel();
+    boost::system::error_code close_ec;
+    (*i)->sock->shutdown(close_ec);
+    if(close_ec) {
+      LOG_WARNING << bf("connect_mode dtor: error while shutting socket down after accept failure: %s")
+        % close_ec.message();
+    }
+  }
+  if(carrier_) {
+    reset_carrier();
   }
-
 }
 
 void connect_mode::private_t::setup() {
-  // split host and port
-  auto colon = st_.address.find(':');
-  if(std::string::npos == colon) {
-    host_ = st_.address;
-    port_ = "443";
+  std::vector<std::string> addresses;
+  boost::algorithm::split(addresses, st_.address, boost::is_any_of(","), boost::token_compress_on);
+  std::vector<upstream_selector::upstream_t> upstreams;
+  for(auto i = addresses.begin(); i != addresses.end(); ++i) {
+    if(!i->empty()) {
+      upstreams.push_back(parse_upstream(*i));
+    }
   }
-  else {
-    host_ = st_.address.substr(0, colon);
-    port_ = st_.address.substr(colon+1);
+  if(upstreams.empty()) {
+    throw exception(boost::str(bf("No upstream in connect address '%s'") % st_.address));
   }
 
-  async_reconnect();
+  LOG_INFO << bf("connect_mode::setup: session '%s' over %d stripe(s)%s%s")
+    % session_ % st_.stripes % (st_.standby ? " with standby" : "")
+    % (carrier_ ? " of one http/2 connection" : st_.split ? " split into upload and download" : "");
+  schedule_stats();
+  if(1 == upstreams.size()) {
+    handle_upstream_switch(upstreams.front());
+    return;
+  }
+  // connect once the fastest upstream is known
+  selector_ = boost::make_shared<upstream_selector>(
+    ios_,
+    wheel_,
+    resolver_,
+    st_,
+    upstreams,
+    boost::bind(
+      &private_t::handle_upstream_switch,
+        this,
+        _1
+    )
+  );
+  selector_->start();
 }
 
-void connect_mode::private_t::close_and_reconnect() {
+void connect_mode::private_t::close_and_reconnect(std::size_t stripe) {
   static const char func[] = "connect_mode::close_and_reconnect";
+  auto& s = *stripes_[stripe];
   boost::system::error_code close_ec;
-  socket_->cancel(close_ec);
-  tap_.cancel(close_ec);
+  s.established = false;
+  wheel_.cancel(s.ping_timer);
+  s.reconnect_timer.cancel();
+  s.race.cancel();
+  s.awaiting_carrier = false;
+  s.sock->cancel(close_ec);
 
-  socket_->shutdown(close_ec);
+  s.sock->shutdown(close_ec);
   if(close_ec) {
     LOG_WARNING << bf("%s: error while shutting socket down after accept failure: %s")
       % func % close_ec.message();
   }
-  socket_->close(close_ec);
+  s.sock->close(close_ec);
   if(close_ec) {
     LOG_WARNING << bf("%s: error while closing socket after accept failure: %s")
       % func % close_ec.message();
   }
-  resolver_.cancel();
+  ++s.attempt;
   // 'clear' buffers
-  http_heades_buf_.consume(http_heades_buf_.size());
-  async_reconnect();
+  s.http_heades_buf.consume(s.http_heades_buf.size());
+  async_reconnect(stripe);
   return;
 }
 
-void connect_mode::private_t::set_reconnect_timer() {
+void connect_mode::private_t::set_reconnect_timer(std::size_t stripe, bool immediate) {
   static const char func[] = "connect_mode::set_reconnect_timer";
-  LOG_TRACE << bf("%s: setting reconnect time for %d ms")
-    % func % std::chrono::duration_cast<std::chrono::milliseconds>(st_.reconnect_interval).count();
-  reconnect_timer_.expires_from_now(st_.reconnect_interval);
-  reconnect_timer_.async_wait(boost::bind(
-    &private_t::close_and_reconnect,
-      this
+  auto interval = immediate ? std::chrono::milliseconds(0) : st_.reconnect_interval;
+  LOG_TRACE << bf("%s: setting reconnect time for stripe %d for %d ms")
+    % func % stripe % std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+  auto& s = *stripes_[stripe];
+  wheel_.cancel(s.handshake_timer);
+  s.reconnect_timer.expires_from_now(interval);
+  s.reconnect_timer.async_wait(boost::bind(
+    &private_t::handle_reconnect_timer,
+      this,
+      asio::placeholders::error,
+      stripe
   ));
+  // may switch upstream and reconnect right away
+  if(selector_) {
+    selector_->report_failure();
+  }
 }
 
-void connect_mode::private_t::async_reconnect() {
-  static const char func[] = "connect_mode::async_reconnect";
-  LOG_DEBUG << bf("%s: resolving host '%s', port '%s'") % func % host_ % port_;
+void connect_mode::private_t::handle_reconnect_timer(const boost::system::error_code& ec, std::size_t stripe) {
+  // timer is re-set if several failures are reported for one connection
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  close_and_reconnect(stripe);
+}
 
-  resolver_t::query q(host_, port_);
-  resolver_.async_resolve(q, boost::bind(
+void connect_mode::private_t::handle_handshake_timeout(std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_handshake_timeout";
+  auto& s = *stripes_[stripe];
+  s.handshake_timer = timing_wheel::no_timer;
+  LOG_WARNING << bf("%s: stripe %d to '%s:%s' not established within %d ms, setting reconnect timer")
+    % func % stripe % host_ % port_ % st_.handshake_timeout.count();
+  if(s.sends()) {
+    // an optimistic stripe is in the loop already
+    tth_loop_->remove_stripe(s.serves);
+  }
+  boost::system::error_code dummy_ec;
+  s.sock->cancel(dummy_ec);
+  ++s.attempt;
+  s.race.cancel();
+  if(s.awaiting_carrier) {
+    // connection the stream waits for is stuck, next attempt starts over
+    s.awaiting_carrier = false;
+    reset_carrier();
+  }
+  set_reconnect_timer(stripe);
+}
+
+void connect_mode::private_t::async_reconnect(std::size_t stripe) {
+  static const char func[] = "connect_mode::async_reconnect";
+  auto& s = *stripes_[stripe];
+  if(st_.handshake_timeout.count()) {
+    wheel_.reschedule(
+      s.handshake_timer,
+      st_.handshake_timeout,
+      boost::bind(
+        &private_t::handle_handshake_timeout,
+          this,
+          stripe
+      )
+    );
+  }
+  if(carrier_) {
+    connect_stream(stripe);
+    return;
+  }
+  LOG_DEBUG << bf("%s: resolving host '%s', port '%s' for stripe %d") % func % host_ % port_ % stripe;
+  resolver_.async_resolve(host_, port_, boost::bind(
     &private_t::handle_resolve,
       this,
-        asio::placeholders::error,
-        asio::placeholders::iterator
+        _1,
+        _2,
+        stripe,
+        s.attempt
   ));
 }
 
-void connect_mode::private_t::handle_resolve(const boost::system::error_code& ec, resolver_t::iterator i) {
+void connect_mode::private_t::handle_resolve(const boost::system::error_code& ec, const resolver_cache::endpoints_t& endpoints, std::size_t stripe, uint64_t attempt) {
   static const char func[] = "connect_mode::handle_resolve";
-  if(asio::error::operation_aborted == ec) {
+  if(attempt != stripes_[stripe]->attempt) {
     return;
   }
 
   if(ec) {
     LOG_ERROR << bf("%s: resolve of '%s:%d' failed, setting reconnect timer: %s")
       % func % host_ % port_ % ec.message();
-    set_reconnect_timer();
+    set_reconnect_timer(stripe);
     return;
   }
-  async_connect(i);
-}
-
-void connect_mode::private_t::async_connect(resolver_t::iterator i) {
-  socket_->async_connect(*i, boost::bind(
+  stripes_[stripe]->race.async_connect(endpoints, boost::bind(
     &private_t::handle_connect,
       this,
-      asio::placeholders::error,
-      i
+      _1,
+      _2,
+      stripe
   ));
 }
 
-void connect_mode::private_t::handle_connect(const boost::system::error_code& ec, resolver_t::iterator i) {
+void connect_mode::private_t::handle_connect(const boost::system::error_code& ec, asio::ip::tcp::socket& winner, std::size_t stripe) {
   static const char func[] = "connect_mode::handle_connect";
   if(asio::error::operation_aborted == ec) {
     return;
   }
 
   if(ec) {
-    LOG_DEBUG << bf("%s: connection to endpoint '%s:%d' failed, continuing: %s")
-      % func % i->endpoint().address().to_string() % i->endpoint().port() % ec.message();
-    if(++i != resolver_t::iterator()) {
-      async_connect(i);
-      return;
-    }
-    else {
-      LOG_ERROR << bf("%s: couldn't establish connection to any of the endpoints, setting reconnect timer")
-       % func;
-      set_reconnect_timer();
-      return;
-    }
+    LOG_ERROR << bf("%s: couldn't establish connection to any of the endpoints, setting reconnect timer: %s")
+     % func % ec.message();
+    set_reconnect_timer(stripe);
+    return;
+  }
+  boost::system::error_code peer_ec;
+  stripes_[stripe]->peer = winner.remote_endpoint(peer_ec);
+  stripes_[stripe]->sock->async_attach(std::move(winner), boost::bind(
+    &private_t::handle_attach,
+      this,
+      asio::placeholders::error,
+      stripe
+  ));
+}
+
+void connect_mode::private_t::handle_attach(const boost::system::error_code& ec, std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_attach";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  if(ec) {
+    LOG_ERROR << bf("%s: failed to set up connection of stripe %d, setting reconnect timer: %s")
+      % func % stripe % ec.message();
+    set_reconnect_timer(stripe);
+    return;
   }
   // we have connected
-  async_write_http_headers();
+  async_write_http_headers(stripe);
 }
 
-void connect_mode::private_t::async_write_http_headers() {
+void connect_mode::private_t::async_write_http_headers(std::size_t stripe) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  std::ostream str(&http_heades_buf_);
-  str << "POST /tunnel HTTP/1.1" << CRLF;
-  str << "Host: " << host_ << ":" << port_ << CRLF;
-  str << "User-Agent: secret-passage" << CRLF; //@TODO: add version
-  str << "Accept: application/octet-stream" << CRLF;
-  str << "Transfer-Encoding: chunked" << CRLF;
-  str << "Content-Type: application/octet-stream" << CRLF;
+  auto& s = *stripes_[stripe];
+  std::ostream str(&s.http_heades_buf);
+  if(settings::transport::websocket == st_.transport) {
+    s.websocket_key = websocket::make_key();
+    str << "GET /tunnel HTTP/1.1" << CRLF;
+    str << "Host: " << host_ << ":" << port_ << CRLF;
+    str << "User-Agent: secret-passage" << CRLF; //@TODO: add version
+    str << "Upgrade: websocket" << CRLF;
+    str << "Connection: Upgrade" << CRLF;
+    str << "Sec-WebSocket-Key: " << s.websocket_key << CRLF;
+    str << "Sec-WebSocket-Version: 13" << CRLF;
+  }
+  else if(protocol::download == s.direction) {
+    str << "GET /tunnel HTTP/1.1" << CRLF;
+    str << "Host: " << host_ << ":" << port_ << CRLF;
+    str << "User-Agent: secret-passage" << CRLF; //@TODO: add version
+    str << "Accept: application/octet-stream" << CRLF;
+  }
+  else {
+    str << "POST /tunnel HTTP/1.1" << CRLF;
+    str << "Host: " << host_ << ":" << port_ << CRLF;
+    str << "User-Agent: secret-passage" << CRLF; //@TODO: add version
+    str << "Accept: application/octet-stream" << CRLF;
+    str << "Transfer-Encoding: chunked" << CRLF;
+    str << "Content-Type: application/octet-stream" << CRLF;
+  }
+  str << protocol::session_header << ": " << session_ << CRLF;
+  if(s.standby) {
+    str << protocol::standby_header << ": 1" << CRLF;
+  }
+  else {
+    str << protocol::stripe_header << ": " << s.serves << CRLF;
+  }
+  if(protocol::both != s.direction) {
+    str << protocol::direction_header << ": "
+      << (protocol::upload == s.direction ? protocol::direction_upload : protocol::direction_download) << CRLF;
+  }
+  str << protocol::capabilities_header << ": " << offer(stripe).to_string() << CRLF;
+  if(!seal_key_.empty()) {
+    s.seal_nonce = batch_cipher::make_nonce();
+    str << protocol::seal_header << ": " << s.seal_nonce << CRLF;
+    str << protocol::seal_proof_header << ": " << batch_cipher::prove(seal_key_, s.seal_nonce, session_) << CRLF;
+  }
+  if(st_.resume) {
+    str << protocol::resume_header << ": " << s.htt_loop->received() << CRLF;
+  }
   str << CRLF;
 
-  socket_->async_write_some(
-    http_heades_buf_.data(),
+  s.sock->async_write_some(
+    s.http_heades_buf.data(),
     boost::bind(
       &private_t::handle_write_http_headers,
         this,
         asio::placeholders::error,
-        asio::placeholders::bytes_transferred
+        asio::placeholders::bytes_transferred,
+        stripe
     )
   );
 }
 
-void connect_mode::private_t::handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr) {
+void connect_mode::private_t::handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr, std::size_t stripe) {
   LOG_TRACE << __PRETTY_FUNCTION__;
   static const char func[] = "connect_mode::handle_write_http_headers";
   if(asio::error::operation_aborted == ec) {
@@ -246,39 +597,601 @@ void connect_mode::private_t::handle_write_http_headers(const boost::system::err
   if(ec) {
     LOG_WARNING << bf("%s: failed to write headers, setting reconnect timer: %s")
       % func % ec.message();
-    set_reconnect_timer();
+    set_reconnect_timer(stripe);
     return;
   }
 
-  http_heades_buf_.consume(tr);
-  htt_loop_->start();
+  auto& s = *stripes_[stripe];
+  s.http_heades_buf.consume(tr);
+  s.htt_loop->start();
+  if(protocol::upload == s.direction) {
+    // a proxy may hold the response back until the request ends, so frames don't wait for it.
+    // it is still read, a rejection or the connection closing stops the upload
+    wheel_.cancel(s.handshake_timer);
+    s.established = true;
+    s.established_at = std::chrono::steady_clock::now();
+    LOG_INFO << bf("%s: %s established over %s") % func % s.name() % s.sock->stats();
+    add_stripe(stripe, true);
+  }
+  else if(st_.optimistic_send && s.sends()) {
+    // don't wait a round trip for the response, frames are replayed if it's not a success
+    add_stripe(stripe, false);
+  }
 }
 
-bool connect_mode::private_t::handle_headers_complete(const http_parser* parser) {
+bool connect_mode::private_t::handle_headers_complete(const http_parser* parser, std::size_t stripe) {
   static const char func[] = "connect_mode::handle_headers_complete";
-  LOG_DEBUG << bf("%s: Headers complete. Status: '%d %s' , headers are:")
-    % func % parser->code() % parser->status();
+  LOG_DEBUG << bf("%s: Headers complete on stripe %d. Status: '%d %s' , headers are:")
+    % func % stripe % parser->code() % parser->status();
   for(auto i = parser->headers().begin(); i != parser->headers().end(); ++i) {
     LOG_DEBUG << bf("\t%s: %s") % i->first % i->second;
   }
+  if(settings::transport::websocket == st_.transport && 101 == parser->code()) {
+    auto& s = *stripes_[stripe];
+    auto accept = parser->header("Sec-WebSocket-Accept");
+    if(!accept || *accept != websocket::accept_key(s.websocket_key)) {
+      LOG_ERROR << bf("%s: websocket upgrade on stripe %d not accepted properly") % func % stripe;
+      return false;
+    }
+  }
+  return handle_response(
+    parser->code(),
+    parser->status(),
+    parser->header(protocol::capabilities_header),
+    parser->header(protocol::resume_header),
+    parser->header(protocol::seal_header),
+    stripe
+  );
+}
 
-  //@TODO: check status
-  tth_loop_->start();
+bool connect_mode::private_t::handle_response(int code, const std::string& status, const std::string* caps, const std::string* resume,
+  const std::string* seal, std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_response";
+  auto& s = *stripes_[stripe];
+  int expected = settings::transport::websocket == st_.transport ? 101 : 200;
+  if(expected != code) {
+    LOG_ERROR << bf("%s: tunnel request on stripe %d rejected: '%d %s'")
+      % func % stripe % code % status;
+    return false;
+  }
+  // what the server has negotiated, nothing from servers predating capabilities
+  s.caps = offer(stripe).negotiate(capabilities::parse(caps ? *caps : std::string()));
+  LOG_DEBUG << bf("%s: capabilities of stripe %d: '%s'") % func % stripe % s.caps.to_string();
+  auto channels = s.caps.number(protocol::cap_channels);
+  if(channels != taps_.multiplexed()) {
+    taps_.multiplex(channels);
+    LOG_WARNING << bf("%s: server takes %d of %d channels, frames of the others are dropped")
+      % func % std::max<std::size_t>(channels, 1) % taps_.size();
+  }
+  if(!seal_key_.empty()) {
+    // frames never go in the clear
+    if(!s.caps.has(protocol::cap_seal) || !seal || seal->empty()) {
+      LOG_ERROR << bf("%s: server does not seal frames of stripe %d with %s") % func % stripe % st_.seal_cipher;
+      return false;
+    }
+    s.htt_loop->open_sealed(boost::make_shared<batch_cipher>(st_.seal_cipher, seal_key_, s.seal_nonce, *seal, false));
+    s.seal = boost::make_shared<batch_cipher>(st_.seal_cipher, seal_key_, s.seal_nonce, *seal, true);
+  }
+  // the loop outlives the connection, what the previous one negotiated does not
+  s.htt_loop->decompress(s.caps.has(protocol::cap_compress) ? compressor_ : boost::shared_ptr<batch_compressor>());
+  if(compressor_ && !s.caps.has(protocol::cap_compress)) {
+    LOG_WARNING << bf("%s: server does not compress with %s, frames of stripe %d go as they are")
+      % func % compressor_->method() % stripe;
+  }
+  s.htt_loop->decompress_headers(s.caps.has(protocol::cap_headers) ? boost::make_shared<header_compressor>() : boost::shared_ptr<header_compressor>());
+  if(st_.compress_headers && !s.caps.has(protocol::cap_headers)) {
+    LOG_WARNING << bf("%s: server does not compress headers, those of stripe %d go as they are") % func % stripe;
+  }
+  if(datagrams_ && s.keys_datagrams()) {
+    if(s.caps.has(protocol::cap_datagram)) {
+      datagrams_->rekey(*s.sock, asio::ip::udp::endpoint(s.peer.address(), s.peer.port()));
+    }
+    else {
+      LOG_WARNING << bf("%s: server does not offer datagrams, frames go over http") % func;
+    }
+  }
+  if(s.caps.has(protocol::cap_resume)) {
+    uint64_t peer_received = 0;
+    try {
+      peer_received = resume ? std::stoull(*resume) : 0;
+    }
+    catch(const std::exception&) {
+      LOG_ERROR << bf("%s: bad %s header value '%s' on stripe %d")
+        % func % protocol::resume_header % *resume % stripe;
+      return false;
+    }
+    // frames the server is missing go ahead of new ones once the stripe is added
+    tth_loop_->resume_stripe(s.serves, peer_received);
+  }
+  else if(st_.resume) {
+    LOG_WARNING << bf("%s: server does not resume stripe %d, frames lost on reconnects are not sent again")
+      % func % stripe;
+  }
+  if(protocol::upload == s.direction) {
+    // established since the request went out
+    return true;
+  }
+  wheel_.cancel(s.handshake_timer);
+  s.established = true;
+  s.established_at = std::chrono::steady_clock::now();
+  if(s.standby) {
+    LOG_INFO << bf("%s: standby connection ready over %s") % func % s.sock->stats();
+    s.pong_pending = false;
+    schedule_ping(stripe);
+    return true;
+  }
+  LOG_INFO << bf("%s: %s established over %s") % func % s.name() % s.sock->stats();
+  if(protocol::download == s.direction) {
+    // frames of the stripe are sent on its upload half
+    return true;
+  }
+  if(st_.optimistic_send) {
+    tth_loop_->confirm_stripe(s.serves);
+  }
+  else {
+    add_stripe(stripe, true);
+  }
   return true;
 }
 
-void connect_mode::private_t::handle_htt_loop_stop(loop_stop_reason::code_t code) {
+void connect_mode::private_t::add_stripe(std::size_t stripe, bool confirmed) {
+  auto& s = *stripes_[stripe];
+  tth_loop_->add_stripe(
+    s.serves,
+    s.sock,
+    boost::bind(
+      &private_t::handle_htt_loop_stop,
+        this,
+        _1,
+        stripe
+    ),
+    confirmed,
+    framing(),
+    s.seal,
+    s.caps.has(protocol::cap_compress) ? compressor_ : boost::shared_ptr<batch_compressor>(),
+    s.caps.has(protocol::cap_headers) ? boost::make_shared<header_compressor>() : boost::shared_ptr<header_compressor>()
+  );
+}
+
+// features we ask for on the connection of the stripe
+capabilities connect_mode::private_t::offer(std::size_t stripe) const {
+  auto& s = *stripes_[stripe];
+  capabilities ret;
+  ret.set_version(capabilities::current_version);
+  if(st_.resume) {
+    ret.set(protocol::cap_resume);
+  }
+  if(datagrams_ && s.keys_datagrams()) {
+    ret.set(protocol::cap_datagram);
+  }
+  if(!seal_key_.empty()) {
+    ret.set(protocol::cap_seal, st_.seal_cipher);
+  }
+  if(compressor_) {
+    ret.set(protocol::cap_compress, compressor_->method());
+  }
+  if(st_.compress_headers) {
+    ret.set(protocol::cap_headers);
+  }
+  if(taps_.size() > 1) {
+    ret.set(protocol::cap_channels, std::to_string(taps_.size()));
+  }
+  return ret;
+}
+
+protocol::framing_t connect_mode::private_t::framing() const {
+  if(carrier_) {
+    return protocol::length_prefixed;
+  }
+  if(settings::transport::websocket == st_.transport) {
+    return protocol::websocket_masked;
+  }
+  return protocol::chunked;
+}
+
+void connect_mode::private_t::handle_control(const std::vector<char>& message, std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_control";
+  auto& s = *stripes_[stripe];
+  if(protocol::control_pong == message.front()) {
+    s.pong_pending = false;
+    return;
+  }
+  uint64_t counter = 0;
+  if(protocol::control_ack == message.front() && protocol::parse_counter(message, counter)) {
+    tth_loop_->acknowledge(s.serves, counter);
+    return;
+  }
+  if(protocol::control_sync == message.front() && protocol::parse_counter(message, counter)) {
+    s.htt_loop->set_received(counter);
+    return;
+  }
+  LOG_WARNING << bf("%s: unexpected control message '%c' on stripe %d") % func % message.front() % s.serves;
+}
+
+void connect_mode::private_t::send_ack(uint64_t received, std::size_t stripe) {
+  tth_loop_->send_control(stripes_[stripe]->serves, protocol::counter_message(protocol::control_ack, received));
+}
+
+// pings and closes of the websocket itself, from whatever sits in front of the server
+bool connect_mode::private_t::answer_websocket(websocket::opcode_t opcode, const std::vector<char>& payload, std::size_t stripe) {
+  auto& s = *stripes_[stripe];
+  // standby connections and download halves have no writer to answer with
+  if(!s.sends()) return false;
+  return tth_loop_->send_websocket_control(s.serves, websocket::ping == opcode ? websocket::pong : websocket::close, payload);
+}
+
+void connect_mode::private_t::handle_htt_loop_stop(loop_stop_reason::code_t code, std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_htt_loop_stop";
+  auto& s = *stripes_[stripe];
+  // a connection that served for a while is retried at once, flapping ones wait
+  bool immediate = false;
+  if(s.established) {
+    s.established = false;
+    immediate = std::chrono::steady_clock::now() - s.established_at > st_.reconnect_interval;
+    LOG_INFO << bf("%s: %s stats: %s") % func % s.name() % s.sock->stats();
+  }
+  wheel_.cancel(s.ping_timer);
+  if(s.sends()) {
+    tth_loop_->remove_stripe(s.serves);
+    // otherwise flows of the stripe move to the remaining ones until it reconnects
+    if(activate_standby(s.serves)) {
+      s.standby = true;
+    }
+  }
+  // let the server drop it at once rather than striping flows onto it until we reconnect
   boost::system::error_code dummy_ec;
-  socket_->cancel(dummy_ec);
-  tap_.cancel(dummy_ec);
-  set_reconnect_timer();
+  s.sock->cancel(dummy_ec);
+  s.sock->shutdown(dummy_ec);
+  set_reconnect_timer(stripe, immediate);
+}
+
+bool connect_mode::private_t::activate_standby(std::size_t serves) {
+  static const char func[] = "connect_mode::activate_standby";
+  for(std::size_t stripe = 0; stripe < stripes_.size(); ++stripe) {
+    auto& s = *stripes_[stripe];
+    if(!s.standby || !s.established || s.pong_pending) continue;
+
+    wheel_.cancel(s.ping_timer);
+    s.standby = false;
+    s.serves = serves;
+    add_stripe(stripe, true);
+    // queued ahead of any frame
+    std::string message = protocol::control_activate + std::to_string(serves);
+    tth_loop_->send_control(serves, std::vector<char>(message.begin(), message.end()));
+    LOG_INFO << bf("%s: stripe %d failed over to standby connection") % func % serves;
+    return true;
+  }
+  return false;
+}
+
+void connect_mode::private_t::schedule_ping(std::size_t stripe) {
+  wheel_.reschedule(
+    stripes_[stripe]->ping_timer,
+    st_.standby_ping_interval,
+    boost::bind(
+      &private_t::handle_ping_timer,
+        this,
+        stripe
+    )
+  );
+}
+
+void connect_mode::private_t::handle_ping_timer(std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_ping_timer";
+  auto& s = *stripes_[stripe];
+  s.ping_timer = timing_wheel::no_timer;
+  if(s.pong_pending) {
+    LOG_WARNING << bf("%s: standby connection didn't answer ping within %d ms, reconnecting")
+      % func % st_.standby_ping_interval.count();
+    s.established = false;
+    boost::system::error_code dummy_ec;
+    s.sock->cancel(dummy_ec);
+    set_reconnect_timer(stripe);
+    return;
+  }
+  // nothing else writes to the standby connection
+  s.pong_pending = true;
+  switch(framing()) {
+  case protocol::length_prefixed:
+    s.ping.assign(protocol::ping_prefixed, sizeof(protocol::ping_prefixed) - 1);
+    break;
+  case protocol::websocket_masked: {
+    unsigned char mask[4];
+    s.ping.clear();
+    websocket::append_header(s.ping, websocket::binary, 1, mask);
+    s.ping.push_back(protocol::control_ping);
+    websocket::apply_mask(&s.ping.back(), 1, mask);
+    break;
+  }
+  default:
+    s.ping.assign(protocol::ping_chunk, sizeof(protocol::ping_chunk) - 1);
+  }
+  s.sock->async_write_some(
+    asio::const_buffers_1(asio::buffer(s.ping)),
+    boost::bind(
+      &private_t::handle_write_ping,
+        this,
+        asio::placeholders::error,
+        stripe
+    )
+  );
+  schedule_ping(stripe);
+}
+
+void connect_mode::private_t::handle_write_ping(const boost::system::error_code& ec, std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_write_ping";
+  // a failed connection is noticed by its read loop or the missing pong
+  if(ec && asio::error::operation_aborted != ec) {
+    LOG_DEBUG << bf("%s: failed to write ping to standby connection of stripe %d: %s") % func % stripe % ec.message();
+  }
+}
+
+void connect_mode::private_t::handle_upstream_switch(const upstream_selector::upstream_t& upstream) {
+  host_ = upstream.host;
+  port_ = upstream.port;
+  if(tls_) {
+    tls_->set_server_name(host_);
+  }
+  if(!connecting_) {
+    connecting_ = true;
+    for(std::size_t stripe = 0; stripe < stripes_.size(); ++stripe) {
+      async_reconnect(stripe);
+    }
+    return;
+  }
+  if(carrier_) {
+    reset_carrier();
+  }
+  for(std::size_t stripe = 0; stripe < stripes_.size(); ++stripe) {
+    if(stripes_[stripe]->sends()) {
+      tth_loop_->remove_stripe(stripes_[stripe]->serves);
+    }
+    close_and_reconnect(stripe);
+  }
+}
+
+void connect_mode::private_t::connect_stream(std::size_t stripe) {
+  auto& s = *stripes_[stripe];
+  if(carrier_t::up == carrier_->state) {
+    open_stream(stripe);
+    return;
+  }
+  s.awaiting_carrier = true;
+  if(carrier_t::down == carrier_->state) {
+    connect_carrier();
+  }
+}
+
+void connect_mode::private_t::open_stream(std::size_t stripe) {
+  static const char func[] = "connect_mode::open_stream";
+  auto& s = *stripes_[stripe];
+  s.awaiting_carrier = false;
+  header_list request;
+  request.push_back(std::make_pair(":method", "POST"));
+  request.push_back(std::make_pair(":scheme", tls_ ? "https" : "http"));
+  request.push_back(std::make_pair(":authority", host_ + ":" + port_));
+  request.push_back(std::make_pair(":path", "/tunnel"));
+  request.push_back(std::make_pair("user-agent", "secret-passage"));
+  request.push_back(std::make_pair("accept", "application/octet-stream"));
+  request.push_back(std::make_pair("content-type", "application/octet-stream"));
+  request.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::session_header)), session_));
+  request.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::stripe_header)), std::to_string(s.serves)));
+  request.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::capabilities_header)), offer(stripe).to_string()));
+  if(!seal_key_.empty()) {
+    s.seal_nonce = batch_cipher::make_nonce();
+    request.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::seal_header)), s.seal_nonce));
+    request.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::seal_proof_header)),
+      batch_cipher::prove(seal_key_, s.seal_nonce, session_)));
+  }
+  if(st_.resume) {
+    request.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::resume_header)), std::to_string(s.htt_loop->received())));
+  }
+  bool opened = carrier_->h2->open(
+    *s.stream,
+    request,
+    boost::bind(
+      &private_t::handle_response_headers,
+        this,
+        _1,
+        stripe
+    )
+  );
+  if(!opened) {
+    LOG_WARNING << bf("%s: http/2 connection is gone, setting reconnect timer for stripe %d") % func % stripe;
+    set_reconnect_timer(stripe);
+    return;
+  }
+  LOG_DEBUG << bf("%s: stripe %d requested over %s") % func % stripe % s.stream->stats();
+  s.htt_loop->start();
+  if(st_.optimistic_send && !s.standby) {
+    // don't wait a round trip for the response, frames are replayed if it's not a success
+    add_stripe(stripe, false);
+  }
+}
+
+void connect_mode::private_t::handle_response_headers(const header_list& headers, std::size_t stripe) {
+  static const char func[] = "connect_mode::handle_response_headers";
+  LOG_DEBUG << bf("%s: Headers complete on stripe %d, headers are:") % func % stripe;
+  int code = 0;
+  const std::string* caps = nullptr;
+  const std::string* resume = nullptr;
+  const std::string* seal = nullptr;
+  auto caps_name = boost::algorithm::to_lower_copy(std::string(protocol::capabilities_header));
+  auto resume_name = boost::algorithm::to_lower_copy(std::string(protocol::resume_header));
+  auto seal_name = boost::algorithm::to_lower_copy(std::string(protocol::seal_header));
+  for(auto i = headers.begin(); i != headers.end(); ++i) {
+    LOG_DEBUG << bf("\t%s: %s") % i->first % i->second;
+    if(":status" == i->first) {
+      code = std::atoi(i->second.c_str());
+    }
+    else if(caps_name == i->first) {
+      caps = &i->second;
+    }
+    else if(resume_name == i->first) {
+      resume = &i->second;
+    }
+    else if(seal_name == i->first) {
+      seal = &i->second;
+    }
+  }
+  if(handle_response(code, std::string(), caps, resume, seal, stripe)) {
+    return;
+  }
+  auto& s = *stripes_[stripe];
+  if(s.sends()) {
+    tth_loop_->remove_stripe(s.serves);
+  }
+  boost::system::error_code dummy_ec;
+  s.sock->close(dummy_ec);
+  set_reconnect_timer(stripe);
+}
+
+void connect_mode::private_t::connect_carrier() {
+  static const char func[] = "connect_mode::connect_carrier";
+  LOG_DEBUG << bf("%s: resolving host '%s', port '%s' for http/2 connection") % func % host_ % port_;
+  carrier_->state = carrier_t::connecting;
+  resolver_.async_resolve(host_, port_, boost::bind(
+    &private_t::handle_carrier_resolve,
+      this,
+        _1,
+        _2,
+        carrier_->attempt
+  ));
+}
+
+void connect_mode::private_t::handle_carrier_resolve(const boost::system::error_code& ec, const resolver_cache::endpoints_t& endpoints, uint64_t attempt) {
+  if(attempt != carrier_->attempt) {
+    return;
+  }
+  if(ec) {
+    fail_carrier("resolve failed", ec);
+    return;
+  }
+  carrier_->race.async_connect(endpoints, boost::bind(
+    &private_t::handle_carrier_connect,
+      this,
+      _1,
+      _2,
+      attempt
+  ));
+}
+
+void connect_mode::private_t::handle_carrier_connect(const boost::system::error_code& ec, asio::ip::tcp::socket& winner, uint64_t attempt) {
+  if(asio::error::operation_aborted == ec || attempt != carrier_->attempt) {
+    return;
+  }
+  if(ec) {
+    fail_carrier("couldn't establish connection to any of the endpoints", ec);
+    return;
+  }
+  carrier_->sock->async_attach(std::move(winner), boost::bind(
+    &private_t::handle_carrier_attach,
+      this,
+      asio::placeholders::error,
+      attempt
+  ));
+}
+
+void connect_mode::private_t::handle_carrier_attach(const boost::system::error_code& ec, uint64_t attempt) {
+  static const char func[] = "connect_mode::handle_carrier_attach";
+  if(asio::error::operation_aborted == ec || attempt != carrier_->attempt) {
+    return;
+  }
+  if(ec) {
+    fail_carrier("failed to set up connection", ec);
+    return;
+  }
+  carrier_->state = carrier_t::up;
+  carrier_->h2->start(
+    std::string(),
+    h2_connection::stream_handler(),
+    boost::bind(
+      &private_t::handle_carrier_close,
+        this,
+        asio::placeholders::error,
+        attempt
+    )
+  );
+  LOG_INFO << bf("%s: http/2 connection established over %s") % func % carrier_->sock->stats();
+  for(std::size_t stripe = 0; stripe < stripes_.size(); ++stripe) {
+    if(stripes_[stripe]->awaiting_carrier) {
+      open_stream(stripe);
+    }
+  }
+}
+
+void connect_mode::private_t::handle_carrier_close(const boost::system::error_code& ec, uint64_t attempt) {
+  static const char func[] = "connect_mode::handle_carrier_close";
+  if(attempt != carrier_->attempt) {
+    return;
+  }
+  // its streams failed as well, their stripes reconnect on their own
+  LOG_INFO << bf("%s: http/2 connection closed (%s), stats: %s") % func % ec.message() % carrier_->sock->stats();
+  reset_carrier();
+}
+
+// streams waiting for the connection are retried later
+void connect_mode::private_t::fail_carrier(const char* what, const boost::system::error_code& ec) {
+  static const char func[] = "connect_mode::fail_carrier";
+  LOG_ERROR << bf("%s: http/2 connection to '%s:%s': %s, setting reconnect timer: %s")
+    % func % host_ % port_ % what % ec.message();
+  reset_carrier();
+  for(std::size_t stripe = 0; stripe < stripes_.size(); ++stripe) {
+    auto& s = *stripes_[stripe];
+    if(s.awaiting_carrier) {
+      s.awaiting_carrier = false;
+      set_reconnect_timer(stripe);
+    }
+  }
+}
+
+void connect_mode::private_t::reset_carrier() {
+  ++carrier_->attempt;
+  carrier_->race.cancel();
+  carrier_->h2->close();
+  carrier_->state = carrier_t::down;
+  boost::system::error_code dummy_ec;
+  carrier_->sock->cancel(dummy_ec);
+  carrier_->sock->shutdown(dummy_ec);
+  carrier_->sock->close(dummy_ec);
+}
+
+void connect_mode::private_t::schedule_stats() {
+  if(!st_.stats_interval.count()) return;
+  stats_timer_ = wheel_.schedule(
+    st_.stats_interval,
+    boost::bind(
+      &private_t::handle_stats_timer,
+        this
+    )
+  );
+}
+
+void connect_mode::private_t::handle_stats_timer() {
+  static const char func[] = "connect_mode::handle_stats_timer";
+  for(std::size_t stripe = 0; stripe < stripes_.size(); ++stripe) {
+    auto& s = *stripes_[stripe];
+    if(s.established && !s.standby) {
+      LOG_INFO << bf("%s: %s: %s") % func % s.name() % s.sock->stats();
+    }
+  }
+  if(tls_) {
+    LOG_INFO << bf("%s: %s") % func % tls_->stats();
+  }
+  if(datagrams_) {
+    LOG_INFO << bf("%s: %s") % func % datagrams_->stats();
+  }
+  if(compressor_) {
+    LOG_INFO << bf("%s: %s") % func % compressor_->stats();
+  }
+  schedule_stats();
 }
 
 /*\
  *  class connect_mode
 \*/
-connect_mode::connect_mode(asio::io_service& ios, const settings& st, shared_descriptor tap) {
-  p = boost::make_shared<private_t>(ios, st, tap);
+connect_mode::connect_mode(asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps) {
+  p = boost::make_shared<private_t>(ios, st, taps);
 }
 
 void connect_mode::setup() {
@@ -1,6 +1,7 @@
 #ifndef CONNECT_MODE_HPP
 #define CONNECT_MODE_HPP
 
+#include <vector>
 #include <boost/asio/io_service.hpp>
 #include "settings.hpp"
 #include "scoped_descriptor.hpp"
@@ -14,7 +15,7 @@ class connect_mode
 public:
   typedef sp::exception<connect_mode> exception;
 
-  connect_mode(boost::asio::io_service& ios, const settings& st, shared_descriptor tap);
+  connect_mode(boost::asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps);
   void setup();   // throws exception
 
 private:
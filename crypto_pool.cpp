@@ -0,0 +1,71 @@
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+#include "crypto_pool.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+/*\
+ *  class crypto_pool::private_t
+\*/
+class crypto_pool::private_t {
+public:
+  private_t(asio::io_service& ios, std::size_t threads);
+  ~private_t();
+
+  static void work(asio::io_service& workers_ios);
+  static void run(asio::io_service& ios, job_t job, job_t completion);
+
+  asio::io_service& ios_;
+  asio::io_service workers_ios_;
+  boost::shared_ptr<asio::io_service::work> work_;
+  boost::thread_group workers_;
+  std::size_t threads_;
+};
+
+crypto_pool::private_t::private_t(asio::io_service& ios, std::size_t threads)
+  : ios_(ios)
+  , work_(boost::make_shared<asio::io_service::work>(workers_ios_))
+  , threads_(threads)
+{
+  for(std::size_t i = 0; i < threads_; ++i) {
+    workers_.create_thread(boost::bind(&private_t::work, boost::ref(workers_ios_)));
+  }
+}
+
+crypto_pool::private_t::~private_t() {
+  work_.reset();
+  workers_ios_.stop();
+  workers_.join_all();
+}
+
+void crypto_pool::private_t::work(asio::io_service& workers_ios) {
+  workers_ios.run();
+}
+
+void crypto_pool::private_t::run(asio::io_service& ios, job_t job, job_t completion) {
+  job();
+  ios.post(completion);
+}
+
+/*\
+ *  class crypto_pool
+\*/
+crypto_pool::crypto_pool(asio::io_service& ios, std::size_t threads) {
+  p = boost::make_shared<private_t>(ios, threads);
+}
+
+crypto_pool::~crypto_pool() {}
+
+void crypto_pool::post(job_t job, job_t completion) {
+  p->workers_ios_.post(boost::bind(&private_t::run, boost::ref(p->ios_), job, completion));
+}
+
+std::size_t crypto_pool::threads() const {
+  return p->threads_;
+}
+
+}
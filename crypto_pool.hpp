@@ -0,0 +1,33 @@
+#ifndef CRYPTO_POOL_HPP
+#define CRYPTO_POOL_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace sp
+{
+
+// a few worker threads to run cpu heavy jobs (record encryption) off the io_service thread.
+// jobs run in any order and in parallel, callers restore the order they need in completions
+class crypto_pool
+{
+public:
+  typedef boost::function<void()> job_t;
+
+  crypto_pool(boost::asio::io_service& ios, std::size_t threads);
+  ~crypto_pool(); // joins workers, queued jobs are dropped
+
+  // job is run on a worker, then completion is posted to the io_service
+  void post(job_t job, job_t completion);
+
+  std::size_t threads() const;
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // CRYPTO_POOL_HPP
@@ -0,0 +1,592 @@
+#include <bitset>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/placeholders.hpp>
+#include "datagram_transport.hpp"
+#include "tunnel_protocol.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace {
+static const char export_label[] = "EXPORTER-secret-passage-datagram";
+static const std::size_t key_size = 32;
+static const std::size_t id_size = 8;
+static const std::size_t header_size = id_size + 8; // and the sequence
+static const std::size_t tag_size = 16;
+static const std::size_t nonce_size = 12;
+static const std::size_t max_datagram_size = 65507; // udp over ipv4, what may be received
+static const std::size_t max_sent_size = 1400;      // below the path mtu of most paths, nothing is fragmented
+static const std::size_t batch_size = 32;           // datagrams per sendmmsg or recvmmsg
+static const std::size_t max_queued = 256;          // datagrams waiting for the socket, frames for tap
+static const std::size_t window_size = 1024;
+static const int ip_pmtudisc_do = IP_PMTUDISC_DO;
+static const int ipv6_pmtudisc_do = IPV6_PMTUDISC_DO;
+static const int socket_buffer_size = 4 * 1024 * 1024; // bursts of a fast inner flow
+static const std::chrono::milliseconds tick_interval(1000);
+static const unsigned silent_ticks_down = 3;
+
+void put_sequence(unsigned char* out, uint64_t seq) {
+  for(int i = 7; i >= 0; --i, seq >>= 8) {
+    out[i] = seq & 0xff;
+  }
+}
+
+uint64_t get_sequence(const unsigned char* in) {
+  uint64_t seq = 0;
+  for(int i = 0; i < 8; ++i) {
+    seq = (seq << 8) | in[i];
+  }
+  return seq;
+}
+
+// sequence in the low bytes, the key is never used twice with one
+void make_nonce(unsigned char* nonce, uint64_t seq) {
+  std::memset(nonce, 0, nonce_size - 8);
+  put_sequence(nonce + nonce_size - 8, seq);
+}
+}
+
+/*\
+ *  class datagram_transport::private_t
+\*/
+class datagram_transport::private_t: public boost::enable_shared_from_this<private_t> {
+public:
+  private_t(asio::io_service& ios, tap_set& taps, timing_wheel& wheel, bool server);
+  ~private_t();
+
+  void bind(const asio::ip::udp::endpoint& endpoint, boost::system::error_code& ec);
+  bool rekey(socket& sock, const asio::ip::udp::endpoint& peer);
+  bool send(const char* frame, std::size_t size);
+  void close();
+
+  bool up() const;
+  std::string stats();
+
+private:
+  void connect(const asio::ip::udp::endpoint& peer);
+  void set_buffers();
+  void set_dont_fragment();
+  void queue(const char* data, std::size_t size);
+  bool seal(const char* data, std::size_t size, std::vector<char>& out);
+  bool open(const unsigned char* data, std::size_t size, std::vector<char>& out);
+  bool fresh(uint64_t seq) const;
+  void mark(uint64_t seq);
+
+  void flush();
+  void handle_writable(const boost::system::error_code& ec);
+  void async_receive();
+  void handle_readable(const boost::system::error_code& ec);
+  void receive(const unsigned char* data, std::size_t size, const asio::ip::udp::endpoint& from);
+
+  void async_write_tap();
+  void handle_write_tap(const boost::system::error_code& ec, std::size_t tr);
+
+  void schedule_tick();
+  void handle_tick();
+  void update_state();
+
+  asio::io_service& ios_;
+  tap_set& taps_;
+  timing_wheel& wheel_;
+  const bool server_;
+  asio::ip::udp::socket socket_;
+  timing_wheel::timer_id tick_timer_;
+
+  EVP_CIPHER_CTX* seal_;
+  EVP_CIPHER_CTX* open_;
+  bool keyed_;
+  unsigned char id_[id_size];
+  uint64_t send_seq_;
+  uint64_t recv_max_;  // highest sequence opened
+  std::bitset<window_size> window_; // sequences below it already opened, by sequence modulo size
+
+  asio::ip::udp::endpoint peer_;
+  bool peer_known_;
+  unsigned silent_ticks_; // since the peer was last heard from
+  bool was_up_;
+
+  std::deque<std::vector<char> > out_; // sealed datagrams
+  bool flush_posted_;
+  bool waiting_writable_;
+  std::vector<std::vector<char> > in_; // receive buffers of a batch
+  std::deque<tap_set::frame_t> frames_; // to taps
+
+  uint64_t sent_, received_, rejected_, dropped_;
+};
+
+datagram_transport::private_t::private_t(asio::io_service& ios, tap_set& taps, timing_wheel& wheel, bool server)
+  : ios_(ios), taps_(taps), wheel_(wheel), server_(server), socket_(ios)
+  , tick_timer_(timing_wheel::no_timer)
+  , seal_(EVP_CIPHER_CTX_new()), open_(EVP_CIPHER_CTX_new())
+  , keyed_(false), send_seq_(0), recv_max_(0)
+  , peer_known_(false), silent_ticks_(silent_ticks_down), was_up_(false)
+  , flush_posted_(false), waiting_writable_(false)
+  , in_(batch_size, std::vector<char>(max_datagram_size))
+  , sent_(0), received_(0), rejected_(0), dropped_(0)
+{}
+
+datagram_transport::private_t::~private_t() {
+  EVP_CIPHER_CTX_free(seal_);
+  EVP_CIPHER_CTX_free(open_);
+}
+
+void datagram_transport::private_t::bind(const asio::ip::udp::endpoint& endpoint, boost::system::error_code& ec) {
+  socket_.open(endpoint.protocol(), ec);
+  if(ec) return;
+  socket_.set_option(asio::ip::udp::socket::reuse_address(true), ec);
+  if(ec) return;
+  socket_.bind(endpoint, ec);
+  if(ec) return;
+  set_buffers();
+  set_dont_fragment();
+  async_receive();
+}
+
+bool datagram_transport::private_t::rekey(socket& sock, const asio::ip::udp::endpoint& peer) {
+  static const char func[] = "datagram_transport::rekey";
+  unsigned char material[2 * key_size + id_size];
+  if(!sock.export_keying_material(export_label, material, sizeof(material))) {
+    LOG_WARNING << bf("%s: connection has no tls session to key datagrams with") % func;
+    return false;
+  }
+  // client sends with the first key, server with the second
+  bool keyed =
+    1 == EVP_EncryptInit_ex(seal_, EVP_aes_256_gcm(), nullptr, material + (server_ ? key_size : 0), nullptr) &&
+    1 == EVP_DecryptInit_ex(open_, EVP_aes_256_gcm(), nullptr, material + (server_ ? 0 : key_size), nullptr);
+  std::memcpy(id_, material + 2 * key_size, id_size);
+  OPENSSL_cleanse(material, sizeof(material));
+  if(!keyed) {
+    // frames stay on http
+    LOG_WARNING << bf("%s: failed to key datagrams") % func;
+    keyed_ = false;
+    return false;
+  }
+  keyed_ = true;
+  send_seq_ = 0;
+  recv_max_ = 0;
+  window_.reset();
+  LOG_DEBUG << bf("%s: datagrams keyed") % func;
+
+  if(!server_) {
+    connect(peer);
+    // down until the new key is answered
+    silent_ticks_ = silent_ticks_down;
+    update_state();
+    queue(&protocol::control_ping, 1);
+  }
+  if(timing_wheel::no_timer == tick_timer_) {
+    schedule_tick();
+  }
+  return true;
+}
+
+// client sends to and receives from the server only
+void datagram_transport::private_t::connect(const asio::ip::udp::endpoint& peer) {
+  static const char func[] = "datagram_transport::connect";
+  if(peer_known_ && peer == peer_ && socket_.is_open()) {
+    return;
+  }
+  boost::system::error_code ec;
+  socket_.close(ec);
+  out_.clear();
+  waiting_writable_ = false;
+  peer_ = peer;
+  peer_known_ = false;
+  socket_.open(peer.protocol(), ec);
+  if(!ec) {
+    socket_.connect(peer, ec);
+  }
+  if(ec) {
+    LOG_WARNING << bf("%s: failed to open udp socket to '%s:%d': %s")
+      % func % peer.address().to_string() % peer.port() % ec.message();
+    socket_.close(ec);
+    return;
+  }
+  peer_known_ = true;
+  set_buffers();
+  set_dont_fragment();
+  async_receive();
+}
+
+// defaults drop datagrams of a burst the tunnel would have queued
+void datagram_transport::private_t::set_buffers() {
+  static const char func[] = "datagram_transport::set_buffers";
+  boost::system::error_code ec;
+  socket_.set_option(asio::socket_base::receive_buffer_size(socket_buffer_size), ec);
+  if(!ec) {
+    socket_.set_option(asio::socket_base::send_buffer_size(socket_buffer_size), ec);
+  }
+  if(ec) {
+    LOG_DEBUG << bf("%s: failed to enlarge socket buffers: %s") % func % ec.message();
+  }
+}
+
+// datagrams too large for the path are dropped by the kernel instead of fragmented,
+// missing pongs tell when even small ones don't fit
+void datagram_transport::private_t::set_dont_fragment() {
+  static const char func[] = "datagram_transport::set_dont_fragment";
+  boost::system::error_code ec;
+  int fd = socket_.native_handle();
+  int r = socket_.local_endpoint(ec).address().is_v6()
+    ? ::setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &ipv6_pmtudisc_do, sizeof(ipv6_pmtudisc_do))
+    : ::setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &ip_pmtudisc_do, sizeof(ip_pmtudisc_do));
+  if(r < 0) {
+    LOG_DEBUG << bf("%s: failed to forbid fragmentation: %s") % func % strerror(errno);
+  }
+}
+
+bool datagram_transport::private_t::send(const char* frame, std::size_t size) {
+  // larger frames go over http rather than as fragments, a lost fragment loses the frame
+  if(!up() || header_size + size + tag_size > max_sent_size) {
+    return false;
+  }
+  if(out_.size() >= max_queued) {
+    // like a full stripe queue
+    ++dropped_;
+    return true;
+  }
+  queue(frame, size);
+  return true;
+}
+
+void datagram_transport::private_t::close() {
+  boost::system::error_code ec;
+  socket_.close(ec);
+  wheel_.cancel(tick_timer_);
+}
+
+bool datagram_transport::private_t::up() const {
+  return keyed_ && peer_known_ && silent_ticks_ < silent_ticks_down;
+}
+
+std::string datagram_transport::private_t::stats() {
+  return boost::str(bf("datagrams %s, sent %d, received %d, rejected %d, dropped %d")
+    % (up() ? "up" : "down") % sent_ % received_ % rejected_ % dropped_);
+}
+
+void datagram_transport::private_t::queue(const char* data, std::size_t size) {
+  if(!socket_.is_open() || !peer_known_) {
+    return;
+  }
+  out_.emplace_back();
+  if(!seal(data, size, out_.back())) {
+    // like a datagram lost on the way
+    out_.pop_back();
+    ++dropped_;
+    return;
+  }
+  // datagrams queued until the handlers ready now have run go out in one batch
+  if(!flush_posted_ && !waiting_writable_) {
+    flush_posted_ = true;
+    ios_.post(boost::bind(&private_t::flush, shared_from_this()));
+  }
+}
+
+bool datagram_transport::private_t::seal(const char* data, std::size_t size, std::vector<char>& out) {
+  out.resize(header_size + size + tag_size);
+  auto header = reinterpret_cast<unsigned char*>(out.data());
+  std::memcpy(header, id_, id_size);
+  put_sequence(header + id_size, ++send_seq_);
+  unsigned char nonce[nonce_size];
+  make_nonce(nonce, send_seq_);
+  int len = 0, final_len = 0;
+  return
+    1 == EVP_EncryptInit_ex(seal_, nullptr, nullptr, nullptr, nonce) &&
+    1 == EVP_EncryptUpdate(seal_, nullptr, &len, header, header_size) &&
+    1 == EVP_EncryptUpdate(seal_, header + header_size, &len, reinterpret_cast<const unsigned char*>(data), size) &&
+    1 == EVP_EncryptFinal_ex(seal_, header + header_size + len, &final_len) &&
+    1 == EVP_CIPHER_CTX_ctrl(seal_, EVP_CTRL_GCM_GET_TAG, tag_size, header + header_size + size);
+}
+
+bool datagram_transport::private_t::open(const unsigned char* data, std::size_t size, std::vector<char>& out) {
+  if(size < header_size + tag_size || std::memcmp(data, id_, id_size)) {
+    return false;
+  }
+  auto seq = get_sequence(data + id_size);
+  if(!fresh(seq)) {
+    return false;
+  }
+  auto payload = size - header_size - tag_size;
+  out.resize(payload);
+  unsigned char nonce[nonce_size];
+  make_nonce(nonce, seq);
+  int len = 0, final_len = 0;
+  if(1 != EVP_DecryptInit_ex(open_, nullptr, nullptr, nullptr, nonce) ||
+     1 != EVP_DecryptUpdate(open_, nullptr, &len, data, header_size) ||
+     1 != EVP_DecryptUpdate(open_, reinterpret_cast<unsigned char*>(out.data()), &len, data + header_size, payload) ||
+     1 != EVP_CIPHER_CTX_ctrl(open_, EVP_CTRL_GCM_SET_TAG, tag_size, const_cast<unsigned char*>(data + header_size + payload)) ||
+     1 != EVP_DecryptFinal_ex(open_, reinterpret_cast<unsigned char*>(out.data()) + len, &final_len)) {
+    return false;
+  }
+  // only authentic sequences move the window
+  mark(seq);
+  return true;
+}
+
+bool datagram_transport::private_t::fresh(uint64_t seq) const {
+  if(0 == seq) return false;
+  if(seq > recv_max_) return true;
+  if(recv_max_ - seq >= window_size) return false;
+  return !window_[seq % window_size];
+}
+
+void datagram_transport::private_t::mark(uint64_t seq) {
+  if(seq > recv_max_) {
+    // slots of the sequences skipped over are free again
+    if(seq - recv_max_ >= window_size) {
+      window_.reset();
+    }
+    else {
+      for(auto s = recv_max_ + 1; s < seq; ++s) {
+        window_[s % window_size] = false;
+      }
+    }
+    recv_max_ = seq;
+  }
+  window_[seq % window_size] = true;
+}
+
+void datagram_transport::private_t::flush() {
+  static const char func[] = "datagram_transport::flush";
+  flush_posted_ = false;
+  while(!out_.empty() && socket_.is_open()) {
+    mmsghdr msgs[batch_size];
+    iovec iov[batch_size];
+    std::size_t n = std::min(out_.size(), batch_size);
+    std::memset(msgs, 0, sizeof(msgs));
+    for(std::size_t i = 0; i < n; ++i) {
+      iov[i].iov_base = out_[i].data();
+      iov[i].iov_len = out_[i].size();
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      if(server_) {
+        msgs[i].msg_hdr.msg_name = peer_.data();
+        msgs[i].msg_hdr.msg_namelen = peer_.size();
+      }
+    }
+    int sent = ::sendmmsg(socket_.native_handle(), msgs, n, MSG_DONTWAIT);
+    if(sent < 0) {
+      if(EAGAIN == errno || EWOULDBLOCK == errno) {
+        waiting_writable_ = true;
+        socket_.async_wait(
+          asio::ip::udp::socket::wait_write,
+          boost::bind(
+            &private_t::handle_writable,
+              shared_from_this(),
+              asio::placeholders::error
+          )
+        );
+        return;
+      }
+      // port unreachable and the like, missing pongs tell whether the path is gone
+      LOG_DEBUG << bf("%s: failed to send %d datagram(s): %s") % func % n % strerror(errno);
+      dropped_ += n;
+      out_.erase(out_.begin(), out_.begin() + n);
+      continue;
+    }
+    sent_ += sent;
+    out_.erase(out_.begin(), out_.begin() + sent);
+  }
+}
+
+void datagram_transport::private_t::handle_writable(const boost::system::error_code& ec) {
+  waiting_writable_ = false;
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  flush();
+}
+
+void datagram_transport::private_t::async_receive() {
+  socket_.async_wait(
+    asio::ip::udp::socket::wait_read,
+    boost::bind(
+      &private_t::handle_readable,
+        shared_from_this(),
+        asio::placeholders::error
+    )
+  );
+}
+
+void datagram_transport::private_t::handle_readable(const boost::system::error_code& ec) {
+  static const char func[] = "datagram_transport::handle_readable";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  if(ec) {
+    LOG_WARNING << bf("%s: failed to wait for datagrams: %s") % func % ec.message();
+    return;
+  }
+  mmsghdr msgs[batch_size];
+  iovec iov[batch_size];
+  sockaddr_storage names[batch_size];
+  std::memset(msgs, 0, sizeof(msgs));
+  for(std::size_t i = 0; i < batch_size; ++i) {
+    iov[i].iov_base = in_[i].data();
+    iov[i].iov_len = in_[i].size();
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &names[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+  }
+  int n = ::recvmmsg(socket_.native_handle(), msgs, batch_size, MSG_DONTWAIT, nullptr);
+  if(n < 0 && EAGAIN != errno && EWOULDBLOCK != errno) {
+    // connected client socket reports icmp errors of earlier datagrams here
+    LOG_DEBUG << bf("%s: failed to receive datagrams: %s") % func % strerror(errno);
+  }
+  for(int i = 0; i < n; ++i) {
+    asio::ip::udp::endpoint from;
+    std::memcpy(from.data(), &names[i], std::min<std::size_t>(msgs[i].msg_hdr.msg_namelen, sizeof(names[i])));
+    from.resize(msgs[i].msg_hdr.msg_namelen);
+    receive(reinterpret_cast<const unsigned char*>(in_[i].data()), msgs[i].msg_len, from);
+  }
+  update_state();
+  async_receive();
+}
+
+void datagram_transport::private_t::receive(const unsigned char* data, std::size_t size, const asio::ip::udp::endpoint& from) {
+  std::vector<char> frame;
+  if(!keyed_ || !open(data, size, frame)) {
+    ++rejected_;
+    return;
+  }
+  ++received_;
+  silent_ticks_ = 0;
+  if(server_) {
+    // follows the client to a new address
+    peer_ = from;
+    peer_known_ = true;
+  }
+  if(frame.size() <= protocol::max_control_size) {
+    if(!frame.empty() && protocol::control_ping == frame.front()) {
+      queue(&protocol::control_pong, 1);
+    }
+    return;
+  }
+  if(frames_.size() >= max_queued) {
+    ++dropped_;
+    return;
+  }
+  tap_set::frame_t f;
+  if(!taps_.demux(std::move(frame), f)) {
+    ++dropped_;
+    return;
+  }
+  frames_.push_back(std::move(f));
+  if(1 == frames_.size()) {
+    async_write_tap();
+  }
+}
+
+void datagram_transport::private_t::async_write_tap() {
+  // every write to tap is exactly one frame
+  taps_[frames_.front().channel].async_write_some(
+    frames_.front().buffer(),
+    boost::bind(
+      &private_t::handle_write_tap,
+        shared_from_this(),
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred
+    )
+  );
+}
+
+void datagram_transport::private_t::handle_write_tap(const boost::system::error_code& ec, std::size_t) {
+  static const char func[] = "datagram_transport::handle_write_tap";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  if(boost::system::errc::io_error == ec) {
+    LOG_DEBUG << bf("%s: tap is not up, frame dropped") % func;
+  }
+  else if(ec) {
+    LOG_WARNING << bf("%s: failed to write to tap, frame dropped: %s") % func % ec.message();
+  }
+  frames_.pop_front();
+  if(!frames_.empty()) {
+    async_write_tap();
+  }
+}
+
+void datagram_transport::private_t::schedule_tick() {
+  tick_timer_ = wheel_.schedule(
+    tick_interval,
+    boost::bind(
+      &private_t::handle_tick,
+        shared_from_this()
+    )
+  );
+}
+
+void datagram_transport::private_t::handle_tick() {
+  tick_timer_ = timing_wheel::no_timer;
+  if(silent_ticks_ < silent_ticks_down) {
+    ++silent_ticks_;
+  }
+  update_state();
+  if(!server_) {
+    queue(&protocol::control_ping, 1);
+  }
+  schedule_tick();
+}
+
+void datagram_transport::private_t::update_state() {
+  static const char func[] = "datagram_transport::update_state";
+  if(up() == was_up_) {
+    return;
+  }
+  was_up_ = up();
+  if(was_up_) {
+    LOG_INFO << bf("%s: datagrams get through to '%s:%d', frames are sent as datagrams")
+      % func % peer_.address().to_string() % peer_.port();
+  }
+  else {
+    LOG_INFO << bf("%s: datagrams don't get through, frames fall back to http") % func;
+  }
+}
+
+/*\
+ *  class datagram_transport
+\*/
+datagram_transport::datagram_transport(asio::io_service& ios, tap_set& taps, timing_wheel& wheel, bool server)
+  : p(boost::make_shared<private_t>(ios, taps, wheel, server))
+{}
+
+datagram_transport::~datagram_transport() {
+  p->close();
+}
+
+void datagram_transport::bind(const asio::ip::udp::endpoint& endpoint, boost::system::error_code& ec) {
+  p->bind(endpoint, ec);
+}
+
+bool datagram_transport::rekey(socket& sock, const asio::ip::udp::endpoint& peer) {
+  return p->rekey(sock, peer);
+}
+
+bool datagram_transport::send(const char* frame, std::size_t size) {
+  return p->send(frame, size);
+}
+
+bool datagram_transport::up() const {
+  return p->up();
+}
+
+std::string datagram_transport::stats() {
+  return p->stats();
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef DATAGRAM_TRANSPORT_HPP
+#define DATAGRAM_TRANSPORT_HPP
+
+#include <string>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/shared_ptr.hpp>
+#include "socket.hpp"
+#include "tap_set.hpp"
+#include "timing_wheel.hpp"
+
+namespace sp
+{
+
+// frames as udp datagrams next to the http tunnel, so inner tcp does not run over outer tcp.
+// the tunnel connection that negotiates datagrams keys them with its tls session (rfc 5705
+// exporter), every datagram is
+//   session id (8) | sequence (8) | frame sealed with aes-256-gcm | tag (16)
+// with a key per direction and the sequence as nonce. a window of 1024 sequences below the
+// highest one received lets reordered datagrams in and drops replayed ones.
+// datagrams are at most 1400 bytes and never fragmented, larger frames go over http, so the
+// tap mtu is to be lowered for full sized frames to take datagrams.
+// client pings the server every second, datagrams are up while the peer has been heard from
+// in the last 3 seconds. frames go over http otherwise, which is the fallback when udp is blocked.
+// both ways datagrams are sent and received in batches with sendmmsg and recvmmsg
+class datagram_transport
+{
+public:
+  // received frames are written to the tap of their channel
+  datagram_transport(boost::asio::io_service& ios, tap_set& taps, timing_wheel& wheel, bool server);
+  ~datagram_transport();
+
+  // server: receives datagrams on endpoint
+  void bind(const boost::asio::ip::udp::endpoint& endpoint, boost::system::error_code& ec);
+  // keys datagrams with the tls session of the connection which has just negotiated them,
+  // false if it has none. client sends to peer, server to whoever sent the last datagram
+  // that could be opened
+  bool rekey(socket& sock, const boost::asio::ip::udp::endpoint& peer = boost::asio::ip::udp::endpoint());
+  // seals and sends a frame read from tap, false if datagrams are down or the frame is too
+  // large for one and it's to go over http
+  bool send(const char* frame, std::size_t size);
+
+  bool up() const;
+  std::string stats();
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // DATAGRAM_TRANSPORT_HPP
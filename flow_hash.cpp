@@ -0,0 +1,100 @@
+#include "flow_hash.hpp"
+
+namespace sp
+{
+
+namespace {
+  static const std::size_t eth_header_size = 14;
+  static const std::size_t vlan_tag_size = 4;
+
+  namespace ether_type {
+    static const uint16_t ipv4 = 0x0800;
+    static const uint16_t ipv6 = 0x86dd;
+    static const uint16_t vlan = 0x8100;
+    static const uint16_t qinq = 0x88a8;
+  }
+
+  namespace ip_proto {
+    static const uint8_t tcp = 6;
+    static const uint8_t udp = 17;
+    static const uint8_t sctp = 132;
+  }
+
+  uint16_t read_u16(const unsigned char* p) {
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+  }
+
+  bool has_ports(uint8_t proto) {
+    return ip_proto::tcp == proto || ip_proto::udp == proto || ip_proto::sctp == proto;
+  }
+
+  // FNV-1a
+  struct hasher {
+    uint32_t h = 2166136261u;
+    void add(const unsigned char* p, std::size_t size) {
+      for(std::size_t i = 0; i < size; ++i) {
+        h = (h ^ p[i]) * 16777619u;
+      }
+    }
+  };
+
+  // murmur3 finalizer
+  uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+  }
+}
+
+uint32_t flow_hash(const char* frame, std::size_t size) {
+  auto p = reinterpret_cast<const unsigned char*>(frame);
+  hasher hs;
+  if(size < eth_header_size) {
+    hs.add(p, size);
+    return mix(hs.h);
+  }
+
+  std::size_t off = 12;
+  auto type = read_u16(p + off);
+  while((ether_type::vlan == type || ether_type::qinq == type) && off + vlan_tag_size + 2 <= size) {
+    off += vlan_tag_size;
+    type = read_u16(p + off);
+  }
+  off += 2;
+  auto ip = p + off;
+  auto ip_size = size - off;
+
+  if(ether_type::ipv4 == type && ip_size >= 20) {
+    std::size_t ihl = (ip[0] & 0x0f) * 4;
+    uint8_t proto = ip[9];
+    bool fragment = 0 != (read_u16(ip + 6) & 0x3fff); // MF flag or offset
+    hs.add(&proto, 1);
+    hs.add(ip + 12, 8); // source and destination
+    if(!fragment && has_ports(proto) && ip_size >= ihl + 4) {
+      hs.add(ip + ihl, 4);
+    }
+    return mix(hs.h);
+  }
+  if(ether_type::ipv6 == type && ip_size >= 40) {
+    uint8_t proto = ip[6]; // extension headers are not walked
+    hs.add(&proto, 1);
+    hs.add(ip + 8, 32); // source and destination
+    if(has_ports(proto) && ip_size >= 44) {
+      hs.add(ip + 40, 4);
+    }
+    return mix(hs.h);
+  }
+
+  hs.add(p + off - 2, 2); // ethertype
+  hs.add(p, 12);          // destination and source mac
+  return mix(hs.h);
+}
+
+uint32_t flow_score(uint32_t flow, std::size_t bucket) {
+  return mix(flow ^ static_cast<uint32_t>((bucket + 1) * 0x9e3779b9u));
+}
+
+}
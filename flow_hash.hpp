@@ -0,0 +1,23 @@
+#ifndef FLOW_HASH_HPP
+#define FLOW_HASH_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+namespace sp
+{
+
+// hash of the inner flow an ethernet frame belongs to:
+// protocol, addresses and tcp/udp/sctp ports for ipv4 and ipv6,
+// protocol and addresses for other ip traffic and fragments,
+// ethertype and mac addresses for anything else
+uint32_t flow_hash(const char* frame, std::size_t size);
+
+// rendezvous (highest random weight) score of a flow for a bucket.
+// the bucket with the highest score gets the flow, so losing a bucket
+// only moves the flows it owned
+uint32_t flow_score(uint32_t flow, std::size_t bucket);
+
+}
+
+#endif // FLOW_HASH_HPP
@@ -0,0 +1,1056 @@
+#include <map>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/placeholders.hpp>
+#include "h2_connection.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace
+{
+  static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  static const std::size_t client_preface_size = sizeof(client_preface) - 1;
+  static const std::size_t frame_header_size = 9;
+  static const std::size_t max_frame_size = 16384;         // default SETTINGS_MAX_FRAME_SIZE, both ways
+  static const int64_t default_window = 65535;
+  static const int64_t max_window = 0x7fffffff;
+  static const uint32_t connection_window_factor = 16;      // connection window of stream windows
+  static const uint32_t max_concurrent_streams = 256;       // announced by the server
+  static const std::size_t max_header_block = 64 * 1024;
+  static const std::size_t max_stream_buffer = 64 * 1024;   // body taken from a writer before it has to wait
+  static const std::size_t max_write = 256 * 1024;          // frames gathered into one socket write
+  static const std::size_t read_buffer_size = 64 * 1024;
+
+  namespace frame {
+    enum type_t { data, headers, priority, rst_stream, settings, push_promise, ping, goaway, window_update, continuation };
+  }
+  namespace flag {
+    static const uint8_t end_stream = 0x1;
+    static const uint8_t ack = 0x1;
+    static const uint8_t end_headers = 0x4;
+    static const uint8_t padded = 0x8;
+    static const uint8_t priority = 0x20;
+  }
+  namespace setting {
+    enum id_t { header_table_size = 1, enable_push, max_concurrent_streams, initial_window_size, max_frame_size, max_header_list_size };
+  }
+  namespace h2_error {
+    enum code_t { no_error, protocol_error, internal_error, flow_control_error, settings_timeout, stream_closed,
+      frame_size_error, refused_stream, cancel, compression_error };
+  }
+
+  uint32_t load32(const char* p) {
+    auto u = reinterpret_cast<const unsigned char*>(p);
+    return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+  }
+
+  void put32(std::string& out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+  }
+
+  void put_frame_header(std::string& out, std::size_t length, uint8_t type, uint8_t flags, uint32_t stream) {
+    out.push_back(length >> 16);
+    out.push_back(length >> 8);
+    out.push_back(length);
+    out.push_back(type);
+    out.push_back(flags);
+    put32(out, stream & 0x7fffffff);
+  }
+
+  void put_setting(std::string& out, uint16_t id, uint32_t value) {
+    out.push_back(id >> 8);
+    out.push_back(id);
+    put32(out, value);
+  }
+}
+
+struct h2_stream::state_t {
+  state_t()
+    : id(0), remote_closed(false), response_received(false)
+    , received_offset(0), recv_window(0), consumed(0), send_window(0)
+    , read_data(nullptr), read_size(0)
+    , error(asio::error::not_connected)
+  {}
+
+  uint32_t id;          // zero while unbound
+  bool remote_closed;   // end_stream received
+  bool response_received;
+  h2_connection::response_handler response;
+
+  std::string received; // body not yet read
+  std::size_t received_offset;
+  int64_t recv_window;  // what the peer may still send
+  std::size_t consumed; // read, not yet given back to the peer with window_update
+  int64_t send_window;
+  std::string pending;  // body taken from the writer, not yet framed
+
+  char* read_data;
+  std::size_t read_size;
+  socket::read_handler read_handler;
+  std::vector<asio::const_buffer> write_buffers;
+  socket::write_handler write_handler;
+
+  boost::system::error_code error; // of operations on an unbound stream
+};
+
+/*\
+ *  class h2_connection::private_t
+\*/
+class h2_connection::private_t: public boost::enable_shared_from_this<private_t> {
+public:
+  typedef boost::shared_ptr<h2_stream::state_t> state_ptr;
+
+  private_t(asio::io_service& ios, boost::shared_ptr<socket> sock, bool server, uint32_t window);
+
+  void start(const std::string& received, stream_handler sh, close_handler ch);
+  bool open(state_ptr s, const header_list& request, response_handler rh);
+  void shutdown(const boost::system::error_code& ec, h2_error::code_t code, bool notify);
+  bool running() const { return running_; }
+  std::string stats();
+
+  // operations of streams
+  void read(state_ptr s, char* data, std::size_t size, socket::read_handler h);
+  void write(state_ptr s, const std::vector<asio::const_buffer>& buffers, socket::write_handler h);
+  void cancel(state_ptr s);
+  void reset(state_ptr s, h2_error::code_t code);
+  void respond(state_ptr s, const header_list& headers);
+  std::string stats(state_ptr s);
+
+  asio::io_service& ios_;
+
+private:
+  void async_read();
+  void handle_read(const boost::system::error_code& ec, std::size_t tr, uint64_t generation);
+  bool process();
+  bool handle_frame(uint8_t type, uint8_t flags, uint32_t id, const char* payload, std::size_t size);
+  bool handle_data(uint8_t flags, uint32_t id, const char* payload, std::size_t size);
+  bool handle_headers(uint8_t flags, uint32_t id, const char* payload, std::size_t size);
+  bool handle_header_block();
+  bool handle_settings(uint8_t flags, uint32_t id, const char* payload, std::size_t size);
+  bool handle_window_update(uint32_t id, const char* payload, std::size_t size);
+
+  void send_headers(uint32_t id, const header_list& headers);
+  void send_window_update(uint32_t id, uint32_t increment);
+  void send_rst_stream(uint32_t id, h2_error::code_t code);
+  void consumed(state_ptr s, std::size_t size);
+  void connection_consumed(std::size_t size);
+  void deliver(state_ptr s);
+  void take_write(state_ptr s);
+  void fail_stream(state_ptr s, const boost::system::error_code& ec);
+  bool fail(h2_error::code_t code, const char* what); // connection error, always false
+
+  void flush();
+  void fill_data();
+  void async_write();
+  void handle_write(const boost::system::error_code& ec, std::size_t tr, uint64_t generation);
+
+  boost::shared_ptr<socket> sock_;
+  const bool server_;
+  const uint32_t window_;
+  uint64_t generation_; // bumped by start and shutdown, handlers of an older one are stale
+  bool running_;
+  stream_handler stream_handler_;
+  close_handler close_handler_;
+
+  std::vector<char> read_buf_;
+  std::string in_;      // received, not yet processed
+  bool preface_received_;
+  bool settings_received_;
+  hpack_decoder decoder_;
+  hpack_encoder encoder_;
+  uint32_t continuation_; // stream of a header block awaiting continuation frames
+  uint8_t header_flags_;   // of the headers frame that began the block
+  uint32_t header_stream_;
+  std::string header_block_;
+
+  std::map<uint32_t, state_ptr> streams_;
+  uint32_t next_stream_id_;
+  uint32_t last_peer_stream_;
+  uint32_t round_robin_;   // stream data was last sent for
+  int64_t peer_initial_window_;
+  int64_t send_window_;
+  int64_t recv_window_;
+  std::size_t consumed_;   // connection level, not yet given back
+
+  std::string control_;    // frames to send ahead of data
+  std::string out_;        // being written
+  std::size_t out_offset_;
+  bool writing_;
+};
+
+h2_connection::private_t::private_t(asio::io_service& ios, boost::shared_ptr<socket> sock, bool server, uint32_t window)
+  : ios_(ios), sock_(sock), server_(server), window_(window)
+  , generation_(0), running_(false)
+  , read_buf_(read_buffer_size)
+  , preface_received_(false), settings_received_(false)
+  , continuation_(0), header_flags_(0), header_stream_(0)
+  , next_stream_id_(1), last_peer_stream_(0), round_robin_(0)
+  , peer_initial_window_(default_window), send_window_(default_window)
+  , recv_window_(default_window), consumed_(0)
+  , out_offset_(0), writing_(false)
+{}
+
+void h2_connection::private_t::start(const std::string& received, stream_handler sh, close_handler ch) {
+  ++generation_;
+  running_ = true;
+  stream_handler_ = sh;
+  close_handler_ = ch;
+  in_ = received;
+  preface_received_ = !server_;
+  settings_received_ = false;
+  decoder_ = hpack_decoder();
+  continuation_ = 0;
+  header_block_.clear();
+  streams_.clear();
+  next_stream_id_ = 1;
+  last_peer_stream_ = 0;
+  round_robin_ = 0;
+  peer_initial_window_ = default_window;
+  send_window_ = default_window;
+  consumed_ = 0;
+  control_.clear();
+  out_.clear();
+  writing_ = false;
+
+  if(!server_) {
+    control_.append(client_preface, client_preface_size);
+  }
+  std::string settings;
+  if(server_) {
+    put_setting(settings, setting::max_concurrent_streams, max_concurrent_streams);
+  }
+  else {
+    put_setting(settings, setting::enable_push, 0);
+  }
+  put_setting(settings, setting::initial_window_size, window_);
+  put_frame_header(control_, settings.size(), frame::settings, 0, 0);
+  control_.append(settings);
+  int64_t connection_window = std::min<int64_t>(int64_t(window_) * connection_window_factor, max_window);
+  send_window_update(0, connection_window - default_window);
+  recv_window_ = connection_window;
+  flush();
+
+  if(!process()) {
+    return;
+  }
+  async_read();
+}
+
+bool h2_connection::private_t::open(state_ptr s, const header_list& request, response_handler rh) {
+  if(!running_) {
+    return false;
+  }
+  if(s->id) {
+    reset(s, h2_error::cancel);
+  }
+  s->id = next_stream_id_;
+  next_stream_id_ += 2;
+  s->remote_closed = false;
+  s->response_received = false;
+  s->response = rh;
+  s->received.clear();
+  s->received_offset = 0;
+  s->recv_window = window_;
+  s->consumed = 0;
+  s->send_window = peer_initial_window_;
+  s->pending.clear();
+  s->error = boost::system::error_code();
+  streams_[s->id] = s;
+  send_headers(s->id, request);
+  flush();
+  return true;
+}
+
+void h2_connection::private_t::shutdown(const boost::system::error_code& ec, h2_error::code_t code, bool notify) {
+  if(!running_) {
+    return;
+  }
+  running_ = false;
+  // best effort, the owner closes the socket soon
+  control_.clear();
+  put_frame_header(control_, 8, frame::goaway, 0, 0);
+  put32(control_, last_peer_stream_);
+  put32(control_, code);
+  flush();
+  ++generation_;
+  auto streams = streams_;
+  for(auto i = streams.begin(); i != streams.end(); ++i) {
+    fail_stream(i->second, ec);
+  }
+  if(notify && close_handler_) {
+    ios_.post(boost::bind(close_handler_, ec));
+  }
+}
+
+std::string h2_connection::private_t::stats() {
+  return boost::str(bf("http/2 with %d stream(s) over %s") % streams_.size() % sock_->stats());
+}
+
+std::string h2_connection::private_t::stats(state_ptr s) {
+  if(!s->id) {
+    return "http/2 stream not open";
+  }
+  return boost::str(bf("http/2 stream %d (send window %d, receive window %d) over %s")
+    % s->id % s->send_window % s->recv_window % sock_->stats());
+}
+
+void h2_connection::private_t::read(state_ptr s, char* data, std::size_t size, socket::read_handler h) {
+  if(s->read_handler) {
+    ios_.post(boost::bind(h, asio::error::in_progress, 0));
+    return;
+  }
+  s->read_data = data;
+  s->read_size = size;
+  s->read_handler = h;
+  deliver(s);
+  // window_update once enough is read
+  flush();
+}
+
+void h2_connection::private_t::write(state_ptr s, const std::vector<asio::const_buffer>& buffers, socket::write_handler h) {
+  if(!s->id || s->error) {
+    ios_.post(boost::bind(h, s->error ? s->error : asio::error::not_connected, 0));
+    return;
+  }
+  if(s->write_handler) {
+    ios_.post(boost::bind(h, asio::error::in_progress, 0));
+    return;
+  }
+  s->write_buffers = buffers;
+  s->write_handler = h;
+  take_write(s);
+  flush();
+}
+
+void h2_connection::private_t::cancel(state_ptr s) {
+  if(s->read_handler) {
+    ios_.post(boost::bind(s->read_handler, asio::error::operation_aborted, 0));
+    s->read_handler.clear();
+  }
+  if(s->write_handler) {
+    ios_.post(boost::bind(s->write_handler, asio::error::operation_aborted, 0));
+    s->write_handler.clear();
+    s->write_buffers.clear();
+  }
+}
+
+void h2_connection::private_t::reset(state_ptr s, h2_error::code_t code) {
+  if(!s->id) {
+    return;
+  }
+  if(running_) {
+    send_rst_stream(s->id, code);
+    flush();
+  }
+  fail_stream(s, asio::error::operation_aborted);
+}
+
+void h2_connection::private_t::respond(state_ptr s, const header_list& headers) {
+  if(!s->id || !running_) {
+    return;
+  }
+  send_headers(s->id, headers);
+  flush();
+}
+
+void h2_connection::private_t::async_read() {
+  sock_->async_read_some(
+    asio::buffer(read_buf_),
+    boost::bind(
+      &private_t::handle_read,
+        shared_from_this(),
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred,
+        generation_
+    )
+  );
+}
+
+void h2_connection::private_t::handle_read(const boost::system::error_code& ec, std::size_t tr, uint64_t generation) {
+  static const char func[] = "h2_connection::handle_read";
+  if(generation != generation_) {
+    return;
+  }
+  if(ec) {
+    if(asio::error::operation_aborted != ec) {
+      LOG_DEBUG << bf("%s: connection closed: %s") % func % ec.message();
+    }
+    shutdown(ec, h2_error::no_error, true);
+    return;
+  }
+  in_.append(read_buf_.data(), tr);
+  if(!process()) {
+    return;
+  }
+  async_read();
+}
+
+// frames are handled as they are complete, the rest waits for more data
+bool h2_connection::private_t::process() {
+  std::size_t offset = 0;
+  if(!preface_received_) {
+    std::size_t size = std::min(in_.size(), client_preface_size);
+    if(0 != in_.compare(0, size, client_preface, size)) {
+      return fail(h2_error::protocol_error, "bad connection preface");
+    }
+    if(size < client_preface_size) {
+      return true;
+    }
+    preface_received_ = true;
+    offset = client_preface_size;
+  }
+  auto generation = generation_;
+  while(in_.size() - offset >= frame_header_size) {
+    const char* h = in_.data() + offset;
+    std::size_t length = (std::size_t(uint8_t(h[0])) << 16) | (std::size_t(uint8_t(h[1])) << 8) | uint8_t(h[2]);
+    uint8_t type = h[3];
+    uint8_t flags = h[4];
+    uint32_t id = load32(h + 5) & 0x7fffffff;
+    if(length > max_frame_size) {
+      return fail(h2_error::frame_size_error, "frame too large");
+    }
+    if(in_.size() - offset < frame_header_size + length) {
+      break;
+    }
+    if(!settings_received_ && frame::settings != type) {
+      return fail(h2_error::protocol_error, "first frame is not settings");
+    }
+    if(continuation_ && (frame::continuation != type || id != continuation_)) {
+      return fail(h2_error::protocol_error, "header block interrupted");
+    }
+    if(!handle_frame(type, flags, id, h + frame_header_size, length)) {
+      return false;
+    }
+    if(generation != generation_) {
+      // shut down by a handler
+      return false;
+    }
+    offset += frame_header_size + length;
+  }
+  in_.erase(0, offset);
+  flush();
+  return true;
+}
+
+bool h2_connection::private_t::handle_frame(uint8_t type, uint8_t flags, uint32_t id, const char* payload, std::size_t size) {
+  static const char func[] = "h2_connection::handle_frame";
+  switch(type) {
+  case frame::data:
+    return handle_data(flags, id, payload, size);
+
+  case frame::headers:
+    return handle_headers(flags, id, payload, size);
+
+  case frame::continuation:
+    if(!continuation_) {
+      return fail(h2_error::protocol_error, "unexpected continuation");
+    }
+    if(header_block_.size() + size > max_header_block) {
+      return fail(h2_error::protocol_error, "header block too large");
+    }
+    header_block_.append(payload, size);
+    if(flags & flag::end_headers) {
+      continuation_ = 0;
+      return handle_header_block();
+    }
+    return true;
+
+  case frame::priority:
+    if(!id) {
+      return fail(h2_error::protocol_error, "priority on stream 0");
+    }
+    return true;
+
+  case frame::rst_stream: {
+    if(!id || 4 != size) {
+      return fail(h2_error::protocol_error, "bad rst_stream");
+    }
+    auto i = streams_.find(id);
+    if(streams_.end() != i) {
+      LOG_DEBUG << bf("%s: stream %d reset by peer with error %d") % func % id % load32(payload);
+      fail_stream(i->second, asio::error::connection_reset);
+    }
+    return true;
+  }
+
+  case frame::settings:
+    return handle_settings(flags, id, payload, size);
+
+  case frame::push_promise:
+    // disabled by the client's settings, servers never get one
+    return fail(h2_error::protocol_error, "push_promise");
+
+  case frame::ping:
+    if(id || 8 != size) {
+      return fail(h2_error::protocol_error, "bad ping");
+    }
+    if(!(flags & flag::ack)) {
+      put_frame_header(control_, 8, frame::ping, flag::ack, 0);
+      control_.append(payload, size);
+    }
+    return true;
+
+  case frame::goaway: {
+    if(id || size < 8) {
+      return fail(h2_error::protocol_error, "bad goaway");
+    }
+    // streams are long lived, the tunnel reconnects rather than waiting for them to end
+    LOG_INFO << bf("%s: peer goes away with error %d, last stream %d")
+      % func % load32(payload + 4) % (load32(payload) & 0x7fffffff);
+    shutdown(asio::error::connection_aborted, h2_error::no_error, true);
+    return false;
+  }
+
+  case frame::window_update:
+    return handle_window_update(id, payload, size);
+
+  default:
+    // unknown frame types are ignored
+    return true;
+  }
+}
+
+bool h2_connection::private_t::handle_data(uint8_t flags, uint32_t id, const char* payload, std::size_t size) {
+  if(!id) {
+    return fail(h2_error::protocol_error, "data on stream 0");
+  }
+  if(int64_t(size) > recv_window_) {
+    return fail(h2_error::flow_control_error, "connection window exceeded");
+  }
+  recv_window_ -= size;
+  std::size_t body = size;
+  if(flags & flag::padded) {
+    std::size_t pad = size ? uint8_t(payload[0]) : 0;
+    if(!size || pad >= size) {
+      return fail(h2_error::protocol_error, "bad padding");
+    }
+    ++payload;
+    body = size - 1 - pad;
+  }
+  auto i = streams_.find(id);
+  if(streams_.end() == i || i->second->remote_closed) {
+    // reset by us, the connection window is ours to give back
+    connection_consumed(size);
+    send_rst_stream(id, h2_error::stream_closed);
+    return true;
+  }
+  auto s = i->second;
+  if(int64_t(size) > s->recv_window) {
+    connection_consumed(size);
+    send_rst_stream(id, h2_error::flow_control_error);
+    fail_stream(s, asio::error::connection_reset);
+    return true;
+  }
+  s->recv_window -= size;
+  s->received.append(payload, body);
+  if(size != body) {
+    consumed(s, size - body);
+  }
+  if(flags & flag::end_stream) {
+    s->remote_closed = true;
+  }
+  deliver(s);
+  return true;
+}
+
+bool h2_connection::private_t::handle_headers(uint8_t flags, uint32_t id, const char* payload, std::size_t size) {
+  if(!id) {
+    return fail(h2_error::protocol_error, "headers on stream 0");
+  }
+  std::size_t pad = 0;
+  if(flags & flag::padded) {
+    if(!size) {
+      return fail(h2_error::protocol_error, "bad padding");
+    }
+    pad = uint8_t(payload[0]);
+    ++payload;
+    --size;
+  }
+  if(flags & flag::priority) {
+    if(size < 5) {
+      return fail(h2_error::frame_size_error, "short headers");
+    }
+    payload += 5;
+    size -= 5;
+  }
+  if(pad > size) {
+    return fail(h2_error::protocol_error, "bad padding");
+  }
+  header_block_.assign(payload, size - pad);
+  header_flags_ = flags;
+  header_stream_ = id;
+  if(!(flags & flag::end_headers)) {
+    continuation_ = id;
+    return true;
+  }
+  return handle_header_block();
+}
+
+bool h2_connection::private_t::handle_header_block() {
+  static const char func[] = "h2_connection::handle_header_block";
+  header_list headers;
+  bool decoded = decoder_.decode(header_block_.data(), header_block_.size(), headers);
+  header_block_.clear();
+  if(!decoded) {
+    return fail(h2_error::compression_error, "malformed header block");
+  }
+  uint32_t id = header_stream_;
+  bool end_stream = header_flags_ & flag::end_stream;
+  auto i = streams_.find(id);
+  if(streams_.end() != i) {
+    auto s = i->second;
+    if(!server_ && !s->response_received) {
+      std::string status;
+      for(auto f = headers.begin(); f != headers.end(); ++f) {
+        if(":status" == f->first) {
+          status = f->second;
+        }
+      }
+      if(status.empty()) {
+        send_rst_stream(id, h2_error::protocol_error);
+        fail_stream(s, asio::error::connection_reset);
+        return true;
+      }
+      if('1' == status[0]) {
+        // informational, the response follows
+        return true;
+      }
+      s->response_received = true;
+      if(end_stream) {
+        s->remote_closed = true;
+      }
+      auto rh = s->response;
+      s->response.clear();
+      if(rh) {
+        rh(headers);
+      }
+      deliver(s);
+      return true;
+    }
+    // trailers
+    if(end_stream) {
+      s->remote_closed = true;
+      deliver(s);
+    }
+    return true;
+  }
+  if(!server_) {
+    // stream reset by us
+    return true;
+  }
+  if(!(id & 1) || id <= last_peer_stream_) {
+    if(id > last_peer_stream_) {
+      return fail(h2_error::protocol_error, "even stream id");
+    }
+    // stream reset by us
+    return true;
+  }
+  last_peer_stream_ = id;
+  if(streams_.size() >= max_concurrent_streams) {
+    LOG_INFO << bf("%s: stream %d refused, %d streams open") % func % id % streams_.size();
+    send_rst_stream(id, h2_error::refused_stream);
+    return true;
+  }
+  auto stream = boost::make_shared<h2_stream>(shared_from_this());
+  auto s = stream->s_;
+  s->id = id;
+  s->remote_closed = end_stream;
+  s->response_received = true;
+  s->recv_window = window_;
+  s->send_window = peer_initial_window_;
+  s->error = boost::system::error_code();
+  streams_[id] = s;
+  if(stream_handler_) {
+    // stream is reset if the handler does not keep it
+    stream_handler_(stream, headers);
+  }
+  return true;
+}
+
+bool h2_connection::private_t::handle_settings(uint8_t flags, uint32_t id, const char* payload, std::size_t size) {
+  if(id) {
+    return fail(h2_error::protocol_error, "settings on a stream");
+  }
+  if(flags & flag::ack) {
+    if(size) {
+      return fail(h2_error::frame_size_error, "settings ack with payload");
+    }
+    return true;
+  }
+  if(size % 6) {
+    return fail(h2_error::frame_size_error, "bad settings");
+  }
+  for(std::size_t offset = 0; offset < size; offset += 6) {
+    uint16_t setting = (uint16_t(uint8_t(payload[offset])) << 8) | uint8_t(payload[offset + 1]);
+    uint32_t value = load32(payload + offset + 2);
+    switch(setting) {
+    case setting::enable_push:
+      if(value > 1) {
+        return fail(h2_error::protocol_error, "bad enable_push");
+      }
+      break;
+
+    case setting::initial_window_size: {
+      if(value > max_window) {
+        return fail(h2_error::flow_control_error, "initial window too large");
+      }
+      int64_t delta = int64_t(value) - peer_initial_window_;
+      peer_initial_window_ = value;
+      for(auto i = streams_.begin(); i != streams_.end(); ++i) {
+        i->second->send_window += delta;
+        if(i->second->send_window > max_window) {
+          return fail(h2_error::flow_control_error, "stream window overflow");
+        }
+      }
+      break;
+    }
+
+    case setting::max_frame_size:
+      // frames are never larger than the default
+      if(value < max_frame_size || value > 0xffffff) {
+        return fail(h2_error::protocol_error, "bad max_frame_size");
+      }
+      break;
+
+    default:
+      // the encoder keeps no dynamic table, limits of header lists are not reached
+      break;
+    }
+  }
+  settings_received_ = true;
+  put_frame_header(control_, 0, frame::settings, flag::ack, 0);
+  return true;
+}
+
+bool h2_connection::private_t::handle_window_update(uint32_t id, const char* payload, std::size_t size) {
+  if(4 != size) {
+    return fail(h2_error::frame_size_error, "bad window_update");
+  }
+  uint32_t increment = load32(payload) & 0x7fffffff;
+  if(!id) {
+    if(!increment) {
+      return fail(h2_error::protocol_error, "window_update of 0");
+    }
+    send_window_ += increment;
+    if(send_window_ > max_window) {
+      return fail(h2_error::flow_control_error, "connection window overflow");
+    }
+    return true;
+  }
+  auto i = streams_.find(id);
+  if(streams_.end() == i) {
+    return true;
+  }
+  auto s = i->second;
+  s->send_window += increment;
+  if(!increment || s->send_window > max_window) {
+    send_rst_stream(id, increment ? h2_error::flow_control_error : h2_error::protocol_error);
+    fail_stream(s, asio::error::connection_reset);
+  }
+  return true;
+}
+
+void h2_connection::private_t::send_headers(uint32_t id, const header_list& headers) {
+  std::string block;
+  encoder_.encode(headers, block);
+  // streams are never ended by headers, the tunnel resets them
+  std::size_t offset = 0;
+  do {
+    std::size_t size = std::min(block.size() - offset, max_frame_size);
+    uint8_t flags = offset + size == block.size() ? flag::end_headers : 0;
+    put_frame_header(control_, size, offset ? frame::continuation : frame::headers, flags, id);
+    control_.append(block, offset, size);
+    offset += size;
+  } while(offset < block.size());
+}
+
+void h2_connection::private_t::send_window_update(uint32_t id, uint32_t increment) {
+  put_frame_header(control_, 4, frame::window_update, 0, id);
+  put32(control_, increment);
+}
+
+void h2_connection::private_t::send_rst_stream(uint32_t id, h2_error::code_t code) {
+  put_frame_header(control_, 4, frame::rst_stream, 0, id);
+  put32(control_, code);
+}
+
+// window is given back once half of it is read, not for every frame
+void h2_connection::private_t::consumed(state_ptr s, std::size_t size) {
+  connection_consumed(size);
+  s->consumed += size;
+  if(s->consumed >= window_ / 2 && !s->remote_closed) {
+    send_window_update(s->id, s->consumed);
+    s->recv_window += s->consumed;
+    s->consumed = 0;
+  }
+}
+
+void h2_connection::private_t::connection_consumed(std::size_t size) {
+  consumed_ += size;
+  if(consumed_ >= std::size_t(std::min<int64_t>(int64_t(window_) * connection_window_factor, max_window) / 2)) {
+    send_window_update(0, consumed_);
+    recv_window_ += consumed_;
+    consumed_ = 0;
+  }
+}
+
+void h2_connection::private_t::deliver(state_ptr s) {
+  if(!s->read_handler) {
+    return;
+  }
+  auto h = s->read_handler;
+  if(s->received_offset < s->received.size()) {
+    std::size_t size = std::min(s->received.size() - s->received_offset, s->read_size);
+    std::memcpy(s->read_data, s->received.data() + s->received_offset, size);
+    s->received_offset += size;
+    if(s->received.size() == s->received_offset) {
+      s->received.clear();
+      s->received_offset = 0;
+    }
+    s->read_handler.clear();
+    consumed(s, size);
+    ios_.post(boost::bind(h, boost::system::error_code(), size));
+  }
+  else if(s->id && s->remote_closed) {
+    s->read_handler.clear();
+    ios_.post(boost::bind(h, asio::error::eof, 0));
+  }
+  else if(!s->id) {
+    s->read_handler.clear();
+    ios_.post(boost::bind(h, s->error ? s->error : asio::error::not_connected, 0));
+  }
+}
+
+// body is copied up to max_stream_buffer, the writer completes as if the socket took it
+void h2_connection::private_t::take_write(state_ptr s) {
+  if(!s->write_handler || s->pending.size() >= max_stream_buffer) {
+    return;
+  }
+  std::size_t room = max_stream_buffer - s->pending.size();
+  std::size_t taken = 0;
+  for(auto i = s->write_buffers.begin(); i != s->write_buffers.end() && taken < room; ++i) {
+    std::size_t size = std::min(asio::buffer_size(*i), room - taken);
+    s->pending.append(asio::buffer_cast<const char*>(*i), size);
+    taken += size;
+  }
+  auto h = s->write_handler;
+  s->write_handler.clear();
+  s->write_buffers.clear();
+  ios_.post(boost::bind(h, boost::system::error_code(), taken));
+}
+
+void h2_connection::private_t::fail_stream(state_ptr s, const boost::system::error_code& ec) {
+  if(s->id) {
+    streams_.erase(s->id);
+  }
+  s->id = 0;
+  s->error = ec;
+  s->response.clear();
+  s->received.clear();
+  s->received_offset = 0;
+  s->pending.clear();
+  deliver(s);
+  if(s->write_handler) {
+    ios_.post(boost::bind(s->write_handler, ec, 0));
+    s->write_handler.clear();
+    s->write_buffers.clear();
+  }
+}
+
+bool h2_connection::private_t::fail(h2_error::code_t code, const char* what) {
+  static const char func[] = "h2_connection::fail";
+  LOG_WARNING << bf("%s: connection error: %s") % func % what;
+  shutdown(boost::system::errc::make_error_code(boost::system::errc::protocol_error), code, true);
+  return false;
+}
+
+void h2_connection::private_t::flush() {
+  if(writing_) {
+    return;
+  }
+  out_.swap(control_);
+  control_.clear();
+  if(running_) {
+    fill_data();
+  }
+  if(out_.empty()) {
+    return;
+  }
+  out_offset_ = 0;
+  writing_ = true;
+  async_write();
+}
+
+// one frame at a time from each stream that has body and window, starting after the last one served
+void h2_connection::private_t::fill_data() {
+  while(send_window_ > 0 && out_.size() < max_write) {
+    state_ptr s;
+    auto i = streams_.upper_bound(round_robin_);
+    for(std::size_t n = 0; n < streams_.size(); ++n, ++i) {
+      if(streams_.end() == i) {
+        i = streams_.begin();
+      }
+      if(!i->second->pending.empty() && i->second->send_window > 0) {
+        s = i->second;
+        break;
+      }
+    }
+    if(!s) {
+      break;
+    }
+    std::size_t size = std::min<int64_t>(std::min<int64_t>(s->pending.size(), s->send_window),
+      std::min<int64_t>(send_window_, max_frame_size));
+    put_frame_header(out_, size, frame::data, 0, s->id);
+    out_.append(s->pending, 0, size);
+    s->pending.erase(0, size);
+    s->send_window -= size;
+    send_window_ -= size;
+    round_robin_ = s->id;
+    take_write(s);
+  }
+}
+
+void h2_connection::private_t::async_write() {
+  sock_->async_write_some(
+    asio::buffer(out_.data() + out_offset_, out_.size() - out_offset_),
+    boost::bind(
+      &private_t::handle_write,
+        shared_from_this(),
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred,
+        generation_
+    )
+  );
+}
+
+void h2_connection::private_t::handle_write(const boost::system::error_code& ec, std::size_t tr, uint64_t generation) {
+  static const char func[] = "h2_connection::handle_write";
+  if(generation != generation_) {
+    return;
+  }
+  if(ec) {
+    if(asio::error::operation_aborted != ec) {
+      LOG_DEBUG << bf("%s: write failed: %s") % func % ec.message();
+    }
+    shutdown(ec, h2_error::no_error, true);
+    return;
+  }
+  out_offset_ += tr;
+  if(out_offset_ < out_.size()) {
+    async_write();
+    return;
+  }
+  out_.clear();
+  writing_ = false;
+  flush();
+}
+
+/*\
+ *  class h2_connection
+\*/
+h2_connection::h2_connection(asio::io_service& ios, boost::shared_ptr<socket> sock, bool server, uint32_t window)
+  : p(boost::make_shared<private_t>(ios, sock, server, window))
+{}
+
+h2_connection::~h2_connection() {
+  p->shutdown(asio::error::operation_aborted, h2_error::no_error, false);
+}
+
+void h2_connection::start(const std::string& received, stream_handler sh, close_handler ch) {
+  p->start(received, sh, ch);
+}
+
+bool h2_connection::open(h2_stream& stream, const header_list& request, response_handler rh) {
+  return p->open(stream.s_, request, rh);
+}
+
+boost::shared_ptr<h2_stream> h2_connection::create_stream() {
+  return boost::make_shared<h2_stream>(p);
+}
+
+void h2_connection::close() {
+  p->shutdown(asio::error::operation_aborted, h2_error::no_error, false);
+}
+
+bool h2_connection::running() const {
+  return p->running();
+}
+
+std::string h2_connection::stats() {
+  return p->stats();
+}
+
+/*\
+ *  class h2_stream
+\*/
+h2_stream::h2_stream(boost::shared_ptr<h2_connection::private_t> conn)
+  : conn_(conn)
+  , s_(boost::make_shared<state_t>())
+{}
+
+h2_stream::~h2_stream() {
+  conn_->cancel(s_);
+  conn_->reset(s_, h2_error::cancel);
+}
+
+void h2_stream::respond(const header_list& headers) {
+  conn_->respond(s_, headers);
+}
+
+void h2_stream::async_connect(const acceptor::endpoint_type&, connect_handler handler) {
+  conn_->ios_.post(boost::bind(handler, asio::error::operation_not_supported));
+}
+
+void h2_stream::async_attach(asio::ip::tcp::socket&&, connect_handler handler) {
+  conn_->ios_.post(boost::bind(handler, asio::error::operation_not_supported));
+}
+
+void h2_stream::async_accept(acceptor&, acceptor::endpoint_type&, accept_handler handler) {
+  conn_->ios_.post(boost::bind(handler, asio::error::operation_not_supported));
+}
+
+void h2_stream::async_accept(asio::ip::tcp::socket&&, accept_handler handler) {
+  conn_->ios_.post(boost::bind(handler, asio::error::operation_not_supported));
+}
+
+void h2_stream::async_read_some(const asio::mutable_buffers_1& buffers, read_handler handler) {
+  conn_->read(s_, asio::buffer_cast<char*>(buffers), asio::buffer_size(buffers), handler);
+}
+
+void h2_stream::async_write_some(const asio::const_buffers_1& buffers, write_handler handler) {
+  conn_->write(s_, std::vector<asio::const_buffer>(1, buffers), handler);
+}
+
+void h2_stream::async_write_some(const std::vector<asio::const_buffer>& buffers, write_handler handler) {
+  conn_->write(s_, buffers, handler);
+}
+
+void h2_stream::cancel(boost::system::error_code& ec) {
+  conn_->cancel(s_);
+  ec = boost::system::error_code();
+}
+
+void h2_stream::shutdown(boost::system::error_code& ec) {
+  conn_->reset(s_, h2_error::cancel);
+  ec = boost::system::error_code();
+}
+
+void h2_stream::close(boost::system::error_code& ec) {
+  conn_->reset(s_, h2_error::cancel);
+  ec = boost::system::error_code();
+}
+
+std::string h2_stream::stats() {
+  return conn_->stats(s_);
+}
+
+}
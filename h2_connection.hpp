@@ -0,0 +1,91 @@
+#ifndef H2_CONNECTION_HPP
+#define H2_CONNECTION_HPP
+
+#include <string>
+#include <boost/asio/io_service.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "socket.hpp"
+#include "hpack.hpp"
+
+namespace sp
+{
+
+class h2_stream;
+
+// http/2 connection (rfc 9113) over a connected socket, prior knowledge h2c or h2 negotiated
+// with alpn. client opens streams with a request, server answers the streams opened by the peer.
+// the body of each stream is read and written through an h2_stream. both directions are flow
+// controlled per stream and per connection, data of the streams is sent round robin
+class h2_connection
+{
+public:
+  // server: peer opened a stream with the request headers
+  typedef boost::function<void(boost::shared_ptr<h2_stream>, const header_list&)> stream_handler;
+  // connection failed or was closed by the peer, its streams fail with the same error
+  typedef boost::function<void(const boost::system::error_code&)> close_handler;
+
+  // window is the receive window of every stream, the one of the connection is 16 times larger
+  h2_connection(boost::asio::io_service& ios, boost::shared_ptr<socket> sock, bool server, uint32_t window);
+  ~h2_connection(); // streams fail with operation_aborted
+
+  // exchanges prefaces and settings, then serves streams. received is what has been read
+  // from the socket before. may be called again once the socket is reconnected
+  void start(const std::string& received, stream_handler sh, close_handler ch);
+  // client: binds stream to a new stream of the connection and sends the request,
+  // rh gets the response headers. false if the connection is not running
+  typedef boost::function<void(const header_list&)> response_handler;
+  bool open(h2_stream& stream, const header_list& request, response_handler rh);
+  // client: stream not yet bound to a connection
+  boost::shared_ptr<h2_stream> create_stream();
+  // sends goaway, streams fail with operation_aborted. socket is left to the owner
+  void close();
+
+  bool running() const;
+  // open streams and the transport, for logging
+  std::string stats();
+
+private:
+  friend class h2_stream;
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+// body of an http/2 stream as a socket. connect, attach and accept are not supported,
+// h2_connection binds streams. shutdown and close reset the stream, a reset or ended
+// stream is unbound and can be bound again
+class h2_stream: public socket
+{
+public:
+  ~h2_stream();
+
+  // server: sends the response headers, the stream is open both ways after that
+  void respond(const header_list& headers);
+
+  virtual void async_connect(const acceptor::endpoint_type& peer_endpoint, connect_handler handler);
+  virtual void async_attach(boost::asio::ip::tcp::socket&& connected, connect_handler handler);
+  virtual void async_accept(acceptor& acc, acceptor::endpoint_type& remote_ep, accept_handler handler);
+  virtual void async_accept(boost::asio::ip::tcp::socket&& accepted, accept_handler handler);
+  virtual void async_read_some(const boost::asio::mutable_buffers_1& buffers, read_handler handler);
+  virtual void async_write_some(const boost::asio::const_buffers_1& buffers, write_handler handler);
+  virtual void async_write_some(const std::vector<boost::asio::const_buffer>& buffers, write_handler handler);
+  virtual void cancel(boost::system::error_code& ec);
+  virtual void shutdown(boost::system::error_code& ec);
+  virtual void close(boost::system::error_code& ec);
+  virtual std::string stats();
+
+  // unbound stream of the connection, streams are only made by h2_connection
+  explicit h2_stream(boost::shared_ptr<h2_connection::private_t> conn);
+
+private:
+  friend class h2_connection;
+  friend class h2_connection::private_t;
+  struct state_t;
+
+  boost::shared_ptr<h2_connection::private_t> conn_;
+  boost::shared_ptr<state_t> s_;
+};
+
+}
+
+#endif // H2_CONNECTION_HPP
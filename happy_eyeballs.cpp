@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "happy_eyeballs.hpp"
+#include "tcp_stats.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+/*\
+ *  class happy_eyeballs::private_t
+\*/
+class happy_eyeballs::private_t: public boost::enable_shared_from_this<happy_eyeballs::private_t> {
+public:
+  private_t(asio::io_service& ios, const settings& st);
+  void async_connect(const endpoints_t& endpoints, connect_handler handler);
+  void cancel();
+
+private:
+  typedef asio::ip::tcp::endpoint endpoint_t;
+  typedef asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT> fast_open_connect;
+
+  struct attempt_t {
+    attempt_t(asio::io_service& ios, const endpoint_t& e): ep(e), sock(ios) {}
+
+    endpoint_t ep;
+    asio::ip::tcp::socket sock;
+  };
+
+  void start_next();
+  void handle_connect(const boost::system::error_code& ec, uint64_t race, std::size_t attempt);
+  void handle_delay(const boost::system::error_code& ec, uint64_t race);
+  void finish(const boost::system::error_code& ec);
+
+  asio::io_service& ios_;
+  const settings& st_;
+
+  std::vector<endpoint_t> endpoints_; // in order of attempts
+  std::size_t next_;
+  std::vector<boost::shared_ptr<attempt_t> > attempts_;
+  std::size_t in_flight_;
+  asio::steady_timer delay_timer_;
+  uint64_t race_;  // completions of earlier races are ignored
+  boost::system::error_code last_ec_;
+  connect_handler handler_;
+  asio::ip::tcp::socket winner_;
+  endpoint_t last_winner_; // of the previous race
+};
+
+happy_eyeballs::private_t::private_t(asio::io_service& ios, const settings& st)
+  : ios_(ios), st_(st)
+  , next_(0), in_flight_(0), delay_timer_(ios), race_(0), winner_(ios)
+{}
+
+void happy_eyeballs::private_t::async_connect(const endpoints_t& endpoints, connect_handler handler) {
+  cancel();
+  // alternate address families starting with the one resolver preferred
+  std::vector<endpoint_t> first, second;
+  for(auto ep = endpoints.begin(); ep != endpoints.end(); ++ep) {
+    if(first.empty() || first.front().protocol() == ep->protocol()) {
+      first.push_back(*ep);
+    }
+    else {
+      second.push_back(*ep);
+    }
+  }
+  endpoints_.clear();
+  for(std::size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+    if(i < first.size()) endpoints_.push_back(first[i]);
+    if(i < second.size()) endpoints_.push_back(second[i]);
+  }
+
+  handler_ = handler;
+  next_ = 0;
+  in_flight_ = 0;
+  last_ec_ = asio::error::host_not_found;
+  boost::system::error_code dummy_ec;
+  winner_.close(dummy_ec);
+  start_next();
+}
+
+void happy_eyeballs::private_t::cancel() {
+  if(handler_) {
+    finish(asio::error::operation_aborted);
+  }
+}
+
+void happy_eyeballs::private_t::start_next() {
+  static const char func[] = "happy_eyeballs::start_next";
+  while(next_ < endpoints_.size()) {
+    auto index = attempts_.size();
+    auto a = boost::make_shared<attempt_t>(ios_, endpoints_[next_++]);
+    boost::system::error_code ec;
+    if(st_.mptcp) {
+      bool fallback = false;
+      int fd = open_mptcp_socket(a->ep.protocol().family(), &fallback);
+      if(-1 == fd) {
+        ec.assign(errno, boost::system::system_category());
+      }
+      else {
+        a->sock.assign(a->ep.protocol(), fd, ec);
+        if(ec) {
+          ::close(fd);
+        }
+      }
+    }
+    else {
+      a->sock.open(a->ep.protocol(), ec);
+    }
+    // a fast open connect completes without a syn, it would win the race whether the endpoint answers or not
+    if(!ec && st_.fast_open && (1 == endpoints_.size() || a->ep == last_winner_)) {
+      boost::system::error_code tfo_ec;
+      a->sock.set_option(fast_open_connect(true), tfo_ec);
+      if(tfo_ec) {
+        LOG_DEBUG << bf("%s: tcp fast open is not available for endpoint '%s:%d': %s")
+          % func % a->ep.address().to_string() % a->ep.port() % tfo_ec.message();
+      }
+    }
+    if(ec) {
+      LOG_DEBUG << bf("%s: couldn't open socket for endpoint '%s:%d': %s")
+        % func % a->ep.address().to_string() % a->ep.port() % ec.message();
+      last_ec_ = ec;
+      continue;
+    }
+
+    LOG_DEBUG << bf("%s: connecting to endpoint '%s:%d'") % func % a->ep.address().to_string() % a->ep.port();
+    attempts_.push_back(a);
+    ++in_flight_;
+    a->sock.async_connect(a->ep, boost::bind(
+      &private_t::handle_connect,
+        shared_from_this(),
+        asio::placeholders::error,
+        race_,
+        index
+    ));
+    if(next_ < endpoints_.size()) {
+      delay_timer_.expires_from_now(st_.connect_attempt_delay);
+      delay_timer_.async_wait(boost::bind(
+        &private_t::handle_delay,
+          shared_from_this(),
+          asio::placeholders::error,
+          race_
+      ));
+    }
+    return;
+  }
+  if(0 == in_flight_) {
+    finish(last_ec_);
+  }
+}
+
+void happy_eyeballs::private_t::handle_connect(const boost::system::error_code& ec, uint64_t race, std::size_t attempt) {
+  static const char func[] = "happy_eyeballs::handle_connect";
+  if(race != race_) {
+    return;
+  }
+  auto& a = *attempts_[attempt];
+  --in_flight_;
+  if(ec) {
+    LOG_DEBUG << bf("%s: connection to endpoint '%s:%d' failed: %s")
+      % func % a.ep.address().to_string() % a.ep.port() % ec.message();
+    last_ec_ = ec;
+    boost::system::error_code dummy_ec;
+    a.sock.close(dummy_ec);
+    // don't wait for the delay once an attempt fails
+    delay_timer_.cancel();
+    start_next();
+    return;
+  }
+  LOG_DEBUG << bf("%s: connected to endpoint '%s:%d', %d other attempt(s) cancelled")
+    % func % a.ep.address().to_string() % a.ep.port() % in_flight_;
+  winner_ = std::move(a.sock);
+  last_winner_ = a.ep;
+  // writes of the tunnel are coalesced already, nagle would only hold handshakes and pings back
+  boost::system::error_code nodelay_ec;
+  winner_.set_option(asio::ip::tcp::no_delay(true), nodelay_ec);
+  if(nodelay_ec) {
+    LOG_DEBUG << bf("%s: failed to disable nagle on connection to '%s:%d': %s")
+      % func % a.ep.address().to_string() % a.ep.port() % nodelay_ec.message();
+  }
+  finish(boost::system::error_code());
+}
+
+void happy_eyeballs::private_t::handle_delay(const boost::system::error_code& ec, uint64_t race) {
+  if(asio::error::operation_aborted == ec || race != race_) {
+    return;
+  }
+  start_next();
+}
+
+void happy_eyeballs::private_t::finish(const boost::system::error_code& ec) {
+  ++race_;
+  delay_timer_.cancel();
+  for(auto i = attempts_.begin(); i != attempts_.end(); ++i) {
+    boost::system::error_code dummy_ec;
+    (*i)->sock.close(dummy_ec);
+  }
+  attempts_.clear();
+  endpoints_.clear();
+  in_flight_ = 0;
+  auto h = handler_;
+  handler_.clear();
+  h(ec, winner_);
+}
+
+/*\
+ *  class happy_eyeballs
+\*/
+happy_eyeballs::happy_eyeballs(asio::io_service& ios, const settings& st) {
+  p = boost::make_shared<private_t>(ios, st);
+}
+
+void happy_eyeballs::async_connect(const endpoints_t& endpoints, connect_handler handler) {
+  p->async_connect(endpoints, handler);
+}
+
+void happy_eyeballs::cancel() {
+  p->cancel();
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef HAPPY_EYEBALLS_HPP
+#define HAPPY_EYEBALLS_HPP
+
+#include <chrono>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "settings.hpp"
+
+namespace sp
+{
+
+// RFC 8305 connection racing: resolved endpoints are interleaved by address family
+// and connected to in a staggered way, next attempt starts after attempt_delay or
+// as soon as the previous one fails. first established connection wins, the rest are closed.
+// with tcp fast open and a cached cookie connect completes at once and syn is sent with the first write,
+// so fast open is used only for the sole endpoint or the one that won the previous race
+class happy_eyeballs
+{
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints_t;
+  // on success winner is the established connection, to be moved from
+  typedef boost::function<void(const boost::system::error_code&, boost::asio::ip::tcp::socket& winner)> connect_handler;
+
+  happy_eyeballs(boost::asio::io_service& ios, const settings& st);
+
+  // handler gets the last error if none of the endpoints could be connected,
+  // operation_aborted if the race is cancelled
+  void async_connect(const endpoints_t& endpoints, connect_handler handler);
+  // no-op if no race is running
+  void cancel();
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // HAPPY_EYEBALLS_HPP
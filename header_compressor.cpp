@@ -0,0 +1,300 @@
+#include <cstring>
+#include "header_compressor.hpp"
+#include "logging.hpp"
+
+namespace sp
+{
+
+namespace {
+// first byte of an entry
+enum entry_t { raw = 0, establish = 1, compressed = 2 };
+// second byte is the context, a compressed entry tells the fields that follow in the third one
+enum change_t {
+  id_jump = 0x01,    // ip id is not the one of the context plus one
+  seq = 0x02,        // sequence number delta
+  ack = 0x04,        // acknowledgement number delta
+  window = 0x08,
+  flags = 0x10,
+  timestamps = 0x20, // tsval and tsecr deltas, other options as in the context
+  options = 0x40     // all of them
+};
+static const std::size_t eth_size = 14;
+static const std::size_t vlan_size = 4;
+static const std::size_t min_ip_size = 20;
+static const std::size_t min_tcp_size = 20;
+
+uint16_t get16(const unsigned char* p) {
+  return p[0] << 8 | p[1];
+}
+
+void put16(unsigned char* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+uint32_t get32(const unsigned char* p) {
+  return uint32_t(get16(p)) << 16 | get16(p + 2);
+}
+
+void put32(unsigned char* p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+void put_varint(std::vector<char>& out, uint32_t v) {
+  for(; v >= 0x80; v >>= 7) {
+    out.push_back(v | 0x80);
+  }
+  out.push_back(v);
+}
+
+bool get_varint(const unsigned char*& p, const unsigned char* end, uint32_t& v) {
+  v = 0;
+  for(unsigned shift = 0; shift < 35 && p != end; shift += 7) {
+    auto b = *p++;
+    v |= uint32_t(b & 0x7f) << shift;
+    if(!(b & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// zero over a header with a valid checksum
+uint16_t ip_checksum(const unsigned char* header, std::size_t size) {
+  uint32_t sum = 0;
+  for(std::size_t i = 0; i + 1 < size; i += 2) {
+    sum += get16(header + i);
+  }
+  while(sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+// offset of the values of the timestamp option within the options, 0 if there is none
+std::size_t find_timestamps(const unsigned char* options, std::size_t size) {
+  std::size_t i = 0;
+  while(i < size && 0 != options[i]) {
+    if(1 == options[i]) {
+      ++i;
+      continue;
+    }
+    if(i + 1 >= size || options[i + 1] < 2 || i + options[i + 1] > size) {
+      break;
+    }
+    if(8 == options[i] && 10 == options[i + 1]) {
+      return i + 2;
+    }
+    i += options[i + 1];
+  }
+  return 0;
+}
+
+// unfragmented ipv4/tcp frame, its total length and ip checksum right, behind an optional vlan tag
+bool parse(const unsigned char* f, std::size_t size, std::size_t prefix, std::size_t& ip, std::size_t& tcp, std::size_t& header) {
+  ip = prefix + eth_size;
+  if(size < ip + min_ip_size) {
+    return false;
+  }
+  auto type = get16(f + ip - 2);
+  if(0x8100 == type) {
+    ip += vlan_size;
+    if(size < ip + min_ip_size) {
+      return false;
+    }
+    type = get16(f + ip - 2);
+  }
+  std::size_t ihl = (f[ip] & 0x0f) * 4;
+  if(0x0800 != type || 0x40 != (f[ip] & 0xf0) || ihl < min_ip_size || 6 != f[ip + 9] || (get16(f + ip + 6) & 0x3fff)) {
+    return false;
+  }
+  tcp = ip + ihl;
+  if(size < tcp + min_tcp_size || get16(f + ip + 2) != size - ip || ip_checksum(f + ip, ihl)) {
+    return false;
+  }
+  header = tcp + (f[tcp + 12] >> 4) * 4;
+  return header >= tcp + min_tcp_size && header <= size;
+}
+
+bool same(const unsigned char* a, const unsigned char* b, std::size_t from, std::size_t to) {
+  return 0 == std::memcmp(a + from, b + from, to - from);
+}
+}
+
+header_compressor::header_compressor()
+  : contexts_(contexts)
+{}
+
+void header_compressor::compress(const char* frame, std::size_t size, std::size_t prefix, uint32_t flow, std::vector<char>& entry) {
+  auto f = reinterpret_cast<const unsigned char*>(frame);
+  entry.clear();
+  ++frames_;
+  std::size_t ip, tcp, header;
+  if(!parse(f, size, prefix, ip, tcp, header)) {
+    entry.push_back(raw);
+    entry.insert(entry.end(), frame, frame + size);
+    return;
+  }
+  auto id = flow % contexts;
+  auto& c = contexts_[id];
+  auto h = reinterpret_cast<const unsigned char*>(c.header.data());
+  // all but the fields encoded below as in the context
+  if(c.header.size() != header || c.ip != ip
+    || !same(f, h, 0, ip + 2) || !same(f, h, ip + 6, ip + 10) || !same(f, h, ip + 12, tcp + 4)
+    || !same(f, h, tcp + 12, tcp + 13) || !same(f, h, tcp + 18, tcp + 20)) {
+    entry.push_back(establish);
+    entry.push_back(id);
+    entry.push_back(ip);
+    entry.insert(entry.end(), frame, frame + size);
+    c.header.assign(frame, frame + header);
+    c.ip = ip;
+    return;
+  }
+
+  entry.push_back(compressed);
+  entry.push_back(id);
+  entry.push_back(0);
+  unsigned char changes = 0;
+  if(get16(f + ip + 4) != uint16_t(get16(h + ip + 4) + 1)) {
+    changes |= id_jump;
+    entry.insert(entry.end(), frame + ip + 4, frame + ip + 6);
+  }
+  if(auto d = get32(f + tcp + 4) - get32(h + tcp + 4)) {
+    changes |= seq;
+    put_varint(entry, d);
+  }
+  if(auto d = get32(f + tcp + 8) - get32(h + tcp + 8)) {
+    changes |= ack;
+    put_varint(entry, d);
+  }
+  if(!same(f, h, tcp + 14, tcp + 16)) {
+    changes |= window;
+    entry.insert(entry.end(), frame + tcp + 14, frame + tcp + 16);
+  }
+  if(f[tcp + 13] != h[tcp + 13]) {
+    changes |= flags;
+    entry.push_back(f[tcp + 13]);
+  }
+  auto o = tcp + min_tcp_size;
+  if(!same(f, h, o, header)) {
+    auto ts = find_timestamps(f + o, header - o);
+    if(ts && ts == find_timestamps(h + o, header - o) && same(f, h, o, o + ts) && same(f, h, o + ts + 8, header)) {
+      changes |= timestamps;
+      put_varint(entry, get32(f + o + ts) - get32(h + o + ts));
+      put_varint(entry, get32(f + o + ts + 4) - get32(h + o + ts + 4));
+    }
+    else {
+      changes |= options;
+      entry.insert(entry.end(), frame + o, frame + header);
+    }
+  }
+  entry[2] = changes;
+  entry.insert(entry.end(), frame + tcp + 16, frame + tcp + 18);
+  entry.insert(entry.end(), frame + header, frame + size);
+  std::memcpy(&c.header[0], frame, header);
+  ++compressed_;
+  saved_ += size - entry.size();
+}
+
+bool header_compressor::decompress(const char* entry, std::size_t size, std::vector<char>& frame) {
+  auto e = reinterpret_cast<const unsigned char*>(entry);
+  auto end = e + size;
+  if(size && raw == e[0]) {
+    frame.assign(entry + 1, entry + size);
+    return true;
+  }
+  if(size < 3) {
+    return false;
+  }
+  auto& c = contexts_[e[1]];
+  if(establish == e[0]) {
+    std::size_t ip = e[2];
+    auto f = e + 3;
+    std::size_t fsize = size - 3;
+    if(fsize < ip + min_ip_size || (f[ip] & 0x0f) * 4 < min_ip_size) {
+      return false;
+    }
+    std::size_t tcp = ip + (f[ip] & 0x0f) * 4;
+    if(fsize < tcp + min_tcp_size) {
+      return false;
+    }
+    std::size_t header = tcp + (f[tcp + 12] >> 4) * 4;
+    if(header < tcp + min_tcp_size || header > fsize) {
+      return false;
+    }
+    c.header.assign(entry + 3, entry + 3 + header);
+    c.ip = ip;
+    frame.assign(entry + 3, entry + size);
+    return true;
+  }
+  if(compressed != e[0] || c.header.empty()) {
+    return false;
+  }
+
+  auto h = reinterpret_cast<unsigned char*>(&c.header[0]);
+  auto ip = c.ip;
+  std::size_t ihl = (h[ip] & 0x0f) * 4;
+  auto tcp = ip + ihl;
+  auto o = tcp + min_tcp_size;
+  auto header = c.header.size();
+  auto changes = e[2];
+  auto p = e + 3;
+  uint32_t d;
+  if(changes & id_jump) {
+    if(end - p < 2) return false;
+    std::memcpy(h + ip + 4, p, 2);
+    p += 2;
+  }
+  else {
+    put16(h + ip + 4, get16(h + ip + 4) + 1);
+  }
+  if(changes & seq) {
+    if(!get_varint(p, end, d)) return false;
+    put32(h + tcp + 4, get32(h + tcp + 4) + d);
+  }
+  if(changes & ack) {
+    if(!get_varint(p, end, d)) return false;
+    put32(h + tcp + 8, get32(h + tcp + 8) + d);
+  }
+  if(changes & window) {
+    if(end - p < 2) return false;
+    std::memcpy(h + tcp + 14, p, 2);
+    p += 2;
+  }
+  if(changes & flags) {
+    if(end - p < 1) return false;
+    h[tcp + 13] = *p++;
+  }
+  if(changes & timestamps) {
+    auto ts = find_timestamps(h + o, header - o);
+    if(!ts) return false;
+    if(!get_varint(p, end, d)) return false;
+    put32(h + o + ts, get32(h + o + ts) + d);
+    if(!get_varint(p, end, d)) return false;
+    put32(h + o + ts + 4, get32(h + o + ts + 4) + d);
+  }
+  if(changes & options) {
+    if(std::size_t(end - p) < header - o) return false;
+    std::memcpy(h + o, p, header - o);
+    p += header - o;
+  }
+  if(end - p < 2) {
+    return false;
+  }
+  std::memcpy(h + tcp + 16, p, 2);
+  p += 2;
+  put16(h + ip + 2, header - ip + (end - p));
+  put16(h + ip + 10, 0);
+  put16(h + ip + 10, ip_checksum(h + ip, ihl));
+  frame.reserve(header + (end - p));
+  frame.assign(c.header.begin(), c.header.end());
+  frame.insert(frame.end(), p, end);
+  return true;
+}
+
+std::string header_compressor::stats() const {
+  return boost::str(bf("%d of %d frames with compressed headers, %d B saved") % compressed_ % frames_ % saved_);
+}
+
+}
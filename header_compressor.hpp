@@ -0,0 +1,51 @@
+#ifndef HEADER_COMPRESSOR_HPP
+#define HEADER_COMPRESSOR_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sp
+{
+
+// rohc style compression of the ethernet/ipv4/tcp headers of the frames sent over one connection,
+// an instance compresses on the sending end and another one rebuilds frames on the receiving end.
+// both keep the last header of each context, one per flow hashed to it. a frame whose header
+// differs from that of its context only in fields tcp keeps changing carries just those changes:
+// ip id, sequence and acknowledgement deltas, window, flags, timestamps or other options and the
+// tcp checksum. ip total length and checksum are rebuilt. other ipv4/tcp frames establish their
+// context anew, the rest go as they are. contexts start empty with every connection, frames of
+// a connection arrive in order, so the ends stay in step across reconnects
+class header_compressor
+{
+public:
+  // most an entry is larger than its frame
+  static const std::size_t max_overhead = 3;
+  // frames of flows hashed to the same context must keep their order
+  static const std::size_t contexts = 256;
+
+  header_compressor();
+
+  // entry of a batch for the frame of the flow, prefix bytes (the channel) ahead of its ethernet header
+  void compress(const char* frame, std::size_t size, std::size_t prefix, uint32_t flow, std::vector<char>& entry);
+  // frame of an entry compressed by the peer, false if it does not fit the contexts
+  bool decompress(const char* entry, std::size_t size, std::vector<char>& frame);
+
+  // frames compressed and header bytes saved
+  std::string stats() const;
+
+private:
+  struct context_t {
+    std::vector<char> header; // up to the end of the tcp header, empty until established
+    std::size_t ip = 0;       // offset of the ip header
+  };
+
+  std::vector<context_t> contexts_;
+  uint64_t frames_ = 0;
+  uint64_t compressed_ = 0;
+  uint64_t saved_ = 0;
+};
+
+}
+
+#endif // HEADER_COMPRESSOR_HPP
@@ -0,0 +1,360 @@
+#include <cstdint>
+#include "hpack.hpp"
+
+namespace sp
+{
+
+namespace {
+  // rfc 7541 appendix a
+  static const struct { const char* name; const char* value; } static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+  };
+  static const std::size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]);
+
+  // rfc 7541 appendix b, codes of bytes 0-255, eos is all ones in 30 bits
+  static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+  };
+  static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  };
+  static const std::size_t entry_overhead = 32; // accounted per table entry besides name and value
+  static const uint64_t max_integer = 1 << 24;   // far more than any sane length or index
+
+  // decoding tree of the huffman code, built once. node children are indices,
+  // leaves hold the symbol as a negative number (-1 - symbol), 256 is eos
+  struct huffman_tree {
+    huffman_tree() {
+      nodes.push_back(node_t());
+      for(int sym = 0; sym <= 256; ++sym) {
+        uint32_t code = sym < 256 ? huffman_codes[sym] : 0x3fffffff;
+        int len = sym < 256 ? huffman_lengths[sym] : 30;
+        std::size_t n = 0;
+        for(int bit = len - 1; bit >= 0; --bit) {
+          int b = (code >> bit) & 1;
+          if(0 == bit) {
+            nodes[n].child[b] = -1 - sym;
+          }
+          else {
+            if(0 == nodes[n].child[b]) {
+              nodes[n].child[b] = nodes.size();
+              nodes.push_back(node_t());
+            }
+            n = nodes[n].child[b];
+          }
+        }
+      }
+    }
+
+    struct node_t {
+      node_t() { child[0] = child[1] = 0; }
+      int child[2];
+    };
+    std::vector<node_t> nodes;
+  };
+
+  bool huffman_decode(const unsigned char* data, std::size_t size, std::string& out) {
+    static const huffman_tree tree;
+    std::size_t n = 0;
+    int depth = 0;     // bits since the last symbol
+    bool ones = true;  // those bits are all ones
+    for(std::size_t i = 0; i < size; ++i) {
+      for(int bit = 7; bit >= 0; --bit) {
+        int b = (data[i] >> bit) & 1;
+        int next = tree.nodes[n].child[b];
+        ones = ones && b;
+        ++depth;
+        if(next < 0) {
+          int sym = -1 - next;
+          if(256 == sym) {
+            return false; // eos in a string
+          }
+          out.push_back(static_cast<char>(sym));
+          n = 0;
+          depth = 0;
+          ones = true;
+        }
+        else if(0 == next) {
+          return false;
+        }
+        else {
+          n = next;
+        }
+      }
+    }
+    // padding is the most significant bits of eos, shorter than a byte
+    return depth < 8 && ones;
+  }
+
+  bool decode_integer(const unsigned char*& p, const unsigned char* end, int prefix, uint64_t& value) {
+    if(p == end) return false;
+    uint64_t max_prefix = (1u << prefix) - 1;
+    value = *p++ & max_prefix;
+    if(value < max_prefix) {
+      return true;
+    }
+    for(int shift = 0; p != end; shift += 7) {
+      unsigned char b = *p++;
+      value += uint64_t(b & 0x7f) << shift;
+      if(value > max_integer) return false;
+      if(!(b & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool decode_string(const unsigned char*& p, const unsigned char* end, std::string& s) {
+    if(p == end) return false;
+    bool huffman = *p & 0x80;
+    uint64_t len = 0;
+    if(!decode_integer(p, end, 7, len) || uint64_t(end - p) < len) {
+      return false;
+    }
+    if(huffman) {
+      s.clear();
+      if(!huffman_decode(p, len, s)) return false;
+    }
+    else {
+      s.assign(reinterpret_cast<const char*>(p), len);
+    }
+    p += len;
+    return true;
+  }
+
+  void encode_integer(std::string& out, unsigned char first, int prefix, uint64_t value) {
+    uint64_t max_prefix = (1u << prefix) - 1;
+    if(value < max_prefix) {
+      out.push_back(first | value);
+      return;
+    }
+    out.push_back(first | max_prefix);
+    value -= max_prefix;
+    while(value >= 0x80) {
+      out.push_back(0x80 | (value & 0x7f));
+      value >>= 7;
+    }
+    out.push_back(value);
+  }
+
+  void encode_string(std::string& out, const std::string& s) {
+    encode_integer(out, 0, 7, s.size());
+    out.append(s);
+  }
+}
+
+/*\
+ *  class hpack_encoder
+\*/
+void hpack_encoder::encode(const header_list& headers, std::string& block) const {
+  for(auto h = headers.begin(); h != headers.end(); ++h) {
+    std::size_t name_index = 0;
+    std::size_t index = 0;
+    for(std::size_t i = 0; i < static_table_size && !index; ++i) {
+      if(h->first != static_table[i].name) continue;
+      if(!name_index) name_index = i + 1;
+      if(h->second == static_table[i].value) index = i + 1;
+    }
+    if(index) {
+      // indexed header field
+      encode_integer(block, 0x80, 7, index);
+      continue;
+    }
+    // literal header field without indexing
+    encode_integer(block, 0x00, 4, name_index);
+    if(!name_index) {
+      encode_string(block, h->first);
+    }
+    encode_string(block, h->second);
+  }
+}
+
+/*\
+ *  class hpack_decoder
+\*/
+hpack_decoder::hpack_decoder(std::size_t max_table_size)
+  : size_(0), max_size_(max_table_size), limit_(max_table_size)
+{}
+
+bool hpack_decoder::decode(const char* data, std::size_t size, header_list& headers) {
+  auto p = reinterpret_cast<const unsigned char*>(data);
+  auto end = p + size;
+  bool fields_seen = false;
+  while(p != end) {
+    unsigned char b = *p;
+    uint64_t index = 0;
+    std::pair<std::string, std::string> f;
+    if(b & 0x80) {
+      // indexed header field
+      if(!decode_integer(p, end, 7, index) || !field(index, f)) return false;
+      headers.push_back(f);
+      fields_seen = true;
+      continue;
+    }
+    if(0x20 == (b & 0xe0)) {
+      // dynamic table size update, only at the start of a block
+      if(fields_seen || !decode_integer(p, end, 5, index) || index > limit_) return false;
+      max_size_ = index;
+      evict(max_size_);
+      continue;
+    }
+    // literal with incremental indexing (01), without indexing (0000) or never indexed (0001)
+    bool indexing = 0x40 == (b & 0xc0);
+    if(!decode_integer(p, end, indexing ? 6 : 4, index)) return false;
+    if(index) {
+      std::pair<std::string, std::string> named;
+      if(!field(index, named)) return false;
+      f.first = named.first;
+    }
+    else if(!decode_string(p, end, f.first)) {
+      return false;
+    }
+    if(!decode_string(p, end, f.second)) return false;
+    if(indexing) {
+      insert(f);
+    }
+    headers.push_back(f);
+    fields_seen = true;
+  }
+  return true;
+}
+
+bool hpack_decoder::field(std::size_t index, std::pair<std::string, std::string>& f) const {
+  if(0 == index) {
+    return false;
+  }
+  if(index <= static_table_size) {
+    f.first = static_table[index - 1].name;
+    f.second = static_table[index - 1].value;
+    return true;
+  }
+  index -= static_table_size + 1;
+  if(index >= table_.size()) {
+    return false;
+  }
+  f = table_[index];
+  return true;
+}
+
+void hpack_decoder::insert(const std::pair<std::string, std::string>& f) {
+  std::size_t size = f.first.size() + f.second.size() + entry_overhead;
+  // an entry larger than the table empties it and is not added
+  evict(size > max_size_ ? 0 : max_size_ - size);
+  if(size <= max_size_) {
+    table_.push_front(f);
+    size_ += size;
+  }
+}
+
+void hpack_decoder::evict(std::size_t max_size) {
+  while(size_ > max_size && !table_.empty()) {
+    size_ -= table_.back().first.size() + table_.back().second.size() + entry_overhead;
+    table_.pop_back();
+  }
+}
+
+}
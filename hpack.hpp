@@ -0,0 +1,48 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace sp
+{
+
+// header fields of an http/2 header block in order, names are lower case
+typedef std::vector<std::pair<std::string, std::string> > header_list;
+
+// header compression of http/2 (rfc 7541).
+// encoder refers to the static table and sends everything else as literals that are
+// never indexed, so the dynamic table of the peer stays empty and its size is irrelevant
+class hpack_encoder
+{
+public:
+  void encode(const header_list& headers, std::string& block) const;
+};
+
+// full decoder: static and dynamic table, huffman coded strings
+class hpack_decoder
+{
+public:
+  // max_table_size is SETTINGS_HEADER_TABLE_SIZE announced to the peer
+  explicit hpack_decoder(std::size_t max_table_size = 4096);
+
+  // appends fields of a complete header block. false on a malformed block, which
+  // leaves the table out of sync: connection error of type COMPRESSION_ERROR
+  bool decode(const char* data, std::size_t size, header_list& headers);
+
+private:
+  bool field(std::size_t index, std::pair<std::string, std::string>& f) const;
+  void insert(const std::pair<std::string, std::string>& f);
+  void evict(std::size_t max_size);
+
+  std::deque<std::pair<std::string, std::string> > table_; // newest first
+  std::size_t size_;
+  std::size_t max_size_;  // current one, set by the peer within limit_
+  std::size_t limit_;
+};
+
+}
+
+#endif // HPACK_HPP
@@ -1,3 +1,4 @@
+#include <boost/algorithm/string/predicate.hpp>
 #include "http_parser.hpp"
 #include "logging.hpp"
 
@@ -19,7 +20,7 @@ struct http_parser::private_t {
       on_body,  //data
       on_message_complete,
 //      on_chunk_header,
-//      on_chunk_complete
+      on_chunk_complete
     };
   };
 
@@ -35,6 +36,7 @@ struct http_parser::private_t {
   int on_headers_complete();
   int on_body(const char* data, std::size_t size);
   int on_message_complete();
+  int on_chunk_complete();
 
   http_parser_handler* h;
   ::http_parser parser;
@@ -65,6 +67,7 @@ int http_parser::private_t::http_cb(::http_parser* parser) {
   switch(type) {
   case cb_type::on_headers_complete: return p->on_headers_complete();
   case cb_type::on_message_complete: return p->on_message_complete();
+  case cb_type::on_chunk_complete: return p->on_chunk_complete();
   default: assert(!"unknwn http callback type");
   }
 }
@@ -157,6 +160,10 @@ int http_parser::private_t::on_message_complete() {
   return 0;
 }
 
+int http_parser::private_t::on_chunk_complete() {
+  return h->handle_chunk_complete(parent) ? 0 : -1;
+}
+
 
 /*\
  *  class http_parser
@@ -177,6 +184,7 @@ http_parser::http_parser(http_parser_handler* h)
   __CB(on_headers_complete);
   __DATA_CB(on_body);
   __CB(on_message_complete);
+  __CB(on_chunk_complete);
 
 #undef __DATA_CB
 #undef __CB
@@ -196,6 +204,10 @@ bool http_parser::body_complete() const {
   return p->info.body_complete;
 }
 
+bool http_parser::upgrade() const {
+  return p->parser.upgrade;
+}
+
 bool http_parser::failed() {
   return ::HPE_OK != p->parser.http_errno;
 }
@@ -220,6 +232,10 @@ const std::string& http_parser::status() const {
   return p->info.status;
 }
 
+std::string http_parser::method() const {
+  return ::http_method_str(static_cast<::http_method>(p->parser.method));
+}
+
 const http_parser::url_t& http_parser::url() const {
   return p->info.url;
 }
@@ -228,4 +244,13 @@ const std::map<std::string, std::string>& http_parser::headers() const {
   return p->info.headers;
 }
 
+const std::string* http_parser::header(const std::string& name) const {
+  for(auto i = p->info.headers.begin(); i != p->info.headers.end(); ++i) {
+    if(boost::iequals(i->first, name)) {
+      return &i->second;
+    }
+  }
+  return nullptr;
+}
+
 }
@@ -16,6 +16,8 @@ public:
   virtual bool handle_headers_complete(const http_parser* parser) = 0;
   // true to continue
   virtual bool handle_body(const http_parser* parser, const char* data, std::size_t size) = 0;
+  // called when the body of a chunk is over, true to continue
+  virtual bool handle_chunk_complete(const http_parser* parser) = 0;
 };
 
 class http_parser
@@ -25,6 +27,8 @@ public:
   std::size_t notify(const char* data, std::size_t size); // returns number of bytes consumed
   bool headers_complete() const;
   bool body_complete() const;
+  // connection switches protocol after the head (upgrade or 101 response), parser stops there
+  bool upgrade() const;
   bool failed(); // true if in error state
   std::string error();  // get error string, empty if no error
 
@@ -32,6 +36,8 @@ public:
 
   std::size_t code() const;
   const std::string& status() const;
+  // of a request, e.g. "POST"
+  std::string method() const;
 
   struct url_t {
     std::string full;
@@ -45,6 +51,8 @@ public:
 
   const url_t& url() const;
   const std::map<std::string, std::string>& headers() const;
+  // case-insensitive header lookup, nullptr if missing
+  const std::string* header(const std::string& name) const;
 
 private:
   struct private_t;
@@ -1,8 +1,14 @@
+#include <algorithm>
+#include <deque>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/asio/placeholders.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/asio/buffers_iterator.hpp>
 #include "http_to_tap_loop.hpp"
+#include "tunnel_protocol.hpp"
+#include "websocket.hpp"
 #include "logging.hpp"
 
 namespace asio = boost::asio;
@@ -10,51 +16,131 @@ namespace asio = boost::asio;
 namespace sp
 {
 
+namespace {
+// tap frames are read into a buffer of that size by the other end, plus the channel prefix
+static const std::size_t max_websocket_payload = 65536 + 1;
+// a chunk carries one frame or one batch, the latter fits a length prefix
+static const std::size_t max_chunk_size = max_websocket_payload;
+static const unsigned char zero_mask[4] = {};
+}
+
 /*\
  *  class http_to_tap_loop::private_t
 \*/
-class http_to_tap_loop::private_t: public http_parser_handler {
+class http_to_tap_loop::private_t: public http_parser_handler, public boost::enable_shared_from_this<private_t> {
 public:
-  private_t(boost::shared_ptr<socket>, asio::posix::stream_descriptor& tap, headers_complete_handler hch, loop_stop_handler lsh);
-  void start();
+  private_t(boost::shared_ptr<socket>, tap_set& taps, timing_wheel& wheel, std::chrono::milliseconds idle_timeout, headers_complete_handler hch, control_handler ch, loop_stop_handler lsh, protocol::framing_t framing);
+  void start(const std::string& received);
+  void disable_idle_timeout();
+  uint64_t received() const;
+  void set_received(uint64_t received);
+  void acknowledge(ack_handler handler);
+  void answer_websocket(websocket_control_handler handler);
+  void open_sealed(boost::shared_ptr<batch_cipher> cipher);
+  void decompress(boost::shared_ptr<batch_compressor> compressor);
+  void decompress_headers(boost::shared_ptr<header_compressor> headers);
 
 private:
   void async_read_http();
   void handle_read_http(const boost::system::error_code& ec, std::size_t tr);
+  void process();
+  bool parse_length_prefixed();
+  bool parse_websocket();
+  bool push_frame();
+  void deliver(std::vector<char>&& frame);
 
   void async_write_tap();
   void handle_write_tap(const boost::system::error_code& ec, std::size_t tr);
 
+  void restart_idle_timer();
+  void handle_idle_timeout();
+
   // http_parser_handler interface
   virtual bool handle_headers_complete(const http_parser* parser);
   virtual bool handle_body(const http_parser* parser, const char* data, std::size_t size);
+  virtual bool handle_chunk_complete(const http_parser* parser);
 
-  asio::posix::stream_descriptor& tap_;
+  tap_set& taps_;
   boost::shared_ptr<socket> socket_;
+  timing_wheel& wheel_;
+  std::chrono::milliseconds idle_timeout_;
   headers_complete_handler headers_complete_;
+  control_handler control_;
   loop_stop_handler loop_stop_;
+  ack_handler ack_;
+  websocket_control_handler websocket_control_;
+  boost::shared_ptr<batch_cipher> open_; // only sealed
+  boost::shared_ptr<batch_compressor> inflate_; // only compressed
+  boost::shared_ptr<header_compressor> headers_; // only with compressed headers
+  const protocol::framing_t initial_framing_;
+  protocol::framing_t framing_;  // chunked switches to websocket once the head upgrades the connection
+
+  timing_wheel::timer_id idle_timer_;
 
   http_parser parser_;
 
-  asio::streambuf http_buf_;  // http -> http_buf_ -> parser_ -> tap
-  std::vector<asio::const_buffer> send_buffers_;
-  // for now we just transfer received body data as is
-//  asio::streambuf tap_buf_;
+  asio::streambuf http_buf_;  // http -> http_buf_ -> parser_ -> frame_ -> frames_ -> tap
+  std::vector<char> frame_;   // body of the current chunk (or length prefixed frame), one carries one frame
+  std::deque<tap_set::frame_t> frames_;
+  uint64_t received_;
 };
 
-http_to_tap_loop::private_t::private_t(boost::shared_ptr<socket> socket, asio::posix::stream_descriptor& tap, headers_complete_handler hch, loop_stop_handler lsh)
-  : socket_(socket), tap_(tap), headers_complete_(hch), loop_stop_(lsh)
+http_to_tap_loop::private_t::private_t(boost::shared_ptr<socket> socket, tap_set& taps, timing_wheel& wheel, std::chrono::milliseconds idle_timeout, headers_complete_handler hch, control_handler ch, loop_stop_handler lsh, protocol::framing_t framing)
+  : socket_(socket), taps_(taps), wheel_(wheel), idle_timeout_(idle_timeout)
+  , headers_complete_(hch), control_(ch), loop_stop_(lsh), initial_framing_(framing), framing_(framing)
+  , idle_timer_(timing_wheel::no_timer)
   , parser_(this)
+  , received_(0)
 {}
 
-void http_to_tap_loop::private_t::start() {
+void http_to_tap_loop::private_t::start(const std::string& received) {
+  restart_idle_timer();
   parser_.reset();
-  send_buffers_.clear();
+  framing_ = initial_framing_;
+  frame_.clear();
+  frames_.clear();
   // 'clear' buffer input
   http_buf_.consume(http_buf_.size());
-//  tap_buf_.consume(tap_buf_.size());
 
-  async_read_http();
+  if(received.empty()) {
+    async_read_http();
+    return;
+  }
+  http_buf_.commit(asio::buffer_copy(http_buf_.prepare(received.size()), asio::buffer(received)));
+  process();
+}
+
+void http_to_tap_loop::private_t::disable_idle_timeout() {
+  idle_timeout_ = std::chrono::milliseconds(0);
+  wheel_.cancel(idle_timer_);
+}
+
+uint64_t http_to_tap_loop::private_t::received() const {
+  return received_;
+}
+
+void http_to_tap_loop::private_t::set_received(uint64_t received) {
+  received_ = received;
+}
+
+void http_to_tap_loop::private_t::acknowledge(ack_handler handler) {
+  ack_ = handler;
+}
+
+void http_to_tap_loop::private_t::answer_websocket(websocket_control_handler handler) {
+  websocket_control_ = handler;
+}
+
+void http_to_tap_loop::private_t::open_sealed(boost::shared_ptr<batch_cipher> cipher) {
+  open_ = cipher;
+}
+
+void http_to_tap_loop::private_t::decompress(boost::shared_ptr<batch_compressor> compressor) {
+  inflate_ = compressor;
+}
+
+void http_to_tap_loop::private_t::decompress_headers(boost::shared_ptr<header_compressor> headers) {
+  headers_ = headers;
 }
 
 void http_to_tap_loop::private_t::async_read_http() {
@@ -62,7 +148,7 @@ void http_to_tap_loop::private_t::async_read_http() {
     http_buf_.prepare(512),
     boost::bind(
       &private_t::handle_read_http,
-        this,
+        shared_from_this(),
         asio::placeholders::error,
         asio::placeholders::bytes_transferred
     )
@@ -73,11 +159,13 @@ void http_to_tap_loop::private_t::handle_read_http(const boost::system::error_co
   static const char func[] = "http_to_tap_loop::handle_read_http";
   if(asio::error::operation_aborted == ec) {
     LOG_TRACE << func << ": operation aborted";
+    wheel_.cancel(idle_timer_);
     return;
   }
 
   // @TODO: handle close errors differently?
   if(ec) {
+    wheel_.cancel(idle_timer_);
     LOG_WARNING << bf("%s: failed to read from socket: %s")
       % func % ec.message();
     loop_stop_(loop_stop_reason::socket_read_error);
@@ -85,34 +173,64 @@ void http_to_tap_loop::private_t::handle_read_http(const boost::system::error_co
   }
 
   // actually some data!
+  restart_idle_timer();
   http_buf_.commit(tr);
+  LOG_TRACE << bf("%s: received request data (%d bytes)") % func % tr;
+  process();
+}
+
+void http_to_tap_loop::private_t::process() {
+  static const char func[] = "http_to_tap_loop::process";
+  if(protocol::chunked != framing_) {
+    if(protocol::length_prefixed == framing_ ? !parse_length_prefixed() : !parse_websocket()) {
+      return;
+    }
+    if(!frames_.empty()) {
+      async_write_tap();
+    }
+    else {
+      async_read_http();
+    }
+    return;
+  }
+
   auto data = asio::buffer_cast<const char*>(http_buf_.data());
   auto size = http_buf_.size();
-  LOG_TRACE << bf("%s: received request data (%d bytes):\n%s")
-    % func % tr % std::string(data, size);
   auto consumed = parser_.notify(data, size);
-  LOG_DEBUG << bf("%s: parser consumed %d/%d data") % func % consumed % size;
+  LOG_TRACE << bf("%s: parser consumed %d/%d data") % func % consumed % size;
   if(parser_.failed()) {
+    wheel_.cancel(idle_timer_);
     LOG_ERROR << bf("%s: request parsing error, resetting connection: %s") % func % parser_.error();
     loop_stop_(loop_stop_reason::request_prasing_error);
     return;
   }
+  if(parser_.upgrade()) {
+    // the head has been answered by (or is being answered with) 101, websocket frames follow it
+    LOG_DEBUG << bf("%s: switching to websocket framing") % func;
+    http_buf_.consume(consumed);
+    // an upgraded request makes us the server, the client masks every frame it sends
+    framing_ = parser_.code() ? protocol::websocket : protocol::websocket_masked;
+    process();
+    return;
+  }
+  // body data is copied to frames
+  http_buf_.consume(http_buf_.size());
 
-  if(!send_buffers_.empty()) {
+  if(!frames_.empty()) {
     async_write_tap();
   }
   else {
-    http_buf_.consume(http_buf_.size());
     async_read_http();
   }
 }
 
 void http_to_tap_loop::private_t::async_write_tap() {
-  tap_.async_write_some(
-    send_buffers_,
+  // every write to tap is exactly one frame
+  taps_[frames_.front().channel].async_write_some(
+    frames_.front().buffer(),
     boost::bind(
       &private_t::handle_write_tap,
-        this,
+        shared_from_this(),
         asio::placeholders::error,
         asio::placeholders::bytes_transferred
     )
@@ -122,19 +240,54 @@ void http_to_tap_loop::private_t::async_write_tap() {
 void http_to_tap_loop::private_t::handle_write_tap(const boost::system::error_code& ec, std::size_t tr) {
   static const char func[] = "http_to_tap_loop::handle_write_tap";
   if(asio::error::operation_aborted == ec) {
+    wheel_.cancel(idle_timer_);
     return;
   }
 
-  if(ec) {
+  if(boost::system::errc::io_error == ec) {
+    // interface is down, not a reason to drop the connection
+    LOG_DEBUG << bf("%s: tap is not up, frame dropped") % func;
+  }
+  else if(ec) {
+    wheel_.cancel(idle_timer_);
     LOG_WARNING << bf("%s: failed to write to tap: %s")
       % func % ec.message();
     loop_stop_(loop_stop_reason::tap_write_error);
     return;
   }
+  else if(tr != frames_.front().size()) {
+    LOG_WARNING << bf("%s: frame truncated by tap, %d/%d bytes written")
+      % func % tr % frames_.front().size();
+  }
 
-  send_buffers_.clear();
-  http_buf_.consume(http_buf_.size());
-  async_read_http();
+  frames_.pop_front();
+  if(!frames_.empty()) {
+    async_write_tap();
+  }
+  else {
+    async_read_http();
+  }
+}
+
+void http_to_tap_loop::private_t::restart_idle_timer() {
+  if(!idle_timeout_.count()) {
+    return;
+  }
+  wheel_.reschedule(
+    idle_timer_,
+    idle_timeout_,
+    boost::bind(
+      &private_t::handle_idle_timeout,
+        shared_from_this()
+    )
+  );
+}
+
+void http_to_tap_loop::private_t::handle_idle_timeout() {
+  static const char func[] = "http_to_tap_loop::handle_idle_timeout";
+  idle_timer_ = timing_wheel::no_timer;
+  LOG_ERROR << bf("%s: nothing received for %d ms") % func % idle_timeout_.count();
+  loop_stop_(loop_stop_reason::socket_idle_timeout);
 }
 
 bool http_to_tap_loop::private_t::handle_headers_complete(const http_parser* parser) {
@@ -143,22 +296,251 @@ bool http_to_tap_loop::private_t::handle_headers_complete(const http_parser* par
 
 bool http_to_tap_loop::private_t::handle_body(const http_parser* parser, const char* data, std::size_t size) {
   static const char func[] = "http_to_tap_loop::handle_body";
-  LOG_TRACE << bf("%s: body part (%d bytes):\n%s")
-    % func % size % std::string(data, size);
+  LOG_TRACE << bf("%s: body part (%d bytes)") % func % size;
+
+  // something else is talking, the parser fails and the connection is reset
+  if(frame_.size() + size > max_chunk_size) {
+    LOG_ERROR << bf("%s: chunk of more than %d bytes") % func % max_chunk_size;
+    return false;
+  }
+  frame_.insert(frame_.end(), data, data + size);
+  return true;
+}
 
-  send_buffers_.push_back(asio::const_buffer(data, size));
+bool http_to_tap_loop::private_t::handle_chunk_complete(const http_parser*) {
+  // last chunk is empty
+  if(frame_.empty()) {
+    return true;
+  }
+  return push_frame();
+}
+
+// complete frames are taken from the buffer, a partial one waits for more data.
+// false if the connection is to be dropped
+bool http_to_tap_loop::private_t::parse_length_prefixed() {
+  auto data = asio::buffer_cast<const unsigned char*>(http_buf_.data());
+  auto size = http_buf_.size();
+  std::size_t offset = 0;
+  while(size - offset >= protocol::length_prefix_size) {
+    std::size_t length = (std::size_t(data[offset]) << 8) | data[offset + 1];
+    if(size - offset - protocol::length_prefix_size < length) {
+      break;
+    }
+    offset += protocol::length_prefix_size;
+    // empty ones are padding
+    if(length) {
+      frame_.assign(data + offset, data + offset + length);
+      if(!push_frame()) {
+        wheel_.cancel(idle_timer_);
+        loop_stop_(loop_stop_reason::request_prasing_error);
+        return false;
+      }
+    }
+    offset += length;
+  }
+  http_buf_.consume(offset);
+  return true;
+}
+
+// same for websocket frames, masked by the client. false if the connection is to be dropped
+bool http_to_tap_loop::private_t::parse_websocket() {
+  static const char func[] = "http_to_tap_loop::parse_websocket";
+  auto data = asio::buffer_cast<const unsigned char*>(http_buf_.data());
+  auto size = http_buf_.size();
+  std::size_t offset = 0;
+  while(size - offset >= 2) {
+    auto header = data + offset;
+    bool fin = header[0] & 0x80;
+    auto opcode = header[0] & 0x0f;
+    bool masked = header[1] & 0x80;
+    // rfc 6455 section 5.1, the server closes the connection on an unmasked frame
+    if(protocol::websocket_masked == framing_ && !masked) {
+      wheel_.cancel(idle_timer_);
+      LOG_ERROR << bf("%s: unmasked websocket frame from the client, resetting connection") % func;
+      loop_stop_(loop_stop_reason::request_prasing_error);
+      return false;
+    }
+    std::size_t header_size = 2 + (masked ? 4 : 0);
+    uint64_t length = header[1] & 0x7f;
+    if(126 == length) {
+      header_size += 2;
+    }
+    else if(127 == length) {
+      header_size += 8;
+    }
+    if(size - offset < header_size) {
+      break;
+    }
+    if(126 == length) {
+      length = (uint64_t(header[2]) << 8) | header[3];
+    }
+    else if(127 == length) {
+      length = 0;
+      for(int i = 2; i < 10; ++i) {
+        length = (length << 8) | header[i];
+      }
+    }
+    // a frame is never larger than that, something else is talking
+    if(length > max_websocket_payload) {
+      wheel_.cancel(idle_timer_);
+      LOG_ERROR << bf("%s: websocket frame of %d bytes, resetting connection") % func % length;
+      loop_stop_(loop_stop_reason::request_prasing_error);
+      return false;
+    }
+    if(size - offset - header_size < length) {
+      break;
+    }
+    auto payload = reinterpret_cast<const char*>(header + header_size);
+    offset += header_size + length;
+
+    switch(opcode) {
+    case websocket::binary:
+    case websocket::text:
+      frame_.clear();
+      // fall through
+    case websocket::continuation: {
+      // unmasked while copied out of the buffer
+      auto begin = frame_.size();
+      if(begin + length > max_websocket_payload) {
+        wheel_.cancel(idle_timer_);
+        LOG_ERROR << bf("%s: fragmented websocket message of more than %d bytes, resetting connection")
+          % func % max_websocket_payload;
+        loop_stop_(loop_stop_reason::request_prasing_error);
+        return false;
+      }
+      frame_.resize(begin + length);
+      if(masked) {
+        websocket::copy_masked(frame_.data() + begin, payload, length, header + header_size - 4);
+      }
+      else {
+        std::copy(payload, payload + length, frame_.begin() + begin);
+      }
+      break;
+    }
+    case websocket::close: {
+      wheel_.cancel(idle_timer_);
+      LOG_INFO << bf("%s: websocket closed by peer") % func;
+      // rfc 6455 section 5.5.1, the close is echoed with its status code before the connection goes
+      std::vector<char> status(std::min<uint64_t>(length, 2));
+      websocket::copy_masked(status.data(), payload, status.size(), masked ? header + header_size - 4 : zero_mask);
+      if(!websocket_control_ || !websocket_control_(websocket::close, status)) {
+        loop_stop_(loop_stop_reason::socket_read_error);
+      }
+      return false;
+    }
+    case websocket::ping: {
+      // rfc 6455 section 5.5.2, answered by a pong with the same payload
+      std::vector<char> data(length);
+      websocket::copy_masked(data.data(), payload, length, masked ? header + header_size - 4 : zero_mask);
+      if(!websocket_control_ || !websocket_control_(websocket::ping, data)) {
+        LOG_DEBUG << bf("%s: websocket ping not answered") % func;
+      }
+      continue;
+    }
+    default:
+      // pongs answer nobody, the tunnel has its own pings
+      LOG_DEBUG << bf("%s: websocket control frame %d ignored") % func % opcode;
+      continue;
+    }
+    if(fin && !frame_.empty() && !push_frame()) {
+      wheel_.cancel(idle_timer_);
+      loop_stop_(loop_stop_reason::request_prasing_error);
+      return false;
+    }
+  }
+  http_buf_.consume(offset);
+  return true;
+}
+
+// false if a sealed batch doesn't open, a compressed one doesn't inflate or headers don't fit their contexts
+bool http_to_tap_loop::private_t::push_frame() {
+  static const char func[] = "http_to_tap_loop::push_frame";
+  if(!open_ && !inflate_ && !headers_) {
+    deliver(std::move(frame_));
+    frame_.clear();
+    return true;
+  }
+  std::vector<std::vector<char> > frames;
+  if(open_ && !open_->open(frame_)) {
+    LOG_ERROR << bf("%s: sealed batch of %d bytes does not open, resetting connection") % func % frame_.size();
+    return false;
+  }
+  if(inflate_ ? !inflate_->decompress(frame_.data(), frame_.size(), frames) : !batch_cipher::split(frame_, frames)) {
+    LOG_ERROR << bf("%s: batch of %d bytes is corrupt, resetting connection") % func % frame_.size();
+    return false;
+  }
+  for(auto i = frames.begin(); i != frames.end(); ++i) {
+    if(!headers_) {
+      deliver(std::move(*i));
+      continue;
+    }
+    std::vector<char> frame;
+    if(!headers_->decompress(i->data(), i->size(), frame)) {
+      LOG_ERROR << bf("%s: frame of %d bytes does not fit its header context, resetting connection") % func % i->size();
+      return false;
+    }
+    deliver(std::move(frame));
+  }
+  frame_.clear();
   return true;
 }
 
+void http_to_tap_loop::private_t::deliver(std::vector<char>&& frame) {
+  if(frame.size() <= protocol::max_control_size) {
+    control_(frame);
+    return;
+  }
+  // counted even if dropped, the peer numbers all it sends
+  tap_set::frame_t f;
+  if(taps_.demux(std::move(frame), f)) {
+    frames_.push_back(std::move(f));
+  }
+  if(0 == ++received_ % protocol::ack_frames && ack_) {
+    ack_(received_);
+  }
+}
+
 /*\
  *  class http_to_tap_loop
 \*/
-http_to_tap_loop::http_to_tap_loop(boost::shared_ptr<socket> socket, asio::posix::stream_descriptor& tap, headers_complete_handler hch, loop_stop_handler lsh)
-  : p(new private_t(socket, tap, hch, lsh))
+http_to_tap_loop::http_to_tap_loop(boost::shared_ptr<socket> socket, tap_set& taps, timing_wheel& wheel, std::chrono::milliseconds idle_timeout, headers_complete_handler hch, control_handler ch, loop_stop_handler lsh, protocol::framing_t framing)
+  : p(boost::make_shared<private_t>(socket, taps, wheel, idle_timeout, hch, ch, lsh, framing))
 {}
 
-void http_to_tap_loop::start() {
-  p->start();
+void http_to_tap_loop::start(const std::string& received) {
+  p->start(received);
+}
+
+void http_to_tap_loop::disable_idle_timeout() {
+  p->disable_idle_timeout();
+}
+
+uint64_t http_to_tap_loop::received() const {
+  return p->received();
+}
+
+void http_to_tap_loop::set_received(uint64_t received) {
+  p->set_received(received);
+}
+
+void http_to_tap_loop::acknowledge(ack_handler handler) {
+  p->acknowledge(handler);
+}
+
+void http_to_tap_loop::answer_websocket(websocket_control_handler handler) {
+  p->answer_websocket(handler);
+}
+
+void http_to_tap_loop::open_sealed(boost::shared_ptr<batch_cipher> cipher) {
+  p->open_sealed(cipher);
+}
+
+void http_to_tap_loop::decompress(boost::shared_ptr<batch_compressor> compressor) {
+  p->decompress(compressor);
+}
+
+void http_to_tap_loop::decompress_headers(boost::shared_ptr<header_compressor> headers) {
+  p->decompress_headers(headers);
 }
 
 }
@@ -1,23 +1,71 @@
 #ifndef HTTP_TO_TAP_LOOP_HPP
 #define HTTP_TO_TAP_LOOP_HPP
 
-#include <boost/asio/posix/stream_descriptor.hpp>
+#include <vector>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include "socket.hpp"
+#include "tap_set.hpp"
+#include "batch_cipher.hpp"
+#include "batch_compressor.hpp"
+#include "header_compressor.hpp"
 #include "loop_stop.hpp"
 #include "http_parser.hpp"
+#include "timing_wheel.hpp"
+#include "tunnel_protocol.hpp"
+#include "websocket.hpp"
 
 namespace sp
 {
 
 typedef boost::function<bool(const http_parser*)> headers_complete_handler;
+// called with body of a control chunk, see protocol::max_control_size
+typedef boost::function<void(const std::vector<char>&)> control_handler;
+// called with the number of frames received so far
+typedef boost::function<void(uint64_t)> ack_handler;
+// called with a websocket ping or close of the peer and its payload, false if it can't be answered
+typedef boost::function<bool(websocket::opcode_t, const std::vector<char>&)> websocket_control_handler;
 
 class http_to_tap_loop
 {
 public:
-  http_to_tap_loop(boost::shared_ptr<socket> socket, boost::asio::posix::stream_descriptor& tap, headers_complete_handler hch, loop_stop_handler lsh);
-  void start();
+  // loop stops with socket_idle_timeout if nothing is read for idle_timeout.
+  // control messages are passed to ch instead of tap, frames go to the tap of their channel.
+  // length_prefixed framing reads bare body, hch is not called
+  http_to_tap_loop(
+    boost::shared_ptr<socket> socket,
+    tap_set& taps,
+    timing_wheel& wheel,
+    std::chrono::milliseconds idle_timeout,
+    headers_complete_handler hch,
+    control_handler ch,
+    loop_stop_handler lsh,
+    protocol::framing_t framing = protocol::chunked
+  );
+  // received is what has already been read from the socket
+  void start(const std::string& received = std::string());
+  // peer is not going to send anything more on this connection, reading goes on to notice it closing
+  void disable_idle_timeout();
+  // frames (not control messages) received over the life of the loop, restarts don't reset it.
+  // set to where the peer numbers the frames it resumes with
+  uint64_t received() const;
+  void set_received(uint64_t received);
+  // handler is called every protocol::ack_frames frames, to acknowledge them to the peer
+  void acknowledge(ack_handler handler);
+  // handler answers websocket pings and closes of the peer. after a close that is answered
+  // nothing more is read, the connection is to be closed once the answer is written.
+  // without a handler, or if it can't answer, pings are ignored and a close stops the loop
+  // with socket_read_error
+  void answer_websocket(websocket_control_handler handler);
+  // body chunks are batches of frames sealed by the peer from now on, the first one that
+  // fails to open stops the loop with request_prasing_error
+  void open_sealed(boost::shared_ptr<batch_cipher> cipher);
+  // body chunks are batches of frames compressed by the peer from now on, opened first if sealed.
+  // the first one that fails to inflate stops the loop with request_prasing_error
+  void decompress(boost::shared_ptr<batch_compressor> compressor);
+  // body chunks are batches of frames with headers compressed by the peer from now on, rebuilt
+  // with the receiving end of the connection's contexts. null for frames as they are
+  void decompress_headers(boost::shared_ptr<header_compressor> headers);
 
 private:
   class private_t;
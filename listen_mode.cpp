@@ -1,3 +1,11 @@
+#include <map>
+#include <set>
+#include <deque>
+#include <fstream>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
 #include <boost/make_shared.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -5,14 +13,26 @@
 #include <boost/asio/streambuf.hpp>
 #include <boost/asio/buffers_iterator.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
 #include "listen_mode.hpp"
 #include "logging.hpp"
 #include "normal_socket.hpp"
 #include "secure_socket.hpp"
+#include "h2_connection.hpp"
 #include "http_parser.hpp"
 #include "loop_stop.hpp"
 #include "http_to_tap_loop.hpp"
 #include "tap_to_http_loop.hpp"
+#include "datagram_transport.hpp"
+#include "capabilities.hpp"
+#include "tap_set.hpp"
+#include "batch_cipher.hpp"
+#include "timing_wheel.hpp"
+#include "tunnel_protocol.hpp"
+#include "websocket.hpp"
+#include "tcp_stats.hpp"
 
 namespace asio = boost::asio;
 
@@ -21,6 +41,31 @@ namespace sp
 
 namespace {
 static const char CRLF[] = "\r\n";
+static const int fast_open_queue = 256; // pending fast open requests per acceptor
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const std::size_t h2_preface_size = sizeof(h2_preface) - 1;
+static const std::size_t max_seen_nonces = 65536; // seal nonces of clients, a request reusing one is a replay
+
+// the tunnel is all we serve
+bool tunnel_request(const std::string& method, const std::string& path) {
+  return ("POST" == method || "GET" == method) && protocol::tunnel_path == path;
+}
+
+// kernel accepts data in syn only if server side is enabled in net.ipv4.tcp_fastopen
+bool fast_open_server_enabled() {
+  std::ifstream f("/proc/sys/net/ipv4/tcp_fastopen");
+  int flags = 0;
+  return (f >> flags) && (flags & 0x2);
+}
+
+const std::string* find_header(const header_list& headers, const char* name) {
+  for(auto i = headers.begin(); i != headers.end(); ++i) {
+    if(boost::iequals(i->first, name)) {
+      return &i->second;
+    }
+  }
+  return nullptr;
+}
 }
 
 /*\
@@ -28,78 +73,174 @@ static const char CRLF[] = "\r\n";
 \*/
 class listen_mode::private_t {
 public:
-  private_t(boost::asio::io_service& ios, const settings& st, shared_descriptor tap);
+  private_t(boost::asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps);
   ~private_t();
   void setup();
 
 private:
-  void close_and_listen();
-  void async_accept();
-  void handle_accept(const boost::system::error_code& ec);
+  // acceptor bound with SO_REUSEPORT, accepting on a thread of its own.
+  // accepted connections are handed over to the io_service of the tunnel,
+  // tls ones once their handshake is complete
+  struct shard_t {
+    shard_t(): acceptor(ios), peer(ios) {}
+
+    asio::io_service ios;
+    socket::acceptor acceptor;
+    asio::ip::tcp::socket peer; // being accepted
+    socket::acceptor::endpoint_type remote_ep;
+  };
 
-  bool handle_headers_complete(const http_parser* parser);
+  // accepted connection, becomes a stripe of the tunnel once its request is served
+  // or stays in standby until the peer activates it in place of a failed stripe.
+  // an http/2 connection carries a connection of this kind for each of its streams
+  struct connection_t {
+    connection_t(): handshake_timer(timing_wheel::no_timer), stripe(0), served(false), standby(false)
+      , carrier(0), streams(0), framing(protocol::chunked), direction(protocol::both), resume(false) {}
 
-  void async_write_http_headers();
-  void handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr);
+    socket::acceptor::endpoint_type remote_ep;
+    boost::shared_ptr<socket> sock;
+    boost::shared_ptr<h2_connection> h2;    // http/2 connection
+    boost::shared_ptr<h2_stream> stream;    // stream of an http/2 connection, sock itself
+    std::string sniffed;                    // read before the protocol was known
+    boost::shared_ptr<http_to_tap_loop> htt_loop;
+    timing_wheel::timer_id handshake_timer;
+    std::size_t stripe;
+    bool served;
+    bool standby;
+    std::size_t carrier; // id of the http/2 connection of a stream
+    std::size_t streams; // of an http/2 connection
+    protocol::framing_t framing;  // of the frames we send
+    std::string websocket_accept; // answer to the key of an upgrade request
+    protocol::direction_t direction; // of the frames it carries, half of a split stripe if not both
+    capabilities caps;               // negotiated with the peer, the response tells it
+    bool resume;                     // stripe is resumable, frames are numbered
+    boost::shared_ptr<batch_cipher> seal; // of the frames we send, only sealed
+    std::string seal_nonce;               // ours, the response tells it
 
-  void handle_loop_stop(loop_stop_reason::code_t code);
+    asio::streambuf http_headers_buf;
+  };
+  typedef std::map<std::size_t, boost::shared_ptr<connection_t> > connections_t;
 
+  static void run_shard(asio::io_service& ios);
+  void async_accept(std::size_t shard);
+  void handle_accept(const boost::system::error_code& ec, std::size_t shard);
+  void adopt_connection(int fd, socket::acceptor::endpoint_type remote_ep, std::size_t shard);
+  void handle_adopt(const boost::system::error_code& ec, boost::shared_ptr<socket> sock, socket::acceptor::endpoint_type remote_ep, std::size_t shard);
+  void handle_handshake_timeout(std::size_t id);
+  void close_connection(std::size_t id);
+  void async_sniff(std::size_t id);
+  void handle_sniff(const boost::system::error_code& ec, std::size_t tr, boost::shared_ptr<std::vector<char> > buf, std::size_t id);
+
+  bool handle_headers_complete(const http_parser* parser, std::size_t id);
+  bool handle_request(std::size_t id, const std::string* session, const std::string* stripe, bool standby,
+    const std::string* caps, const std::string* resume, const std::string* seal, const std::string* seal_proof);
+  void handle_stream(boost::shared_ptr<h2_stream> stream, const header_list& headers, std::size_t carrier);
+  void handle_h2_close(const boost::system::error_code& ec, std::size_t id);
+  void handle_control(const std::vector<char>& message, std::size_t id);
+  void handle_write_pong(const boost::system::error_code& ec, std::size_t id);
+  bool answer_websocket(websocket::opcode_t opcode, const std::vector<char>& payload, std::size_t id);
+  // frame is kept until written
+  void handle_write_websocket(const boost::system::error_code& ec, boost::shared_ptr<std::string> frame, bool close, std::size_t id);
+  void send_ack(uint64_t received, std::size_t id);
+  void serve_stripe(std::size_t id);
+
+  void async_write_http_headers(std::size_t id);
+  void handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr, std::size_t id);
+
+  void handle_loop_stop(loop_stop_reason::code_t code, std::size_t id);
+
+  void schedule_stats();
+  void handle_stats_timer();
 
   boost::asio::io_service& ios_;
   const settings& st_;
-  asio::posix::stream_descriptor tap_;
+  tap_set taps_;
+  timing_wheel wheel_;
+  timing_wheel::timer_id stats_timer_;
+  boost::shared_ptr<tls_context> tls_; // only with tls
+  boost::shared_ptr<crypto_pool> crypto_; // only with tls and crypto threads
 
-  socket::acceptor acceptor_;
-  socket::acceptor::endpoint_type remote_ep_;
-  boost::shared_ptr<socket> socket_;
-  boost::shared_ptr<http_to_tap_loop> htt_loop_;
+  std::vector<boost::shared_ptr<shard_t> > shards_;
+  boost::thread_group shard_threads_;
+  connections_t connections_;
+  std::size_t next_connection_id_;
+  std::string session_;  // session of the served connections
+  std::map<std::size_t, uint64_t> received_; // frames of resumable stripes received by closed connections
+  capabilities supported_;
+  std::string seal_key_;  // pre-shared, only sealed
+  std::set<std::string> seen_nonces_;   // of requests taken, only sealed
+  std::deque<std::string> seen_order_;  // same, oldest first
+  boost::shared_ptr<batch_compressor> compressor_; // of all connections, only compressed
   boost::shared_ptr<tap_to_http_loop> tth_loop_;
-
-  asio::streambuf http_headers_buf_;
+  boost::shared_ptr<datagram_transport> datagrams_; // only with datagrams enabled
 };
 
-listen_mode::private_t::private_t(boost::asio::io_service& ios, const settings& st, shared_descriptor tap)
-  : ios_(ios), st_(st), tap_(ios_, tap->get())
-  , acceptor_(ios_)
+listen_mode::private_t::private_t(boost::asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps)
+  : ios_(ios), st_(st), taps_(ios_, taps)
+  , wheel_(ios_)
+  , stats_timer_(timing_wheel::no_timer)
+  , next_connection_id_(0)
 {
-  socket_ = boost::make_shared<normal_socket>(ios_); // @TODO: read tls option from settings
-  htt_loop_ = boost::make_shared<http_to_tap_loop>(
-    socket_,
-    tap_,
-    boost::bind(
-      &private_t::handle_headers_complete,
-        this,
-        _1
-    ),
-    boost::bind(
-      &private_t::handle_loop_stop,
-        this,
-        _1
-    )
-  );
-
+  if(st_.tls) {
+    tls_ = boost::make_shared<tls_context>(st_);
+    if(st_.crypto_threads) {
+      crypto_ = boost::make_shared<crypto_pool>(ios_, st_.crypto_threads);
+    }
+  }
+  for(std::size_t i = 0; i < st_.listen_shards; ++i) {
+    shards_.push_back(boost::make_shared<shard_t>());
+  }
   tth_loop_ = boost::make_shared<tap_to_http_loop>(
-    socket_,
-    tap_,
-    boost::bind(
-      &private_t::handle_loop_stop,
-        this,
-        _1
-    )
+    taps_,
+    wheel_,
+    st_.write_stall_timeout
   );
+  if(st_.datagram) {
+    datagrams_ = boost::make_shared<datagram_transport>(ios_, taps_, wheel_, true);
+    tth_loop_->divert(boost::bind(&datagram_transport::send, datagrams_, _1, _2));
+  }
+  supported_.set_version(capabilities::current_version);
+  supported_.set(protocol::cap_resume);
+  if(datagrams_) {
+    supported_.set(protocol::cap_datagram);
+  }
+  if(taps_.size() > 1) {
+    supported_.set(protocol::cap_channels, std::to_string(taps_.size()));
+  }
+  if(!st_.seal_key.empty()) {
+    seal_key_ = batch_cipher::load_key(st_.seal_key);
+    supported_.set(protocol::cap_seal, st_.seal_cipher);
+  }
+  if(st_.compress_level) {
+    compressor_ = boost::make_shared<batch_compressor>(st_.compress_level,
+      st_.compress_dictionary.empty() ? std::string() : batch_compressor::load_dictionary(st_.compress_dictionary));
+    supported_.set(protocol::cap_compress, compressor_->method());
+  }
+  if(st_.compress_headers) {
+    supported_.set(protocol::cap_headers);
+  }
 }
 
 listen_mode::private_t::~private_t() {
-  boost::system::error_code close_ec;
-  socket_->shutdown(close_ec);
-  if(close_ec) {
-    LOG_WARNING << bf("listen_mode dtor: error while shutting socket down after accept failure: %s")
-      % close_ec.message();
+  for(auto i = shards_.begin(); i != shards_.end(); ++i) {
+    (*i)->ios.stop();
+  }
+  shard_threads_.join_all();
+  wheel_.cancel(stats_timer_);
+  for(auto i = connections_.begin(); i != connections_.end(); ++i) {
+    boost::system::error_code close_ec;
+    i->second->sock->shutdown(close_ec);
+    if(close_ec) {
+      LOG_WARNING << bf("listen_mode dtor: error while shutting socket down: %s")
+        % close_ec.message();
+    }
   }
 }
 
 void listen_mode::private_t::setup() {
   static const char func[] = "listen_mode::setup";
+  typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+  typedef asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN> fast_open;
   // split host and port
   std::string host, port;
   auto colon = st_.address.find(':');
@@ -124,59 +265,97 @@ void listen_mode::private_t::setup() {
     ));
   }
   auto ep = i->endpoint();
-  LOG_DEBUG << bf("%s: resolved to '%s:%d'") % func % ep.address().to_string() % ep.port();
-  acceptor_.open(ep.protocol());
-  acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-  acceptor_.bind(ep, ec);
-  if(ec) {
-    throw exception(boost::str(bf("Failed to bind acceptor to endpont '%s:%s': %s")
-      % q.host_name() % q.service_name() % ec.message()
-    ));
+  LOG_DEBUG << bf("%s: resolved to '%s:%d', opening %d acceptor(s)")
+    % func % ep.address().to_string() % ep.port() % shards_.size();
+  if(st_.fast_open && !fast_open_server_enabled()) {
+    LOG_WARNING << bf("%s: server side tcp fast open is disabled by net.ipv4.tcp_fastopen sysctl, set bit 0x2 to enable")
+      % func;
   }
-  acceptor_.listen(1, ec); // @TODO: just one connection for now
-  if(ec) {
-    throw exception(boost::str(bf("Failed to start listening on endpoint '%s:%s': %s")
-      % q.host_name() % q.service_name() % ec.message()
-    ));
+  for(auto sh = shards_.begin(); sh != shards_.end(); ++sh) {
+    auto& acceptor = (*sh)->acceptor;
+    if(st_.mptcp) {
+      // accepted connections inherit the protocol of the listener
+      bool fallback = false;
+      int fd = open_mptcp_socket(ep.protocol().family(), &fallback);
+      if(-1 == fd) {
+        throw exception(boost::str(bf("Failed to open multipath tcp acceptor for '%s:%s': %s")
+          % q.host_name() % q.service_name() % strerror(errno)
+        ));
+      }
+      if(fallback && sh == shards_.begin()) {
+        LOG_WARNING << bf("%s: multipath tcp is not available, listening with plain tcp") % func;
+      }
+      acceptor.assign(ep.protocol(), fd);
+    }
+    else {
+      acceptor.open(ep.protocol());
+    }
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    if(shards_.size() > 1) {
+      // let the kernel spread incoming connections between the acceptors
+      acceptor.set_option(reuse_port(true), ec);
+      if(ec) {
+        throw exception(boost::str(bf("Failed to set SO_REUSEPORT on acceptor for '%s:%s': %s")
+          % q.host_name() % q.service_name() % ec.message()
+        ));
+      }
+    }
+    if(st_.fast_open) {
+      acceptor.set_option(fast_open(fast_open_queue), ec);
+      if(ec) {
+        LOG_WARNING << bf("%s: failed to enable tcp fast open on acceptor: %s") % func % ec.message();
+      }
+    }
+    acceptor.bind(ep, ec);
+    if(ec) {
+      throw exception(boost::str(bf("Failed to bind acceptor to endpont '%s:%s': %s")
+        % q.host_name() % q.service_name() % ec.message()
+      ));
+    }
+    acceptor.listen(asio::socket_base::max_connections, ec);
+    if(ec) {
+      throw exception(boost::str(bf("Failed to start listening on endpoint '%s:%s': %s")
+        % q.host_name() % q.service_name() % ec.message()
+      ));
+    }
   }
-  async_accept();
-}
-
-void listen_mode::private_t::close_and_listen() {
-  static const char func[] = "listen_mode::close_and_listen";
-  boost::system::error_code close_ec;
-  socket_->cancel(close_ec);
-  tap_.cancel(close_ec);
-  socket_->shutdown(close_ec);
-  if(close_ec) {
-    LOG_WARNING << bf("%s: error while shutting socket down after accept failure: %s")
-      % func % close_ec.message();
+  if(datagrams_) {
+    // same address and port as the tunnel, udp passes where the listen port is open
+    datagrams_->bind(asio::ip::udp::endpoint(ep.address(), ep.port()), ec);
+    if(ec) {
+      throw exception(boost::str(bf("Failed to bind datagram socket to endpoint '%s:%s': %s")
+        % q.host_name() % q.service_name() % ec.message()
+      ));
+    }
   }
-  socket_->close(close_ec);
-  if(close_ec) {
-    LOG_WARNING << bf("%s: error while closing socket after accept failure: %s")
-      % func % close_ec.message();
+  for(std::size_t shard = 0; shard < shards_.size(); ++shard) {
+    async_accept(shard);
+    shard_threads_.create_thread(boost::bind(&private_t::run_shard, boost::ref(shards_[shard]->ios)));
   }
-  acceptor_.cancel();
-  // 'clear' buffer input
-  http_headers_buf_.consume(http_headers_buf_.size());
-  async_accept();
-  return;
+  schedule_stats();
+}
+
+void listen_mode::private_t::run_shard(asio::io_service& ios) {
+  ios.run();
 }
 
-void listen_mode::private_t::async_accept() {
-  socket_->async_accept(
-    acceptor_,
-    remote_ep_,
+// runs on the thread of the shard
+void listen_mode::private_t::async_accept(std::size_t shard) {
+  auto& sh = *shards_[shard];
+  sh.acceptor.async_accept(
+    sh.peer,
+    sh.remote_ep,
     boost::bind(
       &private_t::handle_accept,
         this,
-        asio::placeholders::error
+        asio::placeholders::error,
+        shard
     )
   );
 }
 
-void listen_mode::private_t::handle_accept(const boost::system::error_code& ec) {
+// runs on the thread of the shard
+void listen_mode::private_t::handle_accept(const boost::system::error_code& ec, std::size_t shard) {
   static const char func[] = "listen_mode::handle_accept";
   if(ec == asio::error::operation_aborted) {
     return;
@@ -184,72 +363,801 @@ void listen_mode::private_t::handle_accept(const boost::system::error_code& ec)
 
   if(ec) {
     LOG_ERROR << bf("%s: accept opration failed, retrying: %s") % func % ec.message();
-    close_and_listen();
+    async_accept(shard);
+    return;
+  }
+
+  auto& sh = *shards_[shard];
+  // writes of the tunnel are coalesced already, nagle would only hold handshakes and pongs back
+  boost::system::error_code option_ec;
+  sh.peer.set_option(asio::ip::tcp::no_delay(true), option_ec);
+  if(option_ec) {
+    LOG_DEBUG << bf("%s: failed to disable nagle on connection from '%s:%d': %s")
+      % func % sh.remote_ep.address().to_string() % sh.remote_ep.port() % option_ec.message();
+  }
+  if(tls_) {
+    // tls handshakes are what a storm of reconnecting clients costs, they are carried out
+    // on the thread of the shard and established connections are handed over
+    auto sock = boost::make_shared<secure_socket>(ios_, *tls_, st_.tls_flush_delay, crypto_.get());
+    sock->async_accept_handshake(
+      std::move(sh.peer),
+      st_.handshake_timeout,
+      boost::bind(
+        &private_t::handle_adopt,
+          this,
+          asio::placeholders::error,
+          sock,
+          sh.remote_ep,
+          shard
+      )
+    );
+    async_accept(shard);
+    return;
+  }
+  boost::system::error_code release_ec;
+  int fd = sh.peer.release(release_ec);
+  if(release_ec) {
+    LOG_ERROR << bf("%s: failed to hand over connection accepted by shard %d: %s") % func % shard % release_ec.message();
+    sh.peer.close(release_ec);
+  }
+  else {
+    ios_.post(boost::bind(&private_t::adopt_connection, this, fd, sh.remote_ep, shard));
+  }
+  async_accept(shard);
+}
+
+void listen_mode::private_t::adopt_connection(int fd, socket::acceptor::endpoint_type remote_ep, std::size_t shard) {
+  static const char func[] = "listen_mode::adopt_connection";
+  asio::ip::tcp::socket accepted(ios_);
+  boost::system::error_code ec;
+  accepted.assign(remote_ep.protocol(), fd, ec);
+  if(ec) {
+    LOG_ERROR << bf("%s: failed to take over connection accepted by shard %d: %s") % func % shard % ec.message();
+    ::close(fd);
+    return;
+  }
+  auto sock = boost::make_shared<normal_socket>(ios_);
+  sock->async_accept(
+    std::move(accepted),
+    boost::bind(
+      &private_t::handle_adopt,
+        this,
+        asio::placeholders::error,
+        sock,
+        remote_ep,
+        shard
+    )
+  );
+}
+
+void listen_mode::private_t::handle_adopt(const boost::system::error_code& ec, boost::shared_ptr<socket> sock, socket::acceptor::endpoint_type remote_ep, std::size_t shard) {
+  static const char func[] = "listen_mode::handle_adopt";
+  if(ec) {
+    LOG_ERROR << bf("%s: failed to set up connection from '%s:%d': %s")
+      % func % remote_ep.address().to_string() % remote_ep.port() % ec.message();
+    boost::system::error_code close_ec;
+    sock->close(close_ec);
     return;
   }
 
-  LOG_INFO << bf("%s: accepted connection from '%s:%d', awaiting request..")
-    % func % remote_ep_.address().to_string() % remote_ep_.port();
+  auto id = next_connection_id_++;
+  auto conn = boost::make_shared<connection_t>();
+  conn->remote_ep = remote_ep;
+  conn->sock = sock;
+  conn->htt_loop = boost::make_shared<http_to_tap_loop>(
+    conn->sock,
+    taps_,
+    wheel_,
+    st_.idle_timeout,
+    boost::bind(
+      &private_t::handle_headers_complete,
+        this,
+        _1,
+        id
+    ),
+    boost::bind(
+      &private_t::handle_control,
+        this,
+        _1,
+        id
+    ),
+    boost::bind(
+      &private_t::handle_loop_stop,
+        this,
+        _1,
+        id
+    )
+  );
+  connections_[id] = conn;
+  LOG_INFO << bf("%s: shard %d accepted connection %d from '%s:%d', awaiting request..")
+    % func % shard % id % conn->remote_ep.address().to_string() % conn->remote_ep.port();
+
+  if(st_.handshake_timeout.count()) {
+    conn->handshake_timer = wheel_.schedule(
+      st_.handshake_timeout,
+      boost::bind(
+        &private_t::handle_handshake_timeout,
+          this,
+          id
+      )
+    );
+  }
+  async_sniff(id);
+}
+
+// http/1.1 request or http/2 connection preface, they differ from the second byte on
+void listen_mode::private_t::async_sniff(std::size_t id) {
+  auto buf = boost::make_shared<std::vector<char> >(h2_preface_size);
+  connections_[id]->sock->async_read_some(
+    asio::buffer(*buf),
+    boost::bind(
+      &private_t::handle_sniff,
+        this,
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred,
+        buf,
+        id
+    )
+  );
+}
+
+void listen_mode::private_t::handle_sniff(const boost::system::error_code& ec, std::size_t tr, boost::shared_ptr<std::vector<char> > buf, std::size_t id) {
+  static const char func[] = "listen_mode::handle_sniff";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  auto i = connections_.find(id);
+  if(connections_.end() == i) return;
+  auto& conn = *i->second;
+  if(ec) {
+    LOG_WARNING << bf("%s: failed to read request on connection %d: %s") % func % id % ec.message();
+    close_connection(id);
+    return;
+  }
+  conn.sniffed.append(buf->data(), tr);
+  auto size = std::min(conn.sniffed.size(), h2_preface_size);
+  bool h2 = 0 == conn.sniffed.compare(0, size, h2_preface, size);
+  if(h2 && size < h2_preface_size) {
+    async_sniff(id);
+    return;
+  }
+  std::string received;
+  received.swap(conn.sniffed);
+  if(!h2) {
+    conn.htt_loop->start(received);
+    return;
+  }
+  LOG_DEBUG << bf("%s: connection %d speaks http/2") % func % id;
+  conn.htt_loop.reset();
+  conn.h2 = boost::make_shared<h2_connection>(ios_, conn.sock, true, st_.http2_window);
+  conn.h2->start(
+    received,
+    boost::bind(
+      &private_t::handle_stream,
+        this,
+        _1,
+        _2,
+        id
+    ),
+    boost::bind(
+      &private_t::handle_h2_close,
+        this,
+        asio::placeholders::error,
+        id
+    )
+  );
+}
 
-  htt_loop_->start();
+void listen_mode::private_t::handle_handshake_timeout(std::size_t id) {
+  static const char func[] = "listen_mode::handle_handshake_timeout";
+  auto i = connections_.find(id);
+  if(connections_.end() == i) return;
+  auto& conn = *i->second;
+  conn.handshake_timer = timing_wheel::no_timer;
+  LOG_WARNING << bf("%s: no tunnel request on connection %d from '%s:%d' within %d ms, closing")
+    % func % id % conn.remote_ep.address().to_string() % conn.remote_ep.port()
+    % st_.handshake_timeout.count();
+  close_connection(id);
 }
 
-bool listen_mode::private_t::handle_headers_complete(const http_parser* parser) {
+void listen_mode::private_t::close_connection(std::size_t id) {
+  static const char func[] = "listen_mode::close_connection";
+  auto i = connections_.find(id);
+  if(connections_.end() == i) return;
+  auto conn = i->second;
+  connections_.erase(i);
+
+  wheel_.cancel(conn->handshake_timer);
+  if(conn->served) {
+    if(protocol::upload != conn->direction) {
+      tth_loop_->remove_stripe(conn->stripe);
+    }
+    if(conn->resume) {
+      received_[conn->stripe] = conn->htt_loop->received();
+    }
+    LOG_INFO << bf("%s: connection %d stats: %s") % func % id % conn->sock->stats();
+  }
+  if(conn->stream) {
+    auto carrier = connections_.find(conn->carrier);
+    if(connections_.end() != carrier) {
+      --carrier->second->streams;
+    }
+  }
+  if(conn->h2) {
+    // streams are closed first, they go down with the connection anyway
+    std::vector<std::size_t> streams;
+    for(auto c = connections_.begin(); c != connections_.end(); ++c) {
+      if(c->second->stream && id == c->second->carrier) {
+        streams.push_back(c->first);
+      }
+    }
+    for(auto c = streams.begin(); c != streams.end(); ++c) {
+      close_connection(*c);
+    }
+    LOG_INFO << bf("%s: connection %d stats: %s") % func % id % conn->h2->stats();
+    conn->h2->close();
+  }
+  boost::system::error_code close_ec;
+  conn->sock->cancel(close_ec);
+  conn->sock->shutdown(close_ec);
+  if(close_ec) {
+    LOG_WARNING << bf("%s: error while shutting socket down: %s")
+      % func % close_ec.message();
+  }
+  conn->sock->close(close_ec);
+  if(close_ec) {
+    LOG_WARNING << bf("%s: error while closing socket: %s")
+      % func % close_ec.message();
+  }
+  LOG_INFO << bf("%s: connection %d from '%s:%d' closed, %d connection(s) left")
+    % func % id % conn->remote_ep.address().to_string() % conn->remote_ep.port()
+    % connections_.size();
+}
+
+bool listen_mode::private_t::handle_headers_complete(const http_parser* parser, std::size_t id) {
   static const char func[] = "listen_mode::handle_headers_complete";
-  LOG_DEBUG << bf("%s: Headers complete. Url is '%s', headers are:") % func % parser->url().full;
+  LOG_DEBUG << bf("%s: Headers complete on connection %d. Url is '%s', headers are:")
+    % func % id % parser->url().full;
   for(auto i = parser->headers().begin(); i != parser->headers().end(); ++i) {
     LOG_DEBUG << bf("\t%s: %s") % i->first % i->second;
   }
-  async_write_http_headers();
+  if(!tunnel_request(parser->method(), parser->url().path)) {
+    LOG_ERROR << bf("%s: '%s %s' on connection %d is not a tunnel request, rejected")
+      % func % parser->method() % parser->url().path % id;
+    return false;
+  }
+  if(parser->upgrade()) {
+    // the parser stops at the head, only websocket may follow it
+    auto upgrade = parser->header("Upgrade");
+    auto key = parser->header("Sec-WebSocket-Key");
+    if(!upgrade || !boost::iequals(*upgrade, "websocket") || !key) {
+      LOG_ERROR << bf("%s: unsupported upgrade request on connection %d") % func % id;
+      return false;
+    }
+    auto& conn = *connections_[id];
+    conn.framing = protocol::websocket;
+    conn.websocket_accept = websocket::accept_key(*key);
+    conn.htt_loop->answer_websocket(boost::bind(
+      &private_t::answer_websocket,
+        this,
+        _1,
+        _2,
+        id
+    ));
+  }
+  auto direction = parser->header(protocol::direction_header);
+  if(direction) {
+    auto& conn = *connections_[id];
+    if(boost::iequals(*direction, protocol::direction_upload)) {
+      conn.direction = protocol::upload;
+    }
+    else if(boost::iequals(*direction, protocol::direction_download)) {
+      // nothing follows the request, frames go the other way
+      conn.direction = protocol::download;
+      conn.htt_loop->disable_idle_timeout();
+    }
+    else {
+      LOG_ERROR << bf("%s: bad %s header value '%s' on connection %d")
+        % func % protocol::direction_header % *direction % id;
+      return false;
+    }
+  }
+  return handle_request(
+    id,
+    parser->header(protocol::session_header),
+    parser->header(protocol::stripe_header),
+    nullptr != parser->header(protocol::standby_header),
+    parser->header(protocol::capabilities_header),
+    parser->header(protocol::resume_header),
+    parser->header(protocol::seal_header),
+    parser->header(protocol::seal_proof_header)
+  );
+}
+
+void listen_mode::private_t::handle_stream(boost::shared_ptr<h2_stream> stream, const header_list& headers, std::size_t carrier) {
+  static const char func[] = "listen_mode::handle_stream";
+  auto i = connections_.find(carrier);
+  if(connections_.end() == i) return;
+  auto& carrier_conn = *i->second;
+  wheel_.cancel(carrier_conn.handshake_timer);
+  ++carrier_conn.streams;
+
+  auto id = next_connection_id_++;
+  auto conn = boost::make_shared<connection_t>();
+  conn->remote_ep = carrier_conn.remote_ep;
+  conn->sock = stream;
+  conn->stream = stream;
+  conn->carrier = carrier;
+  conn->framing = protocol::length_prefixed;
+  conn->htt_loop = boost::make_shared<http_to_tap_loop>(
+    conn->sock,
+    taps_,
+    wheel_,
+    st_.idle_timeout,
+    headers_complete_handler(),
+    boost::bind(
+      &private_t::handle_control,
+        this,
+        _1,
+        id
+    ),
+    boost::bind(
+      &private_t::handle_loop_stop,
+        this,
+        _1,
+        id
+    ),
+    protocol::length_prefixed
+  );
+  connections_[id] = conn;
+  LOG_DEBUG << bf("%s: Stream %s of connection %d is connection %d, headers are:")
+    % func % stream->stats() % carrier % id;
+  for(auto h = headers.begin(); h != headers.end(); ++h) {
+    LOG_DEBUG << bf("\t%s: %s") % h->first % h->second;
+  }
+  auto method = find_header(headers, ":method");
+  auto path = find_header(headers, ":path");
+  if(!method || !path || !tunnel_request(*method, *path)) {
+    LOG_ERROR << bf("%s: stream of connection %d is not a tunnel request, rejected") % func % carrier;
+    close_connection(id);
+    return;
+  }
+  if(!handle_request(
+    id,
+    find_header(headers, protocol::session_header),
+    find_header(headers, protocol::stripe_header),
+    nullptr != find_header(headers, protocol::standby_header),
+    find_header(headers, protocol::capabilities_header),
+    find_header(headers, protocol::resume_header),
+    find_header(headers, protocol::seal_header),
+    find_header(headers, protocol::seal_proof_header)
+  )) {
+    close_connection(id);
+    return;
+  }
+  conn->htt_loop->start();
+}
+
+void listen_mode::private_t::handle_h2_close(const boost::system::error_code& ec, std::size_t id) {
+  static const char func[] = "listen_mode::handle_h2_close";
+  LOG_DEBUG << bf("%s: http/2 connection %d closed: %s") % func % id % ec.message();
+  close_connection(id);
+}
+
+bool listen_mode::private_t::handle_request(std::size_t id, const std::string* session_header, const std::string* stripe_header, bool standby,
+  const std::string* caps_header, const std::string* resume_header, const std::string* seal_header, const std::string* seal_proof_header) {
+  static const char func[] = "listen_mode::handle_request";
+  // requests without session headers are a single stripe of an anonymous session
+  std::string session;
+  std::size_t stripe = 0;
+  if(session_header) {
+    session = *session_header;
+  }
+  if(stripe_header) {
+    try {
+      stripe = std::stoul(*stripe_header);
+    }
+    catch(const std::exception&) {
+      LOG_ERROR << bf("%s: bad %s header value '%s' on connection %d")
+        % func % protocol::stripe_header % *stripe_header % id;
+      return false;
+    }
+  }
+  uint64_t peer_received = 0;
+  if(resume_header) {
+    try {
+      peer_received = std::stoull(*resume_header);
+    }
+    catch(const std::exception&) {
+      LOG_ERROR << bf("%s: bad %s header value '%s' on connection %d")
+        % func % protocol::resume_header % *resume_header % id;
+      return false;
+    }
+  }
+
+  auto& conn = *connections_[id];
+  // peers without the header get none
+  conn.caps = supported_.negotiate(capabilities::parse(caps_header ? *caps_header : std::string()));
+  LOG_DEBUG << bf("%s: capabilities of connection %d: '%s'") % func % id % conn.caps.to_string();
+  if(!seal_key_.empty()) {
+    // frames never go in the clear
+    if(!conn.caps.has(protocol::cap_seal) || !seal_header || seal_header->empty()) {
+      LOG_ERROR << bf("%s: connection %d does not seal frames with %s, rejected") % func % id % st_.seal_cipher;
+      return false;
+    }
+    // the nonce and session are in the clear, a request must prove the key before it is taken
+    if(!seal_proof_header || !batch_cipher::check_proof(seal_key_, *seal_header, session, *seal_proof_header)) {
+      LOG_ERROR << bf("%s: connection %d does not prove the seal key, rejected") % func % id;
+      return false;
+    }
+    if(!seen_nonces_.insert(*seal_header).second) {
+      LOG_ERROR << bf("%s: connection %d replays an earlier request, rejected") % func % id;
+      return false;
+    }
+    seen_order_.push_back(*seal_header);
+    if(seen_order_.size() > max_seen_nonces) {
+      seen_nonces_.erase(seen_order_.front());
+      seen_order_.pop_front();
+    }
+    conn.seal_nonce = batch_cipher::make_nonce();
+    conn.htt_loop->open_sealed(boost::make_shared<batch_cipher>(st_.seal_cipher, seal_key_, *seal_header, conn.seal_nonce, true));
+    conn.seal = boost::make_shared<batch_cipher>(st_.seal_cipher, seal_key_, *seal_header, conn.seal_nonce, false);
+  }
+  if(conn.caps.has(protocol::cap_compress)) {
+    conn.htt_loop->decompress(compressor_);
+  }
+  if(conn.caps.has(protocol::cap_headers)) {
+    conn.htt_loop->decompress_headers(boost::make_shared<header_compressor>());
+  }
+
+  // taps serve one peer at a time, so a new session supersedes the one being served:
+  // a peer reconnecting has abandoned its previous connections, even if we have not noticed yet.
+  // same goes for a stripe reconnecting within the session. only a peer that has proven
+  // the seal key or shown a client certificate may take over from another session, any
+  // other waits until the connections of the served one are gone
+  bool authenticated = !seal_key_.empty() || (tls_ && !st_.tls_ca.empty());
+  std::vector<std::size_t> superseded;
+  for(auto i = connections_.begin(); i != connections_.end(); ++i) {
+    auto& other = *i->second;
+    bool old_session = session != session_ && (other.served || other.standby || (other.h2 && other.streams));
+    bool same_stripe = !standby && other.served && stripe == other.stripe && conn.direction == other.direction;
+    bool own_carrier = conn.stream && i->first == conn.carrier;
+    if(i->first == id || own_carrier) {
+      continue;
+    }
+    if(old_session && !authenticated) {
+      LOG_WARNING << bf("%s: request on connection %d (session '%s') while session '%s' is served, rejected")
+        % func % id % session % session_;
+      return false;
+    }
+    if(old_session || same_stripe) {
+      superseded.push_back(i->first);
+    }
+  }
+  for(auto i = superseded.begin(); i != superseded.end(); ++i) {
+    LOG_INFO << bf("%s: request on connection %d (session '%s', stripe %d) supersedes connection %d")
+      % func % id % session % stripe % *i;
+    close_connection(*i);
+  }
+  if(session != session_) {
+    // a new peer numbers its frames from scratch
+    tth_loop_->forget_resumes();
+    received_.clear();
+  }
+  session_ = session;
+
+  conn.stripe = stripe;
+  conn.standby = standby;
+  if(conn.caps.has(protocol::cap_datagram) && !datagrams_->rekey(*conn.sock)) {
+    // no tls session to key them with
+    conn.caps.unset(protocol::cap_datagram);
+  }
+  taps_.multiplex(conn.caps.number(protocol::cap_channels));
+  if(conn.caps.has(protocol::cap_resume) && !standby) {
+    // frames the peer is missing go ahead of new ones once the stripe is served
+    conn.resume = true;
+    conn.htt_loop->set_received(received_[stripe]);
+    conn.htt_loop->acknowledge(boost::bind(
+      &private_t::send_ack,
+        this,
+        _1,
+        id
+    ));
+    tth_loop_->resume_stripe(stripe, peer_received);
+  }
+  async_write_http_headers(id);
   return true;
 }
 
-void listen_mode::private_t::async_write_http_headers() {
+void listen_mode::private_t::async_write_http_headers(std::size_t id) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  std::ostream str(&http_headers_buf_);
-  str << "HTTP/1.1 200 OK" << CRLF;
-  str << "Transfer-Encoding: chunked" << CRLF;
-  str << "Content-Type: application/octet-stream" << CRLF;
+  auto& conn = *connections_[id];
+  if(conn.stream) {
+    header_list response;
+    response.push_back(std::make_pair(":status", "200"));
+    response.push_back(std::make_pair("content-type", "application/octet-stream"));
+    if(conn.caps.version()) {
+      response.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::capabilities_header)), conn.caps.to_string()));
+    }
+    if(conn.resume) {
+      response.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::resume_header)), std::to_string(conn.htt_loop->received())));
+    }
+    if(conn.seal) {
+      response.push_back(std::make_pair(boost::algorithm::to_lower_copy(std::string(protocol::seal_header)), conn.seal_nonce));
+    }
+    conn.stream->respond(response);
+    ios_.post(boost::bind(
+      &private_t::handle_write_http_headers,
+        this,
+        boost::system::error_code(),
+        0,
+        id
+    ));
+    return;
+  }
+  std::ostream str(&conn.http_headers_buf);
+  if(protocol::websocket == conn.framing) {
+    str << "HTTP/1.1 101 Switching Protocols" << CRLF;
+    str << "Upgrade: websocket" << CRLF;
+    str << "Connection: Upgrade" << CRLF;
+    str << "Sec-WebSocket-Accept: " << conn.websocket_accept << CRLF;
+  }
+  else {
+    str << "HTTP/1.1 200 OK" << CRLF;
+    str << "Transfer-Encoding: chunked" << CRLF;
+    str << "Content-Type: application/octet-stream" << CRLF;
+  }
+  if(conn.caps.version()) {
+    str << protocol::capabilities_header << ": " << conn.caps.to_string() << CRLF;
+  }
+  if(conn.resume) {
+    str << protocol::resume_header << ": " << conn.htt_loop->received() << CRLF;
+  }
+  if(conn.seal) {
+    str << protocol::seal_header << ": " << conn.seal_nonce << CRLF;
+  }
   str << CRLF;
 
-  socket_->async_write_some(
-    http_headers_buf_.data(),
+  conn.sock->async_write_some(
+    conn.http_headers_buf.data(),
     boost::bind(
       &private_t::handle_write_http_headers,
         this,
         asio::placeholders::error,
-        asio::placeholders::bytes_transferred
+        asio::placeholders::bytes_transferred,
+        id
     )
   );
 }
 
-void listen_mode::private_t::handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr) {
+void listen_mode::private_t::handle_write_http_headers(const boost::system::error_code& ec, std::size_t tr, std::size_t id) {
   LOG_TRACE << __PRETTY_FUNCTION__;
   static const char func[] = "listen_mode::handle_write_http_headers";
   if(asio::error::operation_aborted == ec) {
     return;
   }
+  auto i = connections_.find(id);
+  if(connections_.end() == i) return;
   if(ec) {
-    LOG_WARNING << bf("%s: failed to write headers, setting reconnect timer: %s")
-      % func % ec.message();
-    close_and_listen();
+    LOG_WARNING << bf("%s: failed to write headers, closing connection %d: %s")
+      % func % id % ec.message();
+    close_connection(id);
+    return;
+  }
+
+  auto& conn = *i->second;
+  wheel_.cancel(conn.handshake_timer);
+  conn.http_headers_buf.consume(tr);
+  if(conn.standby) {
+    LOG_DEBUG << bf("%s: connection %d is in standby over %s") % func % id % conn.sock->stats();
     return;
   }
+  serve_stripe(id);
+}
+
+void listen_mode::private_t::serve_stripe(std::size_t id) {
+  static const char func[] = "listen_mode::serve_stripe";
+  auto& conn = *connections_[id];
+  conn.served = true;
+  LOG_INFO << bf("%s: connection %d serves stripe %d%s over %s") % func % id % conn.stripe
+    % (protocol::upload == conn.direction ? " upload" : protocol::download == conn.direction ? " download" : "")
+    % conn.sock->stats();
+  if(protocol::upload == conn.direction) {
+    // frames of the stripe are sent on its download half
+    return;
+  }
+  tth_loop_->add_stripe(
+    conn.stripe,
+    conn.sock,
+    boost::bind(
+      &private_t::handle_loop_stop,
+        this,
+        _1,
+        id
+    ),
+    true,
+    conn.framing,
+    conn.seal,
+    conn.caps.has(protocol::cap_compress) ? compressor_ : boost::shared_ptr<batch_compressor>(),
+    conn.caps.has(protocol::cap_headers) ? boost::make_shared<header_compressor>() : boost::shared_ptr<header_compressor>()
+  );
+}
+
+void listen_mode::private_t::handle_control(const std::vector<char>& message, std::size_t id) {
+  static const char func[] = "listen_mode::handle_control";
+  auto i = connections_.find(id);
+  if(connections_.end() == i) return;
+  auto& conn = *i->second;
+
+  switch(message.front()) {
+  case protocol::control_ping:
+    if(conn.served) {
+      tth_loop_->send_control(conn.stripe, std::vector<char>(1, protocol::control_pong));
+    }
+    else {
+      // nothing else writes to a standby connection
+      conn.sock->async_write_some(
+        protocol::length_prefixed == conn.framing
+          ? asio::buffer(protocol::pong_prefixed, sizeof(protocol::pong_prefixed) - 1)
+          : protocol::websocket == conn.framing
+            ? asio::buffer(protocol::pong_websocket, sizeof(protocol::pong_websocket) - 1)
+            : asio::buffer(protocol::pong_chunk, sizeof(protocol::pong_chunk) - 1),
+        boost::bind(
+          &private_t::handle_write_pong,
+            this,
+            asio::placeholders::error,
+            id
+        )
+      );
+    }
+    break;
+
+  case protocol::control_activate: {
+    std::size_t stripe = 0;
+    try {
+      stripe = std::stoul(std::string(message.begin() + 1, message.end()));
+    }
+    catch(const std::exception&) {
+      LOG_ERROR << bf("%s: bad stripe index in activation on connection %d") % func % id;
+      return;
+    }
+    if(!conn.standby) {
+      LOG_WARNING << bf("%s: connection %d is not in standby, activation ignored") % func % id;
+      return;
+    }
+    // the stripe we served may not have failed on our side yet
+    std::vector<std::size_t> superseded;
+    for(auto c = connections_.begin(); c != connections_.end(); ++c) {
+      if(c->second->served && stripe == c->second->stripe) {
+        superseded.push_back(c->first);
+      }
+    }
+    for(auto c = superseded.begin(); c != superseded.end(); ++c) {
+      close_connection(*c);
+    }
+    LOG_INFO << bf("%s: standby connection %d activated for stripe %d") % func % id % stripe;
+    conn.standby = false;
+    conn.stripe = stripe;
+    serve_stripe(id);
+    break;
+  }
 
-  http_headers_buf_.consume(tr);
-  tth_loop_->start();
+  case protocol::control_ack: {
+    uint64_t received = 0;
+    if(conn.served && conn.resume && protocol::parse_counter(message, received)) {
+      tth_loop_->acknowledge(conn.stripe, received);
+    }
+    break;
+  }
 
+  case protocol::control_sync: {
+    uint64_t first = 0;
+    if(conn.resume && protocol::parse_counter(message, first)) {
+      conn.htt_loop->set_received(first);
+    }
+    break;
+  }
+
+  default:
+    LOG_WARNING << bf("%s: unknown control message '%c' on connection %d") % func % message.front() % id;
+  }
 }
 
-void listen_mode::private_t::handle_loop_stop(loop_stop_reason::code_t code) {
-  close_and_listen();
+void listen_mode::private_t::send_ack(uint64_t received, std::size_t id) {
+  auto i = connections_.find(id);
+  if(connections_.end() == i || !i->second->served) return;
+  tth_loop_->send_control(i->second->stripe, protocol::counter_message(protocol::control_ack, received));
+}
+
+void listen_mode::private_t::handle_write_pong(const boost::system::error_code& ec, std::size_t id) {
+  static const char func[] = "listen_mode::handle_write_pong";
+  // failure of the connection itself is noticed by its read loop
+  if(ec && asio::error::operation_aborted != ec) {
+    LOG_DEBUG << bf("%s: failed to write pong to connection %d: %s") % func % id % ec.message();
+  }
+}
+
+// pings and closes of the websocket itself, echoed on the stripe writing to the connection
+bool listen_mode::private_t::answer_websocket(websocket::opcode_t opcode, const std::vector<char>& payload, std::size_t id) {
+  auto i = connections_.find(id);
+  if(connections_.end() == i) return false;
+  auto& conn = *i->second;
+  auto answer = websocket::ping == opcode ? websocket::pong : websocket::close;
+  if(conn.served && protocol::upload != conn.direction) {
+    return tth_loop_->send_websocket_control(conn.stripe, answer, payload);
+  }
+  // nothing else writes to a standby connection or an upload half but our pongs
+  auto frame = boost::make_shared<std::string>();
+  websocket::append_header(*frame, answer, payload.size());
+  frame->append(payload.begin(), payload.end());
+  conn.sock->async_write_some(
+    asio::buffer(frame->data(), frame->size()),
+    boost::bind(
+      &private_t::handle_write_websocket,
+        this,
+        asio::placeholders::error,
+        frame,
+        websocket::close == answer,
+        id
+    )
+  );
+  return true;
+}
+
+void listen_mode::private_t::handle_write_websocket(const boost::system::error_code& ec, boost::shared_ptr<std::string>, bool close, std::size_t id) {
+  static const char func[] = "listen_mode::handle_write_websocket";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  if(ec) {
+    LOG_DEBUG << bf("%s: failed to answer websocket on connection %d: %s") % func % id % ec.message();
+  }
+  if(close) {
+    close_connection(id);
+  }
+}
+
+void listen_mode::private_t::handle_loop_stop(loop_stop_reason::code_t code, std::size_t id) {
+  close_connection(id);
+}
+
+void listen_mode::private_t::schedule_stats() {
+  if(!st_.stats_interval.count()) return;
+  stats_timer_ = wheel_.schedule(
+    st_.stats_interval,
+    boost::bind(
+      &private_t::handle_stats_timer,
+        this
+    )
+  );
+}
+
+void listen_mode::private_t::handle_stats_timer() {
+  static const char func[] = "listen_mode::handle_stats_timer";
+  // stats of an http/2 stream include those of its connection
+  for(auto i = connections_.begin(); i != connections_.end(); ++i) {
+    if(i->second->served) {
+      LOG_INFO << bf("%s: connection %d, stripe %d: %s")
+        % func % i->first % i->second->stripe % i->second->sock->stats();
+    }
+  }
+  if(tls_) {
+    LOG_INFO << bf("%s: %s") % func % tls_->stats();
+  }
+  if(datagrams_) {
+    LOG_INFO << bf("%s: %s") % func % datagrams_->stats();
+  }
+  if(compressor_) {
+    LOG_INFO << bf("%s: %s") % func % compressor_->stats();
+  }
+  schedule_stats();
 }
 
 /*\
  *  class listen_mode
 \*/
-listen_mode::listen_mode(boost::asio::io_service& ios, const settings& st, shared_descriptor tap) {
-  p = boost::make_shared<private_t>(ios, st, tap);
+listen_mode::listen_mode(boost::asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps) {
+  p = boost::make_shared<private_t>(ios, st, taps);
 }
 
 void listen_mode::setup() {
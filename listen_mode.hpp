@@ -1,6 +1,7 @@
 #ifndef LISTEN_MODE_HPP
 #define LISTEN_MODE_HPP
 
+#include <vector>
 #include <boost/asio/io_service.hpp>
 #include <boost/shared_ptr.hpp>
 #include "settings.hpp"
@@ -15,7 +16,7 @@ class listen_mode
 public:
   typedef sp::exception<listen_mode> exception;
 
-  listen_mode(boost::asio::io_service& ios, const settings& st, shared_descriptor tap);
+  listen_mode(boost::asio::io_service& ios, const settings& st, const std::vector<shared_descriptor>& taps);
   void setup();   // throws exception
 
 private:
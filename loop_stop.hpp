@@ -12,6 +12,8 @@ enum code_t {
   request_prasing_error,
   tap_read_error,
   tap_write_error,
+  socket_idle_timeout,
+  socket_write_timeout,
 };
 }
 
@@ -1,6 +1,8 @@
 #include <iostream>
 #include "settings.hpp"
 #include "secret_passage_service.hpp"
+#include "tls_benchmark.hpp"
+#include "storm_benchmark.hpp"
 
 int main(int argc, char *argv[]) {
   sp::settings st;
@@ -17,6 +19,15 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  if(st.tls_benchmark) {
+    sp::tls_benchmark bench(st);
+    return bench.run();
+  }
+  if(st.storm_benchmark) {
+    sp::storm_benchmark bench(st);
+    return bench.run();
+  }
+
   sp::secret_passage_service svc(st);
   return svc.run();
 }
@@ -1,23 +1,63 @@
+#include <errno.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
 #include "normal_socket.hpp"
+#include "tcp_stats.hpp"
 #include "logging.hpp"
 
 namespace sp
 {
 
-normal_socket::normal_socket(boost::asio::io_service& ios)
-  : socket_(ios)
+normal_socket::normal_socket(boost::asio::io_service& ios, bool mptcp)
+  : ios_(ios)
+  , mptcp_(mptcp)
+  , socket_(ios)
 {}
 
 void normal_socket::async_connect(const acceptor::endpoint_type& peer_endpoint, connect_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
+  static const char func[] = "normal_socket::async_connect";
+  if(mptcp_ && !socket_.is_open()) {
+    bool fallback = false;
+    boost::system::error_code ec;
+    int fd = open_mptcp_socket(peer_endpoint.protocol().family(), &fallback);
+    if(-1 == fd) {
+      ec.assign(errno, boost::system::system_category());
+    }
+    else {
+      if(fallback) {
+        LOG_WARNING << bf("%s: multipath tcp is not available, using plain tcp") % func;
+      }
+      socket_.assign(peer_endpoint.protocol(), fd, ec);
+      if(ec) {
+        ::close(fd);
+      }
+    }
+    if(ec) {
+      ios_.post(boost::bind(handler, ec));
+      return;
+    }
+  }
   socket_.async_connect(peer_endpoint, handler);
 }
 
+void normal_socket::async_attach(boost::asio::ip::tcp::socket&& connected, connect_handler handler) {
+  LOG_TRACE << __PRETTY_FUNCTION__;
+  socket_ = std::move(connected);
+  ios_.post(boost::bind(handler, boost::system::error_code()));
+}
+
 void normal_socket::async_accept(acceptor& acc, acceptor::endpoint_type& remote_ep, accept_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
   acc.async_accept(socket_, remote_ep, handler);
 }
 
+void normal_socket::async_accept(boost::asio::ip::tcp::socket&& accepted, accept_handler handler) {
+  LOG_TRACE << __PRETTY_FUNCTION__;
+  socket_ = std::move(accepted);
+  ios_.post(boost::bind(handler, boost::system::error_code()));
+}
+
 void normal_socket::async_read_some(const boost::asio::mutable_buffers_1& buffers, read_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
   socket_.async_read_some(buffers, handler);
@@ -48,4 +88,13 @@ void normal_socket::close(boost::system::error_code& ec) {
   socket_.close(ec);
 }
 
+std::string normal_socket::stats() {
+  if(!socket_.is_open()) {
+    return "closed";
+  }
+  auto fd = socket_.native_handle();
+  auto mp = mptcp_stats(fd);
+  return mp.empty() ? "tcp: " + tcp_stats(fd) : mp;
+}
+
 }
@@ -1,6 +1,7 @@
 #ifndef NORMAL_SOCKET_HPP
 #define NORMAL_SOCKET_HPP
 
+#include <boost/asio/io_service.hpp>
 #include "socket.hpp"
 
 namespace sp
@@ -9,18 +10,25 @@ namespace sp
 class normal_socket: public socket
 {
 public:
-  normal_socket(boost::asio::io_service& ios);
+  // with mptcp set, connects over multipath tcp falling back to plain tcp
+  // if the kernel does not support it
+  normal_socket(boost::asio::io_service& ios, bool mptcp = false);
 
   virtual void async_connect(const acceptor::endpoint_type& peer_endpoint, connect_handler handler);
+  virtual void async_attach(boost::asio::ip::tcp::socket&& connected, connect_handler handler);
   virtual void async_accept(acceptor& acc, acceptor::endpoint_type& remote_ep, accept_handler handler);
+  virtual void async_accept(boost::asio::ip::tcp::socket&& accepted, accept_handler handler);
   virtual void async_read_some(const boost::asio::mutable_buffers_1& buffers, read_handler handler);
   virtual void async_write_some(const boost::asio::const_buffers_1& buffers, write_handler handler);
   virtual void async_write_some(const std::vector<boost::asio::const_buffer>& buffers, write_handler handler);
   virtual void cancel(boost::system::error_code& ec);
   virtual void shutdown(boost::system::error_code& ec);
   virtual void close(boost::system::error_code& ec);
+  virtual std::string stats();
 
 private:
+  boost::asio::io_service& ios_;
+  bool mptcp_;
   boost::asio::ip::tcp::socket socket_;
 };
 
@@ -0,0 +1,536 @@
+#include <deque>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <openssl/obj_mac.h>
+#include "record_pipeline.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace
+{
+  static const std::size_t header_size = 5;
+  static const std::size_t tag_size = 16;
+  static const std::size_t max_payload = 16384;
+  static const std::size_t max_ciphertext = max_payload + 256; // rfc 8446 5.2
+  static const std::size_t send_window = 512 * 1024; // payload bytes being sealed or written
+  static const std::size_t max_write_records = 32;   // records gathered by a socket write
+  static const std::size_t receive_window = 32;      // records being opened or waiting for the reader
+  static const std::size_t read_buffer_size = 4 * (header_size + max_ciphertext);
+
+  // content types
+  static const unsigned char alert = 21;
+  static const unsigned char handshake = 22;
+  static const unsigned char application_data = 23;
+  // handshake message types
+  static const unsigned char new_session_ticket = 4;
+
+  // one per worker thread, cipher and key are set up again for every record
+  struct cipher_ctx_t {
+    cipher_ctx_t() : ctx(EVP_CIPHER_CTX_new()) {}
+    ~cipher_ctx_t() { EVP_CIPHER_CTX_free(ctx); }
+    EVP_CIPHER_CTX* ctx;
+  };
+
+  EVP_CIPHER_CTX* cipher_ctx() {
+    static thread_local cipher_ctx_t c;
+    return c.ctx;
+  }
+
+  // seals or opens a record in place. size is that of the payload with its inner content type,
+  // the header is additional data and the tag follows the payload
+  bool aead(const record_pipeline::key_t& key, uint64_t seq, bool seal, unsigned char* record, std::size_t size) {
+    unsigned char nonce[sizeof(key.iv)];
+    std::memcpy(nonce, key.iv, sizeof(nonce));
+    for(std::size_t i = 0; i < 8; ++i) {
+      nonce[sizeof(nonce) - 1 - i] ^= (seq >> (8 * i)) & 0xff;
+    }
+    auto ctx = cipher_ctx();
+    int len = 0;
+    if(!ctx || 1 != EVP_CipherInit_ex(ctx, key.cipher.get(), nullptr, key.key.data(), nonce, seal ? 1 : 0)) {
+      return false;
+    }
+    if(!seal && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, tag_size, record + header_size + size)) {
+      return false;
+    }
+    if(1 != EVP_CipherUpdate(ctx, nullptr, &len, record, header_size)
+    || 1 != EVP_CipherUpdate(ctx, record + header_size, &len, record + header_size, size)
+    || 1 != EVP_CipherFinal_ex(ctx, record + header_size + len, &len)) {
+      return false;
+    }
+    return !seal || 1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, tag_size, record + header_size + size);
+  }
+
+  struct record_t {
+    std::vector<unsigned char> data; // header, payload, inner content type, tag
+    uint64_t seq;
+    std::size_t size;   // payload bytes
+    std::size_t offset; // payload bytes taken by the reader
+    unsigned char type; // inner content type
+    bool ready;         // sealed or opened, set on the io_service thread
+    bool ok;            // set by the worker
+  };
+}
+
+/*\
+ *  class record_pipeline::private_t
+\*/
+class record_pipeline::private_t: public boost::enable_shared_from_this<private_t> {
+public:
+  private_t(asio::io_service& ios, crypto_pool& pool, asio::ip::tcp::socket& socket, std::chrono::microseconds flush_delay);
+
+  void send(unsigned char type, const char* data, std::size_t size);
+  void take_write();
+  void schedule_flush();
+  void submit_open();
+  void handle_flush_timer(const boost::system::error_code& ec);
+  void async_read();
+  void fail(const boost::system::error_code& ec);
+
+  static void seal(boost::shared_ptr<const key_t> key, boost::shared_ptr<record_t> r);
+  static void open(boost::shared_ptr<const key_t> key, boost::shared_ptr<record_t> r);
+
+  boost::shared_ptr<record_t> make_record();
+  void submit(boost::shared_ptr<record_t> r, unsigned char type);
+  void handle_sealed(boost::shared_ptr<record_t> r);
+  void flush();
+  void handle_write(const boost::system::error_code& ec);
+
+  void handle_read(const boost::system::error_code& ec, std::size_t bytes);
+  void handle_opened(boost::shared_ptr<record_t> r);
+  void deliver();
+
+  asio::io_service& ios_;
+  crypto_pool& pool_;
+  asio::ip::tcp::socket& socket_;
+  const std::chrono::microseconds flush_delay_;
+  asio::steady_timer flush_timer_;
+  bool flush_timer_armed_;
+  boost::system::error_code error_; // first failure, later operations fail with it
+  bool closed_;                     // pipeline is gone, completions are dropped
+
+  // sending
+  boost::shared_ptr<const key_t> send_key_;
+  uint64_t send_seq_;
+  std::deque<boost::shared_ptr<record_t> > send_queue_; // by sequence, first writing_ ones are being written
+  std::size_t send_bytes_; // payload taken in and not written yet
+  std::size_t writing_;
+  boost::shared_ptr<record_t> open_record_; // partly filled, waits for more writes
+  std::vector<asio::const_buffer> write_buffers_;
+  std::vector<asio::const_buffer> pending_buffers_;
+  io_handler pending_write_;
+
+  // receiving
+  boost::shared_ptr<const key_t> receive_key_;
+  uint64_t receive_seq_;
+  std::deque<boost::shared_ptr<record_t> > receive_queue_; // by sequence
+  std::vector<unsigned char> read_buffer_; // incomplete record from the socket
+  std::size_t read_size_;
+  bool reading_;
+  bool eof_;
+  char* pending_data_;
+  std::size_t pending_size_;
+  io_handler pending_read_;
+
+  uint64_t sealed_, opened_;
+};
+
+record_pipeline::private_t::private_t(asio::io_service& ios, crypto_pool& pool, asio::ip::tcp::socket& socket, std::chrono::microseconds flush_delay)
+  : ios_(ios), pool_(pool), socket_(socket)
+  , flush_delay_(flush_delay), flush_timer_(ios), flush_timer_armed_(false)
+  , closed_(false)
+  , send_seq_(0), send_bytes_(0), writing_(0)
+  , receive_seq_(0), read_size_(0), reading_(false), eof_(false)
+  , pending_data_(nullptr), pending_size_(0)
+  , sealed_(0), opened_(0)
+{}
+
+void record_pipeline::private_t::send(unsigned char type, const char* data, std::size_t size) {
+  if(error_) return;
+  if(open_record_) submit_open();
+  do {
+    auto r = make_record();
+    auto n = std::min(size, max_payload);
+    r->data.insert(r->data.end(), data, data + n);
+    r->size = n;
+    send_bytes_ += n;
+    submit(r, type);
+    data += n;
+    size -= n;
+  } while(size);
+}
+
+void record_pipeline::private_t::take_write() {
+  if(!pending_write_ || send_bytes_ >= send_window) return;
+  std::size_t room = send_window - send_bytes_, taken = 0;
+  auto& r = open_record_;
+  for(auto i = pending_buffers_.begin(); i != pending_buffers_.end() && taken < room; ++i) {
+    auto data = asio::buffer_cast<const unsigned char*>(*i);
+    auto left = asio::buffer_size(*i);
+    while(left && taken < room) {
+      if(!r) r = make_record();
+      auto n = std::min(std::min(left, room - taken), max_payload - r->size);
+      r->data.insert(r->data.end(), data, data + n);
+      r->size += n;
+      data += n;
+      left -= n;
+      taken += n;
+      if(max_payload == r->size) submit_open();
+    }
+  }
+  send_bytes_ += taken;
+
+  auto handler = pending_write_;
+  pending_write_ = io_handler();
+  pending_buffers_.clear();
+  ios_.post(boost::bind(handler, boost::system::error_code(), taken));
+  schedule_flush();
+}
+
+void record_pipeline::private_t::schedule_flush() {
+  if(!open_record_ || error_) return;
+  if(flush_delay_.count()) {
+    if(!flush_timer_armed_) {
+      flush_timer_armed_ = true;
+      flush_timer_.expires_from_now(flush_delay_);
+      flush_timer_.async_wait(boost::bind(
+        &private_t::handle_flush_timer,
+          shared_from_this(),
+          asio::placeholders::error
+      ));
+    }
+    return;
+  }
+  // records in flight are written first, the open one may fill up meanwhile
+  if(send_queue_.empty()) submit_open();
+}
+
+void record_pipeline::private_t::submit_open() {
+  auto r = open_record_;
+  open_record_.reset();
+  submit(r, application_data);
+}
+
+void record_pipeline::private_t::handle_flush_timer(const boost::system::error_code& ec) {
+  if(closed_ || ec) return;
+  flush_timer_armed_ = false;
+  if(open_record_ && !error_) submit_open();
+}
+
+void record_pipeline::private_t::async_read() {
+  if(reading_ || eof_ || error_ || receive_queue_.size() >= receive_window) return;
+  reading_ = true;
+  socket_.async_read_some(
+    asio::buffer(&read_buffer_[read_size_], read_buffer_.size() - read_size_),
+    boost::bind(
+      &private_t::handle_read,
+        shared_from_this(),
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred
+    )
+  );
+}
+
+void record_pipeline::private_t::fail(const boost::system::error_code& ec) {
+  if(!error_) error_ = ec;
+  if(pending_write_) {
+    ios_.post(boost::bind(pending_write_, error_, 0));
+    pending_write_ = io_handler();
+    pending_buffers_.clear();
+  }
+  if(pending_read_) {
+    ios_.post(boost::bind(pending_read_, error_, 0));
+    pending_read_ = io_handler();
+  }
+}
+
+void record_pipeline::private_t::seal(boost::shared_ptr<const key_t> key, boost::shared_ptr<record_t> r) {
+  r->ok = aead(*key, r->seq, true, r->data.data(), r->size + 1);
+}
+
+void record_pipeline::private_t::open(boost::shared_ptr<const key_t> key, boost::shared_ptr<record_t> r) {
+  auto size = r->data.size() - header_size - tag_size;
+  r->ok = aead(*key, r->seq, false, r->data.data(), size);
+  if(!r->ok) return;
+  // inner content type is the last non-zero byte, padding follows it
+  auto payload = r->data.data() + header_size;
+  while(size && !payload[size - 1]) --size;
+  r->ok = size > 0;
+  if(!r->ok) return;
+  r->type = payload[size - 1];
+  r->size = size - 1;
+}
+
+boost::shared_ptr<record_t> record_pipeline::private_t::make_record() {
+  auto r = boost::make_shared<record_t>();
+  r->data.reserve(header_size + max_payload + 1 + tag_size);
+  r->data.resize(header_size);
+  r->seq = 0;
+  r->size = r->offset = 0;
+  r->type = application_data;
+  r->ready = r->ok = false;
+  return r;
+}
+
+void record_pipeline::private_t::submit(boost::shared_ptr<record_t> r, unsigned char type) {
+  r->type = type;
+  r->data.push_back(type);
+  r->data.resize(r->data.size() + tag_size);
+  auto length = r->data.size() - header_size;
+  r->data[0] = application_data;
+  r->data[1] = 3;
+  r->data[2] = 3;
+  r->data[3] = length >> 8;
+  r->data[4] = length & 0xff;
+  r->seq = send_seq_++;
+  send_queue_.push_back(r);
+  pool_.post(
+    boost::bind(&private_t::seal, send_key_, r),
+    boost::bind(&private_t::handle_sealed, shared_from_this(), r)
+  );
+}
+
+void record_pipeline::private_t::handle_sealed(boost::shared_ptr<record_t> r) {
+  static const char func[] = "record_pipeline::handle_sealed";
+  if(closed_) return;
+  r->ready = true;
+  if(!r->ok) {
+    LOG_ERROR << bf("%s: failed to seal record %d") % func % r->seq;
+    fail(boost::system::errc::make_error_code(boost::system::errc::io_error));
+    return;
+  }
+  ++sealed_;
+  flush();
+}
+
+void record_pipeline::private_t::flush() {
+  if(writing_ || error_) return;
+  write_buffers_.clear();
+  for(auto i = send_queue_.begin(); i != send_queue_.end() && (*i)->ready && write_buffers_.size() < max_write_records; ++i) {
+    write_buffers_.push_back(asio::buffer((*i)->data));
+  }
+  if(write_buffers_.empty()) return;
+  writing_ = write_buffers_.size();
+  asio::async_write(
+    socket_,
+    write_buffers_,
+    boost::bind(
+      &private_t::handle_write,
+        shared_from_this(),
+        asio::placeholders::error
+    )
+  );
+}
+
+void record_pipeline::private_t::handle_write(const boost::system::error_code& ec) {
+  if(closed_) return;
+  auto written = writing_;
+  writing_ = 0;
+  if(ec) {
+    fail(ec);
+    return;
+  }
+  for(std::size_t i = 0; i < written; ++i) {
+    send_bytes_ -= send_queue_.front()->size;
+    send_queue_.pop_front();
+  }
+  take_write();
+  if(send_queue_.empty()) schedule_flush();
+  flush();
+}
+
+void record_pipeline::private_t::handle_read(const boost::system::error_code& ec, std::size_t bytes) {
+  static const char func[] = "record_pipeline::handle_read";
+  if(closed_) return;
+  reading_ = false;
+  if(asio::error::eof == ec && !read_size_) {
+    eof_ = true;
+    deliver();
+    return;
+  }
+  if(ec) {
+    fail(ec);
+    return;
+  }
+
+  read_size_ += bytes;
+  std::size_t pos = 0;
+  while(read_size_ - pos >= header_size) {
+    auto header = &read_buffer_[pos];
+    std::size_t length = (header[3] << 8) | header[4];
+    if(application_data != header[0] || length > max_ciphertext || length <= tag_size) {
+      LOG_WARNING << bf("%s: unexpected record of type %d, %d bytes") % func % int(header[0]) % length;
+      fail(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+      return;
+    }
+    if(read_size_ - pos < header_size + length) break;
+    auto r = make_record();
+    r->data.assign(header, header + header_size + length);
+    r->seq = receive_seq_++;
+    receive_queue_.push_back(r);
+    pool_.post(
+      boost::bind(&private_t::open, receive_key_, r),
+      boost::bind(&private_t::handle_opened, shared_from_this(), r)
+    );
+    pos += header_size + length;
+  }
+  std::memmove(&read_buffer_[0], &read_buffer_[pos], read_size_ - pos);
+  read_size_ -= pos;
+  async_read();
+}
+
+void record_pipeline::private_t::handle_opened(boost::shared_ptr<record_t> r) {
+  if(closed_) return;
+  r->ready = true;
+  ++opened_;
+  deliver();
+}
+
+void record_pipeline::private_t::deliver() {
+  static const char func[] = "record_pipeline::deliver";
+  if(!pending_read_) return;
+  std::size_t copied = 0;
+  boost::system::error_code ec;
+  while(!receive_queue_.empty() && receive_queue_.front()->ready && copied < pending_size_) {
+    auto r = receive_queue_.front();
+    auto payload = r->data.data() + header_size;
+    if(!r->ok) {
+      LOG_WARNING << bf("%s: failed to open record %d") % func % r->seq;
+      ec = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+      break;
+    }
+    if(application_data == r->type) {
+      auto n = std::min(r->size - r->offset, pending_size_ - copied);
+      std::memcpy(pending_data_ + copied, payload + r->offset, n);
+      r->offset += n;
+      copied += n;
+      if(r->offset < r->size) break;
+    }
+    else if(handshake == r->type && r->size && new_session_ticket == payload[0]) {
+      // client took over after the tickets of the handshake, later ones are not needed
+      LOG_DEBUG << bf("%s: late session ticket dropped") % func;
+    }
+    else if(alert == r->type && r->size >= 2) {
+      if(0 == payload[1]) {
+        ec = asio::error::eof; // close_notify
+      }
+      else {
+        LOG_WARNING << bf("%s: alert %d received") % func % int(payload[1]);
+        ec = asio::error::connection_reset;
+      }
+      break;
+    }
+    else {
+      // key update included, openssl does not let us follow it
+      LOG_WARNING << bf("%s: unexpected record content type %d") % func % int(r->type);
+      ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+      break;
+    }
+    receive_queue_.pop_front();
+  }
+
+  if(!copied && !ec && receive_queue_.empty() && eof_) {
+    ec = asio::error::eof;
+  }
+  if(copied || ec) {
+    // an error is reported by the read following the data preceding it
+    auto handler = pending_read_;
+    pending_read_ = io_handler();
+    ios_.post(boost::bind(handler, copied ? boost::system::error_code() : ec, copied));
+  }
+  async_read();
+}
+
+/*\
+ *  class record_pipeline
+\*/
+boost::shared_ptr<EVP_CIPHER> record_pipeline::cipher(int nid) {
+  const char* name = nullptr;
+  switch(nid) {
+  case NID_aes_128_gcm: name = "AES-128-GCM"; break;
+  case NID_aes_256_gcm: name = "AES-256-GCM"; break;
+  case NID_chacha20_poly1305: name = "ChaCha20-Poly1305"; break;
+  default: return boost::shared_ptr<EVP_CIPHER>();
+  }
+  auto c = EVP_CIPHER_fetch(nullptr, name, nullptr);
+  return c ? boost::shared_ptr<EVP_CIPHER>(c, &EVP_CIPHER_free) : boost::shared_ptr<EVP_CIPHER>();
+}
+
+record_pipeline::record_pipeline(
+  asio::io_service& ios,
+  crypto_pool& pool,
+  asio::ip::tcp::socket& socket,
+  std::chrono::microseconds flush_delay
+) {
+  p = boost::make_shared<private_t>(ios, pool, socket, flush_delay);
+}
+
+record_pipeline::~record_pipeline() {
+  p->fail(asio::error::operation_aborted);
+  p->closed_ = true;
+  p->flush_timer_.cancel();
+}
+
+void record_pipeline::start_sending(const key_t& key, uint64_t seq) {
+  p->send_key_ = boost::make_shared<key_t>(key);
+  p->send_seq_ = seq;
+}
+
+void record_pipeline::start_receiving(const key_t& key, uint64_t seq) {
+  p->receive_key_ = boost::make_shared<key_t>(key);
+  p->receive_seq_ = seq;
+  p->read_buffer_.resize(read_buffer_size);
+  p->async_read();
+}
+
+bool record_pipeline::sending() const {
+  return !!p->send_key_;
+}
+
+bool record_pipeline::receiving() const {
+  return !!p->receive_key_;
+}
+
+void record_pipeline::send(unsigned char type, const char* data, std::size_t size) {
+  p->send(type, data, size);
+}
+
+void record_pipeline::async_write_some(const std::vector<boost::asio::const_buffer>& buffers, io_handler handler) {
+  if(p->error_) {
+    p->ios_.post(boost::bind(handler, p->error_, 0));
+    return;
+  }
+  p->pending_buffers_ = buffers;
+  p->pending_write_ = handler;
+  p->take_write();
+}
+
+void record_pipeline::async_read_some(char* data, std::size_t size, io_handler handler) {
+  if(p->error_ || !size) {
+    p->ios_.post(boost::bind(handler, p->error_, 0));
+    return;
+  }
+  p->pending_data_ = data;
+  p->pending_size_ = size;
+  p->pending_read_ = handler;
+  p->deliver();
+}
+
+void record_pipeline::cancel() {
+  p->fail(asio::error::operation_aborted);
+  p->flush_timer_.cancel();
+}
+
+std::string record_pipeline::stats() const {
+  return boost::str(bf("crypto pool %d records sealed, %d opened") % p->sealed_ % p->opened_);
+}
+
+}
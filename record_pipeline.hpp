@@ -0,0 +1,68 @@
+#ifndef RECORD_PIPELINE_HPP
+#define RECORD_PIPELINE_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <openssl/evp.h>
+#include "crypto_pool.hpp"
+
+namespace sp
+{
+
+// tls 1.3 records of an established connection sealed and opened on a crypto_pool,
+// many of them at once. sealed records go to the socket and opened ones to the reader
+// in sequence order. keys and sequence numbers of each direction come from openssl,
+// which carries out the handshake and hands the directions over when they are quiet
+class record_pipeline
+{
+public:
+  typedef boost::function<void(const boost::system::error_code&, std::size_t)> io_handler;
+
+  // aead key of one direction
+  struct key_t {
+    boost::shared_ptr<EVP_CIPHER> cipher; // aes-gcm or chacha20-poly1305
+    std::vector<unsigned char> key;
+    unsigned char iv[12];                 // record nonce is iv xor sequence number
+  };
+  // cipher of a tls 1.3 cipher suite by its nid, null if not supported
+  static boost::shared_ptr<EVP_CIPHER> cipher(int nid);
+
+  // application data is packed into records of up to 16 KB, a partly filled one waits
+  // for the records in flight to be written or for flush_delay to pass
+  record_pipeline(
+    boost::asio::io_service& ios,
+    crypto_pool& pool,
+    boost::asio::ip::tcp::socket& socket,
+    std::chrono::microseconds flush_delay
+  );
+  ~record_pipeline(); // pending operations complete with operation_aborted
+
+  void start_sending(const key_t& key, uint64_t seq);
+  void start_receiving(const key_t& key, uint64_t seq);
+  bool sending() const;
+  bool receiving() const;
+
+  // queues data as records of the given content type at once (openssl's own records)
+  void send(unsigned char type, const char* data, std::size_t size);
+  // application data, takes as much as the window of records in flight allows. handler is posted
+  void async_write_some(const std::vector<boost::asio::const_buffer>& buffers, io_handler handler);
+  void async_read_some(char* data, std::size_t size, io_handler handler);
+  // pending operations complete with operation_aborted, the connection is unusable after that
+  void cancel();
+
+  // records sealed and opened so far
+  std::string stats() const;
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // RECORD_PIPELINE_HPP
@@ -0,0 +1,155 @@
+#include <map>
+#include <list>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio/placeholders.hpp>
+#include "resolver_cache.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace {
+  // entries older than this are not served even if the resolver fails
+  static const std::chrono::hours max_stale(24);
+}
+
+/*\
+ *  class resolver_cache::private_t
+\*/
+class resolver_cache::private_t: public boost::enable_shared_from_this<resolver_cache::private_t> {
+public:
+  private_t(asio::io_service& ios, timing_wheel& wheel, std::chrono::milliseconds ttl);
+  void async_resolve(const std::string& host, const std::string& port, resolve_handler handler);
+
+private:
+  typedef asio::ip::tcp::resolver resolver_t;
+  typedef std::chrono::steady_clock clock_t;
+  typedef std::pair<std::string, std::string> key_t;
+
+  struct entry_t {
+    entry_t(asio::io_service& ios): resolver(ios), resolved(false), querying(false), refresh_timer(timing_wheel::no_timer) {}
+
+    resolver_t resolver;
+    endpoints_t endpoints;
+    clock_t::time_point resolved_at;
+    bool resolved;  // endpoints are valid
+    bool querying;
+    std::list<resolve_handler> waiters;
+    timing_wheel::timer_id refresh_timer;
+  };
+  typedef std::map<key_t, boost::shared_ptr<entry_t> > entries_t;
+
+  void query(const key_t& key, entry_t& e);
+  void handle_resolve(const boost::system::error_code& ec, resolver_t::iterator i, key_t key);
+  void handle_refresh_timer(key_t key);
+
+  asio::io_service& ios_;
+  timing_wheel& wheel_;
+  std::chrono::milliseconds ttl_;
+  entries_t entries_;
+};
+
+resolver_cache::private_t::private_t(asio::io_service& ios, timing_wheel& wheel, std::chrono::milliseconds ttl)
+  : ios_(ios), wheel_(wheel), ttl_(ttl)
+{}
+
+void resolver_cache::private_t::async_resolve(const std::string& host, const std::string& port, resolve_handler handler) {
+  key_t key(host, port);
+  auto& e = entries_[key];
+  if(!e) {
+    e = boost::make_shared<entry_t>(ios_);
+  }
+  if(e->resolved && clock_t::now() - e->resolved_at < ttl_) {
+    ios_.post(boost::bind(handler, boost::system::error_code(), e->endpoints));
+    return;
+  }
+  e->waiters.push_back(handler);
+  if(!e->querying) {
+    query(key, *e);
+  }
+}
+
+void resolver_cache::private_t::query(const key_t& key, entry_t& e) {
+  LOG_TRACE << bf("resolver_cache::query: resolving host '%s', port '%s'") % key.first % key.second;
+  e.querying = true;
+  resolver_t::query q(key.first, key.second);
+  e.resolver.async_resolve(q, boost::bind(
+    &private_t::handle_resolve,
+      shared_from_this(),
+      asio::placeholders::error,
+      asio::placeholders::iterator,
+      key
+  ));
+}
+
+void resolver_cache::private_t::handle_resolve(const boost::system::error_code& ec, resolver_t::iterator i, key_t key) {
+  static const char func[] = "resolver_cache::handle_resolve";
+  auto found = entries_.find(key);
+  if(entries_.end() == found) return;
+  auto e = found->second;
+  e->querying = false;
+
+  boost::system::error_code result_ec = ec;
+  if(!ec) {
+    e->endpoints.assign(i, resolver_t::iterator());
+    e->resolved = true;
+    e->resolved_at = clock_t::now();
+  }
+  else if(e->resolved && clock_t::now() - e->resolved_at < max_stale) {
+    LOG_WARNING << bf("%s: resolve of '%s:%s' failed, serving addresses resolved %d s ago: %s")
+      % func % key.first % key.second
+      % std::chrono::duration_cast<std::chrono::seconds>(clock_t::now() - e->resolved_at).count()
+      % ec.message();
+    result_ec = boost::system::error_code();
+  }
+  else {
+    e->resolved = false;
+    e->endpoints.clear();
+  }
+
+  // refresh ahead at 3/4 of ttl, retry failures the same way
+  if(ttl_.count() && asio::error::operation_aborted != ec) {
+    wheel_.reschedule(
+      e->refresh_timer,
+      ttl_ * 3 / 4,
+      boost::bind(
+        &private_t::handle_refresh_timer,
+          shared_from_this(),
+          key
+      )
+    );
+  }
+
+  std::list<resolve_handler> waiters;
+  waiters.swap(e->waiters);
+  for(auto w = waiters.begin(); w != waiters.end(); ++w) {
+    (*w)(result_ec, e->endpoints);
+  }
+}
+
+void resolver_cache::private_t::handle_refresh_timer(key_t key) {
+  auto found = entries_.find(key);
+  if(entries_.end() == found) return;
+  auto& e = *found->second;
+  e.refresh_timer = timing_wheel::no_timer;
+  if(!e.querying) {
+    query(key, e);
+  }
+}
+
+/*\
+ *  class resolver_cache
+\*/
+resolver_cache::resolver_cache(asio::io_service& ios, timing_wheel& wheel, std::chrono::milliseconds ttl) {
+  p = boost::make_shared<private_t>(ios, wheel, ttl);
+}
+
+void resolver_cache::async_resolve(const std::string& host, const std::string& port, resolve_handler handler) {
+  p->async_resolve(host, port, handler);
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef RESOLVER_CACHE_HPP
+#define RESOLVER_CACHE_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "timing_wheel.hpp"
+
+namespace sp
+{
+
+// in-process cache of host/port resolutions.
+// entries are refreshed in background before ttl runs out so lookups never wait for dns,
+// concurrent lookups of one key share a query, and an expired entry is served
+// if the resolver fails. zero ttl disables caching
+class resolver_cache
+{
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints_t;
+  typedef boost::function<void(const boost::system::error_code&, const endpoints_t&)> resolve_handler;
+
+  resolver_cache(boost::asio::io_service& ios, timing_wheel& wheel, std::chrono::milliseconds ttl);
+
+  // handler is always called from the io_service, never from within this call
+  void async_resolve(const std::string& host, const std::string& port, resolve_handler handler);
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // RESOLVER_CACHE_HPP
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <stdexcept>
+#include <signal.h>
 #include <boost/bind.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/placeholders.hpp>
@@ -39,19 +40,25 @@ int secret_passage_service::run() {
     return -30;
   }
 
-  std::string tap_name;
-  tap_ = create_tap(&tap_name);
-  if(!tap_->valid()) {
-    return -40;
+  // tls writes to sockets with write(2), a peer gone must be an error rather than a signal
+  signal(SIGPIPE, SIG_IGN);
+
+  for(std::size_t c = 0; c < st_.channels; ++c) {
+    std::string tap_name;
+    auto tap = create_tap(&tap_name);
+    if(!tap->valid()) {
+      return -40;
+    }
+    LOG_INFO << bf("tap interface created: '%s' (channel %d)") % tap_name % c;
+    taps_.push_back(tap);
   }
-  LOG_INFO << bf("tap interface created: '%s'") % tap_name;
 
   if(settings::mode::listen == st_.mode) {
-    listen_mode_ = boost::make_shared<listen_mode>(ios_, st_, tap_);
+    listen_mode_ = boost::make_shared<listen_mode>(ios_, st_, taps_);
     listen_mode_->setup();
   }
   else {
-    connect_mode_ = boost::make_shared<connect_mode>(ios_, st_, tap_);
+    connect_mode_ = boost::make_shared<connect_mode>(ios_, st_, taps_);
     connect_mode_->setup();
   }
   try {
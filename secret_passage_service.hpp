@@ -1,6 +1,7 @@
 #ifndef SECRET_PASSAGE_SERVICE_HPP
 #define SECRET_PASSAGE_SERVICE_HPP
 
+#include <vector>
 #include <boost/asio/io_service.hpp>
 #include <boost/shared_ptr.hpp>
 #include "settings.hpp"
@@ -25,7 +26,7 @@ private:
   boost::asio::io_service ios_;
   settings st_;
 
-  shared_descriptor tap_;
+  std::vector<shared_descriptor> taps_; // one per channel
 
   boost::shared_ptr<listen_mode> listen_mode_;
   boost::shared_ptr<connect_mode> connect_mode_;
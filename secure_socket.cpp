@@ -1,30 +1,291 @@
+#include <errno.h>
+#include <unistd.h>
+#include <cstring>
+#include <sys/socket.h>
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/asio/placeholders.hpp>
+#include <boost/asio/ssl/error.hpp>
 #include "secure_socket.hpp"
+#include "tcp_stats.hpp"
 #include "logging.hpp"
 
 namespace asio = boost::asio;
 
+// openssl's controls of kernel tls (internal/bio.h). a bio taking them is handed
+// the sending key of a connection and plaintext records after that
+#ifndef BIO_CTRL_SET_KTLS
+# define BIO_CTRL_SET_KTLS 72
+#endif
+#ifndef BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG
+# define BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG 74
+#endif
+#ifndef BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG
+# define BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG 75
+#endif
+
 namespace sp
 {
 
-secure_socket::secure_socket(boost::asio::io_service& ios)
-  : ctxt_(asio::ssl::context::sslv23)
-  , ssl_strm_(ios, ctxt_)
+namespace
+{
+  static const unsigned char application_data = 23;
+  static const std::size_t max_record = 16384;          // plaintext of a full tls record
+  static const std::size_t max_coalesced = 4 * max_record; // taken in before writes have to wait
+
+  uint64_t load_seq(const unsigned char* p) {
+    uint64_t seq = 0;
+    for(std::size_t i = 0; i < 8; ++i) seq = (seq << 8) | p[i];
+    return seq;
+  }
+
+  // sending key from the kernel tls crypto info openssl passes along with BIO_CTRL_SET_KTLS
+  bool sending_key(const void* crypto_info, record_pipeline::key_t& key, uint64_t& seq) {
+    auto info = static_cast<const tls_crypto_info*>(crypto_info);
+    if(TLS_1_3_VERSION != info->version) {
+      return false;
+    }
+    switch(info->cipher_type) {
+    case TLS_CIPHER_AES_GCM_128: {
+      auto c = static_cast<const tls12_crypto_info_aes_gcm_128*>(crypto_info);
+      key.cipher = record_pipeline::cipher(NID_aes_128_gcm);
+      key.key.assign(c->key, c->key + sizeof(c->key));
+      std::memcpy(key.iv, c->salt, sizeof(c->salt));
+      std::memcpy(key.iv + sizeof(c->salt), c->iv, sizeof(c->iv));
+      seq = load_seq(c->rec_seq);
+      break;
+    }
+    case TLS_CIPHER_AES_GCM_256: {
+      auto c = static_cast<const tls12_crypto_info_aes_gcm_256*>(crypto_info);
+      key.cipher = record_pipeline::cipher(NID_aes_256_gcm);
+      key.key.assign(c->key, c->key + sizeof(c->key));
+      std::memcpy(key.iv, c->salt, sizeof(c->salt));
+      std::memcpy(key.iv + sizeof(c->salt), c->iv, sizeof(c->iv));
+      seq = load_seq(c->rec_seq);
+      break;
+    }
+    case TLS_CIPHER_CHACHA20_POLY1305: {
+      auto c = static_cast<const tls12_crypto_info_chacha20_poly1305*>(crypto_info);
+      key.cipher = record_pipeline::cipher(NID_chacha20_poly1305);
+      key.key.assign(c->key, c->key + sizeof(c->key));
+      std::memcpy(key.iv, c->iv, sizeof(c->iv));
+      seq = load_seq(c->rec_seq);
+      break;
+    }
+    default:
+      return false;
+    }
+    return !!key.cipher;
+  }
+
+  // HKDF-Expand-Label of rfc 8446 7.1
+  bool expand_label(const EVP_MD* md, const std::vector<unsigned char>& secret, const std::string& label, unsigned char* out, std::size_t size) {
+    auto full_label = "tls13 " + label;
+    std::vector<unsigned char> info;
+    info.push_back(size >> 8);
+    info.push_back(size & 0xff);
+    info.push_back(full_label.size());
+    info.insert(info.end(), full_label.begin(), full_label.end());
+    info.push_back(0); // no context
+    auto kdf = EVP_KDF_fetch(nullptr, "HKDF", nullptr);
+    auto ctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+    EVP_KDF_free(kdf);
+    if(!ctx) return false;
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, const_cast<char*>(EVP_MD_get0_name(md)), 0),
+      OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, const_cast<unsigned char*>(secret.data()), secret.size()),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info.data(), info.size()),
+      OSSL_PARAM_construct_end()
+    };
+    bool ok = 1 == EVP_KDF_derive(ctx, out, size, params);
+    EVP_KDF_CTX_free(ctx);
+    return ok;
+  }
+
+  // receiving key from the application traffic secret of the peer (rfc 8446 7.3)
+  bool receiving_key(SSL* ssl, const std::vector<unsigned char>& secret, record_pipeline::key_t& key) {
+    auto suite = SSL_get_current_cipher(ssl);
+    auto md = suite ? SSL_CIPHER_get_handshake_digest(suite) : nullptr;
+    if(!md || secret.empty()) {
+      return false;
+    }
+    key.cipher = record_pipeline::cipher(SSL_CIPHER_get_cipher_nid(suite));
+    if(!key.cipher) {
+      return false;
+    }
+    key.key.resize(EVP_CIPHER_get_key_length(key.cipher.get()));
+    return expand_label(md, secret, "key", key.key.data(), key.key.size())
+      && expand_label(md, secret, "iv", key.iv, sizeof(key.iv));
+  }
+}
+
+struct secure_socket::read_op {
+  char* data;
+  std::size_t size;
+  read_handler handler;
+  uint64_t generation;
+  bool initiating; // completion is posted while within async_read_some
+};
+
+struct secure_socket::write_op {
+  const char* data;
+  std::size_t size;
+  write_handler handler;
+  uint64_t generation;
+  bool initiating;
+};
+
+struct secure_socket::handshake_op {
+  explicit handshake_op(asio::ip::tcp::socket&& accepted)
+    : socket(std::move(accepted)), timer(socket.get_executor()), timed_out(false) {}
+
+  asio::ip::tcp::socket socket; // of the other io_service until taken over
+  asio::steady_timer timer;
+  accept_handler handler;
+  bool timed_out;
+};
+
+// socket io of openssl while records go through a pipeline. reads stop at record boundaries,
+// so openssl never holds a part of a record the pipeline is to take over
+struct secure_socket::record_bio {
+  int fd;
+  record_pipeline* pipeline;
+  unsigned char header[5]; // of the record being read
+  std::size_t header_read;
+  std::size_t body_left;
+  uint64_t records_read;
+  unsigned char send_type; // content type of the next plaintext record
+
+  bool at_boundary() const { return 0 == header_read; }
+
+  static BIO_METHOD* method();
+  static int write(BIO* b, const char* data, int size);
+  static int read(BIO* b, char* data, int size);
+  static long ctrl(BIO* b, int cmd, long num, void* ptr);
+};
+
+BIO_METHOD* secure_socket::record_bio::method() {
+  static BIO_METHOD* m = nullptr;
+  if(!m) {
+    m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "secure_socket records");
+    BIO_meth_set_write(m, &record_bio::write);
+    BIO_meth_set_read(m, &record_bio::read);
+    BIO_meth_set_ctrl(m, &record_bio::ctrl);
+  }
+  return m;
+}
+
+int secure_socket::record_bio::write(BIO* b, const char* data, int size) {
+  auto self = static_cast<record_bio*>(BIO_get_data(b));
+  BIO_clear_retry_flags(b);
+  if(self->pipeline->sending()) {
+    self->pipeline->send(self->send_type, data, size);
+    self->send_type = application_data;
+    return size;
+  }
+  auto ret = ::send(self->fd, data, size, MSG_NOSIGNAL);
+  if(ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+    BIO_set_retry_write(b);
+  }
+  return ret;
+}
+
+int secure_socket::record_bio::read(BIO* b, char* data, int size) {
+  auto self = static_cast<record_bio*>(BIO_get_data(b));
+  BIO_clear_retry_flags(b);
+  bool in_header = self->header_read < sizeof(self->header);
+  std::size_t want = in_header ? sizeof(self->header) - self->header_read : self->body_left;
+  auto ret = ::recv(self->fd, data, std::min<std::size_t>(want, size), 0);
+  if(ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+    BIO_set_retry_read(b);
+  }
+  if(ret <= 0) {
+    return ret;
+  }
+  if(in_header) {
+    std::memcpy(self->header + self->header_read, data, ret);
+    self->header_read += ret;
+    if(sizeof(self->header) == self->header_read) {
+      ++self->records_read;
+      self->body_left = (self->header[3] << 8) | self->header[4];
+    }
+  }
+  else {
+    self->body_left -= ret;
+  }
+  if(sizeof(self->header) == self->header_read && !self->body_left) {
+    self->header_read = 0;
+  }
+  return ret;
+}
+
+long secure_socket::record_bio::ctrl(BIO* b, int cmd, long num, void* ptr) {
+  auto self = static_cast<record_bio*>(BIO_get_data(b));
+  switch(cmd) {
+  case BIO_CTRL_FLUSH:
+    return 1;
+  case BIO_CTRL_SET_KTLS: {
+    // receiving keys are not handed over by openssl 3.0 for tls 1.3, refused for tls 1.2
+    record_pipeline::key_t key;
+    uint64_t seq = 0;
+    if(!num || !sending_key(ptr, key, seq)) return 0;
+    self->pipeline->start_sending(key, seq);
+    return 1;
+  }
+  case BIO_CTRL_GET_KTLS_SEND:
+    return self->pipeline->sending();
+  case BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG:
+    self->send_type = num;
+    return 1;
+  case BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG:
+    self->send_type = application_data;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+secure_socket::secure_socket(
+  boost::asio::io_service& ios,
+  tls_context& ctx,
+  std::chrono::microseconds flush_delay,
+  crypto_pool* pool
+)
+  : ios_(ios)
+  , ctx_(ctx)
+  , socket_(ios)
+  , ssl_(nullptr)
+  , generation_(0)
+  , handshake_done_(false)
+  , early_writable_(false)
+  , reading_early_(false)
+  , ktls_send_(false)
+  , pool_(pool)
+  , handshake_records_(0)
+  , receive_in_openssl_(false)
+  , data_read_(false)
+  , flush_delay_(flush_delay)
+  , flush_timer_(ios)
+  , flush_timer_armed_(false)
+  , flushing_(0)
+  , handshake_ms_(0)
 {
-  // @TODO: decide tls stuff
-//  ctxt_.set_options(
-//      boost::asio::ssl::context::default_workarounds
-//      | boost::asio::ssl::context::no_sslv2
-//      | boost::asio::ssl::context::single_dh_use);
-//  ctxt_.use_certificate_chain_file("server.pem");
-//  ctxt_.use_private_key_file("server.pem", boost::asio::ssl::context::pem);
-//  ctxt_.use_tmp_dh_file("dh512.pem");
+  coalesced_.reserve(max_coalesced);
+}
+
+secure_socket::~secure_socket() {
+  end_session();
 }
 
 void secure_socket::async_connect(const acceptor::endpoint_type& peer_endpoint, connect_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  ssl_strm_.lowest_layer().async_connect(
+  socket_.async_connect(
     peer_endpoint,
     boost::bind(
       &secure_socket::handle_connect,
@@ -35,10 +296,18 @@ void secure_socket::async_connect(const acceptor::endpoint_type& peer_endpoint,
   );
 }
 
+void secure_socket::async_attach(boost::asio::ip::tcp::socket&& connected, connect_handler handler) {
+  LOG_TRACE << __PRETTY_FUNCTION__;
+  socket_ = std::move(connected);
+  boost::system::error_code ec;
+  start_session(false, socket_, ec);
+  ios_.post(boost::bind(handler, ec));
+}
+
 void secure_socket::async_accept(acceptor& acc, acceptor::endpoint_type& remote_ep, accept_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
   acc.async_accept(
-    ssl_strm_.lowest_layer(),
+    socket_,
     remote_ep,
     boost::bind(
       &secure_socket::handle_accept,
@@ -49,30 +318,145 @@ void secure_socket::async_accept(acceptor& acc, acceptor::endpoint_type& remote_
   );
 }
 
+void secure_socket::async_accept(boost::asio::ip::tcp::socket&& accepted, accept_handler handler) {
+  LOG_TRACE << __PRETTY_FUNCTION__;
+  socket_ = std::move(accepted);
+  boost::system::error_code ec;
+  start_session(true, socket_, ec);
+  ios_.post(boost::bind(handler, ec));
+}
+
+void secure_socket::async_accept_handshake(boost::asio::ip::tcp::socket&& accepted, std::chrono::milliseconds timeout, accept_handler handler) {
+  LOG_TRACE << __PRETTY_FUNCTION__;
+  auto op = boost::make_shared<handshake_op>(std::move(accepted));
+  op->handler = handler;
+  boost::system::error_code ec;
+  start_session(true, op->socket, ec);
+  if(ec || pool_) {
+    return take_over(ec, op);
+  }
+  if(timeout.count()) {
+    op->timer.expires_from_now(timeout);
+    op->timer.async_wait(boost::bind(
+      &secure_socket::handle_handshake_timer,
+        this,
+        asio::placeholders::error,
+        op
+    ));
+  }
+  do_handshake(boost::system::error_code(), op);
+}
+
 void secure_socket::async_read_some(const boost::asio::mutable_buffers_1& buffers, read_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  ssl_strm_.async_read_some(buffers, handler);
+  auto op = boost::make_shared<read_op>();
+  op->data = asio::buffer_cast<char*>(buffers);
+  op->size = asio::buffer_size(buffers);
+  op->handler = handler;
+  op->generation = generation_;
+  op->initiating = true;
+  do_read(boost::system::error_code(), op);
+  op->initiating = false;
 }
 
 void secure_socket::async_write_some(const boost::asio::const_buffers_1& buffers, write_handler handler) {
+  async_write_some(std::vector<asio::const_buffer>(1, *buffers.begin()), handler);
+}
+
+void secure_socket::async_write_some(const std::vector<boost::asio::const_buffer>& buffers, write_handler handler) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  ssl_strm_.async_write_some(buffers, handler);
+  if(pipeline_ && handshake_done_ && pipeline_->sending()) {
+    pipeline_->async_write_some(buffers, handler);
+    return;
+  }
+  if(ktls_send_) {
+    // kernel cuts records out of the gathered buffers
+    socket_.async_write_some(buffers, handler);
+    return;
+  }
+  if(handshake_done_) {
+    coalesce(buffers, handler);
+    return;
+  }
+
+  // handshake and 0-rtt data go through openssl one write at a time
+  gathered_.clear();
+  for(auto i = buffers.begin(); i != buffers.end() && gathered_.size() < max_record; ++i) {
+    auto data = asio::buffer_cast<const char*>(*i);
+    auto size = std::min(asio::buffer_size(*i), max_record - gathered_.size());
+    gathered_.insert(gathered_.end(), data, data + size);
+  }
+  auto op = boost::make_shared<write_op>();
+  op->data = gathered_.data();
+  op->size = gathered_.size();
+  op->handler = handler;
+  op->generation = generation_;
+  op->initiating = true;
+  do_write(boost::system::error_code(), op);
+  op->initiating = false;
 }
 
 void secure_socket::cancel(boost::system::error_code& ec) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  ssl_strm_.lowest_layer().cancel(ec);
+  socket_.cancel(ec);
+  flush_timer_.cancel();
+  flush_timer_armed_ = false;
+  if(pipeline_) {
+    pipeline_->cancel();
+  }
 }
 
 void secure_socket::shutdown(boost::system::error_code& ec) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  ssl_strm_.shutdown(ec);
-  ssl_strm_.lowest_layer().shutdown(asio::socket_base::shutdown_both, ec);
+  if(ssl_ && handshake_done_) {
+    // best effort close_notify, socket is non-blocking
+    ERR_clear_error();
+    SSL_shutdown(ssl_);
+  }
+  socket_.shutdown(asio::socket_base::shutdown_both, ec);
 }
 
 void secure_socket::close(boost::system::error_code& ec) {
   LOG_TRACE << __PRETTY_FUNCTION__;
-  ssl_strm_.lowest_layer().close(ec);
+  socket_.close(ec);
+  end_session();
+}
+
+std::string secure_socket::stats() {
+  if(!socket_.is_open()) {
+    return "closed";
+  }
+  auto fd = socket_.native_handle();
+  auto mp = mptcp_stats(fd);
+  auto transport = mp.empty() ? "tcp: " + tcp_stats(fd) : mp;
+  if(!ssl_ || !handshake_done_) {
+    return "tls handshake in progress over " + transport;
+  }
+  std::string offload;
+  if(pipeline_) {
+    offload = ", " + pipeline_->stats();
+  }
+  else {
+    bool ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+    if(ktls_send_ || ktls_recv) offload = std::string(", ktls") + (ktls_send_ ? " tx" : "") + (ktls_recv ? " rx" : "");
+  }
+  const unsigned char* alpn = nullptr;
+  unsigned int alpn_size = 0;
+  SSL_get0_alpn_selected(ssl_, &alpn, &alpn_size);
+  return boost::str(bf("%s %s%s%s%s%s, handshake %.2f ms over %s")
+    % SSL_get_version(ssl_) % SSL_get_cipher_name(ssl_)
+    % (alpn_size ? ", " + std::string(reinterpret_cast<const char*>(alpn), alpn_size) : std::string())
+    % (SSL_session_reused(ssl_) ? ", resumed" : "")
+    % (SSL_EARLY_DATA_ACCEPTED == SSL_get_early_data_status(ssl_) ? ", 0-rtt" : "")
+    % offload
+    % handshake_ms_ % transport);
+}
+
+bool secure_socket::export_keying_material(const std::string& label, unsigned char* out, std::size_t size) {
+  if(!ssl_ || !handshake_done_) {
+    return false;
+  }
+  return 1 == SSL_export_keying_material(ssl_, out, size, label.data(), label.size(), nullptr, 0, 0);
 }
 
 void secure_socket::handle_connect(const boost::system::error_code& ec, socket::connect_handler h) {
@@ -80,7 +464,9 @@ void secure_socket::handle_connect(const boost::system::error_code& ec, socket::
   if(ec) {
     return h(ec);
   }
-  ssl_strm_.async_handshake(asio::ssl::stream_base::client, h);
+  boost::system::error_code session_ec;
+  start_session(false, socket_, session_ec);
+  h(session_ec);
 }
 
 void secure_socket::handle_accept(const boost::system::error_code& ec, accept_handler h) {
@@ -88,7 +474,481 @@ void secure_socket::handle_accept(const boost::system::error_code& ec, accept_ha
   if(ec) {
     return h(ec);
   }
-  ssl_strm_.async_handshake(asio::ssl::stream_base::server, h);
+  boost::system::error_code session_ec;
+  start_session(true, socket_, session_ec);
+  h(session_ec);
+}
+
+void secure_socket::start_session(bool server, boost::asio::ip::tcp::socket& socket, boost::system::error_code& ec) {
+  static const char func[] = "secure_socket::start_session";
+  end_session();
+  bool early_data = false;
+  try {
+    ssl_ = ctx_.create(server, &early_data);
+  }
+  catch(const tls_context::exception& e) {
+    LOG_ERROR << bf("%s: %s") % func % e.what();
+    ec = asio::error::no_memory;
+    return;
+  }
+  socket.non_blocking(true, ec);
+  if(ec) {
+    return;
+  }
+  if(pool_) {
+    pipeline_ = boost::make_shared<record_pipeline>(ios_, *pool_, socket_, flush_delay_);
+    bio_ = boost::make_shared<record_bio>();
+    bio_->fd = socket.native_handle();
+    bio_->pipeline = pipeline_.get();
+    bio_->header_read = bio_->body_left = 0;
+    bio_->records_read = 0;
+    bio_->send_type = application_data;
+    auto b = BIO_new(record_bio::method());
+    if(!b) {
+      ec = asio::error::no_memory;
+      return;
+    }
+    BIO_set_data(b, bio_.get());
+    BIO_set_init(b, 1);
+    SSL_set_bio(ssl_, b, b);
+    // openssl hands the sending key over as it does to the kernel
+    SSL_set_options(ssl_, SSL_OP_ENABLE_KTLS);
+  }
+  else {
+    SSL_set_fd(ssl_, socket.native_handle());
+  }
+  handshake_records_ = 0;
+  receive_in_openssl_ = false;
+  data_read_ = false;
+  handshake_done_ = false;
+  ktls_send_ = false;
+  early_writable_ = early_data;
+  reading_early_ = server && SSL_get_max_early_data(ssl_) > 0;
+  handshake_start_ = std::chrono::steady_clock::now();
+}
+
+void secure_socket::end_session() {
+  ++generation_;
+  flush_timer_.cancel();
+  flush_timer_armed_ = false;
+  coalesced_.clear();
+  flushing_ = 0;
+  write_error_.clear();
+  if(pending_write_) {
+    ios_.post(boost::bind(pending_write_, asio::error::operation_aborted, 0));
+    pending_write_ = write_handler();
+    pending_buffers_.clear();
+  }
+  early_sent_.clear();
+  early_read_.clear();
+  ktls_send_ = false;
+  if(ssl_) {
+    if(handshake_done_) {
+      // tickets of a connection torn down without close_notify would be dropped otherwise
+      SSL_set_shutdown(ssl_, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+    SSL_free(ssl_);
+    ssl_ = nullptr;
+  }
+  pipeline_.reset();
+  bio_.reset();
+}
+
+// runs on the io_service of the accepted socket
+void secure_socket::do_handshake(const boost::system::error_code& ec, boost::shared_ptr<handshake_op> op) {
+  boost::system::error_code handshake_ec = ec;
+  if(op->timed_out) {
+    handshake_ec = asio::error::timed_out;
+  }
+  auto r = handshake_ec ? failed : done;
+  while(done == r && !handshake_done_) {
+    if(!reading_early_) {
+      r = handshake(handshake_ec);
+    }
+    else {
+      // early data goes before the first read of ours
+      auto size = early_read_.size();
+      early_read_.resize(size + max_record);
+      std::size_t tr = 0;
+      ERR_clear_error();
+      switch(SSL_read_early_data(ssl_, early_read_.data() + size, max_record, &tr)) {
+      case SSL_READ_EARLY_DATA_SUCCESS:
+        break;
+      case SSL_READ_EARLY_DATA_FINISH:
+        reading_early_ = false;
+        break;
+      default:
+        r = result(SSL_READ_EARLY_DATA_ERROR, handshake_ec);
+        break;
+      }
+      early_read_.resize(size + tr);
+    }
+    if(failed != r && SSL_session_reused(ssl_)) {
+      break;
+    }
+  }
+  if(want_read == r || want_write == r) {
+    if(!SSL_session_reused(ssl_)) {
+      op->socket.async_wait(
+        want_read == r ? asio::socket_base::wait_read : asio::socket_base::wait_write,
+        boost::bind(
+          &secure_socket::do_handshake,
+            this,
+            asio::placeholders::error,
+            op
+        )
+      );
+      return;
+    }
+    handshake_ec.clear();
+  }
+  take_over(handshake_ec, op);
+}
+
+void secure_socket::handle_handshake_timer(const boost::system::error_code& ec, boost::shared_ptr<handshake_op> op) {
+  if(ec == asio::error::operation_aborted) {
+    return;
+  }
+  op->timed_out = true;
+  boost::system::error_code cancel_ec;
+  op->socket.cancel(cancel_ec);
+}
+
+// hands the socket over to our io_service, whatever is left of the handshake continues there
+void secure_socket::take_over(boost::system::error_code ec, boost::shared_ptr<handshake_op> op) {
+  op->timer.cancel();
+  boost::system::error_code close_ec;
+  if(!ec) {
+    auto protocol = op->socket.local_endpoint(ec).protocol();
+    int fd = ec ? -1 : op->socket.release(ec);
+    if(!ec) {
+      socket_.assign(protocol, fd, ec);
+      if(ec) {
+        ::close(fd);
+      }
+    }
+    if(!ec) {
+      socket_.non_blocking(true, ec);
+    }
+  }
+  op->socket.close(close_ec);
+  ios_.post(boost::bind(op->handler, ec));
+}
+
+void secure_socket::do_read(const boost::system::error_code& ec, boost::shared_ptr<read_op> op) {
+  boost::system::error_code read_ec = ec;
+  if(!read_ec && (op->generation != generation_ || !ssl_)) {
+    read_ec = asio::error::operation_aborted;
+  }
+  std::size_t tr = 0;
+  if(!read_ec) {
+    if(pipeline_ && receive_pipelined()) {
+      pipeline_->async_read_some(op->data, op->size, op->handler);
+      return;
+    }
+    auto r = read(op->data, op->size, tr, read_ec);
+    if(want_read == r || want_write == r) {
+      socket_.async_wait(
+        want_read == r ? asio::socket_base::wait_read : asio::socket_base::wait_write,
+        boost::bind(
+          &secure_socket::do_read,
+            this,
+            asio::placeholders::error,
+            op
+        )
+      );
+      return;
+    }
+  }
+  if(op->initiating) {
+    ios_.post(boost::bind(op->handler, read_ec, tr));
+    return;
+  }
+  op->handler(read_ec, tr);
+}
+
+void secure_socket::do_write(const boost::system::error_code& ec, boost::shared_ptr<write_op> op) {
+  boost::system::error_code write_ec = ec;
+  if(!write_ec && (op->generation != generation_ || !ssl_)) {
+    write_ec = asio::error::operation_aborted;
+  }
+  std::size_t tr = 0;
+  if(!write_ec) {
+    auto r = write(op->data, op->size, tr, write_ec);
+    if(want_read == r || want_write == r) {
+      socket_.async_wait(
+        want_read == r ? asio::socket_base::wait_read : asio::socket_base::wait_write,
+        boost::bind(
+          &secure_socket::do_write,
+            this,
+            asio::placeholders::error,
+            op
+        )
+      );
+      return;
+    }
+  }
+  if(op->initiating) {
+    ios_.post(boost::bind(op->handler, write_ec, tr));
+    return;
+  }
+  op->handler(write_ec, tr);
+}
+
+secure_socket::result_t secure_socket::read(char* data, std::size_t size, std::size_t& tr, boost::system::error_code& ec) {
+  if(!early_read_.empty()) {
+    tr = std::min(size, early_read_.size());
+    std::memcpy(data, early_read_.data(), tr);
+    early_read_.erase(early_read_.begin(), early_read_.begin() + tr);
+    return done;
+  }
+  if(reading_early_) {
+    ERR_clear_error();
+    switch(SSL_read_early_data(ssl_, data, size, &tr)) {
+    case SSL_READ_EARLY_DATA_SUCCESS:
+      return done;
+    case SSL_READ_EARLY_DATA_FINISH:
+      reading_early_ = false;
+      if(tr) return done;
+      break;
+    default:
+      return result(SSL_READ_EARLY_DATA_ERROR, ec);
+    }
+  }
+  // reading makes the client go on with the handshake, no more early data after that
+  early_writable_ = false;
+  if(!handshake_done_) {
+    auto r = handshake(ec);
+    if(done != r) return r;
+  }
+  ERR_clear_error();
+  int ret = SSL_read_ex(ssl_, data, size, &tr);
+  if(ret <= 0) {
+    return result(ret, ec);
+  }
+  data_read_ = true;
+  return done;
+}
+
+secure_socket::result_t secure_socket::write(const char* data, std::size_t size, std::size_t& tr, boost::system::error_code& ec) {
+  if(early_writable_ && early_sent_.size() + size <= SSL_SESSION_get_max_early_data(SSL_get0_session(ssl_))) {
+    ERR_clear_error();
+    int ret = SSL_write_early_data(ssl_, data, size, &tr);
+    if(ret > 0) {
+      early_sent_.insert(early_sent_.end(), data, data + tr);
+      return done;
+    }
+    return result(ret, ec);
+  }
+  early_writable_ = false;
+  if(reading_early_) {
+    // server answers 0-rtt request before the handshake completes
+    ERR_clear_error();
+    int ret = SSL_write_early_data(ssl_, data, size, &tr);
+    return ret > 0 ? done : result(ret, ec);
+  }
+  if(!handshake_done_) {
+    auto r = handshake(ec);
+    if(done != r) return r;
+  }
+  ERR_clear_error();
+  int ret = SSL_write_ex(ssl_, data, size, &tr);
+  return ret > 0 ? done : result(ret, ec);
+}
+
+secure_socket::result_t secure_socket::handshake(boost::system::error_code& ec) {
+  static const char func[] = "secure_socket::handshake";
+  ERR_clear_error();
+  int ret = SSL_do_handshake(ssl_);
+  if(1 != ret) {
+    auto r = result(ret, ec);
+    if(failed == r) {
+      LOG_WARNING << bf("%s: tls handshake failed: %s") % func % ec.message();
+    }
+    return r;
+  }
+
+  handshake_done_ = true;
+  if(bio_) {
+    handshake_records_ = bio_->records_read;
+  }
+  handshake_ms_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - handshake_start_).count();
+  ctx_.handshake_finished(ssl_, handshake_ms_);
+  LOG_DEBUG << bf("%s: %s handshake complete in %.2f ms")
+    % func % (SSL_session_reused(ssl_) ? "resumed" : "full") % handshake_ms_;
+  if(SSL_EARLY_DATA_REJECTED == SSL_get_early_data_status(ssl_) && !early_sent_.empty()) {
+    // it's small and goes first on a fresh connection, so no need to wait for the socket
+    LOG_DEBUG << bf("%s: server rejected %d bytes of early data, sending them again") % func % early_sent_.size();
+    std::size_t tr = 0;
+    ERR_clear_error();
+    int ret = SSL_write_ex(ssl_, early_sent_.data(), early_sent_.size(), &tr);
+    if(ret <= 0 && failed == result(ret, ec)) {
+      return failed;
+    }
+    if(ret <= 0 || tr != early_sent_.size()) {
+      ec = asio::error::would_block;
+      return failed;
+    }
+  }
+  early_sent_.clear();
+  // resent early data went through openssl, so did everything before
+  if(pipeline_) {
+    LOG_DEBUG << bf("%s: records are sealed %s") % func % (pipeline_->sending() ? "on the crypto pool" : "by openssl");
+    return done;
+  }
+  ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+  if(SSL_get_options(ssl_) & SSL_OP_ENABLE_KTLS) {
+    LOG_DEBUG << bf("%s: kernel tls %s for sending, %s for receiving")
+      % func % (ktls_send_ ? "on" : "unavailable")
+      % (BIO_get_ktls_recv(SSL_get_rbio(ssl_)) ? "on" : "unavailable");
+  }
+  return done;
+}
+
+bool secure_socket::receive_pipelined() {
+  static const char func[] = "secure_socket::receive_pipelined";
+  if(pipeline_->receiving()) {
+    return true;
+  }
+  if(receive_in_openssl_ || !handshake_done_) {
+    return false;
+  }
+  // openssl must not hold anything of the records to come. client lets it take the session
+  // tickets, the server sends them right after the handshake and ahead of the tunnel response
+  if(TLS1_3_VERSION == SSL_version(ssl_)) {
+    if(!SSL_is_server(ssl_) && (!ctx_.tickets_received(ssl_) || !data_read_)) {
+      return false;
+    }
+    if(SSL_has_pending(ssl_) || !bio_->at_boundary()) {
+      return false;
+    }
+  }
+  record_pipeline::key_t key;
+  if(TLS1_3_VERSION != SSL_version(ssl_) || !receiving_key(ssl_, ctx_.peer_traffic_secret(ssl_), key)) {
+    LOG_DEBUG << bf("%s: %s %s records are opened by openssl") % func % SSL_get_version(ssl_) % SSL_get_cipher_name(ssl_);
+    receive_in_openssl_ = true;
+    return false;
+  }
+  auto seq = bio_->records_read - handshake_records_;
+  pipeline_->start_receiving(key, seq);
+  LOG_DEBUG << bf("%s: records are opened on the crypto pool from sequence number %d") % func % seq;
+  return true;
+}
+
+void secure_socket::coalesce(const std::vector<boost::asio::const_buffer>& buffers, write_handler handler) {
+  if(write_error_) {
+    ios_.post(boost::bind(handler, write_error_, 0));
+    return;
+  }
+  pending_buffers_ = buffers;
+  pending_write_ = handler;
+  take_write();
+  schedule_flush();
+}
+
+void secure_socket::take_write() {
+  if(!pending_write_ || coalesced_.size() == max_coalesced) return;
+  std::size_t taken = 0;
+  for(auto i = pending_buffers_.begin(); i != pending_buffers_.end() && coalesced_.size() < max_coalesced; ++i) {
+    auto data = asio::buffer_cast<const char*>(*i);
+    auto size = std::min(asio::buffer_size(*i), max_coalesced - coalesced_.size());
+    coalesced_.insert(coalesced_.end(), data, data + size);
+    taken += size;
+  }
+  auto handler = pending_write_;
+  pending_write_ = write_handler();
+  pending_buffers_.clear();
+  ios_.post(boost::bind(handler, boost::system::error_code(), taken));
+}
+
+void secure_socket::schedule_flush() {
+  if(flushing_ || coalesced_.empty() || write_error_) return;
+  if(flush_delay_.count() && coalesced_.size() < max_record && !pending_write_) {
+    if(!flush_timer_armed_) {
+      flush_timer_armed_ = true;
+      flush_timer_.expires_from_now(flush_delay_);
+      flush_timer_.async_wait(boost::bind(
+        &secure_socket::handle_flush_timer,
+          this,
+          asio::placeholders::error,
+          generation_
+      ));
+    }
+    return;
+  }
+  start_flush();
+}
+
+void secure_socket::start_flush() {
+  // coalesced_ has its capacity reserved, so openssl may be given the same buffer again
+  // while more writes are appended to it
+  flushing_ = coalesced_.size();
+  auto op = boost::make_shared<write_op>();
+  op->data = coalesced_.data();
+  op->size = flushing_;
+  op->handler = boost::bind(
+    &secure_socket::handle_flushed,
+      this,
+      asio::placeholders::error,
+      asio::placeholders::bytes_transferred,
+      generation_
+  );
+  op->generation = generation_;
+  op->initiating = true;
+  do_write(boost::system::error_code(), op);
+  op->initiating = false;
+}
+
+void secure_socket::handle_flushed(const boost::system::error_code& ec, std::size_t bytes, uint64_t generation) {
+  if(generation != generation_) return;
+  flushing_ = 0;
+  if(ec) {
+    write_error_ = ec;
+    if(pending_write_) {
+      auto handler = pending_write_;
+      pending_write_ = write_handler();
+      pending_buffers_.clear();
+      handler(ec, 0);
+    }
+    return;
+  }
+  coalesced_.erase(coalesced_.begin(), coalesced_.begin() + bytes);
+  take_write();
+  schedule_flush();
+}
+
+void secure_socket::handle_flush_timer(const boost::system::error_code& ec, uint64_t generation) {
+  if(ec || generation != generation_) return;
+  flush_timer_armed_ = false;
+  if(!flushing_ && !coalesced_.empty() && !write_error_) {
+    start_flush();
+  }
+}
+
+secure_socket::result_t secure_socket::result(int ret, boost::system::error_code& ec) {
+  switch(SSL_get_error(ssl_, ret)) {
+  case SSL_ERROR_WANT_READ:
+    return want_read;
+  case SSL_ERROR_WANT_WRITE:
+    return want_write;
+  case SSL_ERROR_ZERO_RETURN:
+    ec = asio::error::eof;
+    return failed;
+  case SSL_ERROR_SYSCALL:
+    if(auto e = ERR_get_error()) {
+      ec.assign(e, asio::error::get_ssl_category());
+    }
+    else if(errno) {
+      ec.assign(errno, boost::system::system_category());
+    }
+    else {
+      ec = asio::error::eof;
+    }
+    return failed;
+  default:
+    ec.assign(ERR_get_error(), asio::error::get_ssl_category());
+    return failed;
+  }
 }
 
 }
@@ -1,32 +1,117 @@
 #ifndef SECURE_SOCKET_HPP
 #define SECURE_SOCKET_HPP
 
-#include <boost/asio/ssl/stream.hpp>
-#include <boost/asio/ssl/context.hpp>
+#include <chrono>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/shared_ptr.hpp>
 #include "socket.hpp"
+#include "crypto_pool.hpp"
+#include "record_pipeline.hpp"
+#include "tls_context.hpp"
 
 namespace sp
 {
 
+// tls over tcp. handshake is carried out by the first reads and writes,
+// so connect and accept complete as soon as tcp is established.
+// a client resuming a session that allows 0-rtt sends its writes preceding the first read
+// as early data, they are sent again after the handshake if the server rejects them.
+// established connection coalesces writes: they are taken in at once and packed into records
+// of up to 16 KB, a partly filled one waits for the socket to be free or for flush_delay to pass.
+// once the kernel encrypts outgoing records (ktls) writes go to the tcp socket directly.
+// given a crypto pool, tls 1.3 records of an established connection are sealed and opened
+// on it by a record_pipeline: openssl hands the sending key over like it does to the kernel
+// and receiving is taken over at a record boundary after the handshake (and session tickets)
 class secure_socket: public socket
 {
 public:
-  secure_socket(boost::asio::io_service& ios);
+  secure_socket(
+    boost::asio::io_service& ios,
+    tls_context& ctx,
+    std::chrono::microseconds flush_delay,
+    crypto_pool* pool = nullptr
+  );
+  ~secure_socket();
 
   virtual void async_connect(const acceptor::endpoint_type& peer_endpoint, connect_handler handler);
+  virtual void async_attach(boost::asio::ip::tcp::socket&& connected, connect_handler handler);
   virtual void async_accept(acceptor& acc, acceptor::endpoint_type& remote_ep, accept_handler handler);
+  virtual void async_accept(boost::asio::ip::tcp::socket&& accepted, accept_handler handler);
+  // like async_accept of a socket of another io_service, but the server handshake is carried out
+  // on that one (the thread of an acceptor) before the socket is taken over, handler is posted
+  // to ours. a resumed handshake is cheap and is taken over as soon as it is known to be one,
+  // so 0-rtt requests are still answered early. timeout of zero waits for the peer forever.
+  // with a crypto pool the socket is taken over right away, its records go through ours
+  void async_accept_handshake(boost::asio::ip::tcp::socket&& accepted, std::chrono::milliseconds timeout, accept_handler handler);
   virtual void async_read_some(const boost::asio::mutable_buffers_1& buffers, read_handler handler);
   virtual void async_write_some(const boost::asio::const_buffers_1& buffers, write_handler handler);
+  virtual void async_write_some(const std::vector<boost::asio::const_buffer>& buffers, write_handler handler);
   virtual void cancel(boost::system::error_code& ec);
   virtual void shutdown(boost::system::error_code& ec);
   virtual void close(boost::system::error_code& ec);
+  virtual std::string stats();
+  virtual bool export_keying_material(const std::string& label, unsigned char* out, std::size_t size);
 
 private:
+  enum result_t { done, want_read, want_write, failed };
+  struct read_op;
+  struct write_op;
+  struct record_bio;
+  struct handshake_op;
+
   void handle_connect(const boost::system::error_code& ec, connect_handler h);
   void handle_accept(const boost::system::error_code& ec, accept_handler h);
-  
-  boost::asio::ssl::context ctxt_;
-  boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_strm_;
+  void start_session(bool server, boost::asio::ip::tcp::socket& socket, boost::system::error_code& ec);
+  void end_session();
+
+  void do_handshake(const boost::system::error_code& ec, boost::shared_ptr<handshake_op> op);
+  void handle_handshake_timer(const boost::system::error_code& ec, boost::shared_ptr<handshake_op> op);
+  void take_over(boost::system::error_code ec, boost::shared_ptr<handshake_op> op);
+  void do_read(const boost::system::error_code& ec, boost::shared_ptr<read_op> op);
+  void do_write(const boost::system::error_code& ec, boost::shared_ptr<write_op> op);
+  result_t read(char* data, std::size_t size, std::size_t& tr, boost::system::error_code& ec);
+  result_t write(const char* data, std::size_t size, std::size_t& tr, boost::system::error_code& ec);
+  result_t handshake(boost::system::error_code& ec);
+  result_t result(int ret, boost::system::error_code& ec);
+  bool receive_pipelined();
+
+  void coalesce(const std::vector<boost::asio::const_buffer>& buffers, write_handler handler);
+  void take_write();
+  void schedule_flush();
+  void start_flush();
+  void handle_flushed(const boost::system::error_code& ec, std::size_t bytes, uint64_t generation);
+  void handle_flush_timer(const boost::system::error_code& ec, uint64_t generation);
+
+  boost::asio::io_service& ios_;
+  tls_context& ctx_;
+  boost::asio::ip::tcp::socket socket_;
+  SSL* ssl_;
+  uint64_t generation_; // bumped with every session, operations of older ones are aborted
+  bool handshake_done_;
+  bool early_writable_; // client may still write 0-rtt data
+  bool reading_early_;  // server may still receive 0-rtt data
+  bool ktls_send_;      // kernel encrypts what is written to the socket
+  crypto_pool* pool_;
+  boost::shared_ptr<record_pipeline> pipeline_; // with a crypto pool only
+  boost::shared_ptr<record_bio> bio_;           // socket io of openssl when pipelined
+  uint64_t handshake_records_;                  // records read up to the end of handshake
+  bool receive_in_openssl_;                     // taking over receiving failed
+  bool data_read_;                              // openssl returned application data
+  const std::chrono::microseconds flush_delay_;
+  boost::asio::steady_timer flush_timer_;
+  bool flush_timer_armed_;
+  std::vector<char> coalesced_; // taken from writes, never reallocated while being flushed
+  std::size_t flushing_;        // bytes of coalesced_ being written by openssl
+  std::vector<boost::asio::const_buffer> pending_buffers_;
+  write_handler pending_write_; // waits for room in coalesced_
+  boost::system::error_code write_error_; // reported by writes following the failed flush
+  std::vector<char> gathered_;  // gather list of a write during the handshake
+  std::vector<char> early_sent_;
+  std::vector<char> early_read_; // by a handshake on another io_service, read first
+  std::chrono::steady_clock::time_point handshake_start_;
+  double handshake_ms_;
 };
 
 }
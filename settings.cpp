@@ -2,6 +2,7 @@
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include "settings.hpp"
+#include "batch_cipher.hpp"
 
 namespace po = boost::program_options;
 
@@ -24,7 +25,41 @@ namespace def {
   static const auto log_level = str::severity::warning;
   static const std::string listen("127.0.0.1:443");
   static const bool daemonize(false);
+  static const bool tls_benchmark(false);
+  static const uint32_t storm_benchmark(0);
   static const int32_t reconnect_interval_ms(5000);
+  static const int32_t handshake_timeout_ms(10000);
+  static const int32_t idle_timeout_ms(0);
+  static const int32_t write_stall_timeout_ms(30000);
+  static const int32_t stats_interval_ms(0);
+  static const uint32_t channels(1);
+  static const uint32_t listen_shards(1);
+  static const uint32_t stripes(1);
+  static const bool mptcp(false);
+  static const bool fast_open(false);
+  static const bool optimistic_send(false);
+  static const bool split(false);
+  static const bool datagram(false);
+  static const bool resume(false);
+  static const std::string transport("http1");
+  static const uint32_t http2_window_kb(1024);
+  static const bool tls(false);
+  static const std::string tls_min_version("1.3");
+  static const std::string tls_ciphers("auto");
+  static const std::string seal_cipher("aes-256-gcm");
+  static const uint32_t compress_level(0);
+  static const bool compress_headers(false);
+  static const bool tls_early_data(false);
+  static const bool ktls(false);
+  static const uint32_t crypto_threads(0);
+  static const int32_t tls_flush_delay_us(0);
+  static const int32_t connect_attempt_delay_ms(250);
+  static const int32_t resolve_ttl_ms(300000);
+  static const bool standby(false);
+  static const int32_t standby_ping_interval_ms(15000);
+  static const int32_t probe_interval_ms(10000);
+  static const int32_t upstream_max_rtt_ms(0);
+  static const uint32_t upstream_max_error_percent(50);
 }
 
 void describe(po::options_description& desc, settings* st = nullptr) {
@@ -46,10 +81,49 @@ void describe(po::options_description& desc, settings* st = nullptr) {
     ("log-path,L", po::value<std::string>(st ? &st->log_path : nullptr), "full path to log file. 'syslog' to use syslog, empty for stdout (for non-deamon only)")
     ("log-level", po::value<std::string>()->notifier(severity_handler)->default_value(def::log_level), "log level: trace, debug, info, warning, error or fatal")
     ("daemonize,d", po::bool_switch(st ? &st->daemonize : nullptr)->default_value(def::daemonize), "start as service")
+    ("tls-benchmark", po::bool_switch(st ? &st->tls_benchmark : nullptr)->default_value(def::tls_benchmark), "run a loopback tls tunnel for each suite of 'tls-ciphers', print MB/s, MB/s per cpu core and handshakes/s, then compare their records with frames sealed in batches by each 'seal-cipher', and exit. uses 'crypto-threads', 'ktls' and 'tls-flush-delay-us'")
+    ("storm-benchmark", po::value<uint32_t>(st ? &st->storm_benchmark : nullptr)->default_value(def::storm_benchmark), "connect this many clients at once to a listen mode over loopback, each as a stripe of one session, print the time until all of them are served over tcp, with full tls handshakes and with these resumed, and exit. uses 'listen-shards', 'tls-ciphers', 'tls-early-data', 'crypto-threads' and 'ktls'. 0 to disable")
     ("reconnect-interval-ms", po::value<int32_t>()->default_value(def::reconnect_interval_ms), "client reconnect interval, ms")
+    ("handshake-timeout-ms", po::value<int32_t>()->default_value(def::handshake_timeout_ms), "time allowed from connect/accept to exchanged tunnel headers, ms. 0 to disable")
+    ("idle-timeout-ms", po::value<int32_t>()->default_value(def::idle_timeout_ms), "reset tunnel if nothing is received for this long, ms. 0 to disable")
+    ("write-stall-timeout-ms", po::value<int32_t>()->default_value(def::write_stall_timeout_ms), "reset tunnel if a socket write makes no progress for this long, ms. 0 to disable")
+    ("stats-interval-ms", po::value<int32_t>()->default_value(def::stats_interval_ms), "log transport stats of every tunnel connection this often, ms. 0 to log them on close only")
     // [tunnel options]
     ("listen,l", po::value<std::string>(st ? &st->address : nullptr)->default_value(def::listen), "listen address\nstarts in listen mode")
-    ("connect,c", po::value<std::string>(st ? &st->address : nullptr), "connect address\nstarts in connect mode")
+    ("connect,c", po::value<std::string>(st ? &st->address : nullptr), "connect address or comma separated list of them\nstarts in connect mode")
+    ("channels", po::value<uint32_t>(st ? &st->channels : nullptr)->default_value(def::channels), "number of tap devices, each a separate virtual segment carried over the same tunnel connections. the peers use as many as both have, frames of the others are dropped")
+    ("listen-shards", po::value<uint32_t>(st ? &st->listen_shards : nullptr)->default_value(def::listen_shards), "number of acceptors bound to the listen address with SO_REUSEPORT, each accepting and carrying out tls handshakes on a thread of its own")
+    ("stripes", po::value<uint32_t>(st ? &st->stripes : nullptr)->default_value(def::stripes), "number of parallel connections to stripe the tunnel over, frames of one flow always share a connection (connect mode)")
+    ("mptcp", po::bool_switch(st ? &st->mptcp : nullptr)->default_value(def::mptcp), "use multipath tcp for tunnel connections, falls back to tcp if unsupported")
+    ("tcp-fast-open", po::bool_switch(st ? &st->fast_open : nullptr)->default_value(def::fast_open), "send tunnel request in syn when reconnecting to a known server (connect mode), accept data in syn (listen mode)")
+    ("optimistic-send", po::bool_switch(st ? &st->optimistic_send : nullptr)->default_value(def::optimistic_send), "start sending frames right after the tunnel request instead of waiting for the response, they are sent again if the request fails (connect mode)")
+    ("split", po::bool_switch(st ? &st->split : nullptr)->default_value(def::split), "carry each stripe over two connections, frames are sent in the body of an upload 'POST /tunnel' and received in the response to a download 'GET /tunnel'. for proxies that buffer requests or responses, directions don't wait on each other (connect mode, http1 transport)")
+    ("datagram", po::bool_switch(st ? &st->datagram : nullptr)->default_value(def::datagram), "send frames as encrypted udp datagrams to the listen address and port, keyed by the tls session of a tunnel connection, so inner tcp does not run over tcp. datagrams are at most 1400 bytes, larger frames and frames while datagrams are not answered go over http (requires tls)")
+    ("resume", po::bool_switch(st ? &st->resume : nullptr)->default_value(def::resume), "number the frames of every stripe and keep them until acknowledged, a reconnecting stripe sends again those the server has not received and vice versa, so inner connections survive a reconnect without retransmission timeouts (connect mode, listen mode accepts it)")
+    ("transport", po::value<std::string>()->default_value(def::transport), "'http1': each stripe is a chunked 'POST /tunnel' connection. 'http2': stripes are streams of a single http/2 connection, h2 negotiated with alpn over tls, prior knowledge h2c without (connect mode). 'websocket': each stripe is a 'GET /tunnel' connection upgraded to websocket, a binary message per frame. listen mode accepts all")
+    ("http2-window-kb", po::value<uint32_t>()->default_value(def::http2_window_kb), "receive window of every http/2 stream, the one of the connection is 16 times larger, KB")
+    ("tls", po::bool_switch(st ? &st->tls : nullptr)->default_value(def::tls), "run the tunnel over tls")
+    ("tls-cert", po::value<std::string>(st ? &st->tls_cert : nullptr), "certificate chain file in pem format, required in listen mode, used as client certificate in connect mode")
+    ("tls-key", po::value<std::string>(st ? &st->tls_key : nullptr), "private key file of the certificate in pem format")
+    ("tls-ca", po::value<std::string>(st ? &st->tls_ca : nullptr), "ca certificates to verify the server with (connect mode, system ones if not set) or to require client certificates signed by (listen mode)")
+    ("tls-min-version", po::value<std::string>(st ? &st->tls_min_version : nullptr)->default_value(def::tls_min_version), "lowest tls version allowed: 1.2 or 1.3")
+    ("tls-ciphers", po::value<std::string>(st ? &st->tls_ciphers : nullptr)->default_value(def::tls_ciphers), "cipher policy: 'auto' prefers aes-gcm if the cpu has aes instructions and chacha20-poly1305 otherwise, 'aes-gcm', 'chacha20' or a colon separated list of tls 1.3 suites")
+    ("tls-early-data", po::bool_switch(st ? &st->tls_early_data : nullptr)->default_value(def::tls_early_data), "send tunnel request as tls 1.3 0-rtt data when resuming a session (connect mode), accept such requests (listen mode). replay protected by single use tickets")
+    ("ktls", po::bool_switch(st ? &st->ktls : nullptr)->default_value(def::ktls), "move tls record encryption to the kernel (TCP_ULP \"tls\") after the handshake, openssl keeps doing it if kernel or cipher don't support that")
+    ("crypto-threads", po::value<uint32_t>(st ? &st->crypto_threads : nullptr)->default_value(def::crypto_threads), "seal and open tls 1.3 records of established connections on this many worker threads, several records at once. 0 to leave them to openssl on the network thread")
+    ("tls-flush-delay-us", po::value<int32_t>()->default_value(def::tls_flush_delay_us), "hold a partly filled tls record up to this long for more writes to join it, us. 0 sends it as soon as the socket is free, so records fill up under load only")
+    ("seal-key-file", po::value<std::string>(st ? &st->seal_key : nullptr), "pre-shared key file, 16 bytes or more. frames of plain http tunnels are encrypted in batches, one aead seal per write, with keys derived from it for every connection. the peer must have the same key (excludes 'tls')")
+    ("seal-cipher", po::value<std::string>(st ? &st->seal_cipher : nullptr)->default_value(def::seal_cipher), "aead of sealed batches: 'aes-256-gcm' or 'chacha20-poly1305', the peer must use the same")
+    ("compress-level", po::value<uint32_t>(st ? &st->compress_level : nullptr)->default_value(def::compress_level), "deflate the frames of every write as one batch, 1 for speed to 9 for ratio. frames that look random and flows that don't shrink are sent as they are. flows never share deflate history, but a flow carrying both secrets and data an attacker chooses may leak the secrets through the size of its batches (crime). the peer must compress too, with the same dictionary. 0 to disable")
+    ("compress-dictionary", po::value<std::string>(st ? &st->compress_dictionary : nullptr), "preset dictionary for 'compress-level', e.g. samples of captured tunnel traffic with the most common strings last. up to its last 32 KB are used")
+    ("compress-headers", po::bool_switch(st ? &st->compress_headers : nullptr)->default_value(def::compress_headers), "send only the fields that changed in the ethernet/ipv4/tcp headers of a flow's frames, with the frames of every write in one batch. both ends keep the contexts of every connection. for small packets on narrow links, the peer must compress headers too")
+    ("connect-attempt-delay-ms", po::value<int32_t>()->default_value(def::connect_attempt_delay_ms), "delay before racing the next resolved address while a connect is in progress, ms (connect mode)")
+    ("resolve-ttl-ms", po::value<int32_t>()->default_value(def::resolve_ttl_ms), "cache resolved upstream addresses this long, refreshing them in background. if resolver fails, stale addresses are used. 0 to resolve on every connect, ms")
+    ("standby", po::bool_switch(st ? &st->standby : nullptr)->default_value(def::standby), "keep an extra established connection idle and switch a failed stripe to it at once (connect mode)")
+    ("standby-ping-interval-ms", po::value<int32_t>()->default_value(def::standby_ping_interval_ms), "ping the standby connection this often, it is replaced if a ping is not answered until the next one, ms")
+    ("probe-interval-ms", po::value<int32_t>()->default_value(def::probe_interval_ms), "interval of handshake rtt probes when several connect addresses are given, ms. 0 to probe only at start")
+    ("upstream-max-rtt-ms", po::value<int32_t>()->default_value(def::upstream_max_rtt_ms), "switch to a faster upstream if rtt of the current one is above this, ms. 0 to disable")
+    ("upstream-max-error-percent", po::value<uint32_t>(st ? &st->upstream_max_error_percent : nullptr)->default_value(def::upstream_max_error_percent), "switch away from an upstream if its recent error rate is above this, %")
     ;
 }
 
@@ -98,9 +172,37 @@ void settings::read(int argc, char *argv[]) {
   }
   mode = has_connect ? mode::connect : mode::listen;
 
+  // transport
+  auto tr = map["transport"].as<std::string>();
+  if(boost::iequals(tr, transport::name(transport::http1))) transport = transport::http1;
+  else if(boost::iequals(tr, transport::name(transport::http2))) transport = transport::http2;
+  else if(boost::iequals(tr, transport::name(transport::websocket))) transport = transport::websocket;
+  else throw exception("option 'transport' must be http1, http2 or websocket");
+  auto window_kb = map["http2-window-kb"].as<uint32_t>();
+  if(window_kb < 64 || window_kb > 128 * 1024) {
+    throw exception("option 'http2-window-kb' must be between 64 and 131072");
+  }
+  http2_window = window_kb * 1024;
+
   // reconnect interval
   reconnect_interval = std::chrono::milliseconds(map["reconnect-interval-ms"].as<int32_t>());
 
+  // upstream selection
+  connect_attempt_delay = std::chrono::milliseconds(map["connect-attempt-delay-ms"].as<int32_t>());
+  resolve_ttl = std::chrono::milliseconds(map["resolve-ttl-ms"].as<int32_t>());
+  standby_ping_interval = std::chrono::milliseconds(map["standby-ping-interval-ms"].as<int32_t>());
+  probe_interval = std::chrono::milliseconds(map["probe-interval-ms"].as<int32_t>());
+  upstream_max_rtt = std::chrono::milliseconds(map["upstream-max-rtt-ms"].as<int32_t>());
+
+  // timeouts
+  handshake_timeout = std::chrono::milliseconds(map["handshake-timeout-ms"].as<int32_t>());
+  idle_timeout = std::chrono::milliseconds(map["idle-timeout-ms"].as<int32_t>());
+  write_stall_timeout = std::chrono::milliseconds(map["write-stall-timeout-ms"].as<int32_t>());
+  stats_interval = std::chrono::milliseconds(map["stats-interval-ms"].as<int32_t>());
+
+  // tls record coalescing
+  tls_flush_delay = std::chrono::microseconds(map["tls-flush-delay-us"].as<int32_t>());
+
   validate();
 }
 
@@ -115,17 +217,150 @@ std::string settings::to_string() const {
   __W(log_path);
   __W(daemonize);
   sstr << "\tlog_level: " << boost::log::trivial::to_string(log_level) << '\n';
+  sstr << "\thandshake_timeout: " << handshake_timeout.count() << " ms\n";
+  sstr << "\tidle_timeout: " << idle_timeout.count() << " ms\n";
+  sstr << "\twrite_stall_timeout: " << write_stall_timeout.count() << " ms\n";
+  sstr << "\tstats_interval: " << stats_interval.count() << " ms\n";
+  __W(mptcp);
+  __W(fast_open);
+  __W(channels);
+  __W(tls);
+  if(tls) {
+    __W(tls_cert);
+    __W(tls_key);
+    __W(tls_ca);
+    __W(tls_min_version);
+    __W(tls_ciphers);
+    __W(tls_early_data);
+    __W(ktls);
+    __W(crypto_threads);
+    sstr << "\ttls_flush_delay: " << tls_flush_delay.count() << " us\n";
+  }
+  if(!seal_key.empty()) {
+    __W(seal_key);
+    __W(seal_cipher);
+  }
+  __W(compress_level);
+  if(compress_level) {
+    __W(compress_dictionary);
+  }
+  __W(compress_headers);
   if(mode == mode::listen) {
     sstr << "\tlisten: " << address << '\n';
+    __W(listen_shards);
+    __W(datagram);
   }
   else {
     sstr << "\tconnect: " << address << '\n';
+    __W(stripes);
+    __W(optimistic_send);
+    __W(split);
+    __W(datagram);
+    __W(resume);
+    sstr << "\ttransport: " << transport::name(transport) << '\n';
+    if(transport == transport::http2) {
+      sstr << "\thttp2_window: " << http2_window / 1024 << " KB\n";
+    }
+    sstr << "\tconnect_attempt_delay: " << connect_attempt_delay.count() << " ms\n";
+    sstr << "\tresolve_ttl: " << resolve_ttl.count() << " ms\n";
+    __W(standby);
+    sstr << "\tstandby_ping_interval: " << standby_ping_interval.count() << " ms\n";
+    sstr << "\tprobe_interval: " << probe_interval.count() << " ms\n";
+    sstr << "\tupstream_max_rtt: " << upstream_max_rtt.count() << " ms\n";
+    __W(upstream_max_error_percent);
   }
 #undef __W
   return sstr.str();
 }
 
 void settings::validate() {
+  if(0 == channels || channels > 256) {
+    // channel prefix of a multiplexed frame is a byte
+    throw exception("option 'channels' must be from 1 to 256");
+  }
+  if(0 == listen_shards) {
+    throw exception("option 'listen-shards' must be at least 1");
+  }
+  if(0 == stripes) {
+    throw exception("option 'stripes' must be at least 1");
+  }
+  if(handshake_timeout.count() < 0 || idle_timeout.count() < 0 || write_stall_timeout.count() < 0) {
+    throw exception("timeouts must not be negative");
+  }
+  if(stats_interval.count() < 0) {
+    throw exception("option 'stats-interval-ms' must not be negative");
+  }
+  if(tls && mode == mode::listen && tls_cert.empty()) {
+    throw exception("option 'tls-cert' is required for tls in listen mode");
+  }
+  if(!tls_cert.empty() && tls_key.empty()) {
+    throw exception("option 'tls-key' is required with 'tls-cert'");
+  }
+  if(tls_min_version != "1.2" && tls_min_version != "1.3") {
+    throw exception("option 'tls-min-version' must be 1.2 or 1.3");
+  }
+  if(tls_ciphers.empty()) {
+    throw exception("option 'tls-ciphers' must not be empty");
+  }
+  if(tls_flush_delay.count() < 0) {
+    throw exception("option 'tls-flush-delay-us' must not be negative");
+  }
+  if(crypto_threads && ktls) {
+    throw exception("options 'crypto-threads' and 'ktls' are mutually exclusive");
+  }
+  if(connect_attempt_delay.count() < 10) {
+    // RFC 8305 minimum, less would flood the network with parallel handshakes
+    throw exception("option 'connect-attempt-delay-ms' must be at least 10");
+  }
+  if(standby && transport == transport::http2) {
+    // streams share the connection a standby would protect against
+    throw exception("options 'standby' and 'transport http2' are mutually exclusive");
+  }
+  if(split && transport != transport::http1) {
+    throw exception("option 'split' requires 'transport http1'");
+  }
+  if(split && standby) {
+    throw exception("options 'split' and 'standby' are mutually exclusive");
+  }
+  if(datagram && !tls) {
+    // datagrams are keyed from the tls session
+    throw exception("option 'datagram' requires 'tls'");
+  }
+  if(datagram && mode == mode::connect && transport == transport::http2) {
+    // streams don't expose the tls session of their connection
+    throw exception("options 'datagram' and 'transport http2' are mutually exclusive");
+  }
+  if(resume && (standby || split || optimistic_send)) {
+    // standby and split stripes have no single connection to number frames on,
+    // optimistic frames would go out before the response tells where to resume
+    throw exception("option 'resume' excludes 'standby', 'split' and 'optimistic-send'");
+  }
+  if(!seal_key.empty() && tls) {
+    throw exception("options 'seal-key-file' and 'tls' are mutually exclusive");
+  }
+  if(!batch_cipher::supported(seal_cipher)) {
+    throw exception("option 'seal-cipher' must be 'aes-256-gcm' or 'chacha20-poly1305'");
+  }
+  if(compress_level > 9) {
+    throw exception("option 'compress-level' must be from 0 to 9");
+  }
+  if(!compress_dictionary.empty() && !compress_level) {
+    throw exception("option 'compress-dictionary' requires 'compress-level'");
+  }
+  if((!seal_key.empty() || compress_level || compress_headers) && (standby || split || optimistic_send)) {
+    // batched body framing: standby pings are written around the tap loop, split uploads and optimistic
+    // frames would go out before the response brings the seal nonce and tells what the server takes
+    throw exception("options 'seal-key-file', 'compress-level' and 'compress-headers' exclude 'standby', 'split' and 'optimistic-send'");
+  }
+  if(standby_ping_interval.count() <= 0) {
+    throw exception("option 'standby-ping-interval-ms' must be positive");
+  }
+  if(resolve_ttl.count() < 0) {
+    throw exception("option 'resolve-ttl-ms' must not be negative");
+  }
+  if(probe_interval.count() < 0 || upstream_max_rtt.count() < 0) {
+    throw exception("upstream probe interval and max rtt must not be negative");
+  }
 }
 
 std::string settings::mode::name(settings::mode::code_t c) {
@@ -136,6 +371,15 @@ std::string settings::mode::name(settings::mode::code_t c) {
   }
 }
 
+std::string settings::transport::name(settings::transport::code_t c) {
+  switch(c) {
+  case http1: return "http1";
+  case http2: return "http2";
+  case websocket: return "websocket";
+  default: return "unknown";
+  }
+}
+
 
 }
 
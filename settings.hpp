@@ -26,6 +26,13 @@ public:
   std::string pid_path;
   bool daemonize;
   std::chrono::milliseconds reconnect_interval;
+  // deadlines, zero disables
+  std::chrono::milliseconds handshake_timeout;   // connection start to tunnel headers exchanged
+  std::chrono::milliseconds idle_timeout;        // nothing received from peer
+  std::chrono::milliseconds write_stall_timeout; // socket write makes no progress
+  std::chrono::milliseconds stats_interval;      // period of connection stats logging, zero logs on close only
+  bool tls_benchmark; // measure tls throughput and handshake rate over loopback and exit
+  uint32_t storm_benchmark; // clients of a reconnect storm against listen mode over loopback, run it and exit if not zero
 
   // [tunnel options]
   struct mode {
@@ -33,7 +40,48 @@ public:
     static std::string name(code_t);
   };
   mode::code_t mode;   // operating mode
-  std::string address; // listen/conect address
+  std::string address; // listen/conect address, connect accepts comma separated list of upstreams
+  uint32_t channels;      // tap devices, each a virtual segment of its own sharing the tunnel
+  uint32_t listen_shards; // number of SO_REUSEPORT acceptors in listen mode
+  uint32_t stripes;       // number of connections the tunnel is striped over in connect mode
+  bool mptcp;             // use multipath tcp if the kernel supports it
+  bool fast_open;         // tcp fast open on tunnel connections
+  bool optimistic_send;   // send frames before tunnel response arrives in connect mode
+  bool split;             // stripes are an upload and a download connection in connect mode
+  bool datagram;          // frames as udp datagrams keyed by the tls session, http when udp is blocked
+  bool resume;            // reconnecting stripes send again the frames their peer has not received
+  struct transport {
+    enum code_t { http1, http2, websocket };
+    static std::string name(code_t);
+  };
+  transport::code_t transport; // of connect mode, listen mode serves all
+  uint32_t http2_window;       // receive window of an http/2 stream, bytes
+  // tls, plain http if disabled
+  bool tls;
+  std::string tls_cert;        // certificate chain, required in listen mode
+  std::string tls_key;         // private key of the certificate
+  std::string tls_ca;          // verifies server (connect mode, system store if empty) or client certificates (listen mode)
+  std::string tls_min_version; // 1.2 or 1.3
+  std::string tls_ciphers;     // cipher policy: auto, aes-gcm, chacha20 or a list of tls 1.3 suites
+  bool tls_early_data;         // 0-rtt tunnel request on resumed sessions
+  bool ktls;                   // hand record encryption to the kernel when it supports the cipher
+  uint32_t crypto_threads;     // workers sealing and opening tls 1.3 records, zero leaves them to openssl
+  std::chrono::microseconds tls_flush_delay; // partial record waits for more writes, zero flushes once socket is free
+  // sealed batches, plain http tunnels encrypted without tls
+  std::string seal_key;        // pre-shared key file, empty disables sealing
+  std::string seal_cipher;     // aes-256-gcm or chacha20-poly1305
+  // compressed batches
+  uint32_t compress_level;         // deflate level 1 to 9, zero disables compression
+  std::string compress_dictionary; // preset dictionary file, none if empty
+  bool compress_headers;           // inner ethernet/ipv4/tcp headers against per flow contexts
+  std::chrono::milliseconds connect_attempt_delay; // stagger of parallel connects to resolved endpoints
+  std::chrono::milliseconds resolve_ttl;           // lifetime of cached resolutions, zero disables cache
+  bool standby;                                    // keep an extra connection to fail over to
+  std::chrono::milliseconds standby_ping_interval; // keepalive of the standby connection
+  // upstream selection when several connect addresses are given
+  std::chrono::milliseconds probe_interval;   // zero probes only once at start
+  std::chrono::milliseconds upstream_max_rtt; // switch away from slower upstream, zero disables
+  uint32_t upstream_max_error_percent;        // upstream with higher error rate is unhealthy
 };
 
 }
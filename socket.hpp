@@ -3,6 +3,7 @@
 
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/function.hpp>
+#include <string>
 
 namespace sp
 {
@@ -12,9 +13,13 @@ public:
   typedef boost::asio::ip::tcp::acceptor acceptor;
   typedef boost::function<void(const boost::system::error_code&)> connect_handler;
   virtual void async_connect(const acceptor::endpoint_type& peer_endpoint, connect_handler handler) = 0;
+  // takes over an already connected tcp socket and completes connection on it
+  virtual void async_attach(boost::asio::ip::tcp::socket&& connected, connect_handler handler) = 0;
 
   typedef boost::function<void(const boost::system::error_code&)> accept_handler;
   virtual void async_accept(acceptor& acc, acceptor::endpoint_type& remote_ep, accept_handler handler) = 0;
+  // takes over a tcp socket accepted on another io_service and completes accepting on it
+  virtual void async_accept(boost::asio::ip::tcp::socket&& accepted, accept_handler handler) = 0;
 
   typedef boost::function<void(const boost::system::error_code&, std::size_t)> read_handler;
   virtual void async_read_some(const boost::asio::mutable_buffers_1& buffers, read_handler handler) = 0;
@@ -26,6 +31,13 @@ public:
   virtual void cancel(boost::system::error_code& ec) = 0;
   virtual void shutdown(boost::system::error_code& ec) = 0;
   virtual void close(boost::system::error_code& ec) = 0;
+
+  // human readable transport statistics of the connection, for logging
+  virtual std::string stats() = 0;
+
+  // keying material exported from the tls session securing the connection (rfc 5705),
+  // false if there is none or its handshake is not complete
+  virtual bool export_keying_material(const std::string&, unsigned char*, std::size_t) { return false; }
 };
 
 }
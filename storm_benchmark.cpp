@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/asio/placeholders.hpp>
+#include "storm_benchmark.hpp"
+#include "tls_benchmark.hpp"
+#include "normal_socket.hpp"
+#include "secure_socket.hpp"
+#include "tunnel_protocol.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace {
+  static const std::chrono::seconds storm_timeout(60); // clients not served by then fail the run
+  static const std::size_t response_buffer_size = 4096;
+  static const char response_end[] = "\r\n\r\n";
+  static const char response_ok[] = "HTTP/1.1 200 ";
+  static const char session[] = "storm-benchmark";
+
+  void run_ios(asio::io_service& ios) {
+    ios.run();
+  }
+
+  double ms_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+}
+
+// a stripe of the peer, its connections of earlier storms are left open for the listener to replace
+struct storm_benchmark::client_t {
+  std::size_t stripe;
+  asio::io_service* ios;              // of its worker
+  boost::shared_ptr<tls_context> tls; // keeps the tickets of the first storm, tls only
+  boost::shared_ptr<socket> sock;
+  std::vector<boost::shared_ptr<socket> > replaced;
+  std::string request;
+  std::size_t written;
+  std::vector<char> response;
+  std::size_t received;
+  double served_ms;
+  bool served;
+};
+
+storm_benchmark::storm_benchmark(settings st)
+  : st_(st)
+  , listen_st_(st)
+  , client_st_(st)
+  , storm_timer_(ios_)
+  , timed_out_(false)
+  , port_(0)
+  , worker_count_(std::max(1u, boost::thread::hardware_concurrency()))
+  , ended_(0)
+{}
+
+int storm_benchmark::run() {
+  static const char func[] = "storm_benchmark::run";
+  try {
+    setup_logging(st_);
+  }
+  catch(const std::exception& ex) {
+    std::cout << "Exception while setting up logging: " << ex.what() << std::endl;
+    return -10;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  // each client takes a descriptor on both ends
+  rlimit files;
+  if(0 == getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+  if(!tls_benchmark::make_certificate(dir_)) {
+    return -20;
+  }
+  client_st_.mode = settings::mode::connect;
+  client_st_.tls = true;
+  client_st_.tls_cert.clear();
+  client_st_.tls_key.clear();
+  client_st_.tls_ca = tls_benchmark::certificate_path(dir_);
+
+  try {
+    // shards bind the same port with SO_REUSEPORT, so it can't be left to each of them
+    asio::ip::tcp::acceptor probe(ios_, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    port_ = probe.local_endpoint().port();
+  }
+  catch(const std::exception& ex) {
+    LOG_ERROR << bf("%s: failed to find a free port on loopback: %s") % func % ex.what();
+    tls_benchmark::remove_certificate(dir_);
+    return -30;
+  }
+
+  std::cout << bf("%d clients, %d listen shard(s), %d client thread(s)\n")
+    % st_.storm_benchmark % st_.listen_shards % worker_count_;
+  std::cout << bf("%-24s %14s %12s %12s %8s\n") % "storm" % "all served ms" % "median ms" % "served/s" % "failed";
+  int ret = 0;
+  for(int tls = 0; tls < 2 && 0 == ret; ++tls) {
+    if(!start_listener(tls)) {
+      ret = -40;
+      break;
+    }
+    start_workers();
+    result_t r = {0, 0, 0};
+    if(!storm(false, r)) {
+      ret = -50;
+    }
+    else {
+      print(tls ? "tls full handshakes" : "tcp", r);
+    }
+    if(tls && 0 == ret) {
+      if(!storm(true, r)) {
+        ret = -50;
+      }
+      else {
+        print(st_.tls_early_data ? "tls resumed, 0-rtt" : "tls resumed", r);
+      }
+    }
+    // clients go last, the listener would log each of them leaving
+    stop_listener();
+    stop_workers();
+  }
+  tls_benchmark::remove_certificate(dir_);
+  return ret;
+}
+
+bool storm_benchmark::start_listener(bool tls) {
+  static const char func[] = "storm_benchmark::start_listener";
+  listen_st_ = st_;
+  listen_st_.mode = settings::mode::listen;
+  listen_st_.address = boost::str(bf("127.0.0.1:%d") % port_);
+  listen_st_.channels = 1;
+  listen_st_.tls = tls;
+  listen_st_.tls_cert = tls_benchmark::certificate_path(dir_);
+  listen_st_.tls_key = tls_benchmark::key_path(dir_);
+  listen_st_.tls_ca.clear();
+  listen_st_.seal_key.clear();
+  listen_st_.compress_level = 0;
+  listen_st_.compress_headers = false;
+  listen_st_.datagram = false;
+
+  // the tap goes with the listen mode, its descriptor can't be taken over by another one
+  int pair[2];
+  if(-1 == socketpair(AF_UNIX, SOCK_DGRAM, 0, pair)) {
+    LOG_ERROR << bf("%s: failed to create socketpair for the tap: %s") % func % strerror(errno);
+    return false;
+  }
+  taps_.push_back(boost::make_shared<scoped_descriptor>(pair[0]));
+  tap_peer_ = boost::make_shared<scoped_descriptor>(pair[1]);
+  listen_ios_ = boost::make_shared<asio::io_service>();
+  listen_work_ = boost::make_shared<asio::io_service::work>(*listen_ios_);
+  try {
+    listener_ = boost::make_shared<listen_mode>(*listen_ios_, listen_st_, taps_);
+    listener_->setup();
+  }
+  catch(const std::exception& ex) {
+    LOG_ERROR << bf("%s: failed to start listen mode: %s") % func % ex.what();
+    listener_.reset();
+    listen_work_.reset();
+    listen_ios_.reset();
+    taps_.clear();
+    tap_peer_.reset();
+    return false;
+  }
+  listen_thread_ = boost::thread(boost::bind(&run_ios, boost::ref(*listen_ios_)));
+  return true;
+}
+
+void storm_benchmark::stop_listener() {
+  listen_ios_->stop();
+  listen_thread_.join();
+  listener_.reset();
+  listen_work_.reset();
+  listen_ios_.reset();
+  taps_.clear();
+  tap_peer_.reset();
+}
+
+void storm_benchmark::start_workers() {
+  workers_ = boost::make_shared<boost::thread_group>();
+  for(std::size_t i = 0; i < worker_count_; ++i) {
+    workers_ios_.push_back(boost::make_shared<asio::io_service>());
+    work_.push_back(boost::make_shared<asio::io_service::work>(*workers_ios_.back()));
+    workers_->create_thread(boost::bind(&run_ios, boost::ref(*workers_ios_.back())));
+  }
+}
+
+void storm_benchmark::stop_workers() {
+  work_.clear();
+  for(auto i = workers_ios_.begin(); i != workers_ios_.end(); ++i) {
+    (*i)->stop();
+  }
+  workers_->join_all();
+  workers_.reset();
+  clients_.clear();
+  workers_ios_.clear();
+}
+
+// connections of a resumed storm replace those of the previous one
+bool storm_benchmark::storm(bool resume, result_t& r) {
+  static const char func[] = "storm_benchmark::storm";
+  if(!resume) {
+    for(std::size_t i = 0; i < st_.storm_benchmark; ++i) {
+      auto c = boost::make_shared<client_t>();
+      c->stripe = i;
+      c->ios = workers_ios_[i % workers_ios_.size()].get();
+      if(listen_st_.tls) {
+        try {
+          c->tls = boost::make_shared<tls_context>(client_st_);
+        }
+        catch(const std::exception& ex) {
+          LOG_ERROR << bf("%s: failed to set up tls of a client: %s") % func % ex.what();
+          return false;
+        }
+        c->tls->set_server_name("127.0.0.1");
+      }
+      clients_.push_back(c);
+    }
+  }
+
+  ended_ = 0;
+  timed_out_ = false;
+  start_ = std::chrono::steady_clock::now();
+  for(auto i = clients_.begin(); i != clients_.end(); ++i) {
+    (*i)->ios->post(boost::bind(&storm_benchmark::start_client, this, *i));
+  }
+  storm_timer_.expires_from_now(storm_timeout);
+  storm_timer_.async_wait(boost::bind(
+    &storm_benchmark::handle_storm_timer, this, asio::placeholders::error));
+  ios_.reset();
+  ios_.run();
+  if(timed_out_) {
+    LOG_ERROR << bf("%s: %d of %d clients not served within %d s")
+      % func % (clients_.size() - ended_) % clients_.size() % storm_timeout.count();
+    return false;
+  }
+
+  std::vector<double> served;
+  for(auto i = clients_.begin(); i != clients_.end(); ++i) {
+    if((*i)->served) {
+      served.push_back((*i)->served_ms);
+    }
+  }
+  std::sort(served.begin(), served.end());
+  r.all_ms = served.empty() ? 0 : served.back();
+  r.median_ms = served.empty() ? 0 : served[served.size() / 2];
+  r.failed = clients_.size() - served.size();
+  return 0 == r.failed;
+}
+
+void storm_benchmark::print(const std::string& name, const result_t& r) {
+  std::cout << bf("%-24s %14.1f %12.1f %12.1f %8d\n")
+    % name % r.all_ms % r.median_ms
+    % (r.all_ms > 0 ? (clients_.size() - r.failed) * 1000. / r.all_ms : 0.)
+    % r.failed;
+  std::cout.flush();
+}
+
+void storm_benchmark::handle_storm_end() {
+  storm_timer_.cancel();
+}
+
+void storm_benchmark::handle_storm_timer(const boost::system::error_code& ec) {
+  if(ec == asio::error::operation_aborted) {
+    return;
+  }
+  timed_out_ = true;
+}
+
+/*\
+ *  clients, each on the thread of its worker
+\*/
+void storm_benchmark::start_client(boost::shared_ptr<client_t> c) {
+  if(c->sock) {
+    c->replaced.push_back(c->sock);
+  }
+  if(c->tls) {
+    c->sock = boost::make_shared<secure_socket>(*c->ios, *c->tls, client_st_.tls_flush_delay);
+  }
+  else {
+    c->sock = boost::make_shared<normal_socket>(*c->ios);
+  }
+  c->request = boost::str(bf(
+    "POST %s HTTP/1.1\r\n"
+    "Host: 127.0.0.1:%d\r\n"
+    "User-Agent: secret-passage\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "%s: %s\r\n"
+    "%s: %d\r\n"
+    "\r\n")
+    % protocol::tunnel_path % port_
+    % protocol::session_header % session
+    % protocol::stripe_header % c->stripe);
+  c->written = 0;
+  c->response.resize(response_buffer_size);
+  c->received = 0;
+  c->served = false;
+  c->sock->async_connect(
+    asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port_),
+    boost::bind(
+      &storm_benchmark::handle_connect,
+        this,
+        asio::placeholders::error,
+        c
+    )
+  );
+}
+
+void storm_benchmark::handle_connect(const boost::system::error_code& ec, boost::shared_ptr<client_t> c) {
+  if(ec) {
+    return end_client(*c, "connect", ec);
+  }
+  write_request(c);
+}
+
+void storm_benchmark::write_request(boost::shared_ptr<client_t> c) {
+  c->sock->async_write_some(
+    asio::buffer(static_cast<const void*>(c->request.data() + c->written), c->request.size() - c->written),
+    boost::bind(
+      &storm_benchmark::handle_write,
+        this,
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred,
+        c
+    )
+  );
+}
+
+void storm_benchmark::handle_write(const boost::system::error_code& ec, std::size_t bytes, boost::shared_ptr<client_t> c) {
+  if(ec) {
+    return end_client(*c, "write request", ec);
+  }
+  c->written += bytes;
+  if(c->written < c->request.size()) {
+    return write_request(c);
+  }
+  read_response(c);
+}
+
+void storm_benchmark::read_response(boost::shared_ptr<client_t> c) {
+  c->sock->async_read_some(
+    asio::buffer(c->response.data() + c->received, c->response.size() - c->received),
+    boost::bind(
+      &storm_benchmark::handle_read,
+        this,
+        asio::placeholders::error,
+        asio::placeholders::bytes_transferred,
+        c
+    )
+  );
+}
+
+// served once the response head is in, the connection stays open like a stripe would
+void storm_benchmark::handle_read(const boost::system::error_code& ec, std::size_t bytes, boost::shared_ptr<client_t> c) {
+  if(ec) {
+    return end_client(*c, "read response", ec);
+  }
+  c->received += bytes;
+  auto begin = c->response.begin();
+  auto end = begin + c->received;
+  if(std::search(begin, end, response_end, response_end + sizeof(response_end) - 1) == end) {
+    if(c->received == c->response.size()) {
+      return end_client(*c, "read response", asio::error::message_size);
+    }
+    return read_response(c);
+  }
+  if(c->received < sizeof(response_ok) - 1 || !std::equal(response_ok, response_ok + sizeof(response_ok) - 1, begin)) {
+    return end_client(*c, "be served", boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+  }
+  c->served_ms = ms_since(start_);
+  c->served = true;
+  end_client(*c, nullptr, boost::system::error_code());
+}
+
+void storm_benchmark::end_client(client_t& c, const char* what, const boost::system::error_code& ec) {
+  static const char func[] = "storm_benchmark::end_client";
+  if(what) {
+    LOG_ERROR << bf("%s: stripe %d failed to %s: %s") % func % c.stripe % what % ec.message();
+  }
+  if(++ended_ == clients_.size()) {
+    ios_.post(boost::bind(&storm_benchmark::handle_storm_end, this));
+  }
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef STORM_BENCHMARK_HPP
+#define STORM_BENCHMARK_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include "settings.hpp"
+#include "scoped_descriptor.hpp"
+#include "socket.hpp"
+#include "tls_context.hpp"
+#include "listen_mode.hpp"
+
+namespace sp
+{
+
+// reconnect storm against a listen mode over loopback, like a peer coming back after a blip.
+// all clients connect at once, each as a stripe of one session, and wait for the response to
+// their tunnel request. reports the time until all of them are served over tcp, with full tls
+// handshakes and again resuming those, while the connections they replace are still open.
+// the tap of the listen mode is a socketpair. listen shards, tls ciphers, early data, crypto
+// threads and ktls are taken from settings, clients run on a thread per cpu core
+class storm_benchmark
+{
+public:
+  storm_benchmark(settings st);
+  int run();
+
+private:
+  struct client_t;
+  struct result_t {
+    double all_ms;    // until the last client is served
+    double median_ms;
+    std::size_t failed;
+  };
+
+  bool start_listener(bool tls);
+  void stop_listener();
+  void start_workers();
+  void stop_workers();
+  bool storm(bool resume, result_t& r);
+  void print(const std::string& name, const result_t& r);
+
+  // run on the thread of the client's worker
+  void start_client(boost::shared_ptr<client_t> c);
+  void handle_connect(const boost::system::error_code& ec, boost::shared_ptr<client_t> c);
+  void write_request(boost::shared_ptr<client_t> c);
+  void handle_write(const boost::system::error_code& ec, std::size_t bytes, boost::shared_ptr<client_t> c);
+  void read_response(boost::shared_ptr<client_t> c);
+  void handle_read(const boost::system::error_code& ec, std::size_t bytes, boost::shared_ptr<client_t> c);
+  void end_client(client_t& c, const char* what, const boost::system::error_code& ec);
+
+  void handle_storm_end();
+  void handle_storm_timer(const boost::system::error_code& ec);
+
+  settings st_;
+  settings listen_st_;
+  settings client_st_;
+  std::string dir_; // of the certificate
+  boost::asio::io_service ios_; // waits for storms to end
+  boost::asio::steady_timer storm_timer_;
+  bool timed_out_;
+
+  std::vector<shared_descriptor> taps_; // an end of a socketpair, one for each listen mode
+  shared_descriptor tap_peer_;          // the other end, nothing is written to it
+  uint16_t port_;
+  boost::shared_ptr<boost::asio::io_service> listen_ios_;
+  boost::shared_ptr<boost::asio::io_service::work> listen_work_; // acceptors are on the shards
+  boost::shared_ptr<listen_mode> listener_;
+  boost::thread listen_thread_;
+
+  std::size_t worker_count_;
+  std::vector<boost::shared_ptr<boost::asio::io_service> > workers_ios_;
+  std::vector<boost::shared_ptr<boost::asio::io_service::work> > work_;
+  boost::shared_ptr<boost::thread_group> workers_;
+
+  std::vector<boost::shared_ptr<client_t> > clients_;
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<std::size_t> ended_; // clients served or failed in the current storm
+};
+
+}
+
+#endif // STORM_BENCHMARK_HPP
@@ -0,0 +1,56 @@
+#include <boost/make_shared.hpp>
+#include "tap_set.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+tap_set::tap_set(asio::io_service& ios, const std::vector<shared_descriptor>& taps)
+  : multiplexed_(0)
+{
+  for(auto i = taps.begin(); i != taps.end(); ++i) {
+    taps_.push_back(boost::make_shared<asio::posix::stream_descriptor>(ios, (*i)->get()));
+  }
+}
+
+std::size_t tap_set::size() const {
+  return taps_.size();
+}
+
+asio::posix::stream_descriptor& tap_set::operator[](std::size_t channel) {
+  return *taps_[channel];
+}
+
+void tap_set::multiplex(std::size_t channels) {
+  multiplexed_ = channels;
+}
+
+std::size_t tap_set::multiplexed() const {
+  return multiplexed_;
+}
+
+bool tap_set::carried(std::size_t channel) const {
+  return multiplexed_ ? channel < multiplexed_ : 0 == channel;
+}
+
+bool tap_set::demux(std::vector<char>&& data, frame_t& frame) const {
+  if(!multiplexed_) {
+    frame.channel = 0;
+    frame.offset = 0;
+  }
+  else if(data.empty()) {
+    return false;
+  }
+  else {
+    frame.channel = static_cast<unsigned char>(data.front());
+    frame.offset = 1;
+  }
+  if(frame.channel >= taps_.size()) {
+    return false;
+  }
+  frame.data = std::move(data);
+  return true;
+}
+
+}
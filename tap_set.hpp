@@ -0,0 +1,54 @@
+#ifndef TAP_SET_HPP
+#define TAP_SET_HPP
+
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/shared_ptr.hpp>
+#include "scoped_descriptor.hpp"
+
+namespace sp
+{
+
+// tap devices of a tunnel, one per channel, all sharing its connections.
+// multiplexed frames carry their channel in a byte ahead of the frame, see protocol::cap_channels,
+// otherwise only channel 0 is carried and its frames go bare
+class tap_set
+{
+public:
+  // frame received from the peer on its way to the tap of its channel
+  struct frame_t {
+    std::size_t channel = 0;
+    std::size_t offset = 0;  // of the frame, behind the channel prefix
+    std::vector<char> data;
+
+    boost::asio::const_buffer buffer() const {
+      return boost::asio::buffer(data.data() + offset, data.size() - offset);
+    }
+    std::size_t size() const {
+      return data.size() - offset;
+    }
+  };
+
+  tap_set(boost::asio::io_service& ios, const std::vector<shared_descriptor>& taps);
+
+  std::size_t size() const;
+  boost::asio::posix::stream_descriptor& operator[](std::size_t channel);
+
+  // channels the peer takes, 0 for bare frames of channel 0
+  void multiplex(std::size_t channels);
+  std::size_t multiplexed() const;
+  // frames read from the tap of the channel go to the peer
+  bool carried(std::size_t channel) const;
+  // false if the frame is for a channel with no tap here, it's dropped then
+  bool demux(std::vector<char>&& data, frame_t& frame) const;
+
+private:
+  std::vector<boost::shared_ptr<boost::asio::posix::stream_descriptor> > taps_;
+  std::size_t multiplexed_;
+};
+
+}
+
+#endif // TAP_SET_HPP
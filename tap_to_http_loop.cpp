@@ -1,8 +1,13 @@
+#include <deque>
+#include <map>
+#include <sstream>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/asio/placeholders.hpp>
-#include <boost/asio/streambuf.hpp>
-#include <boost/asio/buffers_iterator.hpp>
 #include "tap_to_http_loop.hpp"
+#include "flow_hash.hpp"
+#include "websocket.hpp"
 #include "logging.hpp"
 
 namespace asio = boost::asio;
@@ -12,135 +17,781 @@ namespace sp
 
 namespace {
 static const char CRLF[] = "\r\n";
+static const std::size_t max_frame_size = 65536;
+static const std::size_t max_queued_frames = 256; // per stripe, newer frames are dropped
+static const std::size_t max_gathered_chunks = 64; // per write
+static const std::size_t max_unacked_frames = 4096; // per resumable stripe, older ones are lost on resuming
+static const std::size_t max_unacked_bytes = 16 << 20; // same
+static const std::chrono::milliseconds max_hold(1000);  // flows wait that long for a removed stripe to resume
+
+// drop first n bytes from the buffer sequence
+void consume(std::vector<asio::const_buffer>& buffers, std::size_t n) {
+  auto i = buffers.begin();
+  for(; i != buffers.end() && n >= asio::buffer_size(*i); ++i) {
+    n -= asio::buffer_size(*i);
+  }
+  buffers.erase(buffers.begin(), i);
+  if(!buffers.empty()) {
+    buffers.front() = buffers.front() + n;
+  }
+}
+
+// chunk size line, length prefix or websocket header of a body frame of size bytes.
+// a masked websocket header gets a new mask, the frame is to be masked with
+void frame_head(std::string& head, protocol::framing_t framing, std::size_t size, unsigned char* mask) {
+  if(protocol::length_prefixed == framing) {
+    head.push_back(size >> 8);
+    head.push_back(size);
+  }
+  else if(protocol::websocket == framing || protocol::websocket_masked == framing) {
+    websocket::append_header(head, websocket::binary, size, protocol::websocket_masked == framing ? mask : nullptr);
+  }
+  else {
+    std::ostringstream sstr;
+    sstr << std::hex << size << CRLF;
+    head = sstr.str();
+  }
+}
 }
 
 /*\
  *  class tap_to_http_loop::private_t
 \*/
-class tap_to_http_loop::private_t {
+class tap_to_http_loop::private_t: public boost::enable_shared_from_this<private_t> {
 public:
-  private_t(boost::shared_ptr<socket>, asio::posix::stream_descriptor& tap, loop_stop_handler lsh);
-  void start();
+  private_t(tap_set& taps, timing_wheel& wheel, std::chrono::milliseconds write_stall_timeout);
+  void add_stripe(std::size_t index, boost::shared_ptr<socket> socket, loop_stop_handler lsh, bool confirmed, protocol::framing_t framing,
+    boost::shared_ptr<batch_cipher> seal, boost::shared_ptr<batch_compressor> compress, boost::shared_ptr<header_compressor> headers);
+  void confirm_stripe(std::size_t index);
+  void remove_stripe(std::size_t index);
+  std::size_t stripes() const;
+  bool send_control(std::size_t index, const std::vector<char>& message);
+  bool send_websocket_control(std::size_t index, websocket::opcode_t opcode, const std::vector<char>& payload);
+  void divert(divert_handler handler);
+  void resume_stripe(std::size_t index, uint64_t peer_received);
+  void acknowledge(std::size_t index, uint64_t peer_received);
+  void forget_resumes();
 
 private:
-  void async_read_tap();
-  void handle_read_tap(const boost::system::error_code& ec, std::size_t tr);
+  struct chunk_t {
+    std::string size_line; // or length prefix or websocket header
+    std::vector<char> frame;
+    std::vector<char> masked; // what is written of a masked websocket frame, frame stays clear for replays
+    bool control;
+    websocket::opcode_t opcode = websocket::binary; // any other goes as a websocket frame of its own
+  };
+
+  struct stripe_t {
+    std::size_t index;
+    boost::shared_ptr<socket> sock;
+    loop_stop_handler loop_stop;
+    protocol::framing_t framing;
 
-  void async_write_http_chunk();
-  void handle_write_http_chunk(const boost::system::error_code& ec, std::size_t tr);
+    std::deque<chunk_t> queue;  // front in_flight chunks are being written
+    std::size_t in_flight = 0;
+    std::vector<asio::const_buffer> buffers; // part of in flight chunks not yet written
+    timing_wheel::timer_id write_timer = timing_wheel::no_timer;
+    std::size_t dropped = 0;
+    bool removed = false;
+    bool closing = false; // websocket close is queued
+    bool confirmed = true;
+    std::deque<std::vector<char> > unconfirmed; // frames written before confirmation
 
-  asio::posix::stream_descriptor& tap_;
-  boost::shared_ptr<socket> socket_;
-  loop_stop_handler loop_stop_;
+    boost::shared_ptr<batch_cipher> seal;         // only sealed
+    boost::shared_ptr<batch_compressor> compress; // only compressed
+    boost::shared_ptr<header_compressor> headers; // only with compressed headers
+    std::string batch_head;
+    std::vector<char> batch; // frames of the chunks in flight, compressed and sealed
 
-  asio::streambuf chunk_size_buf_;
-  asio::streambuf tap_buf_;  // tap -> tap_buf_ -> (converted to chunk) -> http
+    bool batched() const {
+      return seal || compress || headers;
+    }
+  };
+  typedef boost::shared_ptr<stripe_t> stripe_ptr;
+
+  // numbering of a resumable stripe, outlives its connections
+  struct resume_t {
+    uint64_t sent = 0;   // frames numbered, the next one gets this number
+    std::deque<std::vector<char> > unacked; // numbered sent - size() onwards
+    std::size_t unacked_bytes = 0;
+    bool pending = false; // next stripe added continues it
+    bool away = false;    // removed with frames to send again, newer frames of its flows are held
+    std::deque<std::vector<char> > held; // until those are queued, so flows stay in order
+    timing_wheel::timer_id hold_timer = timing_wheel::no_timer;
+  };
+  void release(resume_t& r, uint64_t peer_received);
+  bool holder(const char* frame, std::size_t size, std::size_t& index);
+  void give_up(std::size_t index);
+
+  void async_read_tap(std::size_t channel);
+  void handle_read_tap(const boost::system::error_code& ec, std::size_t tr, std::size_t channel);
+  uint32_t flow_of(const char* frame, std::size_t size) const;
+  stripe_ptr select_stripe(const char* frame, std::size_t size) const;
+  void dispatch(std::vector<char>&& frame);
+  bool fits(const stripe_t& s, const std::vector<char>& frame) const;
+  void enqueue(stripe_ptr s, std::vector<char>&& frame, bool control);
+
+  void async_write_http_chunks(stripe_ptr s);
+  bool make_batch(stripe_ptr s);
+  void async_write_chunk_buffers(stripe_ptr s);
+  void handle_write_http_chunks(const boost::system::error_code& ec, std::size_t tr, stripe_ptr s);
+  void handle_write_stall(stripe_ptr s);
+  void stop_stripe(stripe_ptr s, loop_stop_reason::code_t code);
+
+  tap_set& taps_;
+  timing_wheel& wheel_;
+  const std::chrono::milliseconds write_stall_timeout_;
+
+  std::map<std::size_t, stripe_ptr> stripes_;
+  std::deque<std::vector<char> > replay_;  // frames of removed unconfirmed stripes awaiting a stripe
+  std::map<std::size_t, resume_t> resumes_;
+  std::size_t away_ = 0; // resumes holding flows
+  std::vector<std::vector<char> > tap_bufs_; // per channel, frames are read behind a byte for the channel prefix
+  std::vector<bool> reading_;
+  std::vector<char> entry_; // frame with its header compressed
+  divert_handler divert_;
 };
 
-tap_to_http_loop::private_t::private_t(boost::shared_ptr<socket> socket, asio::posix::stream_descriptor& tap, loop_stop_handler lsh)
-  : socket_(socket), tap_(tap), loop_stop_(lsh)
+tap_to_http_loop::private_t::private_t(tap_set& taps, timing_wheel& wheel, std::chrono::milliseconds write_stall_timeout)
+  : taps_(taps), wheel_(wheel), write_stall_timeout_(write_stall_timeout)
+  , tap_bufs_(taps.size(), std::vector<char>(1 + max_frame_size)), reading_(taps.size(), false)
 {}
 
-void tap_to_http_loop::private_t::start() {
-  // 'clear' buffer input
-  chunk_size_buf_.consume(chunk_size_buf_.size());
-  tap_buf_.consume(tap_buf_.size());
+void tap_to_http_loop::private_t::add_stripe(std::size_t index, boost::shared_ptr<socket> socket, loop_stop_handler lsh, bool confirmed, protocol::framing_t framing,
+  boost::shared_ptr<batch_cipher> seal, boost::shared_ptr<batch_compressor> compress, boost::shared_ptr<header_compressor> headers) {
+  static const char func[] = "tap_to_http_loop::add_stripe";
+  remove_stripe(index);
+  auto s = boost::make_shared<stripe_t>();
+  s->index = index;
+  s->sock = socket;
+  s->loop_stop = lsh;
+  s->framing = framing;
+  s->seal = seal;
+  s->compress = compress;
+  s->headers = headers;
+  s->confirmed = confirmed;
+  stripes_[index] = s;
+  LOG_DEBUG << bf("%s: stripe %d added%s, %d stripe(s) active")
+    % func % index % (confirmed ? "" : " unconfirmed") % stripes_.size();
+
+  auto r = resumes_.find(index);
+  std::deque<std::vector<char> > held;
+  if(resumes_.end() != r && r->second.away) {
+    r->second.away = false;
+    --away_;
+    wheel_.cancel(r->second.hold_timer);
+    held.swap(r->second.held);
+  }
+  if(resumes_.end() != r && r->second.pending) {
+    auto& rs = r->second;
+    rs.pending = false;
+    LOG_DEBUG << bf("%s: stripe %d resumed, sending %d unacknowledged frame(s) again") % func % index % rs.unacked.size();
+    enqueue(s, protocol::counter_message(protocol::control_sync, rs.sent - rs.unacked.size()), true);
+    for(auto f = rs.unacked.begin(); f != rs.unacked.end(); ++f) {
+      enqueue(s, std::vector<char>(*f), false);
+    }
+  }
+  else if(resumes_.end() != r) {
+    resumes_.erase(r);
+  }
+  // behind the frames sent again, or as new ones if the stripe doesn't resume
+  if(!held.empty()) {
+    LOG_DEBUG << bf("%s: sending %d frame(s) held for stripe %d") % func % held.size() % index;
+  }
+  for(auto f = held.begin(); f != held.end(); ++f) {
+    dispatch(std::move(*f));
+  }
+
+  if(!replay_.empty()) {
+    LOG_DEBUG << bf("%s: replaying %d frame(s) of removed unconfirmed stripes") % func % replay_.size();
+    std::deque<std::vector<char> > replay;
+    replay.swap(replay_);
+    for(auto i = replay.begin(); i != replay.end(); ++i) {
+      dispatch(std::move(*i));
+    }
+  }
+
+  for(std::size_t c = 0; c < taps_.size(); ++c) {
+    if(!reading_[c]) {
+      async_read_tap(c);
+    }
+  }
+}
+
+void tap_to_http_loop::private_t::confirm_stripe(std::size_t index) {
+  auto i = stripes_.find(index);
+  if(stripes_.end() == i) return;
+  i->second->confirmed = true;
+  i->second->unconfirmed.clear();
+}
+
+void tap_to_http_loop::private_t::remove_stripe(std::size_t index) {
+  static const char func[] = "tap_to_http_loop::remove_stripe";
+  auto i = stripes_.find(index);
+  if(stripes_.end() == i) return;
+  auto s = i->second;
+  s->removed = true;
+  wheel_.cancel(s->write_timer);
+  stripes_.erase(i);
+  LOG_DEBUG << bf("%s: stripe %d removed with %d frame(s) queued, %d frame(s) dropped on overflow, %d stripe(s) left")
+    % func % index % s->queue.size() % s->dropped % stripes_.size();
+  if(s->headers) {
+    LOG_DEBUG << bf("%s: stripe %d sent %s") % func % index % s->headers->stats();
+  }
+
+  if(!s->confirmed) {
+    // copied, in flight ones are still referenced by the write
+    for(auto c = s->queue.begin(); c != s->queue.end(); ++c) {
+      if(!c->control) {
+        s->unconfirmed.push_back(c->frame);
+      }
+    }
+    LOG_DEBUG << bf("%s: %d frame(s) of unconfirmed stripe %d will be sent again")
+      % func % s->unconfirmed.size() % index;
+    for(auto f = s->unconfirmed.begin(); f != s->unconfirmed.end(); ++f) {
+      dispatch(std::move(*f));
+    }
+    s->unconfirmed.clear();
+  }
+
+  // frames sent again on resuming would come after newer ones of the same flows
+  // sent meanwhile on other stripes, those are held instead
+  auto r = resumes_.find(index);
+  if(resumes_.end() != r && !r->second.unacked.empty() && !r->second.away) {
+    r->second.away = true;
+    ++away_;
+    r->second.hold_timer = wheel_.schedule(
+      max_hold,
+      boost::bind(
+        &private_t::give_up,
+          shared_from_this(),
+          index
+      )
+    );
+  }
+}
+
+std::size_t tap_to_http_loop::private_t::stripes() const {
+  return stripes_.size();
+}
 
-  async_read_tap();
+bool tap_to_http_loop::private_t::send_control(std::size_t index, const std::vector<char>& message) {
+  auto i = stripes_.find(index);
+  if(stripes_.end() == i) return false;
+  // not subject to queue limit, they are few
+  enqueue(i->second, std::vector<char>(message), true);
+  return true;
 }
 
-void tap_to_http_loop::private_t::async_read_tap() {
-  tap_.async_read_some(
-    tap_buf_.prepare(512),
+bool tap_to_http_loop::private_t::send_websocket_control(std::size_t index, websocket::opcode_t opcode, const std::vector<char>& payload) {
+  auto i = stripes_.find(index);
+  if(stripes_.end() == i) return false;
+  auto s = i->second;
+  if(protocol::websocket != s->framing && protocol::websocket_masked != s->framing) return false;
+  if(s->closing) return true;
+  chunk_t c;
+  unsigned char mask[4];
+  websocket::append_header(c.size_line, opcode, payload.size(), protocol::websocket_masked == s->framing ? mask : nullptr);
+  c.frame = payload;
+  if(protocol::websocket_masked == s->framing) {
+    c.masked.resize(payload.size());
+    websocket::copy_masked(c.masked.data(), payload.data(), payload.size(), mask);
+  }
+  c.control = true;
+  c.opcode = opcode;
+  s->queue.push_back(std::move(c));
+  s->closing = websocket::close == opcode;
+  if(0 == s->in_flight) {
+    async_write_http_chunks(s);
+  }
+  return true;
+}
+
+void tap_to_http_loop::private_t::divert(divert_handler handler) {
+  divert_ = handler;
+}
+
+void tap_to_http_loop::private_t::resume_stripe(std::size_t index, uint64_t peer_received) {
+  static const char func[] = "tap_to_http_loop::resume_stripe";
+  auto& r = resumes_[index];
+  release(r, peer_received);
+  auto first = r.sent - r.unacked.size();
+  if(peer_received > r.sent) {
+    // peer counts frames we don't know of, numbering follows it
+    r.sent = peer_received;
+  }
+  else if(peer_received < first) {
+    LOG_WARNING << bf("%s: %d frame(s) of stripe %d were not kept and are lost")
+      % func % (first - peer_received) % index;
+  }
+  r.pending = true;
+}
+
+void tap_to_http_loop::private_t::acknowledge(std::size_t index, uint64_t peer_received) {
+  auto r = resumes_.find(index);
+  if(resumes_.end() == r) return;
+  release(r->second, peer_received);
+}
+
+void tap_to_http_loop::private_t::forget_resumes() {
+  std::deque<std::vector<char> > held;
+  for(auto r = resumes_.begin(); r != resumes_.end(); ++r) {
+    wheel_.cancel(r->second.hold_timer);
+    std::move(r->second.held.begin(), r->second.held.end(), std::back_inserter(held));
+  }
+  resumes_.clear();
+  away_ = 0;
+  for(auto f = held.begin(); f != held.end(); ++f) {
+    dispatch(std::move(*f));
+  }
+}
+
+void tap_to_http_loop::private_t::release(resume_t& r, uint64_t peer_received) {
+  auto first = r.sent - r.unacked.size();
+  while(!r.unacked.empty() && first < peer_received) {
+    r.unacked_bytes -= r.unacked.front().size();
+    r.unacked.pop_front();
+    ++first;
+  }
+}
+
+void tap_to_http_loop::private_t::async_read_tap(std::size_t channel) {
+  reading_[channel] = true;
+  taps_[channel].async_read_some(
+    asio::buffer(tap_bufs_[channel]) + 1,
     boost::bind(
       &private_t::handle_read_tap,
-        this,
+        shared_from_this(),
         asio::placeholders::error,
-        asio::placeholders::bytes_transferred
+        asio::placeholders::bytes_transferred,
+        channel
     )
   );
-
-//  std::ostream str(&tap_buf_);
-//  static int count = 0;
-//  if(++count < 5) {
-//    str << count;
-//    boost::system::error_code dummy;
-//    handle_read_tap(dummy, 1);
-//  }
 }
 
-void tap_to_http_loop::private_t::handle_read_tap(const boost::system::error_code& ec, std::size_t tr) {
+void tap_to_http_loop::private_t::handle_read_tap(const boost::system::error_code& ec, std::size_t tr, std::size_t channel) {
   static const char func[] = "tap_to_http_loop::handle_read_tap";
-  LOG_TRACE << bf("%s: %d bytes read") % func % tr;
+  LOG_TRACE << bf("%s: %d bytes read from channel %d") % func % tr % channel;
+  reading_[channel] = false;
   if(asio::error::operation_aborted == ec) {
     return;
   }
 
   if(ec) {
-    LOG_ERROR << (bf("%s: reading from tap failed: %s") % func % ec.message());
-    loop_stop_(loop_stop_reason::tap_read_error);
+    LOG_ERROR << (bf("%s: reading from tap of channel %d failed: %s") % func % channel % ec.message());
+    // taps are shared by all stripes
+    auto stripes = stripes_;
+    for(auto i = stripes.begin(); i != stripes.end(); ++i) {
+      stop_stripe(i->second, loop_stop_reason::tap_read_error);
+    }
+    return;
+  }
+  if(stripes_.empty()) {
+    LOG_TRACE << bf("%s: no stripes, frame dropped") % func;
+    return;
+  }
+
+  // every read from tap is exactly one frame
+  auto& buf = tap_bufs_[channel];
+  if(!taps_.carried(channel)) {
+    LOG_TRACE << bf("%s: channel %d is not carried, frame dropped") % func % channel;
+  }
+  else {
+    auto begin = buf.begin() + 1;
+    if(taps_.multiplexed()) {
+      *--begin = channel;
+    }
+    auto end = buf.begin() + 1 + tr;
+    if(!divert_ || !divert_(&*begin, end - begin)) {
+      dispatch(std::vector<char>(begin, end));
+    }
+  }
+  async_read_tap(channel);
+}
+
+// removed stripe holding flows the frame's flow would go to, false if it goes to a stripe
+bool tap_to_http_loop::private_t::holder(const char* frame, std::size_t size, std::size_t& index) {
+  auto flow = flow_of(frame, size);
+  bool ret = false;
+  uint32_t best_score = 0;
+  for(auto i = stripes_.begin(); i != stripes_.end(); ++i) {
+    best_score = std::max(best_score, flow_score(flow, i->first));
+  }
+  for(auto r = resumes_.begin(); r != resumes_.end(); ++r) {
+    auto score = flow_score(flow, r->first);
+    if(r->second.away && ((stripes_.empty() && !ret) || score > best_score)) {
+      ret = true;
+      index = r->first;
+      best_score = score;
+    }
+  }
+  return ret;
+}
+
+// the stripe stayed away too long, or too many frames of its flows are held. they go on
+// on other stripes without the frames it would send again
+void tap_to_http_loop::private_t::give_up(std::size_t index) {
+  static const char func[] = "tap_to_http_loop::give_up";
+  auto i = resumes_.find(index);
+  if(resumes_.end() == i || !i->second.away) return;
+  auto& r = i->second;
+  wheel_.cancel(r.hold_timer);
+  if(stripes_.empty()) {
+    // nowhere for the flows to go, they wait on
+    r.hold_timer = wheel_.schedule(
+      max_hold,
+      boost::bind(
+        &private_t::give_up,
+          shared_from_this(),
+          index
+      )
+    );
+    return;
+  }
+  LOG_WARNING << bf("%s: %d frame(s) of stripe %d won't be sent again, %d held frame(s) of its flows go on")
+    % func % r.unacked.size() % index % r.held.size();
+  r.away = false;
+  --away_;
+  r.unacked.clear();
+  r.unacked_bytes = 0;
+  std::deque<std::vector<char> > held;
+  held.swap(r.held);
+  for(auto f = held.begin(); f != held.end(); ++f) {
+    dispatch(std::move(*f));
+  }
+}
+
+void tap_to_http_loop::private_t::dispatch(std::vector<char>&& frame) {
+  static const char func[] = "tap_to_http_loop::dispatch";
+  std::size_t away = 0;
+  if(away_ && holder(frame.data(), frame.size(), away)) {
+    auto& held = resumes_[away].held;
+    if(held.size() < max_queued_frames) {
+      held.push_back(std::move(frame));
+      return;
+    }
+    if(stripes_.empty()) {
+      // nowhere else to go either
+      return;
+    }
+    give_up(away);
+  }
+  if(stripes_.empty()) {
+    if(replay_.size() < max_queued_frames) {
+      replay_.push_back(std::move(frame));
+    }
+    return;
+  }
+  auto s = select_stripe(frame.data(), frame.size());
+  if(s->queue.size() >= max_queued_frames) {
+    ++s->dropped;
+    LOG_TRACE << bf("%s: stripe %d queue is full, frame dropped") % func % s->index;
     return;
   }
-  // we have some packets
-  tap_buf_.commit(tr); // @TODO: commit whole number of packets
-  async_write_http_chunk();
+  // dropped before it is numbered, the peer would wait for it on resuming
+  if(!fits(*s, frame)) {
+    return;
+  }
+  auto r = resumes_.find(s->index);
+  if(resumes_.end() != r) {
+    auto& rs = r->second;
+    rs.unacked.push_back(frame);
+    rs.unacked_bytes += frame.size();
+    ++rs.sent;
+    while(rs.unacked.size() > max_unacked_frames || rs.unacked_bytes > max_unacked_bytes) {
+      rs.unacked_bytes -= rs.unacked.front().size();
+      rs.unacked.pop_front();
+    }
+  }
+  enqueue(s, std::move(frame), false);
+}
+
+// false if the framing of the stripe has no room for the frame
+bool tap_to_http_loop::private_t::fits(const stripe_t& s, const std::vector<char>& frame) const {
+  static const char func[] = "tap_to_http_loop::fits";
+  std::size_t overhead = s.headers ? header_compressor::max_overhead : 0;
+  if((s.batched() || protocol::length_prefixed == s.framing) && frame.size() + overhead > 0xffff) {
+    LOG_WARNING << bf("%s: frame of %d bytes does not fit a length prefix, dropped") % func % frame.size();
+    return false;
+  }
+  return true;
+}
+
+void tap_to_http_loop::private_t::enqueue(stripe_ptr s, std::vector<char>&& frame, bool control) {
+  chunk_t c;
+  // frames sent again on resuming were numbered for the framing of an older connection
+  if(s->closing || !fits(*s, frame)) {
+    return;
+  }
+  if(s->batched()) {
+    // framed as part of its batch
+  }
+  else if(protocol::websocket_masked == s->framing) {
+    unsigned char mask[4];
+    frame_head(c.size_line, s->framing, frame.size(), mask);
+    c.masked.resize(frame.size());
+    websocket::copy_masked(c.masked.data(), frame.data(), frame.size(), mask);
+  }
+  else {
+    frame_head(c.size_line, s->framing, frame.size(), nullptr);
+  }
+  c.frame = std::move(frame);
+  c.control = control;
+  s->queue.push_back(std::move(c));
+  if(0 == s->in_flight) {
+    async_write_http_chunks(s);
+  }
 }
 
-void tap_to_http_loop::private_t::async_write_http_chunk() {
-  static const char func[] = "tap_to_http_loop::async_write_http_chunk";
-  // prepare chunk size buffer
-  std::ostream sstr(&chunk_size_buf_);
-  sstr << std::hex << tap_buf_.size() << CRLF;
+// flows of different channels are told apart too
+uint32_t tap_to_http_loop::private_t::flow_of(const char* frame, std::size_t size) const {
+  std::size_t prefix = taps_.multiplexed() && size ? 1 : 0;
+  return flow_hash(frame + prefix, size - prefix) ^ (prefix ? flow_score(0, static_cast<unsigned char>(*frame)) : 0);
+}
+
+tap_to_http_loop::private_t::stripe_ptr tap_to_http_loop::private_t::select_stripe(const char* frame, std::size_t size) const {
+  if(1 == stripes_.size()) {
+    return stripes_.begin()->second;
+  }
+  auto flow = flow_of(frame, size);
+  auto best = stripes_.begin();
+  auto best_score = flow_score(flow, best->first);
+  for(auto i = std::next(best); i != stripes_.end(); ++i) {
+    auto score = flow_score(flow, i->first);
+    if(score > best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+  return best->second;
+}
+
+void tap_to_http_loop::private_t::async_write_http_chunks(stripe_ptr s) {
+  static const char func[] = "tap_to_http_loop::async_write_http_chunks";
   auto last_buf = asio::const_buffer(CRLF, 2);
+  s->buffers.clear();
+  if(s->batched() && websocket::binary == s->queue.front().opcode) {
+    if(!make_batch(s)) {
+      LOG_ERROR << bf("%s: failed to seal batch for stripe %d") % func % s->index;
+      stop_stripe(s, loop_stop_reason::socket_write_error);
+      return;
+    }
+    LOG_TRACE << bf("%s: writing %d frame(s) batched in %d bytes to stripe %d")
+      % func % s->in_flight % asio::buffer_size(s->buffers) % s->index;
+    async_write_chunk_buffers(s);
+    return;
+  }
+  // a websocket control frame of a batched stripe goes alone
+  s->in_flight = s->batched() ? 1 : std::min(s->queue.size(), max_gathered_chunks);
+  for(std::size_t i = 0; i < s->in_flight; ++i) {
+    const auto& c = s->queue[i];
+    s->buffers.push_back(asio::buffer(c.size_line));
+    s->buffers.push_back(asio::buffer(protocol::websocket_masked == s->framing ? c.masked : c.frame));
+    if(protocol::chunked == s->framing) {
+      s->buffers.push_back(last_buf);
+    }
+  }
 
-  std::vector<asio::const_buffer> buffers;
-  buffers.push_back(chunk_size_buf_.data());
-  buffers.push_back(tap_buf_.data());
-  buffers.push_back(last_buf);
-
-  LOG_TRACE << bf("%s: writing http chunk (%d bytes):\n%s%s%s")
-    % func
-    % asio::buffer_size(buffers)
-    % std::string(asio::buffer_cast<const char*>(chunk_size_buf_.data()), chunk_size_buf_.size())
-    % std::string(asio::buffer_cast<const char*>(tap_buf_.data()), tap_buf_.size())
-    % CRLF;
-  socket_->async_write_some(
-    buffers,
+  LOG_TRACE << bf("%s: writing %d http chunk(s) (%d bytes) to stripe %d")
+    % func % s->in_flight % asio::buffer_size(s->buffers) % s->index;
+  async_write_chunk_buffers(s);
+}
+
+// queued chunks go as one batch, as many as fit a length prefix once compressed and sealed.
+// header contexts and compressor buckets are both the flow modulo 256, frames keep their
+// queue order in the batch. false if it fails to seal
+bool tap_to_http_loop::private_t::make_batch(stripe_ptr s) {
+  s->batch.clear();
+  s->in_flight = 0;
+  std::size_t overhead = (s->seal ? batch_cipher::tag_size : 0) + (s->headers ? header_compressor::max_overhead : 0);
+  if(s->compress) {
+    s->compress->begin();
+  }
+  while(s->in_flight < s->queue.size() && s->in_flight < max_gathered_chunks) {
+    const auto& c = s->queue[s->in_flight];
+    const auto& frame = c.frame;
+    if(websocket::binary != c.opcode) {
+      break;
+    }
+    auto size = s->compress ? s->compress->size() : s->batch.size();
+    if(s->in_flight && size + 2 + frame.size() + overhead > 0xffff) {
+      break;
+    }
+    const char* data = frame.data();
+    std::size_t data_size = frame.size();
+    uint32_t flow = (s->compress || s->headers) && !c.control ? flow_of(data, data_size) : 0;
+    if(s->headers) {
+      s->headers->compress(data, data_size, taps_.multiplexed() ? 1 : 0, flow, entry_);
+      data = entry_.data();
+      data_size = entry_.size();
+    }
+    if(s->compress && c.control) {
+      // kept out of the flows, it would decide for the frames of one
+      s->compress->store(data, data_size);
+    }
+    else if(s->compress) {
+      s->compress->add(data, data_size, flow);
+    }
+    else {
+      batch_cipher::append(s->batch, data, data_size);
+    }
+    ++s->in_flight;
+  }
+  if(s->compress) {
+    s->compress->finish(s->batch);
+  }
+  if(s->seal && !s->seal->seal(s->batch)) {
+    return false;
+  }
+  s->batch_head.clear();
+  if(protocol::websocket_masked == s->framing) {
+    unsigned char mask[4];
+    frame_head(s->batch_head, s->framing, s->batch.size(), mask);
+    websocket::copy_masked(s->batch.data(), s->batch.data(), s->batch.size(), mask);
+  }
+  else {
+    frame_head(s->batch_head, s->framing, s->batch.size(), nullptr);
+  }
+  s->buffers.push_back(asio::buffer(s->batch_head));
+  s->buffers.push_back(asio::buffer(s->batch));
+  if(protocol::chunked == s->framing) {
+    s->buffers.push_back(asio::const_buffer(CRLF, 2));
+  }
+  return true;
+}
+
+void tap_to_http_loop::private_t::async_write_chunk_buffers(stripe_ptr s) {
+  // (re)start write progress deadline
+  if(write_stall_timeout_.count()) {
+    wheel_.reschedule(
+      s->write_timer,
+      write_stall_timeout_,
+      boost::bind(
+        &private_t::handle_write_stall,
+          shared_from_this(),
+          s
+      )
+    );
+  }
+  s->sock->async_write_some(
+    s->buffers,
     boost::bind(
-      &private_t::handle_write_http_chunk,
-        this,
+      &private_t::handle_write_http_chunks,
+        shared_from_this(),
         asio::placeholders::error,
-        asio::placeholders::bytes_transferred
+        asio::placeholders::bytes_transferred,
+        s
     )
   );
 }
 
-void tap_to_http_loop::private_t::handle_write_http_chunk(const boost::system::error_code& ec, std::size_t tr) {
-  static const char func[] = "tap_to_http_loop::handle_write_http_chunk";
+void tap_to_http_loop::private_t::handle_write_http_chunks(const boost::system::error_code& ec, std::size_t tr, stripe_ptr s) {
+  static const char func[] = "tap_to_http_loop::handle_write_http_chunks";
+  if(s->removed) {
+    return;
+  }
   if(asio::error::operation_aborted == ec) {
+    wheel_.cancel(s->write_timer);
+    s->in_flight = 0;
     return;
   }
 
   if(ec) {
-    LOG_ERROR << bf("%s: failed to write http chunk, setting reconnect timer: %s")
-      % func % ec.message();
-    loop_stop_(loop_stop_reason::socket_write_error);
+    LOG_ERROR << bf("%s: failed to write http chunk to stripe %d: %s")
+      % func % s->index % ec.message();
+    stop_stripe(s, loop_stop_reason::socket_write_error);
+    return;
+  }
+
+  consume(s->buffers, tr);
+  if(!s->buffers.empty()) {
+    LOG_TRACE << bf("%s: partial write to stripe %d, %d bytes left")
+      % func % s->index % asio::buffer_size(s->buffers);
+    async_write_chunk_buffers(s);
+    return;
+  }
+  wheel_.cancel(s->write_timer);
+  bool closed = false;
+  for(std::size_t i = 0; i < s->in_flight; ++i) {
+    if(!s->confirmed && !s->queue[i].control && s->unconfirmed.size() < max_queued_frames) {
+      s->unconfirmed.push_back(std::move(s->queue[i].frame));
+    }
+    closed = closed || websocket::close == s->queue[i].opcode;
+  }
+  s->queue.erase(s->queue.begin(), s->queue.begin() + s->in_flight);
+  s->in_flight = 0;
+  if(closed) {
+    LOG_DEBUG << bf("%s: websocket close written to stripe %d") % func % s->index;
+    stop_stripe(s, loop_stop_reason::socket_read_error);
+    return;
+  }
+  if(!s->queue.empty()) {
+    async_write_http_chunks(s);
+  }
+}
+
+void tap_to_http_loop::private_t::handle_write_stall(stripe_ptr s) {
+  static const char func[] = "tap_to_http_loop::handle_write_stall";
+  s->write_timer = timing_wheel::no_timer;
+  LOG_ERROR << bf("%s: socket write to stripe %d made no progress for %d ms, %d bytes pending")
+    % func % s->index % write_stall_timeout_.count() % asio::buffer_size(s->buffers);
+  stop_stripe(s, loop_stop_reason::socket_write_timeout);
+}
+
+void tap_to_http_loop::private_t::stop_stripe(stripe_ptr s, loop_stop_reason::code_t code) {
+  if(s->removed) {
     return;
   }
-  chunk_size_buf_.consume(chunk_size_buf_.size());
-  tap_buf_.consume(tap_buf_.size());
-  async_read_tap();
+  remove_stripe(s->index);
+  s->loop_stop(code);
 }
 
 /*\
  *  class tap_to_http_loop
 \*/
-tap_to_http_loop::tap_to_http_loop(boost::shared_ptr<socket> s, asio::posix::stream_descriptor& tap, loop_stop_handler lsh)
-  : p(new private_t(s, tap, lsh))
+tap_to_http_loop::tap_to_http_loop(tap_set& taps, timing_wheel& wheel, std::chrono::milliseconds write_stall_timeout)
+  : p(boost::make_shared<private_t>(taps, wheel, write_stall_timeout))
 {}
 
-void tap_to_http_loop::start() {
-  p->start();
+void tap_to_http_loop::add_stripe(std::size_t stripe, boost::shared_ptr<socket> socket, loop_stop_handler lsh, bool confirmed, protocol::framing_t framing,
+  boost::shared_ptr<batch_cipher> seal, boost::shared_ptr<batch_compressor> compress, boost::shared_ptr<header_compressor> headers) {
+  p->add_stripe(stripe, socket, lsh, confirmed, framing, seal, compress, headers);
+}
+
+void tap_to_http_loop::confirm_stripe(std::size_t stripe) {
+  p->confirm_stripe(stripe);
+}
+
+void tap_to_http_loop::remove_stripe(std::size_t stripe) {
+  p->remove_stripe(stripe);
+}
+
+std::size_t tap_to_http_loop::stripes() const {
+  return p->stripes();
+}
+
+bool tap_to_http_loop::send_control(std::size_t stripe, const std::vector<char>& message) {
+  return p->send_control(stripe, message);
+}
+
+bool tap_to_http_loop::send_websocket_control(std::size_t stripe, websocket::opcode_t opcode, const std::vector<char>& payload) {
+  return p->send_websocket_control(stripe, opcode, payload);
+}
+
+void tap_to_http_loop::divert(divert_handler handler) {
+  p->divert(handler);
+}
+
+void tap_to_http_loop::resume_stripe(std::size_t stripe, uint64_t peer_received) {
+  p->resume_stripe(stripe, peer_received);
+}
+
+void tap_to_http_loop::acknowledge(std::size_t stripe, uint64_t peer_received) {
+  p->acknowledge(stripe, peer_received);
+}
+
+void tap_to_http_loop::forget_resumes() {
+  p->forget_resumes();
 }
 
 }
@@ -1,20 +1,80 @@
 #ifndef TAP_TO_HTTP_LOOP_HPP
 #define TAP_TO_HTTP_LOOP_HPP
 
-#include <boost/asio/posix/stream_descriptor.hpp>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include "socket.hpp"
+#include "tap_set.hpp"
+#include "batch_cipher.hpp"
+#include "batch_compressor.hpp"
+#include "header_compressor.hpp"
 #include "loop_stop.hpp"
 #include "http_parser.hpp"
+#include "timing_wheel.hpp"
+#include "tunnel_protocol.hpp"
+#include "websocket.hpp"
 
 namespace sp
 {
 
+// reads frames from the taps and writes each as an http chunk to one of the stripes,
+// chosen by inner flow hash so every flow stays in order on a single connection.
+// taps are read while there is at least one stripe, those of channels the peer doesn't
+// take are drained. multiplexed frames get their channel prefix on reading
 class tap_to_http_loop {
 public:
-  tap_to_http_loop(boost::shared_ptr<socket> socket, boost::asio::posix::stream_descriptor& tap, loop_stop_handler lsh);
-  void start();
+  // takes a frame read from tap (with its channel prefix if multiplexed) before it goes to a stripe,
+  // false leaves it to the stripes
+  typedef boost::function<bool(const char* frame, std::size_t size)> divert_handler;
+
+  tap_to_http_loop(
+    tap_set& taps,
+    timing_wheel& wheel,
+    std::chrono::milliseconds write_stall_timeout
+  );
+
+  // lsh is called with socket_write_error or socket_write_timeout (if a chunk write
+  // makes no progress for write_stall_timeout) after the stripe is removed.
+  // replaces stripe with the same index.
+  // frames written to an unconfirmed stripe are kept until it is confirmed.
+  // framing of the stripe's body, length prefixed frames carry no chunk size line or CRLF.
+  // with seal, compress or headers, the frames of every write go as a single batch in one chunk,
+  // their headers compressed first, then the batch compressed and then sealed. headers is the
+  // sending end of the connection's contexts
+  void add_stripe(std::size_t stripe, boost::shared_ptr<socket> socket, loop_stop_handler lsh, bool confirmed = true,
+    protocol::framing_t framing = protocol::chunked, boost::shared_ptr<batch_cipher> seal = boost::shared_ptr<batch_cipher>(),
+    boost::shared_ptr<batch_compressor> compress = boost::shared_ptr<batch_compressor>(),
+    boost::shared_ptr<header_compressor> headers = boost::shared_ptr<header_compressor>());
+  // peer has accepted the stripe, frames kept for replay are released
+  void confirm_stripe(std::size_t stripe);
+  // frames queued for the stripe are dropped (kept for resuming if it's resumable),
+  // its flows move to remaining stripes.
+  // frames sent to or queued for an unconfirmed stripe are sent again to remaining ones,
+  // or to the next stripe added. peer may get some of them twice
+  void remove_stripe(std::size_t stripe);
+  std::size_t stripes() const;
+  // queues control message to the stripe, false if there is no such stripe
+  bool send_control(std::size_t stripe, const std::vector<char>& message);
+  // queues a websocket control frame (pong or close) to a websocket stripe, written as a frame
+  // of its own rather than in a batch. frames queued after a close are dropped and the stripe
+  // stops with socket_read_error once the close is written. false if there is no such stripe
+  bool send_websocket_control(std::size_t stripe, websocket::opcode_t opcode, const std::vector<char>& payload);
+  // frames are offered to handler first, e.g. to send them as datagrams
+  void divert(divert_handler handler);
+
+  // stripe is resumable and the next one added with that index continues it, the peer has
+  // received peer_received of its frames. frames of a resumable stripe are numbered and kept
+  // until acknowledged, the ones the peer is missing are sent again ahead of any new one
+  // (behind a sync message with the number of the first). while a removed resumable stripe
+  // has frames to send again, newer frames of its flows are held rather than moved to other
+  // stripes, and go out behind them. if it isn't resumed within a second or too many pile up
+  // while other stripes are there, those frames are given up and the flows move on. a stripe added without this is not resumable,
+  // its numbering starts over
+  void resume_stripe(std::size_t stripe, uint64_t peer_received);
+  // peer has received that many frames of the stripe, they are released
+  void acknowledge(std::size_t stripe, uint64_t peer_received);
+  // frames kept for all stripes are dropped, the peer is a new session
+  void forget_resumes();
 
 private:
   class private_t;
@@ -0,0 +1,123 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <linux/mptcp.h>
+#include <errno.h>
+#include <string.h>
+#include <sstream>
+#include "tcp_stats.hpp"
+
+#ifndef SOL_MPTCP
+#define SOL_MPTCP 284
+#endif
+
+namespace sp
+{
+
+namespace {
+  static const std::size_t max_subflows = 8;
+
+  std::string to_string(const sockaddr* sa) {
+    char addr[INET6_ADDRSTRLEN] = {};
+    std::ostringstream str;
+    if(AF_INET == sa->sa_family) {
+      auto sin = reinterpret_cast<const sockaddr_in*>(sa);
+      inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+      str << addr << ':' << ntohs(sin->sin_port);
+    }
+    else if(AF_INET6 == sa->sa_family) {
+      auto sin6 = reinterpret_cast<const sockaddr_in6*>(sa);
+      inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof(addr));
+      str << '[' << addr << "]:" << ntohs(sin6->sin6_port);
+    }
+    else {
+      str << '?';
+    }
+    return str.str();
+  }
+
+  void describe(std::ostream& str, const tcp_info& ti) {
+    str << "rtt " << ti.tcpi_rtt / 1000.0 << " ms"
+        << ", cwnd " << ti.tcpi_snd_cwnd
+        << ", retransmits " << ti.tcpi_total_retrans
+        << ", sent " << ti.tcpi_bytes_sent << " B"
+        << ", received " << ti.tcpi_bytes_received << " B";
+    if(ti.tcpi_options & TCPI_OPT_SYN_DATA) {
+      str << ", fast open";
+    }
+  }
+}
+
+int open_mptcp_socket(int family, bool* fallback) {
+  *fallback = false;
+  int fd = ::socket(family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_MPTCP);
+  if(-1 != fd) {
+    return fd;
+  }
+  // not built in, disabled by sysctl or not supported for the family
+  if(EPROTONOSUPPORT == errno || ENOPROTOOPT == errno || EINVAL == errno || EAFNOSUPPORT == errno) {
+    *fallback = true;
+    return ::socket(family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+  }
+  return -1;
+}
+
+std::string tcp_stats(int fd) {
+  tcp_info ti = {};
+  socklen_t len = sizeof(ti);
+  if(-1 == getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len)) {
+    return std::string("tcp info unavailable: ") + strerror(errno);
+  }
+  std::ostringstream str;
+  describe(str, ti);
+  return str.str();
+}
+
+std::string mptcp_stats(int fd) {
+  mptcp_info info = {};
+  socklen_t len = sizeof(info);
+  if(-1 == getsockopt(fd, SOL_MPTCP, MPTCP_INFO, &info, &len)) {
+    return std::string();
+  }
+  if(0 == len || (info.mptcpi_flags & MPTCP_INFO_FLAG_FALLBACK)) {
+    return "mptcp fell back to tcp: " + tcp_stats(fd);
+  }
+
+  std::ostringstream str;
+  str << "mptcp: " << static_cast<int>(info.mptcpi_subflows) + 1 << " subflow(s)"
+      << ", " << static_cast<int>(info.mptcpi_add_addr_accepted) << " peer address(es) accepted";
+
+  struct {
+    mptcp_subflow_data head;
+    tcp_info info[max_subflows];
+  } tcp = {};
+  tcp.head.size_subflow_data = sizeof(tcp.head);
+  tcp.head.size_user = sizeof(tcp_info);
+  len = sizeof(tcp);
+  if(-1 == getsockopt(fd, SOL_MPTCP, MPTCP_TCPINFO, &tcp, &len)) {
+    str << ", subflow info unavailable: " << strerror(errno);
+    return str.str();
+  }
+
+  struct {
+    mptcp_subflow_data head;
+    mptcp_subflow_addrs addrs[max_subflows];
+  } addrs = {};
+  addrs.head.size_subflow_data = sizeof(addrs.head);
+  addrs.head.size_user = sizeof(mptcp_subflow_addrs);
+  len = sizeof(addrs);
+  bool have_addrs = 0 == getsockopt(fd, SOL_MPTCP, MPTCP_SUBFLOW_ADDRS, &addrs, &len);
+
+  auto n = std::min<std::size_t>(tcp.head.num_subflows, max_subflows);
+  for(std::size_t i = 0; i < n; ++i) {
+    str << "\n\tsubflow " << i << ": ";
+    if(have_addrs && i < addrs.head.num_subflows) {
+      str << to_string(&addrs.addrs[i].sa_local) << " -> " << to_string(&addrs.addrs[i].sa_remote) << ", ";
+    }
+    describe(str, tcp.info[i]);
+  }
+  return str.str();
+}
+
+}
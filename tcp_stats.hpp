@@ -0,0 +1,24 @@
+#ifndef TCP_STATS_HPP
+#define TCP_STATS_HPP
+
+#include <string>
+
+namespace sp
+{
+
+// opens a stream socket of the address family with IPPROTO_MPTCP.
+// if the kernel refuses multipath, opens plain tcp and sets *fallback.
+// returns descriptor, -1 with errno set on failure
+int open_mptcp_socket(int family, bool* fallback);
+
+// one line summary of a tcp connection: rtt, cwnd, retransmits, bytes
+// and whether data was carried in syn (tcp fast open)
+std::string tcp_stats(int fd);
+
+// summary of a multipath connection followed by a line per subflow.
+// empty if the socket is not multipath
+std::string mptcp_stats(int fd);
+
+}
+
+#endif // TCP_STATS_HPP
@@ -0,0 +1,149 @@
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <boost/bind.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "timing_wheel.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+/*\
+ *  class timing_wheel::private_t
+\*/
+class timing_wheel::private_t {
+public:
+  private_t(asio::io_service& ios, std::chrono::milliseconds tick, std::size_t slots);
+  timer_id schedule(std::chrono::milliseconds timeout, expiry_handler h);
+  void cancel(timer_id id);
+
+  const std::chrono::milliseconds tick_;
+
+private:
+  struct entry_t {
+    timer_id id;
+    std::size_t rounds; // full wheel turns left before expiry
+    expiry_handler handler;
+  };
+  typedef std::list<entry_t> slot_t;
+
+  void async_tick();
+  void handle_tick(const boost::system::error_code& ec);
+
+  asio::steady_timer timer_;
+  std::vector<slot_t> slots_;
+  std::unordered_map<timer_id, std::pair<std::size_t, slot_t::iterator> > index_;
+  std::size_t current_;
+  timer_id next_id_;
+  bool ticking_;
+};
+
+timing_wheel::private_t::private_t(asio::io_service& ios, std::chrono::milliseconds tick, std::size_t slots)
+  : tick_(tick), timer_(ios), slots_(slots)
+  , current_(0), next_id_(no_timer + 1), ticking_(false)
+{}
+
+timing_wheel::timer_id timing_wheel::private_t::schedule(std::chrono::milliseconds timeout, expiry_handler h) {
+  std::size_t ticks = (timeout.count() + tick_.count() - 1) / tick_.count();
+  if(0 == ticks) ticks = 1;
+  // the next tick of a running wheel is due in less than a tick, skip it not to expire early
+  if(ticking_) ++ticks;
+
+  entry_t e = { next_id_++, (ticks - 1) / slots_.size(), h };
+  auto slot = (current_ + ticks) % slots_.size();
+  auto i = slots_[slot].insert(slots_[slot].end(), e);
+  index_.insert(std::make_pair(e.id, std::make_pair(slot, i)));
+
+  if(!ticking_) {
+    ticking_ = true;
+    timer_.expires_from_now(tick_);
+    async_tick();
+  }
+  return e.id;
+}
+
+void timing_wheel::private_t::cancel(timer_id id) {
+  auto i = index_.find(id);
+  if(index_.end() == i) return;
+  slots_[i->second.first].erase(i->second.second);
+  index_.erase(i);
+}
+
+void timing_wheel::private_t::async_tick() {
+  timer_.async_wait(boost::bind(
+    &private_t::handle_tick,
+      this,
+      asio::placeholders::error
+  ));
+}
+
+void timing_wheel::private_t::handle_tick(const boost::system::error_code& ec) {
+  static const char func[] = "timing_wheel::handle_tick";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  if(ec) {
+    LOG_ERROR << bf("%s: timer wait failed: %s") % func % ec.message();
+  }
+
+  current_ = (current_ + 1) % slots_.size();
+  // detach expired entries first, handlers are free to schedule and cancel
+  slot_t expired;
+  auto& slot = slots_[current_];
+  for(auto i = slot.begin(); i != slot.end();) {
+    if(0 == i->rounds) {
+      index_.erase(i->id);
+      expired.splice(expired.end(), slot, i++);
+    }
+    else {
+      --i->rounds;
+      ++i;
+    }
+  }
+  if(!expired.empty()) {
+    LOG_TRACE << bf("%s: %d deadline(s) expired") % func % expired.size();
+  }
+  for(auto i = expired.begin(); i != expired.end(); ++i) {
+    i->handler();
+  }
+
+  if(index_.empty()) {
+    ticking_ = false;
+    return;
+  }
+  // keep ticks aligned to avoid drift
+  timer_.expires_at(timer_.expires_at() + tick_);
+  async_tick();
+}
+
+/*\
+ *  class timing_wheel
+\*/
+timing_wheel::timing_wheel(asio::io_service& ios, std::chrono::milliseconds tick, std::size_t slots)
+  : p(new private_t(ios, tick, slots))
+{}
+
+timing_wheel::timer_id timing_wheel::schedule(std::chrono::milliseconds timeout, expiry_handler h) {
+  return p->schedule(timeout, h);
+}
+
+void timing_wheel::cancel(timer_id& id) {
+  if(no_timer == id) return;
+  p->cancel(id);
+  id = no_timer;
+}
+
+void timing_wheel::reschedule(timer_id& id, std::chrono::milliseconds timeout, expiry_handler h) {
+  cancel(id);
+  id = schedule(timeout, h);
+}
+
+std::chrono::milliseconds timing_wheel::resolution() const {
+  return p->tick_;
+}
+
+}
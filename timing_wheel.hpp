@@ -0,0 +1,45 @@
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <boost/asio/io_service.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace sp
+{
+
+// hashed timing wheel: a single steady_timer ticks over a ring of slots,
+// deadlines are hashed into slots by expiry tick.
+// schedule and cancel are O(1), a tick costs O(deadlines in one slot)
+class timing_wheel
+{
+public:
+  typedef boost::function<void()> expiry_handler;
+  typedef uint64_t timer_id;
+  static const timer_id no_timer = 0;
+
+  timing_wheel(
+    boost::asio::io_service& ios,
+    std::chrono::milliseconds tick = std::chrono::milliseconds(100),
+    std::size_t slots = 512
+  );
+
+  // handler is called from the io_service once timeout elapses, at most a tick later
+  timer_id schedule(std::chrono::milliseconds timeout, expiry_handler h);
+  // no-op for no_timer, expired or cancelled ids. id is reset to no_timer
+  void cancel(timer_id& id);
+  // cancel id and schedule again, id receives new timer
+  void reschedule(timer_id& id, std::chrono::milliseconds timeout, expiry_handler h);
+
+  std::chrono::milliseconds resolution() const;
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // TIMING_WHEEL_HPP
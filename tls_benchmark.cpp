@@ -0,0 +1,513 @@
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "tls_benchmark.hpp"
+#include "normal_socket.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace {
+  static const std::size_t frame_size = 1400;                  // a full ethernet frame off the tap
+  static const std::size_t small_frame_size = 128;             // an ack or a voice packet
+  static const std::size_t batch_frames = 64;                  // chunks tap_to_http_loop gathers in a write
+  static const std::size_t throughput_bytes = 256 * 1024 * 1024;
+  static const std::size_t read_buffer_size = 64 * 1024;
+  static const std::size_t handshake_rounds = 300;
+  static const char chunk_tail[] = "\r\n";
+  static const char seal_key[] = "secret passage benchmark key";
+  static const char* const seal_ciphers[] = { "aes-256-gcm", "chacha20-poly1305" };
+  static const char ping[] = "p";
+  static const char pong[] = "P";
+  static const char certificate_file[] = "/cert.pem";
+  static const char key_file[] = "/key.pem";
+
+  double cpu_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  double seconds_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  std::string chunk_size_line(std::size_t size) {
+    return boost::str(bf("%x\r\n") % size);
+  }
+}
+
+tls_benchmark::tls_benchmark(settings st)
+  : st_(st)
+  , server_st_(st)
+  , client_st_(st)
+  , acceptor_(ios_)
+  , failed_(false)
+  , read_buffer_(read_buffer_size)
+  , gather_(1)
+  , frames_left_(0)
+  , bytes_left_(0)
+  , batch_chunk_size_(0)
+  , resume_(false)
+  , rounds_left_(0)
+  , round_ends_(0)
+  , server_received_(0)
+  , client_received_(0)
+{}
+
+int tls_benchmark::run() {
+  static const char func[] = "tls_benchmark::run";
+  try {
+    setup_logging(st_);
+  }
+  catch(const std::exception& ex) {
+    std::cout << "Exception while setting up logging: " << ex.what() << std::endl;
+    return -10;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if(!make_certificate(dir_)) {
+    return -20;
+  }
+  try {
+    asio::ip::tcp::endpoint ep(asio::ip::address_v4::loopback(), 0);
+    acceptor_.open(ep.protocol());
+    acceptor_.bind(ep);
+    acceptor_.listen();
+  }
+  catch(const std::exception& ex) {
+    LOG_ERROR << bf("%s: failed to listen on loopback: %s") % func % ex.what();
+    remove_certificate(dir_);
+    return -30;
+  }
+  if(st_.crypto_threads) {
+    crypto_ = boost::make_shared<crypto_pool>(ios_, st_.crypto_threads);
+  }
+  std::string records = crypto_
+    ? boost::str(bf("crypto pool %u") % st_.crypto_threads)
+    : st_.ktls ? "ktls" : "openssl";
+
+  std::cout << bf("%-30s %-16s %10s %10s %10s %12s\n")
+    % "suite" % "records" % "MB/s" % "MB/s/core" % "full hs/s" % "resumed hs/s";
+  int ret = 0;
+  auto suites = tls_context::cipher_suites(st_.tls_ciphers);
+  for(auto i = suites.begin(); i != suites.end(); ++i) {
+    result_t r = {0, 0, 0, 0};
+    try {
+      setup(*i);
+    }
+    catch(const std::exception& ex) {
+      std::cout << bf("%-30s %s\n") % *i % ex.what();
+      ret = -40;
+      continue;
+    }
+    if(!measure_throughput(r) || !measure_handshakes(false, r.full_per_second)
+      || !measure_handshakes(true, r.resumed_per_second))
+    {
+      // handlers of the failed connection are still queued, they would fail the next suite too
+      std::cout << bf("%-30s failed\n") % *i;
+      ret = -50;
+      break;
+    }
+    std::cout << bf("%-30s %-16s %10.1f %10.1f %10.1f %12.1f\n")
+      % *i % records % r.mbps % r.mbps_per_core % r.full_per_second % r.resumed_per_second;
+    std::cout.flush();
+  }
+
+  // same writes as records of each suite and as sealed batches over plain tcp
+  std::cout << bf("\n%-30s %-16s %10s %10s\n")
+    % boost::str(bf("%d frames per write") % batch_frames) % "frame bytes" % "MB/s" % "MB/s/core";
+  std::size_t frame_sizes[] = { small_frame_size, frame_size };
+  for(std::size_t f = 0; f < 2 && 0 == ret; ++f) {
+    for(auto i = suites.begin(); i != suites.end() && 0 == ret; ++i) {
+      result_t r = {0, 0, 0, 0};
+      try {
+        setup(*i);
+      }
+      catch(const std::exception&) {
+        continue;
+      }
+      if(!measure_batches(frame_sizes[f], batch_frames, std::string(), r)) {
+        std::cout << bf("%-30s failed\n") % *i;
+        ret = -50;
+        break;
+      }
+      std::cout << bf("%-30s %-16d %10.1f %10.1f\n") % ("tls " + *i) % frame_sizes[f] % r.mbps % r.mbps_per_core;
+      std::cout.flush();
+    }
+    for(std::size_t c = 0; c < 2 && 0 == ret; ++c) {
+      result_t r = {0, 0, 0, 0};
+      if(!measure_batches(frame_sizes[f], batch_frames, seal_ciphers[c], r)) {
+        std::cout << bf("%-30s failed\n") % seal_ciphers[c];
+        ret = -50;
+        break;
+      }
+      std::cout << bf("%-30s %-16d %10.1f %10.1f\n")
+        % (std::string("sealed ") + seal_ciphers[c]) % frame_sizes[f] % r.mbps % r.mbps_per_core;
+      std::cout.flush();
+    }
+  }
+  server_.reset();
+  client_.reset();
+  server_tls_.reset();
+  client_tls_.reset();
+  remove_certificate(dir_);
+  return ret;
+}
+
+bool tls_benchmark::make_certificate(std::string& dir) {
+  static const char func[] = "tls_benchmark::make_certificate";
+  char temporary[] = "/tmp/secret-passage-benchmark-XXXXXX";
+  if(!mkdtemp(temporary)) {
+    LOG_ERROR << bf("%s: failed to create temporary directory: %s") % func % strerror(errno);
+    return false;
+  }
+  dir = temporary;
+
+  bool ok = false;
+  EVP_PKEY* key = EVP_EC_gen("P-256");
+  X509* cert = X509_new();
+  if(key && cert) {
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char*>("secret passage benchmark"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+    X509_EXTENSION* san = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, "IP:127.0.0.1");
+    ok = san && X509_add_ext(cert, san, -1) && X509_sign(cert, key, EVP_sha256());
+    X509_EXTENSION_free(san);
+  }
+  if(ok) {
+    FILE* f = fopen(certificate_path(dir).c_str(), "w");
+    ok = f && PEM_write_X509(f, cert);
+    if(f) fclose(f);
+  }
+  if(ok) {
+    FILE* f = fopen(key_path(dir).c_str(), "w");
+    ok = f && PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+    if(f) fclose(f);
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  if(!ok) {
+    LOG_ERROR << bf("%s: failed to create certificate in '%s'") % func % dir;
+    remove_certificate(dir);
+  }
+  return ok;
+}
+
+void tls_benchmark::remove_certificate(const std::string& dir) {
+  unlink(certificate_path(dir).c_str());
+  unlink(key_path(dir).c_str());
+  rmdir(dir.c_str());
+}
+
+std::string tls_benchmark::certificate_path(const std::string& dir) {
+  return dir + certificate_file;
+}
+
+std::string tls_benchmark::key_path(const std::string& dir) {
+  return dir + key_file;
+}
+
+void tls_benchmark::setup(const std::string& suite) {
+  server_st_.mode = settings::mode::listen;
+  server_st_.tls = true;
+  server_st_.tls_cert = certificate_path(dir_);
+  server_st_.tls_key = key_path(dir_);
+  server_st_.tls_ca.clear();
+  server_st_.tls_ciphers = suite;
+  client_st_.mode = settings::mode::connect;
+  client_st_.tls = true;
+  client_st_.tls_cert.clear();
+  client_st_.tls_key.clear();
+  client_st_.tls_ca = certificate_path(dir_);
+  client_st_.tls_ciphers = suite;
+
+  server_.reset();
+  client_.reset();
+  server_tls_ = boost::make_shared<tls_context>(server_st_);
+  client_tls_ = boost::make_shared<tls_context>(client_st_);
+  client_tls_->set_server_name("127.0.0.1");
+}
+
+bool tls_benchmark::run_ios() {
+  failed_ = false;
+  ios_.reset();
+  ios_.run();
+  return !failed_;
+}
+
+boost::shared_ptr<secure_socket> tls_benchmark::make_socket(tls_context& ctx) {
+  return boost::make_shared<secure_socket>(ios_, ctx, st_.tls_flush_delay, crypto_.get());
+}
+
+void tls_benchmark::fail(const char* what, const boost::system::error_code& ec) {
+  static const char func[] = "tls_benchmark::fail";
+  LOG_ERROR << bf("%s: %s: %s") % func % what % ec.message();
+  failed_ = true;
+  ios_.stop();
+}
+
+/*\
+ *  throughput
+\*/
+bool tls_benchmark::measure_throughput(result_t& r) {
+  return measure_batches(frame_size, 1, std::string(), r);
+}
+
+// MB are those of the frames, chunk framing and seal overhead aside
+bool tls_benchmark::measure_batches(std::size_t frame_size, std::size_t gather, const std::string& cipher, result_t& r) {
+  if(frame_.size() != frame_size) {
+    frame_.resize(frame_size);
+    for(std::size_t i = 0; i < frame_.size(); ++i) {
+      frame_[i] = static_cast<char>(rand());
+    }
+    chunk_head_ = chunk_size_line(frame_size);
+  }
+  gather_ = gather;
+  std::size_t writes = throughput_bytes / (frame_size * gather);
+  std::size_t frames = writes * gather;
+  frames_left_ = frames;
+  round_ends_ = 0;
+  chunk_.clear();
+  received_.clear();
+  if(cipher.empty()) {
+    seal_.reset();
+    open_.reset();
+    bytes_left_ = frames * (chunk_head_.size() + frame_size + sizeof(chunk_tail) - 1);
+    server_ = make_socket(*server_tls_);
+    client_ = make_socket(*client_tls_);
+  }
+  else {
+    auto client_nonce = batch_cipher::make_nonce();
+    auto server_nonce = batch_cipher::make_nonce();
+    seal_ = boost::make_shared<batch_cipher>(cipher, seal_key, client_nonce, server_nonce, true);
+    open_ = boost::make_shared<batch_cipher>(cipher, seal_key, client_nonce, server_nonce, true);
+    std::size_t sealed = gather * (2 + frame_size) + batch_cipher::tag_size;
+    batch_head_ = chunk_size_line(sealed);
+    batch_chunk_size_ = batch_head_.size() + sealed + sizeof(chunk_tail) - 1;
+    bytes_left_ = writes * batch_chunk_size_;
+    server_ = boost::make_shared<normal_socket>(ios_);
+    client_ = boost::make_shared<normal_socket>(ios_);
+  }
+  std::size_t total = bytes_left_;
+  server_->async_accept(acceptor_, remote_, boost::bind(
+    &tls_benchmark::handle_accept, this, asio::placeholders::error));
+  client_->async_connect(acceptor_.local_endpoint(), boost::bind(
+    &tls_benchmark::handle_connect, this, asio::placeholders::error));
+
+  // handshake included, it is noise next to the volume
+  double cpu_start = cpu_seconds();
+  auto start = std::chrono::steady_clock::now();
+  bool ok = run_ios();
+  double wall = seconds_since(start);
+  double cpu = cpu_seconds() - cpu_start;
+  double mb = frames * frame_size * (double(total - bytes_left_) / total) / 1e6;
+  r.mbps = mb / wall;
+  r.mbps_per_core = mb / cpu;
+  return ok;
+}
+
+void tls_benchmark::handle_accept(const boost::system::error_code& ec) {
+  if(ec) {
+    return fail("accept", ec);
+  }
+  read_next();
+}
+
+void tls_benchmark::handle_connect(const boost::system::error_code& ec) {
+  if(ec) {
+    return fail("connect", ec);
+  }
+  write_next();
+}
+
+// frames are written in chunks like tap_to_http_loop does, gather_ of them per write.
+// sealed, they are a single chunk of one batch
+void tls_benchmark::write_next() {
+  if(chunk_.empty()) {
+    if(0 == frames_left_) {
+      return end_round();
+    }
+    frames_left_ -= gather_;
+    if(seal_) {
+      batch_.clear();
+      for(std::size_t i = 0; i < gather_; ++i) {
+        batch_cipher::append(batch_, frame_.data(), frame_.size());
+      }
+      if(!seal_->seal(batch_)) {
+        return fail("seal", boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+      }
+      chunk_.push_back(asio::buffer(batch_head_));
+      chunk_.push_back(asio::buffer(batch_));
+      chunk_.push_back(asio::buffer(chunk_tail, sizeof(chunk_tail) - 1));
+    }
+    else {
+      for(std::size_t i = 0; i < gather_; ++i) {
+        chunk_.push_back(asio::buffer(chunk_head_));
+        chunk_.push_back(asio::buffer(frame_));
+        chunk_.push_back(asio::buffer(chunk_tail, sizeof(chunk_tail) - 1));
+      }
+    }
+  }
+  client_->async_write_some(chunk_, boost::bind(
+    &tls_benchmark::handle_write, this, asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void tls_benchmark::handle_write(const boost::system::error_code& ec, std::size_t bytes) {
+  if(ec) {
+    return fail("write", ec);
+  }
+  while(bytes && !chunk_.empty()) {
+    std::size_t size = asio::buffer_size(chunk_.front());
+    if(bytes < size) {
+      chunk_.front() = chunk_.front() + bytes;
+      break;
+    }
+    bytes -= size;
+    chunk_.erase(chunk_.begin());
+  }
+  write_next();
+}
+
+void tls_benchmark::read_next() {
+  server_->async_read_some(asio::buffer(read_buffer_), boost::bind(
+    &tls_benchmark::handle_read, this, asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void tls_benchmark::handle_read(const boost::system::error_code& ec, std::size_t bytes) {
+  if(ec) {
+    return fail("read", ec);
+  }
+  if(open_ && !open_batches(bytes)) {
+    return fail("open", boost::system::errc::make_error_code(boost::system::errc::bad_message));
+  }
+  bytes_left_ -= std::min(bytes, bytes_left_);
+  if(0 == bytes_left_) {
+    return end_round();
+  }
+  read_next();
+}
+
+// every complete chunk is copied out and opened like http_to_tap_loop does
+bool tls_benchmark::open_batches(std::size_t bytes) {
+  received_.insert(received_.end(), read_buffer_.begin(), read_buffer_.begin() + bytes);
+  std::size_t offset = 0;
+  for(; received_.size() - offset >= batch_chunk_size_; offset += batch_chunk_size_) {
+    auto begin = received_.begin() + offset + batch_head_.size();
+    opened_.assign(begin, begin + (batch_chunk_size_ - batch_head_.size() - (sizeof(chunk_tail) - 1)));
+    if(!open_->open(opened_)) {
+      return false;
+    }
+  }
+  received_.erase(received_.begin(), received_.begin() + offset);
+  return true;
+}
+
+/*\
+ *  handshakes
+\*/
+bool tls_benchmark::measure_handshakes(bool resume, double& per_second) {
+  resume_ = resume;
+  if(resume) {
+    // first connection only fetches tickets
+    rounds_left_ = 1;
+    start_round();
+    if(!run_ios()) {
+      return false;
+    }
+  }
+  rounds_left_ = handshake_rounds;
+  start_round();
+  auto start = std::chrono::steady_clock::now();
+  bool ok = run_ios();
+  per_second = handshake_rounds / seconds_since(start);
+  return ok;
+}
+
+void tls_benchmark::start_round() {
+  round_ends_ = 0;
+  if(!resume_) {
+    client_tls_->clear_sessions();
+  }
+  server_ = make_socket(*server_tls_);
+  client_ = make_socket(*client_tls_);
+  server_->async_accept(acceptor_, remote_, boost::bind(
+    &tls_benchmark::handle_round_accept, this, asio::placeholders::error));
+  client_->async_connect(acceptor_.local_endpoint(), boost::bind(
+    &tls_benchmark::handle_round_connect, this, asio::placeholders::error));
+}
+
+void tls_benchmark::handle_round_accept(const boost::system::error_code& ec) {
+  if(ec) {
+    return fail("accept", ec);
+  }
+  server_->async_read_some(asio::buffer(&server_received_, 1), boost::bind(
+    &tls_benchmark::handle_ping, this, asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void tls_benchmark::handle_ping(const boost::system::error_code& ec, std::size_t) {
+  if(ec) {
+    return fail("read ping", ec);
+  }
+  server_->async_write_some(asio::buffer(pong, 1), boost::bind(
+    &tls_benchmark::handle_pong, this, asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void tls_benchmark::handle_round_connect(const boost::system::error_code& ec) {
+  if(ec) {
+    return fail("connect", ec);
+  }
+  client_->async_write_some(asio::buffer(ping, 1), boost::bind(
+    &tls_benchmark::handle_pong, this, asio::placeholders::error, asio::placeholders::bytes_transferred));
+  client_->async_read_some(asio::buffer(&client_received_, 1), boost::bind(
+    &tls_benchmark::handle_pong, this, asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+// server's pong written, client's ping written or pong read
+void tls_benchmark::handle_pong(const boost::system::error_code& ec, std::size_t) {
+  if(ec) {
+    return fail("ping pong", ec);
+  }
+  end_round();
+}
+
+// closes the connection once all its ends are done, sockets go away outside of their handlers
+void tls_benchmark::end_round() {
+  std::size_t ends = rounds_left_ ? 3 : 2; // throughput run: writer and reader
+  if(++round_ends_ < ends) {
+    return;
+  }
+  ios_.post(boost::bind(&tls_benchmark::close_round, this));
+}
+
+void tls_benchmark::close_round() {
+  boost::system::error_code ec;
+  client_->close(ec);
+  server_->close(ec);
+  if(rounds_left_ && --rounds_left_) {
+    start_round();
+  }
+}
+
+}
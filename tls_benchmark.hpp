@@ -0,0 +1,111 @@
+#ifndef TLS_BENCHMARK_HPP
+#define TLS_BENCHMARK_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/shared_ptr.hpp>
+#include "settings.hpp"
+#include "crypto_pool.hpp"
+#include "tls_context.hpp"
+#include "secure_socket.hpp"
+#include "batch_cipher.hpp"
+
+namespace sp
+{
+
+// loopback tls tunnel through secure_socket for each cipher suite of the cipher policy.
+// reports throughput of tunnel shaped writes, per cpu core of the process as well, and rates
+// of full and resumed handshakes. crypto threads, ktls and flush delay are taken from settings.
+// then compares tls records with batches sealed by batch_cipher over plain tcp, for small and
+// full frames written in batches the way tap_to_http_loop gathers them
+class tls_benchmark
+{
+public:
+  tls_benchmark(settings st);
+  int run();
+
+  // self signed certificate for 127.0.0.1 and its key in a new temporary directory,
+  // clients trust it as their ca. remove_certificate deletes the directory
+  static bool make_certificate(std::string& dir);
+  static void remove_certificate(const std::string& dir);
+  static std::string certificate_path(const std::string& dir);
+  static std::string key_path(const std::string& dir);
+
+private:
+  struct result_t {
+    double mbps;
+    double mbps_per_core;
+    double full_per_second;
+    double resumed_per_second;
+  };
+
+  void setup(const std::string& suite); // throws tls_context::exception
+  bool measure_throughput(result_t& r);
+  // frames of frame_size, gather of them per write, sealed if cipher is not empty
+  bool measure_batches(std::size_t frame_size, std::size_t gather, const std::string& cipher, result_t& r);
+  bool measure_handshakes(bool resume, double& per_second);
+  bool run_ios();
+  boost::shared_ptr<secure_socket> make_socket(tls_context& ctx);
+
+  // throughput
+  void handle_accept(const boost::system::error_code& ec);
+  void handle_connect(const boost::system::error_code& ec);
+  void write_next();
+  void handle_write(const boost::system::error_code& ec, std::size_t bytes);
+  void read_next();
+  void handle_read(const boost::system::error_code& ec, std::size_t bytes);
+  bool open_batches(std::size_t bytes);
+
+  // handshakes, one byte each way per connection
+  void start_round();
+  void handle_round_accept(const boost::system::error_code& ec);
+  void handle_round_connect(const boost::system::error_code& ec);
+  void handle_ping(const boost::system::error_code& ec, std::size_t bytes);
+  void handle_pong(const boost::system::error_code& ec, std::size_t bytes);
+  void end_round();
+  void close_round();
+  void fail(const char* what, const boost::system::error_code& ec);
+
+  settings st_;
+  settings server_st_;
+  settings client_st_;
+  std::string dir_;
+  boost::asio::io_service ios_;
+  boost::shared_ptr<crypto_pool> crypto_; // only with crypto threads
+  boost::shared_ptr<tls_context> server_tls_;
+  boost::shared_ptr<tls_context> client_tls_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  boost::asio::ip::tcp::endpoint remote_;
+  boost::shared_ptr<socket> server_;
+  boost::shared_ptr<socket> client_;
+  bool failed_;
+
+  std::vector<char> frame_;
+  std::string chunk_head_;
+  std::vector<char> read_buffer_;
+  std::vector<boost::asio::const_buffer> chunk_; // unwritten rest of the write in progress
+  std::size_t gather_;      // frames per write
+  std::size_t frames_left_;
+  std::size_t bytes_left_; // still to be received
+
+  boost::shared_ptr<batch_cipher> seal_; // sealed runs only
+  boost::shared_ptr<batch_cipher> open_;
+  std::vector<char> batch_;        // sealed frames being written
+  std::string batch_head_;
+  std::vector<char> received_;     // part of the chunk being received
+  std::vector<char> opened_;       // batch received
+  std::size_t batch_chunk_size_;   // chunk of every sealed batch
+
+  bool resume_;
+  std::size_t rounds_left_;
+  std::size_t round_ends_; // ends of the connection done with the current round
+  char server_received_;
+  char client_received_;
+};
+
+}
+
+#endif // TLS_BENCHMARK_HPP
@@ -0,0 +1,389 @@
+#include <map>
+#include <deque>
+#include <sys/auxv.h>
+#include <openssl/err.h>
+#include <boost/algorithm/string/join.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/asio/ip/address.hpp>
+#include "tls_context.hpp"
+#include "logging.hpp"
+
+namespace sp
+{
+
+namespace
+{
+  static const uint32_t max_early_data = 16384; // 0-rtt bytes accepted by the server, tunnel request fits well
+  static const std::size_t max_cached_sessions = 8; // tickets kept per server, tls 1.3 ones are used once
+
+  static const std::string aes_gcm_suites("TLS_AES_256_GCM_SHA384:TLS_AES_128_GCM_SHA256");
+  static const std::string chacha20_suites("TLS_CHACHA20_POLY1305_SHA256");
+  static const std::string aes_gcm_ciphers( // tls 1.2
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256");
+  static const std::string chacha20_ciphers("ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305");
+  // alpn protocol lists in wire format, length prefixed names
+  static const unsigned char alpn_h2[] = "\x02h2";
+  static const unsigned char alpn_http1[] = "\x08http/1.1";
+  static const unsigned char alpn_server[] = "\x02h2\x08http/1.1"; // preferred first
+
+  std::string ssl_errors() {
+    std::string ret;
+    char buf[256];
+    while(auto e = ERR_get_error()) {
+      ERR_error_string_n(e, buf, sizeof(buf));
+      if(!ret.empty()) ret += "; ";
+      ret += buf;
+    }
+    return ret.empty() ? "unknown error" : ret;
+  }
+
+  // aes-gcm outruns chacha20-poly1305 only with aes and carry-less multiply instructions
+  bool has_aes_instructions() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+    return false;
+#endif
+  }
+
+  bool is_ip_address(const std::string& host) {
+    boost::system::error_code ec;
+    boost::asio::ip::address::from_string(host, ec);
+    return !ec;
+  }
+
+  // kept with every SSL object
+  struct connection_t {
+    std::vector<unsigned char> client_secret, server_secret;
+    std::size_t tickets;
+  };
+
+  void free_connection(void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+    auto connection = static_cast<connection_t*>(ptr);
+    if(!connection) return;
+    OPENSSL_cleanse(connection->client_secret.data(), connection->client_secret.size());
+    OPENSSL_cleanse(connection->server_secret.data(), connection->server_secret.size());
+    delete connection;
+  }
+}
+
+/*\
+ *  class tls_context::private_t
+\*/
+class tls_context::private_t {
+public:
+  private_t(const settings& st);
+  ~private_t();
+
+  void set_ciphers(bool server);
+  SSL* create(bool server, bool* early_data);
+  void handshake_finished(SSL* ssl, double ms);
+  std::string stats() const;
+
+  static int handle_new_session(SSL* ssl, SSL_SESSION* session);
+  static void handle_keylog(const SSL* ssl, const char* line);
+  static int handle_alpn_select(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+    const unsigned char* in, unsigned int inlen, void* arg);
+
+  const settings& st_;
+  SSL_CTX* ctx_;
+  int connection_index_; // ex data index of connection_t
+  std::string server_name_;
+  std::map<std::string, std::deque<SSL_SESSION*> > sessions_; // by server name, newest last
+
+  mutable boost::mutex stats_mutex_; // handshakes of listen mode finish on acceptor threads
+  uint64_t full_, resumed_;
+  double full_ms_, resumed_ms_;
+  uint64_t early_accepted_, early_rejected_;
+  uint64_t ktls_tx_, ktls_rx_;
+};
+
+tls_context::private_t::private_t(const settings& st)
+  : st_(st), ctx_(nullptr), connection_index_(-1)
+  , full_(0), resumed_(0)
+  , full_ms_(0), resumed_ms_(0)
+  , early_accepted_(0), early_rejected_(0)
+  , ktls_tx_(0), ktls_rx_(0)
+{
+  bool server = settings::mode::listen == st_.mode;
+  ctx_ = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if(!ctx_) {
+    throw exception("Failed to create tls context", ssl_errors());
+  }
+  SSL_CTX_set_app_data(ctx_, this);
+  connection_index_ = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, &free_connection);
+  SSL_CTX_set_options(ctx_, SSL_OP_NO_COMPRESSION | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+  SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_min_proto_version(ctx_, "1.2" == st_.tls_min_version ? TLS1_2_VERSION : TLS1_3_VERSION);
+  set_ciphers(server);
+  if(st_.ktls) {
+    // openssl installs the keys with TCP_ULP/TLS_TX/TLS_RX once the handshake is done
+    // and silently stays in user space if that fails
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+  }
+  if(st_.crypto_threads) {
+    // receive keys are derived from the secrets, openssl 3.0 hands over only those of sending
+    SSL_CTX_set_keylog_callback(ctx_, &private_t::handle_keylog);
+  }
+
+  if(!st_.tls_cert.empty()) {
+    if(1 != SSL_CTX_use_certificate_chain_file(ctx_, st_.tls_cert.c_str())) {
+      throw exception(boost::str(bf("Failed to load certificate '%s'") % st_.tls_cert), ssl_errors());
+    }
+    if(1 != SSL_CTX_use_PrivateKey_file(ctx_, st_.tls_key.c_str(), SSL_FILETYPE_PEM)) {
+      throw exception(boost::str(bf("Failed to load private key '%s'") % st_.tls_key), ssl_errors());
+    }
+    if(1 != SSL_CTX_check_private_key(ctx_)) {
+      throw exception("Private key does not match the certificate", ssl_errors());
+    }
+  }
+
+  // server requires client certificates only if it is given a ca to check them
+  if(!st_.tls_ca.empty()) {
+    if(1 != SSL_CTX_load_verify_locations(ctx_, st_.tls_ca.c_str(), nullptr)) {
+      throw exception(boost::str(bf("Failed to load ca certificates '%s'") % st_.tls_ca), ssl_errors());
+    }
+    SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER | (server ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), nullptr);
+  }
+  else if(!server) {
+    SSL_CTX_set_default_verify_paths(ctx_);
+    SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
+  }
+
+  if(server) {
+    // tickets are single use for 0-rtt thanks to the server session cache (anti-replay)
+    SSL_CTX_set_max_early_data(ctx_, st_.tls_early_data ? max_early_data : 0);
+    SSL_CTX_set_recv_max_early_data(ctx_, st_.tls_early_data ? max_early_data : 0);
+    SSL_CTX_set_alpn_select_cb(ctx_, &private_t::handle_alpn_select, nullptr);
+  }
+  else {
+    if(settings::transport::http2 == st_.transport) {
+      SSL_CTX_set_alpn_protos(ctx_, alpn_h2, sizeof(alpn_h2) - 1);
+    }
+    else {
+      SSL_CTX_set_alpn_protos(ctx_, alpn_http1, sizeof(alpn_http1) - 1);
+    }
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx_, &private_t::handle_new_session);
+  }
+}
+
+tls_context::private_t::~private_t() {
+  for(auto i = sessions_.begin(); i != sessions_.end(); ++i) {
+    for(auto s = i->second.begin(); s != i->second.end(); ++s) {
+      SSL_SESSION_free(*s);
+    }
+  }
+  SSL_CTX_free(ctx_);
+}
+
+void tls_context::private_t::set_ciphers(bool server) {
+  static const char func[] = "tls_context::set_ciphers";
+  auto suites = boost::algorithm::join(cipher_suites(st_.tls_ciphers), ":");
+  if(1 != SSL_CTX_set_ciphersuites(ctx_, suites.c_str())) {
+    throw exception(boost::str(bf("Invalid cipher policy '%s'") % st_.tls_ciphers), ssl_errors());
+  }
+  std::string ciphers;
+  if("aes-gcm" == st_.tls_ciphers) ciphers = aes_gcm_ciphers;
+  else if("chacha20" == st_.tls_ciphers) ciphers = chacha20_ciphers;
+  else if("auto" == st_.tls_ciphers) {
+    ciphers = has_aes_instructions() ? aes_gcm_ciphers + ":" + chacha20_ciphers : chacha20_ciphers + ":" + aes_gcm_ciphers;
+  }
+  if(!ciphers.empty() && 1 != SSL_CTX_set_cipher_list(ctx_, ciphers.c_str())) {
+    throw exception("Failed to set tls 1.2 ciphers", ssl_errors());
+  }
+  if(server && "auto" == st_.tls_ciphers) {
+    // server picks by its own hardware, yet a client putting chacha20 first likely lacks aes instructions
+    SSL_CTX_set_options(ctx_, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
+  }
+  LOG_DEBUG << bf("%s: tls 1.3 cipher suites %s") % func % suites;
+}
+
+SSL* tls_context::private_t::create(bool server, bool* early_data) {
+  *early_data = false;
+  SSL* ssl = SSL_new(ctx_);
+  if(!ssl) {
+    throw exception("Failed to create tls connection", ssl_errors());
+  }
+  auto connection = new connection_t();
+  connection->tickets = 0;
+  SSL_set_ex_data(ssl, connection_index_, connection);
+  if(server) {
+    SSL_set_accept_state(ssl);
+    return ssl;
+  }
+
+  SSL_set_connect_state(ssl);
+  if(is_ip_address(server_name_)) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), server_name_.c_str());
+  }
+  else {
+    SSL_set_tlsext_host_name(ssl, server_name_.c_str());
+    SSL_set1_host(ssl, server_name_.c_str());
+  }
+
+  auto& cached = sessions_[server_name_];
+  while(!cached.empty()) {
+    SSL_SESSION* session = cached.back();
+    cached.pop_back();
+    if(!SSL_SESSION_is_resumable(session)) {
+      SSL_SESSION_free(session);
+      continue;
+    }
+    SSL_set_session(ssl, session);
+    *early_data = st_.tls_early_data && SSL_SESSION_get_max_early_data(session) > 0;
+    if(SSL_SESSION_get_protocol_version(session) < TLS1_3_VERSION) {
+      // tls 1.2 sessions may be resumed many times
+      cached.push_back(session);
+    }
+    else {
+      SSL_SESSION_free(session);
+    }
+    break;
+  }
+  return ssl;
+}
+
+void tls_context::private_t::handshake_finished(SSL* ssl, double ms) {
+  boost::lock_guard<boost::mutex> lock(stats_mutex_);
+  if(SSL_session_reused(ssl)) {
+    ++resumed_;
+    resumed_ms_ += ms;
+  }
+  else {
+    ++full_;
+    full_ms_ += ms;
+  }
+  switch(SSL_get_early_data_status(ssl)) {
+  case SSL_EARLY_DATA_ACCEPTED: ++early_accepted_; break;
+  case SSL_EARLY_DATA_REJECTED: ++early_rejected_; break;
+  default: break;
+  }
+  if(BIO_get_ktls_send(SSL_get_wbio(ssl))) ++ktls_tx_;
+  if(BIO_get_ktls_recv(SSL_get_rbio(ssl))) ++ktls_rx_;
+}
+
+std::string tls_context::private_t::stats() const {
+  boost::lock_guard<boost::mutex> lock(stats_mutex_);
+  auto ret = boost::str(bf("tls handshakes: %d full (avg %.2f ms), %d resumed (avg %.2f ms), 0-rtt %d accepted, %d rejected")
+    % full_ % (full_ ? full_ms_ / full_ : 0.)
+    % resumed_ % (resumed_ ? resumed_ms_ / resumed_ : 0.)
+    % early_accepted_ % early_rejected_);
+  if(st_.ktls) {
+    ret += boost::str(bf(", kernel tls %d tx, %d rx") % ktls_tx_ % ktls_rx_);
+  }
+  return ret;
+}
+
+int tls_context::private_t::handle_new_session(SSL* ssl, SSL_SESSION* session) {
+  static const char func[] = "tls_context::handle_new_session";
+  auto self = static_cast<private_t*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  if(auto connection = static_cast<connection_t*>(SSL_get_ex_data(ssl, self->connection_index_))) {
+    ++connection->tickets;
+  }
+  auto& cached = self->sessions_[self->server_name_];
+  if(cached.size() == max_cached_sessions) {
+    SSL_SESSION_free(cached.front());
+    cached.pop_front();
+  }
+  cached.push_back(session);
+  LOG_DEBUG << bf("%s: session ticket for '%s' cached, %d available")
+    % func % self->server_name_ % cached.size();
+  return 1; // session is ours now
+}
+
+void tls_context::private_t::handle_keylog(const SSL* ssl, const char* line) {
+  // NSS key log format: label, client random, secret in hex
+  static const std::string client_label("CLIENT_TRAFFIC_SECRET_0 "), server_label("SERVER_TRAFFIC_SECRET_0 ");
+  auto self = static_cast<private_t*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  auto connection = static_cast<connection_t*>(SSL_get_ex_data(ssl, self->connection_index_));
+  if(!connection) return;
+  std::string entry(line);
+  std::vector<unsigned char>* secret = nullptr;
+  if(0 == entry.compare(0, client_label.size(), client_label)) secret = &connection->client_secret;
+  else if(0 == entry.compare(0, server_label.size(), server_label)) secret = &connection->server_secret;
+  else return;
+
+  auto hex = entry.substr(entry.rfind(' ') + 1);
+  long size = 0;
+  auto bytes = OPENSSL_hexstr2buf(hex.c_str(), &size);
+  if(!bytes) return;
+  secret->assign(bytes, bytes + size);
+  OPENSSL_cleanse(bytes, size);
+  OPENSSL_free(bytes);
+}
+
+// the tunnel request tells the protocol apart anyway, clients without alpn are served too
+int tls_context::private_t::handle_alpn_select(SSL*, const unsigned char** out, unsigned char* outlen,
+  const unsigned char* in, unsigned int inlen, void*)
+{
+  unsigned char* selected = nullptr;
+  if(OPENSSL_NPN_NEGOTIATED != SSL_select_next_proto(&selected, outlen, alpn_server, sizeof(alpn_server) - 1, in, inlen)) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/*\
+ *  class tls_context
+\*/
+std::vector<std::string> tls_context::cipher_suites(const std::string& policy) {
+  std::string suites = policy;
+  if("aes-gcm" == policy) suites = aes_gcm_suites;
+  else if("chacha20" == policy) suites = chacha20_suites;
+  else if("auto" == policy) {
+    suites = has_aes_instructions() ? aes_gcm_suites + ":" + chacha20_suites : chacha20_suites + ":" + aes_gcm_suites;
+  }
+  std::vector<std::string> ret;
+  boost::algorithm::split(ret, suites, boost::is_any_of(":"), boost::token_compress_on);
+  return ret;
+}
+
+tls_context::tls_context(const settings& st) {
+  p = boost::make_shared<private_t>(st);
+}
+
+void tls_context::set_server_name(const std::string& name) {
+  p->server_name_ = name;
+}
+
+void tls_context::clear_sessions() {
+  for(auto i = p->sessions_.begin(); i != p->sessions_.end(); ++i) {
+    for(auto s = i->second.begin(); s != i->second.end(); ++s) {
+      SSL_SESSION_free(*s);
+    }
+  }
+  p->sessions_.clear();
+}
+
+SSL* tls_context::create(bool server, bool* early_data) {
+  return p->create(server, early_data);
+}
+
+void tls_context::handshake_finished(SSL* ssl, double ms) {
+  p->handshake_finished(ssl, ms);
+}
+
+std::vector<unsigned char> tls_context::peer_traffic_secret(SSL* ssl) const {
+  auto connection = static_cast<connection_t*>(SSL_get_ex_data(ssl, p->connection_index_));
+  if(!connection) return std::vector<unsigned char>();
+  return SSL_is_server(ssl) ? connection->client_secret : connection->server_secret;
+}
+
+std::size_t tls_context::tickets_received(SSL* ssl) const {
+  auto connection = static_cast<connection_t*>(SSL_get_ex_data(ssl, p->connection_index_));
+  return connection ? connection->tickets : 0;
+}
+
+std::string tls_context::stats() const {
+  return p->stats();
+}
+
+}
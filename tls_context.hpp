@@ -0,0 +1,54 @@
+#ifndef TLS_CONTEXT_HPP
+#define TLS_CONTEXT_HPP
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <openssl/ssl.h>
+#include "exception.hpp"
+#include "settings.hpp"
+
+namespace sp
+{
+
+// tls configuration shared by all tunnel connections of a process.
+// client side keeps session tickets of the server so reconnects resume the session
+// and may carry the tunnel request as 0-rtt early data. also collects handshake statistics
+class tls_context
+{
+public:
+  typedef sp::exception<tls_context> exception;
+
+  tls_context(const settings& st); // throws exception
+
+  // tls 1.3 cipher suites a cipher policy (settings::tls_ciphers) stands for, preferred first
+  static std::vector<std::string> cipher_suites(const std::string& policy);
+
+  // name the server is verified against, sni and session cache key (connect mode)
+  void set_server_name(const std::string& name);
+  // drops cached session tickets, following handshakes are full ones
+  void clear_sessions();
+
+  // new connection state, resuming a cached session on the client side if there is one.
+  // early_data is set if 0-rtt data may be written before the handshake
+  SSL* create(bool server, bool* early_data);
+  // accounts a finished handshake, ms is its duration
+  void handshake_finished(SSL* ssl, double ms);
+
+  // tls 1.3 application traffic secret the peer of a connection encrypts with,
+  // kept only if records are handed to a crypto pool. empty if not known (yet)
+  std::vector<unsigned char> peer_traffic_secret(SSL* ssl) const;
+  // session tickets a client connection has received so far
+  std::size_t tickets_received(SSL* ssl) const;
+
+  // counts and average latency of full and resumed handshakes, kernel tls use
+  std::string stats() const;
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // TLS_CONTEXT_HPP
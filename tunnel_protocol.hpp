@@ -0,0 +1,102 @@
+#ifndef TUNNEL_PROTOCOL_HPP
+#define TUNNEL_PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace sp
+{
+
+namespace protocol
+{
+  // request headers of 'POST /tunnel' ('GET /tunnel' for websocket and download halves)
+  static const char tunnel_path[] = "/tunnel";
+  // random id shared by all connections of one connect mode instance
+  static const char session_header[] = "X-Tunnel-Session";
+  // index of the connection within the session, frames are striped between them
+  static const char stripe_header[] = "X-Tunnel-Stripe";
+  // connection is kept idle in standby until it is activated in place of a failed stripe
+  static const char standby_header[] = "X-Tunnel-Standby";
+  // stripe is split over an upload and a download connection, this one carries the given direction
+  static const char direction_header[] = "X-Tunnel-Direction";
+  static const char direction_upload[] = "upload";     // frames in the request body, response is empty
+  static const char direction_download[] = "download"; // frames in the response body, request is empty
+  enum direction_t { both, upload, download };
+  // features offered by the client and negotiated by the server, see capabilities
+  static const char capabilities_header[] = "X-Tunnel-Capabilities";
+  // frames of a stripe are counted and kept until acknowledged, so a reconnecting stripe picks up
+  // where its previous connection left off
+  static const char cap_resume[] = "resume";
+  // number of frames received on a resumable stripe so far, request and response carry it
+  // for their receiving side
+  static const char resume_header[] = "X-Tunnel-Resume";
+  // udp datagrams keyed by the tls session of the connection that negotiates them
+  static const char cap_datagram[] = "datagram";
+  // number of tap channels sharing the tunnel, every frame carries its channel in a byte ahead
+  // of it. without it only channel 0 is carried, as bare frames
+  static const char cap_channels[] = "channels";
+  // frames are sealed in batches, value is the aead. request and response carry the random nonce
+  // of their sender, keys are derived from both and the pre-shared key
+  static const char cap_seal[] = "seal";
+  static const char seal_header[] = "X-Tunnel-Seal";
+  // request proves the pre-shared key before it is taken, see batch_cipher::prove
+  static const char seal_proof_header[] = "X-Tunnel-Seal-Proof";
+  // frames are compressed in batches before they are sealed, value is the method including
+  // the preset dictionary, see batch_compressor
+  static const char cap_compress[] = "compress";
+  // ethernet/ipv4/tcp headers of frames are compressed against per flow contexts, frames go in
+  // batches then. contexts of both ends start empty with every connection, see header_compressor
+  static const char cap_headers[] = "headers";
+
+  // chunks shorter than an ethernet header carry control messages instead of frames,
+  // first byte is the message type
+  static const std::size_t max_control_size = 13;
+  static const char control_ping = 'p';     // answered with pong
+  static const char control_pong = 'P';
+  static const char control_activate = 'A'; // standby takes over stripe, decimal index follows
+  static const char control_ack = 'K';      // frames received on a resumable stripe, hex count follows
+  static const char control_sync = 'S';     // first frame to follow has this hex number, sent on resuming
+  static const std::size_t ack_frames = 32;  // received frames between acks
+  // ready to write chunks of the fixed messages
+  static const char ping_chunk[] = "1\r\np\r\n";
+  static const char pong_chunk[] = "1\r\nP\r\n";
+
+  // counters of resumable stripes in control messages, 12 hex digits are 2^48 frames
+  inline std::vector<char> counter_message(char type, uint64_t counter) {
+    static const char digits[] = "0123456789abcdef";
+    std::vector<char> ret(1, type);
+    do {
+      ret.insert(ret.begin() + 1, digits[counter & 0xf]);
+      counter >>= 4;
+    } while(counter);
+    return ret;
+  }
+  inline bool parse_counter(const std::vector<char>& message, uint64_t& counter) {
+    try {
+      counter = std::stoull(std::string(message.begin() + 1, message.end()), nullptr, 16);
+      return true;
+    }
+    catch(const std::exception&) {
+      return false;
+    }
+  }
+
+  // how frames are delimited in the body of the tunnel request and response
+  enum framing_t {
+    chunked,          // one http/1.1 chunk per frame
+    length_prefixed,  // http/2 has no chunks, each frame follows its 2 byte big endian length
+    websocket,        // one binary websocket message per frame, server to client
+    websocket_masked  // same, masked as the client sends them
+  };
+  static const std::size_t length_prefix_size = 2;
+  static const char ping_prefixed[] = "\0\1p";
+  static const char pong_prefixed[] = "\0\1P";
+  static const char pong_websocket[] = "\x82\x01P";
+}
+
+}
+
+#endif // TUNNEL_PROTOCOL_HPP
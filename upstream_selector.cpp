@@ -0,0 +1,272 @@
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include "upstream_selector.hpp"
+#include "logging.hpp"
+
+namespace asio = boost::asio;
+
+namespace sp
+{
+
+namespace {
+  static const double ewma_weight = 0.25;
+  static const double switch_gain = 0.75; // best one must be this much faster to switch to it
+  static const std::chrono::milliseconds default_probe_timeout(5000);
+}
+
+/*\
+ *  class upstream_selector::private_t
+\*/
+class upstream_selector::private_t {
+public:
+  private_t(asio::io_service& ios, timing_wheel& wheel, resolver_cache& resolver, const settings& st, std::vector<upstream_t> upstreams, switch_handler sh);
+  void start();
+  void report_failure();
+
+private:
+  typedef std::chrono::steady_clock clock_t;
+  static const std::size_t none = static_cast<std::size_t>(-1);
+
+  struct probe_t {
+    probe_t(asio::io_service& ios, upstream_t u)
+      : upstream(u), sock(ios)
+      , timer(timing_wheel::no_timer), pending(false)
+      , measured(false), srtt_ms(0), error_rate(0) {}
+
+    upstream_t upstream;
+    asio::ip::tcp::socket sock;
+    resolver_cache::endpoints_t endpoints; // connect goes through them after the resolve handler returns
+    timing_wheel::timer_id timer;
+    clock_t::time_point started;
+    bool pending;
+
+    bool measured;
+    double srtt_ms;
+    double error_rate;
+  };
+
+  void start_round();
+  void start_probe(std::size_t i);
+  void handle_probe_resolve(const boost::system::error_code& ec, const resolver_cache::endpoints_t& endpoints, std::size_t i);
+  void handle_probe_connect(const boost::system::error_code& ec, std::size_t i);
+  void handle_probe_timeout(std::size_t i);
+  void finish_probe(std::size_t i, bool ok);
+  void evaluate();
+
+  bool healthy(std::size_t i) const;
+  std::size_t best() const;
+  void choose(std::size_t i);
+
+  asio::io_service& ios_;
+  timing_wheel& wheel_;
+  resolver_cache& resolver_;
+  const settings& st_;
+  switch_handler switch_;
+
+  std::vector<boost::shared_ptr<probe_t> > probes_;
+  std::size_t current_;
+  std::size_t pending_;
+  timing_wheel::timer_id round_timer_;
+};
+
+upstream_selector::private_t::private_t(asio::io_service& ios, timing_wheel& wheel, resolver_cache& resolver, const settings& st, std::vector<upstream_t> upstreams, switch_handler sh)
+  : ios_(ios), wheel_(wheel), resolver_(resolver), st_(st), switch_(sh)
+  , current_(none), pending_(0), round_timer_(timing_wheel::no_timer)
+{
+  for(auto i = upstreams.begin(); i != upstreams.end(); ++i) {
+    probes_.push_back(boost::make_shared<probe_t>(ios_, *i));
+  }
+}
+
+void upstream_selector::private_t::start() {
+  start_round();
+}
+
+void upstream_selector::private_t::report_failure() {
+  static const char func[] = "upstream_selector::report_failure";
+  if(none == current_) return;
+  auto& p = *probes_[current_];
+  p.error_rate += (1.0 - p.error_rate) * ewma_weight;
+  LOG_DEBUG << bf("%s: upstream '%s:%s' error rate is %.0f%%")
+    % func % p.upstream.host % p.upstream.port % (p.error_rate * 100);
+  if(!healthy(current_)) {
+    auto b = best();
+    if(none != b && b != current_) {
+      choose(b);
+    }
+  }
+}
+
+void upstream_selector::private_t::start_round() {
+  round_timer_ = timing_wheel::no_timer;
+  pending_ = probes_.size();
+  for(std::size_t i = 0; i < probes_.size(); ++i) {
+    start_probe(i);
+  }
+}
+
+void upstream_selector::private_t::start_probe(std::size_t i) {
+  auto& p = *probes_[i];
+  p.pending = true;
+  auto timeout = st_.handshake_timeout.count() ? st_.handshake_timeout : default_probe_timeout;
+  p.timer = wheel_.schedule(
+    timeout,
+    boost::bind(
+      &private_t::handle_probe_timeout,
+        this,
+        i
+    )
+  );
+  resolver_.async_resolve(p.upstream.host, p.upstream.port, boost::bind(
+    &private_t::handle_probe_resolve,
+      this,
+      _1,
+      _2,
+      i
+  ));
+}
+
+void upstream_selector::private_t::handle_probe_resolve(const boost::system::error_code& ec, const resolver_cache::endpoints_t& endpoints, std::size_t i) {
+  static const char func[] = "upstream_selector::handle_probe_resolve";
+  auto& p = *probes_[i];
+  // probe timed out before resolve completed, or this is a late result of an earlier round
+  if(!p.pending || p.sock.is_open()) {
+    return;
+  }
+  if(ec) {
+    LOG_DEBUG << bf("%s: resolve of '%s:%s' failed: %s")
+      % func % p.upstream.host % p.upstream.port % ec.message();
+    finish_probe(i, false);
+    return;
+  }
+  // dns time is not part of the rtt
+  p.started = clock_t::now();
+  p.endpoints = endpoints;
+  asio::async_connect(p.sock, p.endpoints.begin(), p.endpoints.end(), boost::bind(
+    &private_t::handle_probe_connect,
+      this,
+      asio::placeholders::error,
+      i
+  ));
+}
+
+void upstream_selector::private_t::handle_probe_connect(const boost::system::error_code& ec, std::size_t i) {
+  static const char func[] = "upstream_selector::handle_probe_connect";
+  if(asio::error::operation_aborted == ec) {
+    return;
+  }
+  auto& p = *probes_[i];
+  if(ec) {
+    LOG_DEBUG << bf("%s: probe of '%s:%s' failed: %s")
+      % func % p.upstream.host % p.upstream.port % ec.message();
+    finish_probe(i, false);
+    return;
+  }
+  double rtt_ms = std::chrono::duration_cast<std::chrono::microseconds>(clock_t::now() - p.started).count() / 1000.0;
+  p.srtt_ms = p.measured ? p.srtt_ms + (rtt_ms - p.srtt_ms) * ewma_weight : rtt_ms;
+  p.measured = true;
+  LOG_DEBUG << bf("%s: '%s:%s' rtt %.2f ms, smoothed %.2f ms")
+    % func % p.upstream.host % p.upstream.port % rtt_ms % p.srtt_ms;
+  finish_probe(i, true);
+}
+
+void upstream_selector::private_t::handle_probe_timeout(std::size_t i) {
+  static const char func[] = "upstream_selector::handle_probe_timeout";
+  auto& p = *probes_[i];
+  p.timer = timing_wheel::no_timer;
+  LOG_DEBUG << bf("%s: probe of '%s:%s' timed out") % func % p.upstream.host % p.upstream.port;
+  finish_probe(i, false);
+}
+
+void upstream_selector::private_t::finish_probe(std::size_t i, bool ok) {
+  auto& p = *probes_[i];
+  if(!p.pending) return;
+  p.pending = false;
+  wheel_.cancel(p.timer);
+  boost::system::error_code dummy_ec;
+  p.sock.close(dummy_ec);
+  p.error_rate += ((ok ? 0.0 : 1.0) - p.error_rate) * ewma_weight;
+
+  // probes run in parallel, so the first to succeed is the fastest one
+  if(ok && none == current_) {
+    choose(i);
+  }
+  if(0 == --pending_) {
+    evaluate();
+    if(st_.probe_interval.count()) {
+      round_timer_ = wheel_.schedule(
+        st_.probe_interval,
+        boost::bind(
+          &private_t::start_round,
+            this
+        )
+      );
+    }
+  }
+}
+
+void upstream_selector::private_t::evaluate() {
+  if(none == current_) return;
+  auto b = best();
+  if(none == b || b == current_) return;
+  const auto& cur = *probes_[current_];
+  const auto& alt = *probes_[b];
+  if(!healthy(current_)
+    || (st_.upstream_max_rtt.count() && cur.srtt_ms > st_.upstream_max_rtt.count() && alt.srtt_ms < cur.srtt_ms)
+    || alt.srtt_ms < cur.srtt_ms * switch_gain)
+  {
+    choose(b);
+  }
+}
+
+bool upstream_selector::private_t::healthy(std::size_t i) const {
+  const auto& p = *probes_[i];
+  return p.measured && p.error_rate * 100 < st_.upstream_max_error_percent;
+}
+
+std::size_t upstream_selector::private_t::best() const {
+  auto ret = none;
+  for(std::size_t i = 0; i < probes_.size(); ++i) {
+    if(healthy(i) && (none == ret || probes_[i]->srtt_ms < probes_[ret]->srtt_ms)) {
+      ret = i;
+    }
+  }
+  return ret;
+}
+
+void upstream_selector::private_t::choose(std::size_t i) {
+  static const char func[] = "upstream_selector::choose";
+  const auto& p = *probes_[i];
+  if(none == current_) {
+    LOG_INFO << bf("%s: using upstream '%s:%s', rtt %.2f ms")
+      % func % p.upstream.host % p.upstream.port % p.srtt_ms;
+  }
+  else {
+    const auto& cur = *probes_[current_];
+    LOG_INFO << bf("%s: switching upstream from '%s:%s' (rtt %.2f ms, errors %.0f%%) to '%s:%s' (rtt %.2f ms, errors %.0f%%)")
+      % func % cur.upstream.host % cur.upstream.port % cur.srtt_ms % (cur.error_rate * 100)
+      % p.upstream.host % p.upstream.port % p.srtt_ms % (p.error_rate * 100);
+  }
+  current_ = i;
+  switch_(p.upstream);
+}
+
+/*\
+ *  class upstream_selector
+\*/
+upstream_selector::upstream_selector(asio::io_service& ios, timing_wheel& wheel, resolver_cache& resolver, const settings& st, std::vector<upstream_t> upstreams, switch_handler sh)
+  : p(new private_t(ios, wheel, resolver, st, upstreams, sh))
+{}
+
+void upstream_selector::start() {
+  p->start();
+}
+
+void upstream_selector::report_failure() {
+  p->report_failure();
+}
+
+}
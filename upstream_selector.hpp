@@ -0,0 +1,48 @@
+#ifndef UPSTREAM_SELECTOR_HPP
+#define UPSTREAM_SELECTOR_HPP
+
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "settings.hpp"
+#include "timing_wheel.hpp"
+#include "resolver_cache.hpp"
+
+namespace sp
+{
+
+// probes tcp handshake rtt of every upstream in background and picks the one to use:
+// fastest healthy one first, then switches when the current one gets unhealthy,
+// slower than upstream_max_rtt or considerably slower than the best one
+class upstream_selector
+{
+public:
+  struct upstream_t {
+    std::string host;
+    std::string port;
+  };
+  // called when a different upstream becomes preferred, including the first choice
+  typedef boost::function<void(const upstream_t&)> switch_handler;
+
+  upstream_selector(
+    boost::asio::io_service& ios,
+    timing_wheel& wheel,
+    resolver_cache& resolver,
+    const settings& st,
+    std::vector<upstream_t> upstreams,
+    switch_handler sh
+  );
+  void start();
+  // connecting to or talking to the current upstream failed, counts towards its error rate
+  void report_failure();
+
+private:
+  class private_t;
+  boost::shared_ptr<private_t> p;
+};
+
+}
+
+#endif // UPSTREAM_SELECTOR_HPP
@@ -0,0 +1,98 @@
+#include <cstring>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "websocket.hpp"
+
+namespace sp
+{
+
+namespace websocket
+{
+
+namespace {
+  static const char accept_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  static const std::size_t key_size = 16;
+
+  std::string base64(const unsigned char* data, std::size_t size) {
+    std::string ret(4 * ((size + 2) / 3) + 1, '\0');
+    auto n = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&ret[0]), data, size);
+    ret.resize(n);
+    return ret;
+  }
+
+  // masking key repeated to a word
+  uint64_t mask_word(const unsigned char* mask) {
+    unsigned char bytes[8];
+    for(std::size_t i = 0; i < sizeof(bytes); ++i) {
+      bytes[i] = mask[i & 3];
+    }
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    return word;
+  }
+
+  void xor_mask(char* to, const char* from, std::size_t size, const unsigned char* mask) {
+    auto word = mask_word(mask);
+    std::size_t i = 0;
+    for(; i + sizeof(word) <= size; i += sizeof(word)) {
+      uint64_t v;
+      std::memcpy(&v, from + i, sizeof(v));
+      v ^= word;
+      std::memcpy(to + i, &v, sizeof(v));
+    }
+    // i is a multiple of the key size here
+    for(; i < size; ++i) {
+      to[i] = from[i] ^ mask[i & 3];
+    }
+  }
+}
+
+std::string make_key() {
+  unsigned char key[key_size];
+  RAND_bytes(key, sizeof(key));
+  return base64(key, sizeof(key));
+}
+
+std::string accept_key(const std::string& key) {
+  auto text = key + accept_guid;
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const unsigned char*>(text.data()), text.size(), digest);
+  return base64(digest, sizeof(digest));
+}
+
+void append_header(std::string& out, opcode_t opcode, std::size_t size, unsigned char* mask) {
+  out.push_back(0x80 | opcode);
+  char masked = mask ? 0x80 : 0;
+  if(size < 126) {
+    out.push_back(masked | size);
+  }
+  else if(size <= 0xffff) {
+    out.push_back(masked | 126);
+    out.push_back(size >> 8);
+    out.push_back(size);
+  }
+  else {
+    out.push_back(masked | 127);
+    for(int shift = 56; shift >= 0; shift -= 8) {
+      out.push_back(uint64_t(size) >> shift);
+    }
+  }
+  if(mask) {
+    // unpredictable, so that a proxy can not be fed a request of the peer's choosing
+    RAND_bytes(mask, 4);
+    out.append(reinterpret_cast<const char*>(mask), 4);
+  }
+}
+
+void apply_mask(char* data, std::size_t size, const unsigned char* mask) {
+  xor_mask(data, data, size, mask);
+}
+
+void copy_masked(char* to, const char* from, std::size_t size, const unsigned char* mask) {
+  xor_mask(to, from, size, mask);
+}
+
+}
+
+}
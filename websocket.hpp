@@ -0,0 +1,36 @@
+#ifndef WEBSOCKET_HPP
+#define WEBSOCKET_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace sp
+{
+
+// websocket framing (rfc 6455). the tunnel sends every frame as a binary message of a single
+// websocket frame, client to server ones are masked
+namespace websocket
+{
+  enum opcode_t { continuation = 0x0, text = 0x1, binary = 0x2, close = 0x8, ping = 0x9, pong = 0xa };
+  static const std::size_t max_header_size = 14;
+
+  // value of Sec-WebSocket-Key, 16 random bytes in base64
+  std::string make_key();
+  // value of Sec-WebSocket-Accept answering key
+  std::string accept_key(const std::string& key);
+
+  // appends header of a final frame carrying size bytes of payload. with mask it is masked
+  // by a fresh random key, which is written to mask for the payload to be masked with
+  void append_header(std::string& out, opcode_t opcode, std::size_t size, unsigned char* mask = nullptr);
+
+  // xors the payload with the masking key, which unmasks it as well.
+  // a 64 bit word at a time, the compiler vectorizes the loop further where it can
+  void apply_mask(char* data, std::size_t size, const unsigned char* mask);
+  // same, masking into to while copying
+  void copy_masked(char* to, const char* from, std::size_t size, const unsigned char* mask);
+}
+
+}
+
+#endif // WEBSOCKET_HPP